@@ -0,0 +1,218 @@
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "blocks.hpp"
+#include "network.hpp"
+#include "shapes.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace network {
+namespace blocks {
+
+// 找不到或者个数不对的时候打印错误并返回nullptr
+static const nvinfer1::Weights* find(Key& key, const char* name, int64_t count, const Context& ctx) {
+    auto& full = key.with(name);
+    auto  it   = ctx.weights.find(full);
+    if (it == ctx.weights.end()) {
+        LOGE("ERROR: missing weights %s", full.c_str());
+        return nullptr;
+    }
+    if (count >= 0 && it->second.count != count) {
+        LOGE("ERROR: %s has %lld values, expected %lld", full.c_str(), (long long)it->second.count, (long long)count);
+        return nullptr;
+    }
+    return &it->second;
+}
+
+nvinfer1::ITensor* addConvBNSiLU(
+    Key& key, nvinfer1::ITensor& input, int inChannels, int outChannels, int kernel, int stride,
+    const ConvNames& names, const Context& ctx)
+{
+    auto dims = input.getDimensions();
+    if (dims.nbDims != 4 || (dims.d[1] >= 0 && dims.d[1] != inChannels)) {
+        LOGE("ERROR: %s expects %d input channels, got %s", key.with(names.conv).c_str(), inChannels, printDims(dims).c_str());
+        return nullptr;
+    }
+
+    nvinfer1::ILayer* conv;
+    if (ctx.prec == nvinfer1::DataType::kINT8 && ctx.weights.count(key.with(names.weightScale))) {
+        // 显式量化要插入Q/DQ, 直接用parser的实现
+        conv = parser::addConv2d(key.with(names.conv), input, kernel, outChannels, stride, kernel / 2, ctx.prec, ctx.network, ctx.weights);
+    } else {
+        auto weight = find(key, names.weight, (int64_t)outChannels * inChannels * kernel * kernel, ctx);
+        if (weight == nullptr) return nullptr;
+        auto bias   = ctx.weights.find(key.with(names.bias));
+
+        auto layer  = ctx.network.addConvolutionNd(
+                input, outChannels,
+                nvinfer1::DimsHW{kernel, kernel},
+                *weight,
+                bias == ctx.weights.end() ? nvinfer1::Weights{nvinfer1::DataType::kFLOAT, nullptr, 0} : bias->second);
+        layer->setName(key.with(names.conv).c_str());
+        layer->setStride(nvinfer1::DimsHW(stride, stride));
+        layer->setPaddingNd(nvinfer1::DimsHW(kernel / 2, kernel / 2));
+        layer->setPrecision(ctx.prec);
+        conv = layer;
+    }
+
+    auto gamma = find(key, names.gamma, outChannels, ctx);
+    auto beta  = find(key, names.beta,  outChannels, ctx);
+    auto mean  = find(key, names.mean,  outChannels, ctx);
+    auto var   = find(key, names.var,   outChannels, ctx);
+    if (!gamma || !beta || !mean || !var) return nullptr;
+    auto bn    = parser::addBatchNorm(key.with(names.norm).c_str(), *conv->getOutput(0), *gamma, *beta, *mean, *var, ctx.network);
+
+    auto sigmoid = ctx.network.addActivation(*bn->getOutput(0), nvinfer1::ActivationType::kSIGMOID);
+    sigmoid->setName(key.with(names.sigmoid).c_str());
+    auto mul     = ctx.network.addElementWise(*bn->getOutput(0), *sigmoid->getOutput(0), nvinfer1::ElementWiseOperation::kPROD);
+    mul->setName(key.with(names.mul).c_str());
+
+    LOGV("%s, %s", mul->getName(), (printDims(mul->getOutput(0)->getDimensions())).c_str());
+    return mul->getOutput(0);
+}
+
+nvinfer1::ITensor* addSum(Key& key, const char* name, nvinfer1::ITensor& a, nvinfer1::ITensor& b, const Context& ctx) {
+    auto add = ctx.network.addElementWise(a, b, nvinfer1::ElementWiseOperation::kSUM);
+    add->setName(key.with(name).c_str());
+    return add->getOutput(0);
+}
+
+nvinfer1::ITensor* addChannelSlice(Key& key, const char* name, nvinfer1::ITensor& input, int begin, int size, const Context& ctx) {
+    auto dims = input.getDimensions();
+    if (dims.nbDims != 4 || begin < 0 || (dims.d[1] >= 0 && begin + size > dims.d[1])) {
+        LOGE("ERROR: %s: cannot slice channels [%d, %d) from %s", key.with(name).c_str(), begin, begin + size, printDims(dims).c_str());
+        return nullptr;
+    }
+    // slice的size是静态的, -1会被当成size传给TensorRT. 动态shape需要通过setInput(2)传shape tensor, 这里不支持
+    for (int i = 0; i < dims.nbDims; i++) {
+        if (dims.d[i] < 0) {
+            LOGE("ERROR: %s: channel slice needs a static input shape, got %s", key.with(name).c_str(), printDims(dims).c_str());
+            return nullptr;
+        }
+    }
+    auto slice = ctx.network.addSlice(
+            input,
+            nvinfer1::Dims4{0,         begin, 0,         0},
+            nvinfer1::Dims4{dims.d[0], size,  dims.d[2], dims.d[3]},
+            nvinfer1::Dims4{1,         1,     1,         1});
+    slice->setName(key.with(name).c_str());
+    return slice->getOutput(0);
+}
+
+nvinfer1::ITensor* addChannelConcat(Key& key, const char* name, nvinfer1::ITensor* const* inputs, int count, const Context& ctx) {
+    auto concat = ctx.network.addConcatenation(inputs, count);
+    concat->setAxis(1);
+    concat->setName(key.with(name).c_str());
+    return concat->getOutput(0);
+}
+
+/* ------------------------------- check ------------------------------- */
+
+// 一个ConvBNSiLU的假权重, 名字和addConvBNSiLU以及parser::addConvBNSiLU用的一样
+static void fakeConvBNSiLU(const string& prefix, int inChannels, int outChannels, int kernel,
+                           vector<vector<float>>& storage, map<string, nvinfer1::Weights>& weights) {
+    auto put = [&](const char* name, int64_t count, float base) {
+        storage.emplace_back(count);
+        auto& values = storage.back();
+        for (int64_t i = 0; i < count; i++) values[i] = base + 0.01f * (float)(i % 7);
+        weights[prefix + name] = nvinfer1::Weights{nvinfer1::DataType::kFLOAT, values.data(), count};
+    };
+    put("conv.weight",       (int64_t)outChannels * inChannels * kernel * kernel, 0.0f);
+    put("norm.weight",       outChannels, 1.0f);
+    put("norm.bias",         outChannels, 0.0f);
+    put("norm.running_mean", outChannels, 0.0f);
+    put("norm.running_var",  outChannels, 1.0f);
+}
+
+bool check(int iters) {
+    using M     = ScaleM;
+    using Block = C2F<M::channels(128), M::channels(128), M::repeats(3), true>;
+    const int    repeats = M::repeats(3);
+    const string prefix  = "model.2.";
+    const nvinfer1::Dims4 inputDims{1, Block::inChannels, 80, 80};
+
+    vector<vector<float>>          storage;
+    map<string, nvinfer1::Weights> weights;
+    fakeConvBNSiLU(prefix + "cv1.", Block::inChannels, 2 * Block::hidden, 1, storage, weights);
+    for (int i = 0; i < repeats; i++) {
+        string m = prefix + "m." + to_string(i) + ".";
+        fakeConvBNSiLU(m + "cv1.", Block::hidden, Block::hidden, 3, storage, weights);
+        fakeConvBNSiLU(m + "cv2.", Block::hidden, Block::hidden, 3, storage, weights);
+    }
+    fakeConvBNSiLU(prefix + "cv2.", Block::concatChannels, Block::outChannels, 1, storage, weights);
+
+    typedef function<nvinfer1::ITensor*(nvinfer1::INetworkDefinition&)> BuildFn;
+    BuildFn templated = [&](nvinfer1::INetworkDefinition& network) -> nvinfer1::ITensor* {
+        auto    input = network.addInput("input0", nvinfer1::DataType::kFLOAT, inputDims);
+        Context ctx{network, nvinfer1::DataType::kFLOAT, weights};
+        Key     key(prefix);
+        return Block::add(key, *input, ctx);
+    };
+    BuildFn runtime = [&](nvinfer1::INetworkDefinition& network) -> nvinfer1::ITensor* {
+        auto input = network.addInput("input0", nvinfer1::DataType::kFLOAT, inputDims);
+        auto c2f   = parser::addC2F(prefix, *input, Block::outChannels, nvinfer1::DataType::kFLOAT, network, weights,
+                                    repeats, true);
+        return c2f == nullptr ? nullptr : c2f->getOutput(0);
+    };
+
+    Logger logger;
+    unique_ptr<nvinfer1::IBuilder> builder(nvinfer1::createInferBuilder(logger));
+
+    // 每一层都会打一条VERB, 计时的时候关掉. 时间里包括createNetworkV2, 两边一样
+    Level level = logger::getLevel();
+    logger::setLevel(Level::INFO);
+    auto time = [&](const BuildFn& build) {
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iters; i++) {
+            unique_ptr<nvinfer1::INetworkDefinition> network(builder->createNetworkV2(1));
+            build(*network);
+        }
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / std::max(iters, 1);
+    };
+    double templatedUs = time(templated);
+    double runtimeUs   = time(runtime);
+    logger::setLevel(level);
+
+    // 各build一次, shape和TensorRT的对比, 再比较两边的层名
+    vector<string> names[2];
+    bool           ok = true;
+    BuildFn*       fns[2] = {&templated, &runtime};
+    for (int v = 0; v < 2; v++) {
+        const char* what = v == 0 ? "blocks::C2F" : "parser::addC2F";
+        unique_ptr<nvinfer1::INetworkDefinition> network(builder->createNetworkV2(1));
+        auto output = (*fns[v])(*network);
+        if (output == nullptr) {
+            LOGE("ERROR: blocks check: failed to build %s", what);
+            return false;
+        }
+        network->markOutput(*output);
+        auto dims = output->getDimensions();
+        shapes::Network desc;
+        if (!shapes::check(*network, desc)) {
+            LOGE("ERROR: blocks check: %s shapes do not match TensorRT", what);
+            ok = false;
+        }
+        if (dims.nbDims != 4 || dims.d[1] != Block::outChannels || dims.d[2] != inputDims.d[2] || dims.d[3] != inputDims.d[3]) {
+            LOGE("ERROR: blocks check: %s output is %s, expected [1, %d, 80, 80]", what, printDims(dims).c_str(), Block::outChannels);
+            ok = false;
+        }
+        for (int l = 0; l < network->getNbLayers(); l++) names[v].push_back(network->getLayer(l)->getName());
+    }
+    if (names[0] != names[1]) {
+        LOGE("ERROR: blocks check: blocks::C2F has %d layers, parser::addC2F has %d, or their names differ",
+             (int)names[0].size(), (int)names[1].size());
+        ok = false;
+    }
+
+    LOG("blocks check %s: C2F<%d, %d, %d> %d layers, blocks %.1f us, parser %.1f us per network (%d iterations)",
+        ok ? "passed" : "FAILED", Block::inChannels, Block::outChannels, repeats, (int)names[0].size(),
+        templatedUs, runtimeUs, iters);
+    return ok;
+}
+
+} // namespace blocks
+} // namespace network
@@ -0,0 +1,256 @@
+#ifndef __BLOCKS_HPP__
+#define __BLOCKS_HPP__
+
+#include <map>
+#include <ratio>
+#include <string>
+
+#include "NvInfer.h"
+
+// yolov8的ConvBNSiLU/BottleNeck/C2F, 重复次数, channel, width(e)和shortcut都是模板参数
+//     - channel之间的关系(hidden = C2 * e, concat是(2 + n) * hidden)在编译期用static_assert检查,
+//       运行时只检查输入的channel和权重的个数
+//     - 权重和层的名字的后缀(比如"m.1.cv2.conv.weight")在编译期拼好, 构建的时候只把后缀拷贝到前缀后面,
+//       所有的名字复用同一块buffer(Key), 不再每一层拼接并分配string
+//     - Scale对应yolov8的n/s/m/l/x, 在编译期算出每一层的重复次数和channel
+//     - 和parser::addC2F结构一样, 层的名字也一样, refit和diff不需要区分是哪个版本build的
+// 例子(yolov8s的model.2):
+//     using S = blocks::ScaleS;
+//     blocks::Context ctx{network, prec, weights};
+//     blocks::Key     key("model.2.");
+//     auto y = blocks::C2F<S::channels(64), S::channels(128), S::repeats(3), true>::add(key, *x, ctx);
+
+namespace network {
+namespace blocks {
+
+/* ------------------------------- 编译期的名字 ------------------------------- */
+
+template <char... C>
+struct Name {
+    static constexpr int size = sizeof...(C);
+    static const char    value[sizeof...(C) + 1];
+};
+template <char... C> constexpr int Name<C...>::size;
+template <char... C> const char    Name<C...>::value[sizeof...(C) + 1] = {C..., '\0'};
+
+template <class... N> struct Join;
+template <> struct Join<> { using type = Name<>; };
+template <char... A> struct Join<Name<A...>> { using type = Name<A...>; };
+template <char... A, char... B, class... Rest>
+struct Join<Name<A...>, Name<B...>, Rest...> { using type = typename Join<Name<A..., B...>, Rest...>::type; };
+
+template <class... N> using Suffix = typename Join<N...>::type;
+
+// 非负整数的十进制
+template <int I, bool = (I < 10)>
+struct Digits { using type = Suffix<typename Digits<I / 10>::type, Name<char('0' + I % 10)>>; };
+template <int I>
+struct Digits<I, true> { using type = Name<char('0' + I)>; };
+
+namespace names {
+using Cv1         = Name<'c', 'v', '1', '.'>;
+using Cv2         = Name<'c', 'v', '2', '.'>;
+using M           = Name<'m', '.'>;
+using Dot         = Name<'.'>;
+using Conv        = Name<'c', 'o', 'n', 'v'>;
+using Norm        = Name<'n', 'o', 'r', 'm'>;
+using Sigmoid     = Name<'s', 'i', 'g', 'm', 'o', 'i', 'd'>;
+using Mul         = Name<'m', 'u', 'l'>;
+using Add         = Name<'c', 'v', '1', '.', 'a', 'd', 'd'>;         // 和parser::addBottleNeck一样
+using Slice       = Name<'s', 'l', 'i', 'c', 'e', '2'>;
+using Concat      = Name<'c', 'o', 'n', 'c', 'a', 't', '2'>;
+using Weight      = Name<'.', 'w', 'e', 'i', 'g', 'h', 't'>;
+using WeightScale = Name<'.', 'w', 'e', 'i', 'g', 'h', 't', '_', 's', 'c', 'a', 'l', 'e'>;
+using Bias        = Name<'.', 'b', 'i', 'a', 's'>;
+using Mean        = Name<'.', 'r', 'u', 'n', 'n', 'i', 'n', 'g', '_', 'm', 'e', 'a', 'n'>;
+using Var         = Name<'.', 'r', 'u', 'n', 'n', 'i', 'n', 'g', '_', 'v', 'a', 'r'>;
+} // namespace names
+
+// 运行时的前缀(比如"model.2.") + 编译期的后缀, 返回的引用在下一次调用with之前有效
+class Key {
+public:
+    explicit Key(std::string prefix = "") : mBuffer(std::move(prefix)), mPrefix(mBuffer.size()) { mBuffer.reserve(mPrefix + 64); }
+
+    const std::string& with(const char* suffix) {
+        mBuffer.resize(mPrefix);
+        mBuffer.append(suffix);
+        return mBuffer;
+    }
+    template <class N>
+    const std::string& with() {
+        mBuffer.resize(mPrefix);
+        mBuffer.append(N::value, N::size);
+        return mBuffer;
+    }
+
+private:
+    std::string mBuffer;
+    size_t      mPrefix;
+};
+
+struct Context {
+    nvinfer1::INetworkDefinition&                   network;
+    nvinfer1::DataType                              prec;
+    const std::map<std::string, nvinfer1::Weights>& weights;
+};
+
+/* ------------------------------- 非模板的部分(blocks.cpp) ------------------------------- */
+
+// 一个ConvBNSiLU用到的所有名字的后缀
+struct ConvNames {
+    const char* conv;
+    const char* weight;
+    const char* weightScale;
+    const char* bias;
+    const char* norm;
+    const char* gamma;
+    const char* beta;
+    const char* mean;
+    const char* var;
+    const char* sigmoid;
+    const char* mul;
+};
+
+// 出错的时候(channel对不上, 缺少权重)打印错误并返回nullptr
+nvinfer1::ITensor* addConvBNSiLU(
+    Key& key, nvinfer1::ITensor& input, int inChannels, int outChannels, int kernel, int stride,
+    const ConvNames& names, const Context& ctx);
+nvinfer1::ITensor* addSum(Key& key, const char* name, nvinfer1::ITensor& a, nvinfer1::ITensor& b, const Context& ctx);
+// NCHW的channel的[begin, begin + size), input必须是静态的shape
+nvinfer1::ITensor* addChannelSlice(Key& key, const char* name, nvinfer1::ITensor& input, int begin, int size, const Context& ctx);
+nvinfer1::ITensor* addChannelConcat(Key& key, const char* name, nvinfer1::ITensor* const* inputs, int count, const Context& ctx);
+
+/* ------------------------------- blocks ------------------------------- */
+
+template <int C1, int C2, int K = 1, int S = 1, class Prefix = Name<>>
+struct ConvBNSiLU {
+    static_assert(C1 > 0 && C2 > 0, "ConvBNSiLU channels must be positive");
+    static_assert(K > 0 && K % 2 == 1, "ConvBNSiLU kernel must be odd, pad is K / 2");
+    static_assert(S > 0, "ConvBNSiLU stride must be positive");
+
+    static constexpr int inChannels  = C1;
+    static constexpr int outChannels = C2;
+
+    static nvinfer1::ITensor* add(Key& key, nvinfer1::ITensor& input, const Context& ctx) {
+        return addConvBNSiLU(key, input, C1, C2, K, S, names(), ctx);
+    }
+
+    static const ConvNames& names() {
+        static const ConvNames n = {
+            Suffix<Prefix, names::Conv>::value,
+            Suffix<Prefix, names::Conv, names::Weight>::value,
+            Suffix<Prefix, names::Conv, names::WeightScale>::value,
+            Suffix<Prefix, names::Conv, names::Bias>::value,
+            Suffix<Prefix, names::Norm>::value,
+            Suffix<Prefix, names::Norm, names::Weight>::value,
+            Suffix<Prefix, names::Norm, names::Bias>::value,
+            Suffix<Prefix, names::Norm, names::Mean>::value,
+            Suffix<Prefix, names::Norm, names::Var>::value,
+            Suffix<Prefix, names::Sigmoid>::value,
+            Suffix<Prefix, names::Mul>::value,
+        };
+        return n;
+    }
+};
+
+// E是hidden channel相对于C2的比例, C2F里面用的是1
+template <int C1, int C2, bool Shortcut = true, class E = std::ratio<1, 2>, class Prefix = Name<>>
+struct BottleNeck {
+    static_assert(C2 * E::num % E::den == 0, "BottleNeck hidden channels C2 * e must be an integer");
+    static constexpr int  hidden      = C2 * E::num / E::den;
+    static_assert(hidden > 0, "BottleNeck hidden channels must be positive");
+    static constexpr int  inChannels  = C1;
+    static constexpr int  outChannels = C2;
+    // 和ultralytics一样, 输入输出的channel不一样的时候没有shortcut
+    static constexpr bool residual    = Shortcut && C1 == C2;
+
+    using Cv1 = ConvBNSiLU<C1, hidden, 3, 1, Suffix<Prefix, names::Cv1>>;
+    using Cv2 = ConvBNSiLU<hidden, C2, 3, 1, Suffix<Prefix, names::Cv2>>;
+
+    static nvinfer1::ITensor* add(Key& key, nvinfer1::ITensor& input, const Context& ctx) {
+        auto x = Cv1::add(key, input, ctx);
+        auto y = x ? Cv2::add(key, *x, ctx) : nullptr;
+        if (y == nullptr || !residual) return y;
+        return addSum(key, Suffix<Prefix, names::Add>::value, input, *y, ctx);
+    }
+};
+
+// cv1的输出分成两半, 后一半依次经过N个bottleneck(m.0. ... m.N-1.), cv1的输出和每个bottleneck的输出concat以后是cv2
+template <int C1, int C2, int N = 1, bool Shortcut = false, class E = std::ratio<1, 2>, class Prefix = Name<>>
+struct C2F {
+    static_assert(N >= 1, "C2F needs at least one bottleneck");
+    static_assert(C2 * E::num % E::den == 0, "C2F hidden channels C2 * e must be an integer");
+    static constexpr int hidden         = C2 * E::num / E::den;
+    static_assert(hidden > 0, "C2F hidden channels must be positive");
+    static constexpr int inChannels     = C1;
+    static constexpr int outChannels    = C2;
+    static constexpr int concatChannels = (2 + N) * hidden;
+
+    using Cv1 = ConvBNSiLU<C1, 2 * hidden, 1, 1, Suffix<Prefix, names::Cv1>>;
+    using Cv2 = ConvBNSiLU<concatChannels, C2, 1, 1, Suffix<Prefix, names::Cv2>>;
+    template <int I>
+    using M   = BottleNeck<hidden, hidden, Shortcut, std::ratio<1>, Suffix<Prefix, names::M, typename Digits<I>::type, names::Dot>>;
+
+    static_assert(Cv1::outChannels + N * M<0>::outChannels == concatChannels, "C2F concat channels do not add up");
+
+    static nvinfer1::ITensor* add(Key& key, nvinfer1::ITensor& input, const Context& ctx) {
+        nvinfer1::ITensor* outputs[N + 1];
+        outputs[0] = Cv1::add(key, input, ctx);
+        if (outputs[0] == nullptr) return nullptr;
+
+        // cv1的前一半直接在outputs[0]里参与concat, bottleneck只需要后一半
+        auto tail = addChannelSlice(key, Suffix<Prefix, names::Slice>::value, *outputs[0], hidden, hidden, ctx);
+        if (tail == nullptr || !Repeat<0>::add(key, *tail, outputs, ctx)) return nullptr;
+
+        auto concat = addChannelConcat(key, Suffix<Prefix, names::Concat>::value, outputs, N + 1, ctx);
+        return concat ? Cv2::add(key, *concat, ctx) : nullptr;
+    }
+
+private:
+    // M<0> ... M<N - 1>在编译期展开
+    template <int I, bool = (I < N)>
+    struct Repeat {
+        static bool add(Key& key, nvinfer1::ITensor& input, nvinfer1::ITensor** outputs, const Context& ctx) {
+            outputs[I + 1] = M<I>::add(key, input, ctx);
+            return outputs[I + 1] != nullptr && Repeat<I + 1>::add(key, *outputs[I + 1], outputs, ctx);
+        }
+    };
+    template <int I>
+    struct Repeat<I, false> {
+        static bool add(Key&, nvinfer1::ITensor&, nvinfer1::ITensor**, const Context&) { return true; }
+    };
+};
+
+/* ------------------------------- yolov8的n/s/m/l/x ------------------------------- */
+
+// 和ultralytics的parse_model一样: 重复次数n > 1的时候乘以depth并四舍五入(至少是1),
+// channel先限制在MaxChannels以内, 乘以width以后向上补齐到8的倍数
+template <class Depth, class Width, int MaxChannels>
+struct Scale {
+    static constexpr int repeats(int n) {
+        return n > 1 ? atLeastOne((2 * n * Depth::num + Depth::den) / (2 * Depth::den)) : n;
+    }
+    static constexpr int channels(int c) {
+        return ((c < MaxChannels ? c : MaxChannels) * Width::num + 8 * Width::den - 1) / (8 * Width::den) * 8;
+    }
+
+private:
+    static constexpr int atLeastOne(int n) { return n > 1 ? n : 1; }
+};
+
+using ScaleN = Scale<std::ratio<33, 100>, std::ratio<1, 4>, 1024>;
+using ScaleS = Scale<std::ratio<33, 100>, std::ratio<1, 2>, 1024>;
+using ScaleM = Scale<std::ratio<67, 100>, std::ratio<3, 4>, 768>;
+using ScaleL = Scale<std::ratio<1>,       std::ratio<1>,    512>;
+using ScaleX = Scale<std::ratio<1>,       std::ratio<5, 4>, 512>;
+
+/* ------------------------------- check ------------------------------- */
+
+// 用假的权重构建yolov8m的model.2(C2F<96, 96, 2>), 和parser::addC2F对比构建一个network的时间,
+// 检查两者的层名一样, 并且CPU上推导的每一层的shape和TensorRT的一样(shapes::check)
+bool check(int iters = 100);
+
+} // namespace blocks
+} // namespace network
+
+#endif //__BLOCKS_HPP__
@@ -0,0 +1,549 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include "buildconfig.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace buildcfg {
+
+static string trim(const string& str) {
+    size_t begin = str.find_first_not_of(" \t\r\n");
+    if (begin == string::npos) return "";
+    size_t end = str.find_last_not_of(" \t\r\n");
+    return str.substr(begin, end - begin + 1);
+}
+
+static string lower(string str) {
+    for (auto& c : str) c = (char)tolower((unsigned char)c);
+    return str;
+}
+
+static vector<string> splitList(const string& str) {
+    vector<string> items;
+    stringstream   ss(str);
+    string         item;
+    while (getline(ss, item, ',')) {
+        item = trim(item);
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+bool parseShapeProfile(const string& str, ShapeProfile& profile) {
+    size_t colon = str.rfind(':');
+    if (colon == string::npos || colon == 0) return false;
+    profile.input = str.substr(0, colon);
+
+    nvinfer1::Dims* dims[3] = {&profile.min, &profile.opt, &profile.max};
+    stringstream    ss(str.substr(colon + 1));
+    string          item;
+    int             n = 0;
+    while (getline(ss, item, ',')) {
+        if (n == 3 || !parseDims(item, *dims[n])) return false;
+        n++;
+    }
+    if (n != 3 || profile.min.nbDims != profile.opt.nbDims || profile.min.nbDims != profile.max.nbDims) {
+        return false;
+    }
+    for (int i = 0; i < profile.min.nbDims; i++) {
+        if (profile.min.d[i] > profile.opt.d[i] || profile.opt.d[i] > profile.max.d[i]) return false;
+    }
+    return true;
+}
+
+bool parseSize(const string& str, size_t& bytes) {
+    string s = trim(str);
+    if (s.empty()) return false;
+    double scale = 1;
+    switch (toupper((unsigned char)s.back())) {
+        case 'K': scale = 1024.0;                   s.pop_back(); break;
+        case 'M': scale = 1024.0 * 1024;            s.pop_back(); break;
+        case 'G': scale = 1024.0 * 1024 * 1024;     s.pop_back(); break;
+        default: break;
+    }
+    if (s.empty() || !(isdigit((unsigned char)s[0]) || s[0] == '.')) return false;
+    char*  end;
+    double value = strtod(s.c_str(), &end);
+    if (*end != '\0' || !std::isfinite(value) || value < 0 || value * scale > 1e18) return false;
+    bytes = (size_t)llround(value * scale);
+    return true;
+}
+
+string formatSize(size_t bytes) {
+    char buff[32];
+    if (bytes >= (1ull << 30) && bytes % (1ull << 30) == 0) {
+        snprintf(buff, sizeof(buff), "%zuG", bytes >> 30);
+    } else if (bytes >= (1ull << 20) && bytes % (1ull << 20) == 0) {
+        snprintf(buff, sizeof(buff), "%zuM", bytes >> 20);
+    } else if (bytes >= (1ull << 10) && bytes % (1ull << 10) == 0) {
+        snprintf(buff, sizeof(buff), "%zuK", bytes >> 10);
+    } else {
+        snprintf(buff, sizeof(buff), "%zu", bytes);
+    }
+    return buff;
+}
+
+static bool parseBool(const string& str, bool& value) {
+    string s = lower(str);
+    if (s == "true" || s == "on" || s == "yes" || s == "1")  { value = true;  return true; }
+    if (s == "false" || s == "off" || s == "no" || s == "0") { value = false; return true; }
+    return false;
+}
+
+static bool parseInt(const string& str, int lo, int hi, int& value) {
+    if (str.empty()) return false;
+    char* end;
+    long  v = strtol(str.c_str(), &end, 10);
+    if (*end != '\0' || v < lo || v > hi) return false;
+    value = (int)v;
+    return true;
+}
+
+static bool parseTacticSources(const string& str, int64_t& mask) {
+    if (lower(str) == "default") {
+        mask = -1;
+        return true;
+    }
+    static const map<string, nvinfer1::TacticSource> kSources = {
+        {"cublas",                 nvinfer1::TacticSource::kCUBLAS},
+        {"cublas_lt",              nvinfer1::TacticSource::kCUBLAS_LT},
+        {"cudnn",                  nvinfer1::TacticSource::kCUDNN},
+        {"edge_mask_convolutions", nvinfer1::TacticSource::kEDGE_MASK_CONVOLUTIONS},
+        {"jit_convolutions",       nvinfer1::TacticSource::kJIT_CONVOLUTIONS},
+    };
+    // "none"或者空的列表表示只用TensorRT自己的kernel
+    mask = 0;
+    if (lower(str) == "none") return true;
+    for (auto& item : splitList(str)) {
+        auto it = kSources.find(lower(item));
+        if (it == kSources.end()) return false;
+        mask |= 1ll << (int)it->second;
+    }
+    return true;
+}
+
+static const map<string, nvinfer1::TensorFormat>& formats() {
+    static const map<string, nvinfer1::TensorFormat> kFormats = {
+        {"linear", nvinfer1::TensorFormat::kLINEAR},
+        {"chw2",   nvinfer1::TensorFormat::kCHW2},
+        {"chw4",   nvinfer1::TensorFormat::kCHW4},
+        {"chw16",  nvinfer1::TensorFormat::kCHW16},
+        {"chw32",  nvinfer1::TensorFormat::kCHW32},
+        {"hwc",    nvinfer1::TensorFormat::kHWC},
+        {"hwc8",   nvinfer1::TensorFormat::kHWC8},
+        {"hwc16",  nvinfer1::TensorFormat::kHWC16},
+    };
+    return kFormats;
+}
+
+string formatName(nvinfer1::TensorFormat format) {
+    for (auto& f : formats()) {
+        if (f.second == format) return f.first;
+    }
+    return to_string((int)format);
+}
+
+bool setOption(BuildProfile& p, const string& key, const string& value, string& error) {
+    auto size = [&](size_t& out) {
+        if (parseSize(value, out)) return true;
+        error = "invalid size '" + value + "' for " + key;
+        return false;
+    };
+    auto integer = [&](int lo, int hi, int& out) {
+        if (parseInt(value, lo, hi, out)) return true;
+        error = "'" + value + "' for " + key + " should be in [" + to_string(lo) + ", " + to_string(hi) + "]";
+        return false;
+    };
+    auto boolean = [&](bool& out) {
+        if (parseBool(value, out)) return true;
+        error = "invalid boolean '" + value + "' for " + key;
+        return false;
+    };
+
+    if (key == "workspace") {
+        if (lower(value) == "auto") {
+            p.autoWorkspace = true;
+            return true;
+        }
+        p.autoWorkspace = false;
+        return size(p.workspace);
+    } else if (key == "workspace_candidates") {
+        p.workspaceCandidates.clear();
+        for (auto& item : splitList(value)) {
+            size_t bytes;
+            if (!parseSize(item, bytes) || bytes == 0) {
+                error = "invalid size '" + item + "' for " + key;
+                return false;
+            }
+            p.workspaceCandidates.push_back(bytes);
+        }
+        return true;
+    } else if (key == "memory_budget") {
+        return size(p.memoryBudget);
+    } else if (key == "dla_sram") {
+        return size(p.dlaSram);
+    } else if (key == "dla_local_dram") {
+        return size(p.dlaLocalDram);
+    } else if (key == "dla_global_dram") {
+        return size(p.dlaGlobalDram);
+    } else if (key == "tactic_dram") {
+        return size(p.tacticDram);
+    } else if (key == "tactic_sources") {
+        if (parseTacticSources(value, p.tacticSources)) return true;
+        error = "invalid tactic sources '" + value + "'";
+        return false;
+    } else if (key == "opt_level") {
+        return integer(0, 5, p.optLevel);
+    } else if (key == "device") {
+        string d = lower(value);
+        if (d != "gpu" && d != "dla") {
+            error = "device should be gpu or dla";
+            return false;
+        }
+        p.useDla = d == "dla";
+        return true;
+    } else if (key == "dla_core") {
+        return integer(0, 15, p.dlaCore);
+    } else if (key == "gpu_fallback") {
+        return boolean(p.gpuFallback);
+    } else if (key == "builder_threads") {
+        return integer(0, 1024, p.builderThreads);
+    } else if (key == "avg_timing_iterations") {
+        return integer(0, 1000, p.avgTimingIterations);
+    } else if (key == "max_batch") {
+        return integer(1, 1 << 16, p.maxBatch);
+    } else if (key == "verbosity") {
+        string v = lower(value);
+        if (v == "detailed")         p.verbosity = nvinfer1::ProfilingVerbosity::kDETAILED;
+        else if (v == "layer_names") p.verbosity = nvinfer1::ProfilingVerbosity::kLAYER_NAMES_ONLY;
+        else if (v == "none")        p.verbosity = nvinfer1::ProfilingVerbosity::kNONE;
+        else {
+            error = "verbosity should be detailed, layer_names or none";
+            return false;
+        }
+        return true;
+    } else if (key == "precision_constraints") {
+        string v = lower(value);
+        if (v != "prefer" && v != "obey" && v != "none") {
+            error = "precision_constraints should be prefer, obey or none";
+            return false;
+        }
+        p.precisionConstraints = v;
+        return true;
+    } else if (key == "sparse_weights") {
+        return boolean(p.sparseWeights);
+    } else if (key == "refittable") {
+        return boolean(p.refittable);
+    } else if (key == "input_format" || key == "output_format") {
+        auto it = formats().find(lower(value));
+        if (it == formats().end()) {
+            error = key + " should be linear, chw2, chw4, chw16, chw32, hwc, hwc8 or hwc16";
+            return false;
+        }
+        (key == "input_format" ? p.inputFormat : p.outputFormat) = it->second;
+        return true;
+    } else if (key == "io_type") {
+        string v = lower(value);
+        if (v == "float")      p.ioType = nvinfer1::DataType::kFLOAT;
+        else if (v == "half")  p.ioType = nvinfer1::DataType::kHALF;
+        else {
+            error = "io_type should be float or half";
+            return false;
+        }
+        return true;
+    } else if (key == "shapes") {
+        // 用分号分隔多个input: shapes = images:1x3x640x640,4x3x640x640,8x3x640x640; mask:...
+        p.shapes.clear();
+        stringstream ss(value);
+        string       item;
+        while (getline(ss, item, ';')) {
+            item = trim(item);
+            if (item.empty()) continue;
+            string       compact;
+            for (char c : item) if (!isspace((unsigned char)c)) compact += c;
+            ShapeProfile shape;
+            if (!parseShapeProfile(compact, shape)) {
+                error = "invalid shape profile '" + item + "'";
+                return false;
+            }
+            p.shapes.push_back(shape);
+        }
+        return true;
+    }
+    error = "unknown key '" + key + "'";
+    return false;
+}
+
+/* ------------------------------- ProfileSet ------------------------------- */
+
+bool ProfileSet::load(const string& path) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        LOGE("ERROR: failed to open %s", path.c_str());
+        return false;
+    }
+    stringstream ss;
+    ss << file.rdbuf();
+    return parse(ss.str(), path);
+}
+
+bool ProfileSet::parse(const string& text, const string& source) {
+    stringstream ss(text);
+    string       line;
+    int          lineNo  = 0;
+    Section*     current = nullptr;
+    bool         ok      = true;
+    while (getline(ss, line)) {
+        lineNo++;
+        size_t comment = line.find('#');
+        if (comment != string::npos) line = line.substr(0, comment);
+        line = trim(line);
+        if (line.empty()) continue;
+        string where = source + ":" + to_string(lineNo);
+
+        if (line[0] == '[') {
+            current = nullptr;
+            if (line.back() != ']') {
+                LOGE("ERROR: %s: missing ']'", where.c_str());
+                ok = false;
+                continue;
+            }
+            string header = line.substr(1, line.size() - 2);
+            string name   = header;
+            string parent;
+            size_t colon  = header.find(':');
+            if (colon != string::npos) {
+                name   = trim(header.substr(0, colon));
+                parent = trim(header.substr(colon + 1));
+                if (parent.empty()) {
+                    LOGE("ERROR: %s: empty parent profile", where.c_str());
+                    ok = false;
+                    continue;
+                }
+            }
+            name = trim(name);
+            if (name.empty()) {
+                LOGE("ERROR: %s: empty profile name", where.c_str());
+                ok = false;
+                continue;
+            }
+            if (mSections.count(name)) {
+                LOGE("ERROR: %s: profile %s is already defined at %s", where.c_str(), name.c_str(),
+                     mSections[name].where.c_str());
+                ok = false;
+                continue;
+            }
+            current         = &mSections[name];
+            current->parent = parent;
+            current->where  = where;
+            mOrder.push_back(name);
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        if (eq == string::npos) {
+            LOGE("ERROR: %s: expected key = value", where.c_str());
+            ok = false;
+            continue;
+        }
+        if (current == nullptr) {
+            LOGE("ERROR: %s: key outside of a [profile] section", where.c_str());
+            ok = false;
+            continue;
+        }
+        string key   = lower(trim(line.substr(0, eq)));
+        string value = trim(line.substr(eq + 1));
+
+        // 先在一个空的profile上检查一遍, 这样错误可以报出行号
+        BuildProfile probe;
+        string       error;
+        if (!setOption(probe, key, value, error)) {
+            LOGE("ERROR: %s: %s", where.c_str(), error.c_str());
+            ok = false;
+            continue;
+        }
+        current->entries.push_back(make_pair(key, value));
+    }
+    return ok;
+}
+
+bool ProfileSet::resolve(const string& name, BuildProfile& profile) const {
+    vector<const Section*> chain;
+    set<string>            visited;
+    string                 cur = name;
+    while (!cur.empty()) {
+        auto it = mSections.find(cur);
+        if (it == mSections.end()) {
+            if (cur == name) LOGE("ERROR: build profile %s not found", name.c_str());
+            else             LOGE("ERROR: parent profile %s of %s not found", cur.c_str(), name.c_str());
+            return false;
+        }
+        if (!visited.insert(cur).second) {
+            LOGE("ERROR: build profile %s has an inheritance cycle through %s", name.c_str(), cur.c_str());
+            return false;
+        }
+        chain.push_back(&it->second);
+        cur = it->second.parent;
+    }
+
+    BuildProfile result;
+    result.name = name;
+    for (auto s = chain.rbegin(); s != chain.rend(); ++s) {
+        for (auto& e : (*s)->entries) {
+            string error;
+            if (!setOption(result, e.first, e.second, error)) {
+                LOGE("ERROR: %s: %s", (*s)->where.c_str(), error.c_str());
+                return false;
+            }
+        }
+    }
+    if (result.autoWorkspace && result.workspaceCandidates.empty()) {
+        LOGE("ERROR: build profile %s: workspace = auto needs workspace_candidates", name.c_str());
+        return false;
+    }
+    profile = result;
+    return true;
+}
+
+vector<string> ProfileSet::names() const {
+    return mOrder;
+}
+
+/* ------------------------------- TensorRT ------------------------------- */
+
+void apply(const BuildProfile& p, nvinfer1::IBuilder& builder, nvinfer1::IBuilderConfig& config) {
+    config.setMemoryPoolLimit(nvinfer1::MemoryPoolType::kWORKSPACE, p.workspace);
+    if (p.dlaSram > 0)       config.setMemoryPoolLimit(nvinfer1::MemoryPoolType::kDLA_MANAGED_SRAM, p.dlaSram);
+    if (p.dlaLocalDram > 0)  config.setMemoryPoolLimit(nvinfer1::MemoryPoolType::kDLA_LOCAL_DRAM, p.dlaLocalDram);
+    if (p.dlaGlobalDram > 0) config.setMemoryPoolLimit(nvinfer1::MemoryPoolType::kDLA_GLOBAL_DRAM, p.dlaGlobalDram);
+    if (p.tacticDram > 0)    config.setMemoryPoolLimit(nvinfer1::MemoryPoolType::kTACTIC_DRAM, p.tacticDram);
+
+    config.setProfilingVerbosity(p.verbosity);
+    builder.setMaxBatchSize(p.maxBatch);
+
+    if (p.tacticSources >= 0 && !config.setTacticSources((nvinfer1::TacticSources)p.tacticSources)) {
+        LOGW("failed to set tactic sources 0x%llx", (long long)p.tacticSources);
+    }
+    if (p.optLevel >= 0)            config.setBuilderOptimizationLevel(p.optLevel);
+    if (p.avgTimingIterations > 0)  config.setAvgTimingIterations(p.avgTimingIterations);
+    if (p.builderThreads > 0)       builder.setMaxThreads(p.builderThreads);
+
+    if (p.useDla) {
+        if (p.dlaCore < builder.getNbDLACores()) {
+            config.setDefaultDeviceType(nvinfer1::DeviceType::kDLA);
+            config.setDLACore(p.dlaCore);
+            if (p.gpuFallback) config.setFlag(nvinfer1::BuilderFlag::kGPU_FALLBACK);
+        } else {
+            LOGW("DLA core %d is not available (%d cores), building for GPU", p.dlaCore, builder.getNbDLACores());
+        }
+    }
+
+    // kPREFER_PRECISION_CONSTRAINTS是用来保证层按照指定的精度计算, 不能满足的时候TensorRT会给warning
+    // kOBEY的时候不能满足就build失败
+    if (p.precisionConstraints == "prefer") {
+        config.setFlag(nvinfer1::BuilderFlag::kPREFER_PRECISION_CONSTRAINTS);
+    } else if (p.precisionConstraints == "obey") {
+        config.setFlag(nvinfer1::BuilderFlag::kOBEY_PRECISION_CONSTRAINTS);
+    }
+
+    // 权重已经做过2:4剪枝(sparse::pruneWeights)的时候, 让TensorRT选择sparse的tactic
+    if (p.sparseWeights) {
+        config.setFlag(nvinfer1::BuilderFlag::kSPARSE_WEIGHTS);
+    }
+    // 只换权重的时候可以用refit::refitEngine更新engine, 不需要重新build
+    if (p.refittable) {
+        config.setFlag(nvinfer1::BuilderFlag::kREFIT);
+    }
+}
+
+void applyIO(const BuildProfile& p, nvinfer1::INetworkDefinition& network) {
+    auto set = [&](nvinfer1::ITensor* tensor, nvinfer1::TensorFormat format) {
+        if (p.ioType != nvinfer1::DataType::kFLOAT) tensor->setType(p.ioType);
+        if (format != nvinfer1::TensorFormat::kLINEAR) tensor->setAllowedFormats(1U << (int)format);
+        // 向量化的channel-last只有half的实现
+        if ((format == nvinfer1::TensorFormat::kHWC8 || format == nvinfer1::TensorFormat::kHWC16) &&
+            p.ioType != nvinfer1::DataType::kHALF) {
+            LOGW("%s format %s needs io_type = half", tensor->getName(), formatName(format).c_str());
+        }
+    };
+    for (int i = 0; i < network.getNbInputs(); i++)  set(network.getInput(i), p.inputFormat);
+    for (int i = 0; i < network.getNbOutputs(); i++) set(network.getOutput(i), p.outputFormat);
+}
+
+string describe(const BuildProfile& p) {
+    stringstream ss;
+    ss << p.name << ": workspace=";
+    if (p.autoWorkspace) {
+        ss << "auto(";
+        for (size_t i = 0; i < p.workspaceCandidates.size(); i++) {
+            ss << (i > 0 ? "," : "") << formatSize(p.workspaceCandidates[i]);
+        }
+        ss << ")";
+        if (p.memoryBudget > 0) ss << " budget=" << formatSize(p.memoryBudget);
+    } else {
+        ss << formatSize(p.workspace);
+    }
+    ss << " device=" << (p.useDla ? "dla:" + to_string(p.dlaCore) + (p.gpuFallback ? "+gpu" : "") : "gpu");
+    if (p.optLevel >= 0)       ss << " opt_level=" << p.optLevel;
+    if (p.tacticSources >= 0)  ss << " tactic_sources=0x" << hex << p.tacticSources << dec;
+    if (p.builderThreads > 0)  ss << " threads=" << p.builderThreads;
+    ss << " constraints=" << p.precisionConstraints;
+    if (p.sparseWeights)       ss << " sparse";
+    if (p.refittable)          ss << " refittable";
+    if (!p.shapes.empty())     ss << " shapes=" << p.shapes.size();
+    if (p.ioType != nvinfer1::DataType::kFLOAT)               ss << " io=half";
+    if (p.inputFormat != nvinfer1::TensorFormat::kLINEAR)     ss << " input=" << formatName(p.inputFormat);
+    if (p.outputFormat != nvinfer1::TensorFormat::kLINEAR)    ss << " output=" << formatName(p.outputFormat);
+    return ss.str();
+}
+
+/* ------------------------------- workspace auto-sizing ------------------------------- */
+
+bool improves(const WorkspaceTrial& trial, const WorkspaceTrial* best, size_t budget) {
+    if (budget > 0 && trial.deviceMemory > budget) return false;
+    // 从小到大尝试, 大的workspace要快1%以上才换
+    return best == nullptr || trial.latencyMs < best->latencyMs * 0.99;
+}
+
+int pickWorkspace(const vector<size_t>& candidates, size_t budget, TrialFn trial, vector<WorkspaceTrial>& trials) {
+    vector<size_t> sizes = candidates;
+    sort(sizes.begin(), sizes.end());
+    sizes.erase(unique(sizes.begin(), sizes.end()), sizes.end());
+
+    trials.clear();
+    int best = -1;
+    for (auto size : sizes) {
+        WorkspaceTrial t;
+        t.workspace = size;
+        t.built     = trial(size, t);
+        t.fits      = t.built && (budget == 0 || t.deviceMemory <= budget);
+        trials.push_back(t);
+        if (t.fits && improves(t, best < 0 ? nullptr : &trials[best], budget)) {
+            best = (int)trials.size() - 1;
+        }
+    }
+    return best;
+}
+
+void reportWorkspace(const vector<WorkspaceTrial>& trials, int picked, size_t budget) {
+    LOG("workspace auto-sizing, budget %s:", budget > 0 ? formatSize(budget).c_str() : "unlimited");
+    LOG("    %10s %14s %10s", "workspace", "device memory", "latency");
+    for (size_t i = 0; i < trials.size(); i++) {
+        auto& t = trials[i];
+        if (!t.built) {
+            LOG("    %10s %14s %10s", formatSize(t.workspace).c_str(), "-", "failed");
+            continue;
+        }
+        LOG("    %10s %11.1f MB %7.3f ms%s%s", formatSize(t.workspace).c_str(), t.deviceMemory / 1048576.0,
+            t.latencyMs, t.fits ? "" : "  over budget", (int)i == picked ? "  <- picked" : "");
+    }
+}
+
+} // namespace buildcfg
@@ -0,0 +1,139 @@
+#ifndef __BUILDCONFIG_HPP__
+#define __BUILDCONFIG_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+#include <cstdint>
+
+#include "NvInfer.h"
+
+// build时builder和config的设置(Model::loadBuildProfile), 不再写死在每个build函数里
+// 配置文件是ini的格式, 一个section是一个profile, [名字 : 父profile]可以继承父profile的设置再覆盖:
+//     [default]
+//     workspace      = 256M
+//
+//     [orin-dla : default]
+//     device         = dla
+//     dla_core       = 0
+//     gpu_fallback   = true
+//
+//     [auto : default]
+//     workspace            = auto
+//     workspace_candidates = 64M, 256M, 1G
+//     memory_budget        = 512M
+//
+//     [hwc-input : default]
+//     input_format         = hwc8
+//     io_type              = half
+// 支持的key和默认值见BuildProfile, 大小可以带K/M/G. 解析和继承的展开只依赖CPU, apply才会调用TensorRT
+//
+// workspace = auto的时候, 依次用workspace_candidates里的大小build, 选出device memory不超过memory_budget里
+// 最快的engine(pickWorkspace). timing cache打开的时候(Model::setTimingCache)后面几次build很快
+
+// onnx的input是动态shape的时候, 每个input需要min/opt/max三个shape
+struct ShapeProfile {
+    std::string    input;
+    nvinfer1::Dims min;
+    nvinfer1::Dims opt;
+    nvinfer1::Dims max;
+};
+
+namespace buildcfg {
+
+// 默认值和之前写死在build函数里的一样
+struct BuildProfile {
+    std::string                 name                 = "default";
+    size_t                      workspace            = 1 << 28;
+    bool                        autoWorkspace        = false;
+    std::vector<size_t>         workspaceCandidates;                 // workspace = auto的时候尝试的大小
+    size_t                      memoryBudget         = 0;            // engine的device memory上限, 0不限制
+    size_t                      dlaSram              = 0;            // DLA的memory pool, 0使用TensorRT的默认值
+    size_t                      dlaLocalDram         = 0;
+    size_t                      dlaGlobalDram        = 0;
+    size_t                      tacticDram           = 0;
+    int64_t                     tacticSources        = -1;           // TacticSource的bitmask, -1使用TensorRT的默认值
+    int                         optLevel             = -1;           // builder optimization level 0~5, -1默认(3)
+    bool                        useDla               = false;
+    int                         dlaCore              = 0;
+    bool                        gpuFallback          = true;         // DLA不支持的层回到GPU
+    int                         builderThreads       = 0;            // 0使用TensorRT的默认值
+    int                         avgTimingIterations  = 0;            // 0使用TensorRT的默认值
+    int                         maxBatch             = 1;            // 只对implicit batch的network有效
+    nvinfer1::ProfilingVerbosity verbosity           = nvinfer1::ProfilingVerbosity::kDETAILED;
+    std::string                 precisionConstraints = "prefer";     // prefer | obey | none
+    bool                        sparseWeights        = false;
+    bool                        refittable           = false;        // kREFIT, 权重变化的时候可以refit(见refit.hpp)
+    std::vector<ShapeProfile>   shapes;                              // 只对onnx有效, 所有的input组成一个optimization profile
+    // engine的input/output直接使用的layout和dtype, host上用layout.hpp在拷贝到pinned memory的时候转换
+    // hwc8/hwc16需要io_type = half
+    nvinfer1::TensorFormat      inputFormat          = nvinfer1::TensorFormat::kLINEAR;
+    nvinfer1::TensorFormat      outputFormat         = nvinfer1::TensorFormat::kLINEAR;
+    nvinfer1::DataType          ioType               = nvinfer1::DataType::kFLOAT;   // float | half
+};
+
+// "input0:1x3x224x224,4x3x224x224,8x3x224x224", min/opt/max的rank要一样且min <= opt <= max
+bool parseShapeProfile(const std::string& str, ShapeProfile& profile);
+// "1048576", "64K", "256M", "1.5G"
+bool parseSize(const std::string& str, size_t& bytes);
+std::string formatSize(size_t bytes);
+
+// 设置一个key, 出错的时候返回false并把原因写到error
+bool setOption(BuildProfile& profile, const std::string& key, const std::string& value, std::string& error);
+
+class ProfileSet {
+public:
+    bool load(const std::string& path);
+    // source只用于报错时的位置
+    bool parse(const std::string& text, const std::string& source = "<string>");
+
+    // 从最上层的父profile开始依次覆盖, 找不到名字, 父profile不存在或者继承有环的时候返回false
+    bool resolve(const std::string& name, BuildProfile& profile) const;
+    std::vector<std::string> names() const;
+
+private:
+    struct Section {
+        std::string                                      parent;
+        std::vector<std::pair<std::string, std::string>> entries;
+        std::string                                      where;   // file:line
+    };
+    std::map<std::string, Section> mSections;
+    std::vector<std::string>       mOrder;
+};
+
+// 把profile设置到builder和config上. 精度的flag(kFP16/kINT8)由Model按照precision设置, 这里只设置constraints
+void apply(const BuildProfile& profile, nvinfer1::IBuilder& builder, nvinfer1::IBuilderConfig& config);
+// 设置network的input和output的dtype和format. 在mark debug output之前调用, debug的tensor保持float和linear
+void applyIO(const BuildProfile& profile, nvinfer1::INetworkDefinition& network);
+std::string formatName(nvinfer1::TensorFormat format);
+// 一行的摘要, 用于日志
+std::string describe(const BuildProfile& profile);
+
+/* ------------------------------- workspace auto-sizing ------------------------------- */
+
+struct WorkspaceTrial {
+    size_t workspace    = 0;
+    bool   built        = false;
+    size_t deviceMemory = 0;    // engine执行时需要的device memory
+    double latencyMs    = 0;
+    bool   fits         = false;
+};
+
+// 用给定的workspace build一次并测量, build失败的时候返回false
+typedef std::function<bool(size_t workspace, WorkspaceTrial& trial)> TrialFn;
+
+// 依次尝试candidates, 返回满足budget(0不限制)且最快的那一次在trials里的下标, 都不满足的时候返回-1
+// 一样快(差距在1%以内)的时候选workspace小的
+int pickWorkspace(const std::vector<size_t>& candidates, size_t budget, TrialFn trial,
+                  std::vector<WorkspaceTrial>& trials);
+
+// 从小到大尝试的时候, 已经build成功的trial能不能替换当前最好的best(还没有的时候是nullptr):
+// 满足budget并且比best快1%以上. TrialFn里可以用它决定要不要留下这次的plan, 和pickWorkspace的选择一致
+bool improves(const WorkspaceTrial& trial, const WorkspaceTrial* best, size_t budget);
+
+void reportWorkspace(const std::vector<WorkspaceTrial>& trials, int picked, size_t budget);
+
+} // namespace buildcfg
+
+#endif //__BUILDCONFIG_HPP__
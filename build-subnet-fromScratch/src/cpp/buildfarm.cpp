@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits.h>
+#include <mutex>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+
+#include "buildfarm.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace farm {
+
+static double msSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static string dimsString(const nvinfer1::Dims& dims) {
+    string str;
+    for (int i = 0; i < dims.nbDims; i++) {
+        if (i > 0) str += "x";
+        str += to_string(dims.d[i]);
+    }
+    return str;
+}
+
+// 同一个文件的不同写法(./models/a.onnx, models/a.onnx)当作同一个模型
+static string normalizePath(const string& path) {
+    char buff[PATH_MAX];
+    return realpath(path.c_str(), buff) != nullptr ? string(buff) : path;
+}
+
+static size_t fileSize(const string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+string Job::key() const {
+    string str = normalizePath(model) + " " + precisionName(prec);
+    for (auto& p : profiles) {
+        str += " " + p.input + ":" + dimsString(p.min) + "," + dimsString(p.opt) + "," + dimsString(p.max);
+    }
+    return str;
+}
+
+string precisionName(Model::precision prec) {
+    switch (prec) {
+        case Model::FP16: return "fp16";
+        case Model::INT8: return "int8";
+        default:          return "fp32";
+    }
+}
+
+bool parsePrecision(const string& str, Model::precision& prec) {
+    if (str == "fp32")      prec = Model::FP32;
+    else if (str == "fp16") prec = Model::FP16;
+    else if (str == "int8") prec = Model::INT8;
+    else return false;
+    return true;
+}
+
+BuildFn modelBuilder() {
+    return [](const Job& job, BuildOutput& output) {
+        Model model(job.model, job.prec);
+        model.setProfiles(job.profiles);
+        if (job.memory > 0) model.setWorkspaceSize(job.memory);
+        output.enginePath = model.enginePath();
+        output.cached     = fileExists(output.enginePath);
+        if (!model.build()) return false;
+        output.engineBytes = fileSize(output.enginePath);
+        return true;
+    };
+}
+
+BuildFn simulatedBuilder(function<int(const Job& job)> durationMs) {
+    return [durationMs](const Job& job, BuildOutput& output) {
+        output.enginePath = getEnginePath(job.model, job.prec);
+        this_thread::sleep_for(chrono::milliseconds(durationMs(job)));
+        return true;
+    };
+}
+
+/* ------------------------------- BuildFarm ------------------------------- */
+
+BuildFarm::BuildFarm(int workers, size_t memoryBudget, size_t defaultMemory) :
+    mWorkers(max(workers, 1)), mMemoryBudget(memoryBudget), mDefaultMemory(defaultMemory) {}
+
+bool BuildFarm::add(const Job& job) {
+    string key    = job.key();
+    string engine = getEnginePath(job.model, job.prec);
+    if (isDuplicate(job)) {
+        LOGW("duplicated job %s, skipped", key.c_str());
+        return false;
+    }
+    for (auto& j : mJobs) {
+        if (getEnginePath(j.model, j.prec) == engine) {
+            LOGE("ERROR: %s and %s are both written to %s", j.key().c_str(), key.c_str(), engine.c_str());
+            return false;
+        }
+    }
+
+    Job added = job;
+    if (added.memory == 0) added.memory = mDefaultMemory;
+    if (mMemoryBudget > 0 && added.memory > mMemoryBudget) {
+        LOGW("%s needs %zu MB, more than the budget of %zu MB, it will be built alone", key.c_str(),
+             added.memory >> 20, mMemoryBudget >> 20);
+    }
+    mJobs.push_back(added);
+    return true;
+}
+
+bool BuildFarm::loadManifest(const string& path) {
+    ifstream f(path);
+    if (!f.is_open()) {
+        LOGE("ERROR: failed to open %s", path.c_str());
+        return false;
+    }
+
+    string line;
+    int    lineNo = 0;
+    bool   ok     = true;
+    while (getline(f, line)) {
+        lineNo++;
+        line = line.substr(0, line.find('#'));
+        stringstream ss(line);
+        string       model, prec, option;
+        if (!(ss >> model)) continue;
+
+        Job job;
+        job.model = model;
+        if (!(ss >> prec) || !parsePrecision(prec, job.prec)) {
+            LOGE("ERROR: %s:%d: expected fp32, fp16 or int8 after %s", path.c_str(), lineNo, model.c_str());
+            ok = false;
+            continue;
+        }
+        bool valid = true;
+        while (ss >> option) {
+            ShapeProfile profile;
+            if (option.compare(0, 8, "profile=") == 0 && buildcfg::parseShapeProfile(option.substr(8), profile)) {
+                job.profiles.push_back(profile);
+            } else if (option.compare(0, 7, "memory=") == 0 && atol(option.c_str() + 7) > 0) {
+                job.memory = (size_t)atol(option.c_str() + 7) << 20;
+            } else {
+                LOGE("ERROR: %s:%d: invalid option %s", path.c_str(), lineNo, option.c_str());
+                valid = false;
+            }
+        }
+        if (!valid) {
+            ok = false;
+            continue;
+        }
+        // 重复的job只是跳过, engine冲突才算错误
+        if (isDuplicate(job)) {
+            LOGW("%s:%d: duplicated job %s, skipped", path.c_str(), lineNo, job.key().c_str());
+            continue;
+        }
+        if (!add(job)) ok = false;
+    }
+    LOG("loaded %zu jobs from %s", mJobs.size(), path.c_str());
+    return ok;
+}
+
+bool BuildFarm::isDuplicate(const Job& job) const {
+    string key = job.key();
+    for (auto& j : mJobs) {
+        if (j.key() == key) return true;
+    }
+    return false;
+}
+
+vector<Result> BuildFarm::run(BuildFn build) {
+    vector<Result> results(mJobs.size());
+    if (mJobs.empty()) return results;
+
+    mutex              mtx;
+    condition_variable cv;
+    vector<size_t>     pending;
+    vector<int>        bypassed(mJobs.size(), 0);
+    size_t             inUse   = 0;
+    int                running = 0;
+    for (size_t i = 0; i < mJobs.size(); i++) pending.push_back(i);
+
+    // 按顺序找第一个放得下的job, 前面被跳过的job记一次插队
+    // 没有在运行的job的时候, 超过预算的job也可以单独开始
+    auto pick = [&]() -> int {
+        for (size_t k = 0; k < pending.size(); k++) {
+            size_t job = pending[k];
+            if (mMemoryBudget == 0 || running == 0 || inUse + mJobs[job].memory <= mMemoryBudget) {
+                for (size_t b = 0; b < k; b++) bypassed[pending[b]]++;
+                pending.erase(pending.begin() + k);
+                return (int)job;
+            }
+            if (bypassed[job] >= mWorkers) return -1;
+        }
+        return -1;
+    };
+
+    auto start  = chrono::steady_clock::now();
+    auto worker = [&](int id) {
+        while (true) {
+            int index = -1;
+            {
+                unique_lock<mutex> lock(mtx);
+                while (!pending.empty() && (index = pick()) < 0) cv.wait(lock);
+                if (index < 0) return;
+                inUse += mJobs[index].memory;
+                running++;
+            }
+
+            Result& r = results[index];
+            r.job     = mJobs[index];
+            r.worker  = id;
+            r.queueMs = msSince(start);
+            LOG("[worker %d] building %s", id, r.job.key().c_str());
+            auto t0   = chrono::steady_clock::now();
+            r.ok      = build(r.job, r.output);
+            r.buildMs = msSince(t0);
+            if (!r.ok) LOGE("ERROR: [worker %d] failed to build %s", id, r.job.key().c_str());
+
+            {
+                lock_guard<mutex> lock(mtx);
+                inUse -= mJobs[index].memory;
+                running--;
+            }
+            cv.notify_all();
+        }
+    };
+
+    vector<thread> threads;
+    int            count = min(mWorkers, (int)mJobs.size());
+    for (int i = 0; i < count; i++) threads.emplace_back(worker, i);
+    for (auto& t : threads) t.join();
+    return results;
+}
+
+void BuildFarm::report(const vector<Result>& results, double wallMs) {
+    LOG("%-48s %-5s %6s %10s %10s %10s  %s", "model", "prec", "worker", "start ms", "build ms", "engine MB", "status");
+
+    double total = 0;
+    size_t bytes = 0;
+    int    failed = 0, cached = 0;
+    for (auto& r : results) {
+        const char* status = !r.ok ? "FAILED" : r.output.cached ? "cached" : "built";
+        char        size[32] = "-";
+        if (r.output.engineBytes > 0) snprintf(size, sizeof(size), "%.2f", r.output.engineBytes / 1048576.0);
+        LOG("%-48s %-5s %6d %10.1f %10.1f %10s  %s", r.job.model.c_str(), precisionName(r.job.prec).c_str(),
+            r.worker, r.queueMs, r.buildMs, size, status);
+        total += r.buildMs;
+        bytes += r.output.engineBytes;
+        failed += !r.ok;
+        cached += r.ok && r.output.cached;
+    }
+    LOG("%zu jobs (%d cached, %d failed), engines: %.2f MB, build time: %.1f ms, wall time: %.1f ms, speedup: %.2fx",
+        results.size(), cached, failed, bytes / 1048576.0, total, wallMs, wallMs > 0 ? total / wallMs : 0.0);
+}
+
+bool buildAll(const string& manifest, int workers, size_t memoryBudget) {
+    BuildFarm farm(workers, memoryBudget);
+    if (!farm.loadManifest(manifest)) return false;
+
+    auto start   = chrono::steady_clock::now();
+    auto results = farm.run(modelBuilder());
+    BuildFarm::report(results, msSince(start));
+
+    for (auto& r : results) {
+        if (!r.ok) return false;
+    }
+    return true;
+}
+
+} // namespace farm
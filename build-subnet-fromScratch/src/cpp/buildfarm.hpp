@@ -0,0 +1,90 @@
+#ifndef __BUILDFARM_HPP__
+#define __BUILDFARM_HPP__
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include "model.hpp"
+
+// 一次build多个模型和精度的engine, 代替在main.cpp里改路径然后重复运行trt-infer
+// manifest每一行是一个job, #开头的是注释:
+//     <model> <fp32|fp16|int8> [profile=<input>:<min>,<opt>,<max>]... [memory=<MB>]
+//     models/onnx/sample.onnx fp16 profile=input0:1x3x224x224,4x3x224x224,8x3x224x224 memory=512
+// 调度:
+//     - 固定个数的worker, 每个worker一次build一个job
+//     - 每个job预留memory(同时也是builder的workspace上限), 所有正在build的job加起来不超过memoryBudget
+//       放不下的时候后面小的job可以先开始, 一个job被插队超过workers次以后就不再让别的job插队, 避免饿死
+//     - 完全一样的job只build一次, 输出到同一个engine的不同job(只有profile不一样)直接报错
+// build的方法由调用的地方提供, modelBuilder用Model来build, simulatedBuilder只sleep, 用来测试调度
+
+namespace farm {
+
+struct Job {
+    std::string               model;
+    Model::precision          prec   = Model::FP32;
+    std::vector<ShapeProfile> profiles;
+    size_t                    memory = 0;    // 0表示使用BuildFarm的默认值
+
+    // 去重用的key: 模型路径 + 精度 + profile
+    std::string key() const;
+};
+
+struct BuildOutput {
+    std::string enginePath;
+    size_t      engineBytes = 0;
+    bool        cached      = false;    // engine已经存在, 没有重新build
+};
+
+struct Result {
+    Job         job;
+    BuildOutput output;
+    bool        ok       = false;
+    int         worker   = -1;
+    double      queueMs  = 0;    // 从run开始到这个job开始build
+    double      buildMs  = 0;
+};
+
+typedef std::function<bool(const Job& job, BuildOutput& output)> BuildFn;
+
+std::string precisionName(Model::precision prec);
+bool        parsePrecision(const std::string& str, Model::precision& prec);
+
+// 用Model来build, memory作为builder的workspace上限
+BuildFn modelBuilder();
+
+// 不做真正的build, 按照durationMs(job)的时间sleep, engineBytes为0
+BuildFn simulatedBuilder(std::function<int(const Job& job)> durationMs);
+
+class BuildFarm {
+public:
+    // memoryBudget为0的时候不限制内存, 只限制worker的个数
+    BuildFarm(int workers, size_t memoryBudget = 0, size_t defaultMemory = 1 << 28);
+
+    // 重复的job或者和已有的job输出到同一个engine的时候返回false
+    bool add(const Job& job);
+    bool loadManifest(const std::string& path);
+
+    std::vector<Result> run(BuildFn build);
+    const std::vector<Job>& jobs() const { return mJobs; }
+
+    // 打印每个job的build时间和engine大小, 以及整体的耗时和并行的加速比
+    static void report(const std::vector<Result>& results, double wallMs);
+
+private:
+    bool isDuplicate(const Job& job) const;
+
+private:
+    int              mWorkers;
+    size_t           mMemoryBudget;
+    size_t           mDefaultMemory;
+    std::vector<Job> mJobs;
+};
+
+// loadManifest + run + report, 有job失败的时候返回false
+bool buildAll(const std::string& manifest, int workers, size_t memoryBudget = 0);
+
+} // namespace farm
+
+#endif //__BUILDFARM_HPP__
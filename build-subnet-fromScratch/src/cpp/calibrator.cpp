@@ -0,0 +1,270 @@
+#include <experimental/filesystem>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#include "calibrator.hpp"
+#include "npy.hpp"
+#include "utils.hpp"
+#include "cuda_runtime.h"
+
+using namespace std;
+
+namespace calib {
+
+/* ------------------------------- CalibrationDataset ------------------------------- */
+
+CalibrationDataset::CalibrationDataset(const string& dir, nvinfer1::Dims inputDims, int prefetch, int workers, bool pinned) :
+    mDir(dir), mPrefetch(max(1, prefetch)), mWorkers(max(1, workers)), mPinned(pinned)
+{
+    mBatchSize      = inputDims.nbDims > 0 ? max(1, inputDims.d[0]) : 1;
+    mSampleElements = 1;
+    for (int i = 1; i < inputDims.nbDims; i++) {
+        mSampleElements *= inputDims.d[i];
+    }
+}
+
+CalibrationDataset::~CalibrationDataset() {
+    stop();
+    for (auto& slot : mSlots) {
+        if (mPinned) cudaFreeHost(slot.data);
+        else         free(slot.data);
+    }
+}
+
+bool CalibrationDataset::start() {
+    namespace fs = experimental::filesystem;
+
+    if (!fileExists(mDir)) {
+        LOGE("ERROR: calibration data %s not found", mDir.c_str());
+        return false;
+    }
+    for (auto& entry : fs::directory_iterator(mDir)) {
+        if (entry.path().extension() == ".npy") {
+            mFiles.push_back(entry.path().string());
+        }
+    }
+    sort(mFiles.begin(), mFiles.end());
+
+    // 只读header(mmap), 统计每一个文件里有多少个sample
+    for (size_t f = 0; f < mFiles.size(); f++) {
+        npy::Array array;
+        if (!npy::load(mFiles[f], array)) continue;
+        if (array.type() != nvinfer1::DataType::kFLOAT || array.count() % mSampleElements != 0) {
+            LOGW("%s doesn't match the input shape, skipped", mFiles[f].c_str());
+            continue;
+        }
+        for (int64_t i = 0; i < array.count() / mSampleElements; i++) {
+            mSamples.push_back({(int)f, i});
+        }
+    }
+
+    mBatchCount = mSamples.size() / mBatchSize;
+    if (mMaxBatches >= 0) {
+        mBatchCount = min(mBatchCount, mMaxBatches);
+    }
+    if (mBatchCount == 0) {
+        LOGE("ERROR: no complete calibration batch in %s", mDir.c_str());
+        return false;
+    }
+
+    // 分配失败的时候已经分配的slot由析构函数释放(data是nullptr的也可以free)
+    mSlots.resize(mPrefetch);
+    for (auto& slot : mSlots) {
+        size_t bytes = batchElements() * sizeof(float);
+        if (mPinned) {
+            cudaError_t err = cudaMallocHost(&slot.data, bytes);
+            if (err != cudaSuccess) {
+                slot.data = nullptr;
+                LOGE("ERROR: failed to allocate %zu bytes of pinned memory for calibration: %s", bytes, cudaGetErrorString(err));
+                return false;
+            }
+        } else {
+            slot.data = (float*)malloc(bytes);
+            if (slot.data == nullptr) {
+                LOGE("ERROR: failed to allocate %zu bytes for calibration", bytes);
+                return false;
+            }
+        }
+    }
+
+    for (int i = 0; i < mWorkers; i++) {
+        mThreads.emplace_back(&CalibrationDataset::worker, this);
+    }
+    LOG("calibration dataset: %zu files, %zu samples, %ld batches of %d",
+        mFiles.size(), mSamples.size(), (long)mBatchCount, mBatchSize);
+    return true;
+}
+
+void CalibrationDataset::stop() {
+    {
+        lock_guard<mutex> lock(mLock);
+        mStopping = true;
+    }
+    mCond.notify_all();
+    for (auto& t : mThreads) t.join();
+    mThreads.clear();
+}
+
+// 每个worker领取下一个batch的编号, 等它对应的slot空出来以后在锁外面读数据
+// slot是按照batch编号轮流使用的, 所以next()拿到的batch一定是按顺序的
+void CalibrationDataset::worker() {
+    npy::Array file;
+    int        opened = -1;
+
+    for (;;) {
+        unique_lock<mutex> lock(mLock);
+        mCond.wait(lock, [&] {
+            return mStopping || mNextFill >= mBatchCount || mSlots[mNextFill % mPrefetch].state == SlotState::FREE;
+        });
+        if (mStopping || mNextFill >= mBatchCount) return;
+
+        int64_t batch = mNextFill++;
+        Slot&   slot  = mSlots[batch % mPrefetch];
+        slot.state = SlotState::FILLING;
+        slot.batch = batch;
+        lock.unlock();
+
+        bool ok = true;
+        for (int k = 0; k < mBatchSize && ok; k++) {
+            const SampleRef& ref = mSamples[batch * mBatchSize + k];
+            if (ref.file != opened) {
+                ok     = npy::load(mFiles[ref.file], file);
+                opened = ok ? ref.file : -1;
+            }
+            if (ok) {
+                memcpy(slot.data + k * mSampleElements,
+                       file.as<float>() + ref.index * mSampleElements,
+                       mSampleElements * sizeof(float));
+            }
+        }
+        if (ok && mPreprocess) {
+            mPreprocess(slot.data, batchElements());
+        }
+
+        lock.lock();
+        slot.ok    = ok;
+        slot.state = SlotState::READY;
+        lock.unlock();
+        mCond.notify_all();
+    }
+}
+
+const float* CalibrationDataset::next() {
+    unique_lock<mutex> lock(mLock);
+    if (mNextRead >= mBatchCount) return nullptr;
+
+    Slot& slot = mSlots[mNextRead % mPrefetch];
+    mCond.wait(lock, [&] { return slot.state == SlotState::READY && slot.batch == mNextRead; });
+    if (!slot.ok) {
+        LOGE("ERROR: failed to read calibration batch %ld", (long)mNextRead);
+        return nullptr;
+    }
+    return slot.data;
+}
+
+void CalibrationDataset::release() {
+    {
+        lock_guard<mutex> lock(mLock);
+        mSlots[mNextRead % mPrefetch].state = SlotState::FREE;
+        mNextRead++;
+    }
+    mCond.notify_all();
+}
+
+/* ------------------------------- cache ------------------------------- */
+
+bool readCalibrationCache(const string& path, vector<char>& data) {
+    data.clear();
+    ifstream f(path, ios::in | ios::binary);
+    if (!f.is_open()) return false;
+    data.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+    return !data.empty();
+}
+
+bool writeCalibrationCache(const string& path, const void* data, size_t length) {
+    string tmp = path + ".tmp";
+    FILE*  f   = fopen(tmp.c_str(), "wb");
+    if (f == nullptr) {
+        LOGE("ERROR: failed to open %s", tmp.c_str());
+        return false;
+    }
+    bool ok = fwrite(data, 1, length, f) == length;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGE("ERROR: failed to write %s", path.c_str());
+        remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* ------------------------------- Int8EntropyCalibrator ------------------------------- */
+
+Int8EntropyCalibrator::Int8EntropyCalibrator(shared_ptr<CalibrationDataset> dataset, const string& cachePath) :
+    mDataset(dataset), mCachePath(cachePath) {}
+
+Int8EntropyCalibrator::~Int8EntropyCalibrator() noexcept {
+    if (mDevice != nullptr) cudaFree(mDevice);
+}
+
+// explicit batch的network, batch size已经包含在input的shape里了, 这里必须返回1
+int32_t Int8EntropyCalibrator::getBatchSize() const noexcept {
+    return 1;
+}
+
+bool Int8EntropyCalibrator::getBatch(void* bindings[], const char* names[], int32_t nbBindings) noexcept {
+    if (mDataset == nullptr) return false;
+
+    if (!mStarted) {
+        mStarted = true;
+        if (!mDataset->start()) {
+            mDataset.reset();
+            return false;
+        }
+        cudaError_t err = cudaMalloc(&mDevice, mDataset->batchElements() * sizeof(float));
+        if (err != cudaSuccess) {
+            LOGE("ERROR: failed to allocate the calibration input on the device: %s", cudaGetErrorString(err));
+            mDevice = nullptr;
+            mDataset.reset();
+            return false;
+        }
+    }
+
+    const float* batch = mDataset->next();
+    if (batch == nullptr) {
+        LOG("calibration finished, %ld batches used", (long)mBatches);
+        return false;
+    }
+    cudaError_t err = cudaMemcpy(mDevice, batch, mDataset->batchElements() * sizeof(float), cudaMemcpyKind::cudaMemcpyHostToDevice);
+    mDataset->release();
+    if (err != cudaSuccess) {
+        LOGE("ERROR: failed to copy calibration batch %ld to the device: %s", (long)mBatches, cudaGetErrorString(err));
+        return false;
+    }
+
+    bindings[0] = mDevice;
+    mBatches++;
+    LOGV("calibration batch %ld/%ld, binding: %s", (long)mBatches, (long)mDataset->batchCount(), names[0]);
+    return true;
+}
+
+const void* Int8EntropyCalibrator::readCalibrationCache(size_t& length) noexcept {
+    if (!calib::readCalibrationCache(mCachePath, mCache)) {
+        length = 0;
+        return nullptr;
+    }
+    LOG("using calibration cache %s, calibration skipped", mCachePath.c_str());
+    length = mCache.size();
+    return mCache.data();
+}
+
+void Int8EntropyCalibrator::writeCalibrationCache(const void* ptr, size_t length) noexcept {
+    if (calib::writeCalibrationCache(mCachePath, ptr, length)) {
+        LOG("calibration cache saved to %s", mCachePath.c_str());
+    }
+}
+
+} // namespace calib
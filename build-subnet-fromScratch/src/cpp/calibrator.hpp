@@ -0,0 +1,112 @@
+#ifndef __CALIBRATOR_HPP__
+#define __CALIBRATOR_HPP__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "NvInfer.h"
+
+// INT8量化需要的calibrator:
+//     1. CalibrationDataset按顺序流式地读取一个目录下的.npy(每个文件可以是一个或者多个sample),
+//        后台线程提前把数据读出来, 做完预处理以后放到pinned memory里, 推理线程拿到以后直接拷贝到device
+//     2. Int8EntropyCalibrator实现IInt8EntropyCalibrator2, 把dataset的batch交给TensorRT
+//     3. calibration的结果保存成cache文件, 下一次build的时候直接读cache, 不需要再跑一遍calibration
+// dataset和cache的读写都不依赖GPU(pinned=false的时候使用普通的内存)
+
+namespace calib {
+
+// 预处理, 直接在batch的buffer上原地修改, 比如做归一化
+typedef std::function<void(float* data, int64_t count)> Preprocess;
+
+class CalibrationDataset {
+public:
+    // inputDims的第0维是batch size, 剩下的是一个sample的shape
+    CalibrationDataset(const std::string& dir, nvinfer1::Dims inputDims,
+                       int prefetch = 4, int workers = 2, bool pinned = true);
+    ~CalibrationDataset();
+    CalibrationDataset(const CalibrationDataset&) = delete;
+    CalibrationDataset& operator=(const CalibrationDataset&) = delete;
+
+    void setPreprocess(Preprocess fn) { mPreprocess = fn; }
+    void setMaxBatches(int64_t n) { mMaxBatches = n; }
+
+    // 扫描目录并启动后台线程, 没有找到任何一个完整的batch的时候返回false
+    bool start();
+    // 按顺序拿到下一个batch, 数据读完了返回nullptr. 用完以后需要调用release把buffer还回去
+    const float* next();
+    void         release();
+
+    int     batchSize() const { return mBatchSize; }
+    int64_t batchElements() const { return mBatchSize * mSampleElements; }
+    int64_t batchCount() const { return mBatchCount; }
+
+private:
+    enum class SlotState { FREE, FILLING, READY };
+    struct SampleRef {
+        int     file;
+        int64_t index;
+    };
+    struct Slot {
+        float*    data  = nullptr;
+        SlotState state = SlotState::FREE;
+        int64_t   batch = -1;
+        bool      ok    = false;
+    };
+
+    void worker();
+    void stop();
+
+private:
+    std::string               mDir;
+    int                       mBatchSize;
+    int64_t                   mSampleElements;
+    int                       mPrefetch;
+    int                       mWorkers;
+    bool                      mPinned;
+    Preprocess                mPreprocess;
+    int64_t                   mMaxBatches = -1;
+
+    std::vector<std::string>  mFiles;
+    std::vector<SampleRef>    mSamples;
+    int64_t                   mBatchCount = 0;
+
+    std::vector<Slot>         mSlots;
+    int64_t                   mNextFill = 0;
+    int64_t                   mNextRead = 0;
+    bool                      mStopping = false;
+    std::mutex                mLock;
+    std::condition_variable   mCond;
+    std::vector<std::thread>  mThreads;
+};
+
+// cache文件的读写, 写的时候先写临时文件再rename, 多个build同时写也不会读到一半的内容
+bool readCalibrationCache(const std::string& path, std::vector<char>& data);
+bool writeCalibrationCache(const std::string& path, const void* data, size_t length);
+
+class Int8EntropyCalibrator : public nvinfer1::IInt8EntropyCalibrator2 {
+public:
+    // dataset可以为空, 这个时候只能依靠cache
+    Int8EntropyCalibrator(std::shared_ptr<CalibrationDataset> dataset, const std::string& cachePath);
+    ~Int8EntropyCalibrator() noexcept;
+
+    int32_t     getBatchSize() const noexcept override;
+    bool        getBatch(void* bindings[], const char* names[], int32_t nbBindings) noexcept override;
+    const void* readCalibrationCache(size_t& length) noexcept override;
+    void        writeCalibrationCache(const void* ptr, size_t length) noexcept override;
+
+private:
+    std::shared_ptr<CalibrationDataset> mDataset;
+    std::string                         mCachePath;
+    std::vector<char>                   mCache;
+    void*                               mDevice  = nullptr;
+    bool                                mStarted = false;
+    int64_t                             mBatches = 0;
+};
+
+} // namespace calib
+
+#endif //__CALIBRATOR_HPP__
@@ -0,0 +1,312 @@
+#include <experimental/filesystem>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "diff.hpp"
+#include "npy.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace diff {
+
+// 把float的bit按照大小顺序映射到整数上, 两个整数的差就是ULP的距离
+static inline int64_t orderedBits(float x) {
+    int32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits < 0 ? -(int64_t)(bits & 0x7fffffff) : (int64_t)bits;
+}
+
+static inline int ulpBucket(uint64_t ulp) {
+    int b = ulp == 0 ? 0 : 64 - __builtin_clzll(ulp);
+    return b < kUlpBuckets ? b : kUlpBuckets - 1;
+}
+
+// 每一个线程处理一段数据, 最后再合并
+struct Partial {
+    int64_t  nanMismatch = 0;
+    float    maxAbs      = 0;
+    float    maxRel      = 0;
+    double   sumAbs      = 0;
+    double   dot         = 0;
+    double   normOut     = 0;
+    double   normRef     = 0;
+    uint64_t maxUlp      = 0;
+    int64_t  ulp[kUlpBuckets] = {0};
+};
+
+static inline void accumulateUlp(Partial& p, float a, float b) {
+    bool na = std::isnan(a), nb = std::isnan(b);
+    if (na || nb) {
+        if (na != nb) p.nanMismatch++;
+        return;
+    }
+    int64_t  d   = orderedBits(a) - orderedBits(b);
+    uint64_t ulp = d < 0 ? (uint64_t)(-d) : (uint64_t)d;
+    p.ulp[ulpBucket(ulp)]++;
+    p.maxUlp = std::max(p.maxUlp, ulp);
+}
+
+static void comparePartial(const float* out, const float* ref, int64_t begin, int64_t end, float atol, Partial& p) {
+    int64_t i = begin;
+
+#if defined(__SSE2__)
+    __m128  vabs    = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128  vatol   = _mm_set1_ps(atol);
+    __m128  vmaxAbs = _mm_setzero_ps();
+    __m128  vmaxRel = _mm_setzero_ps();
+    __m128d vsum    = _mm_setzero_pd();
+    __m128d vdot    = _mm_setzero_pd();
+    __m128d vnOut   = _mm_setzero_pd();
+    __m128d vnRef   = _mm_setzero_pd();
+
+    for (; i + 4 <= end; i += 4) {
+        __m128 a     = _mm_loadu_ps(out + i);
+        __m128 b     = _mm_loadu_ps(ref + i);
+        // 有nan的位置全部置0, 不参与累加, 只在下面的ULP统计里计数
+        __m128 valid = _mm_cmpord_ps(a, b);
+        a            = _mm_and_ps(a, valid);
+        b            = _mm_and_ps(b, valid);
+
+        __m128 ad    = _mm_and_ps(_mm_sub_ps(a, b), vabs);
+        __m128 rel   = _mm_div_ps(ad, _mm_max_ps(_mm_and_ps(b, vabs), vatol));
+        vmaxAbs      = _mm_max_ps(ad, vmaxAbs);
+        vmaxRel      = _mm_max_ps(rel, vmaxRel);
+
+        __m128d alo = _mm_cvtps_pd(a), ahi = _mm_cvtps_pd(_mm_movehl_ps(a, a));
+        __m128d blo = _mm_cvtps_pd(b), bhi = _mm_cvtps_pd(_mm_movehl_ps(b, b));
+        __m128d dlo = _mm_cvtps_pd(ad), dhi = _mm_cvtps_pd(_mm_movehl_ps(ad, ad));
+        vsum  = _mm_add_pd(vsum,  _mm_add_pd(dlo, dhi));
+        vdot  = _mm_add_pd(vdot,  _mm_add_pd(_mm_mul_pd(alo, blo), _mm_mul_pd(ahi, bhi)));
+        vnOut = _mm_add_pd(vnOut, _mm_add_pd(_mm_mul_pd(alo, alo), _mm_mul_pd(ahi, ahi)));
+        vnRef = _mm_add_pd(vnRef, _mm_add_pd(_mm_mul_pd(blo, blo), _mm_mul_pd(bhi, bhi)));
+
+        // ULP的分桶需要clz, 这里按元素做
+        for (int k = 0; k < 4; k++) {
+            accumulateUlp(p, out[i + k], ref[i + k]);
+        }
+    }
+
+    float  fmaxAbs[4], fmaxRel[4];
+    double d[2];
+    _mm_storeu_ps(fmaxAbs, vmaxAbs);
+    _mm_storeu_ps(fmaxRel, vmaxRel);
+    for (int k = 0; k < 4; k++) {
+        p.maxAbs = std::max(p.maxAbs, fmaxAbs[k]);
+        p.maxRel = std::max(p.maxRel, fmaxRel[k]);
+    }
+    _mm_storeu_pd(d, vsum);  p.sumAbs  += d[0] + d[1];
+    _mm_storeu_pd(d, vdot);  p.dot     += d[0] + d[1];
+    _mm_storeu_pd(d, vnOut); p.normOut += d[0] + d[1];
+    _mm_storeu_pd(d, vnRef); p.normRef += d[0] + d[1];
+#endif
+
+    for (; i < end; i++) {
+        float a = out[i], b = ref[i];
+        accumulateUlp(p, a, b);
+        if (std::isnan(a) || std::isnan(b)) continue;
+        float ad  = fabsf(a - b);
+        p.maxAbs  = std::max(p.maxAbs, ad);
+        p.maxRel  = std::max(p.maxRel, ad / std::max(fabsf(b), atol));
+        p.sumAbs += ad;
+        p.dot    += (double)a * b;
+        p.normOut+= (double)a * a;
+        p.normRef+= (double)b * b;
+    }
+}
+
+DiffStats compare(const float* out, const float* ref, int64_t count, double atol, int threads) {
+    static const int64_t kMinChunk = 1 << 16;
+
+    if (threads <= 0) {
+        threads = std::max(1u, thread::hardware_concurrency());
+    }
+    threads = (int)std::max<int64_t>(1, std::min<int64_t>(threads, count / kMinChunk));
+
+    vector<Partial> partials(threads);
+    vector<thread>  workers;
+    int64_t chunk = (count + threads - 1) / threads;
+    for (int t = 1; t < threads; t++) {
+        int64_t begin = t * chunk;
+        int64_t end   = std::min(count, begin + chunk);
+        workers.emplace_back(comparePartial, out, ref, begin, end, (float)atol, std::ref(partials[t]));
+    }
+    comparePartial(out, ref, 0, std::min(count, chunk), (float)atol, partials[0]);
+    for (auto& w : workers) w.join();
+
+    DiffStats s;
+    double sumAbs = 0, dot = 0, normOut = 0, normRef = 0;
+    for (auto& p : partials) {
+        s.nanMismatch += p.nanMismatch;
+        s.maxAbs       = std::max(s.maxAbs, (double)p.maxAbs);
+        s.maxRel       = std::max(s.maxRel, (double)p.maxRel);
+        s.maxUlp       = std::max(s.maxUlp, p.maxUlp);
+        sumAbs        += p.sumAbs;
+        dot           += p.dot;
+        normOut       += p.normOut;
+        normRef       += p.normRef;
+        for (int k = 0; k < kUlpBuckets; k++) s.ulp[k] += p.ulp[k];
+    }
+    s.count   = count;
+    s.meanAbs = count > 0 ? sumAbs / count : 0;
+    // 两个都是0向量的时候认为是完全一样的
+    if (normOut == 0 && normRef == 0) {
+        s.cosine = 1.0;
+    } else if (normOut == 0 || normRef == 0) {
+        s.cosine = 0.0;
+    } else {
+        s.cosine = dot / (sqrt(normOut) * sqrt(normRef));
+    }
+    return s;
+}
+
+bool compareWithReference(const string& name, const float* out, int64_t count, const string& refDir, DiffStats& stats) {
+    npy::Array ref;
+    if (!npy::load(refDir + "/" + name + ".npy", ref)) {
+        return false;
+    }
+    if (ref.type() != nvinfer1::DataType::kFLOAT || ref.count() != count) {
+        LOGE("ERROR: %s, reference has %ld elements, but got %ld", name.c_str(), (long)ref.count(), (long)count);
+        return false;
+    }
+    stats      = compare(out, ref.as<float>(), count);
+    stats.name = name;
+    return true;
+}
+
+vector<DiffStats> compareDirs(const string& outDir, const string& refDir, vector<string> names) {
+    namespace fs = experimental::filesystem;
+
+    if (names.empty()) {
+        for (auto& entry : fs::directory_iterator(outDir)) {
+            if (entry.path().extension() == ".npy") {
+                names.push_back(entry.path().stem().string());
+            }
+        }
+        sort(names.begin(), names.end());
+    }
+
+    vector<DiffStats> results;
+    for (auto& name : names) {
+        npy::Array out;
+        if (!npy::load(outDir + "/" + name + ".npy", out)) continue;
+        if (out.type() != nvinfer1::DataType::kFLOAT) {
+            LOGE("ERROR: %s, only float32 tensors can be compared", name.c_str());
+            continue;
+        }
+        DiffStats s;
+        if (compareWithReference(name, out.as<float>(), out.count(), refDir, s)) {
+            results.push_back(s);
+        }
+    }
+    return results;
+}
+
+void report(const vector<DiffStats>& stats) {
+    LOG("%-30s %10s %12s %12s %12s %10s %10s %8s", "tensor", "count", "max abs", "mean abs", "max rel", "cosine", "max ulp", "nan");
+    for (auto& s : stats) {
+        LOG("%-30s %10ld %12.6f %12.6f %12.6f %10.6f %10lu %8ld",
+            s.name.c_str(), (long)s.count, s.maxAbs, s.meanAbs, s.maxRel, s.cosine, (unsigned long)s.maxUlp, (long)s.nanMismatch);
+
+        // ULP的分布只打印非空的bucket
+        string hist;
+        char   buff[64];
+        for (int k = 0; k < kUlpBuckets; k++) {
+            if (s.ulp[k] == 0) continue;
+            if (k == 0) snprintf(buff, sizeof(buff), "0:%ld ", (long)s.ulp[k]);
+            else        snprintf(buff, sizeof(buff), "<2^%d:%ld ", k, (long)s.ulp[k]);
+            hist += buff;
+        }
+        LOGV("%-30s ulp histogram: %s", "", hist.c_str());
+    }
+}
+
+int markDebugOutputs(nvinfer1::INetworkDefinition& network, const vector<string>& patterns) {
+    int marked = 0;
+    for (int i = 0; i < network.getNbLayers(); i++) {
+        auto layer = network.getLayer(i);
+        string name = layer->getName();
+        bool match = false;
+        for (auto& p : patterns) {
+            if (globMatch(p, name)) { match = true; break; }
+        }
+        if (!match) continue;
+
+        auto output = layer->getOutput(0);
+        if (output == nullptr || output->isNetworkOutput()) continue;
+
+        // 用层的名字作为binding的名字, 方便和参考值的文件名对应
+        output->setName(name.c_str());
+        network.markOutput(*output);
+        marked++;
+        LOGV("mark %s as a debug output %s", name.c_str(), printTensorShape(output).c_str());
+    }
+    return marked;
+}
+
+/* ------------------------------- DebugOutputs ------------------------------- */
+
+bool DebugOutputs::allocate(nvinfer1::ICudaEngine& engine, int firstBinding) {
+    for (int i = firstBinding; i < engine.getNbBindings(); i++) {
+        if (engine.bindingIsInput(i)) continue;
+        auto   dims   = engine.getBindingDimensions(i);
+        auto   type   = engine.getBindingDataType(i);
+        bool   dynamic = false;
+        for (int j = 0; j < dims.nbDims; j++) dynamic = dynamic || dims.d[j] < 0;
+        Tensor device, host;
+        if (!dynamic) {
+            device = Tensor::fromDims(dims, type, Location::Device);
+            host   = Tensor::fromDims(dims, type, Location::Pinned);
+        }
+        if (device.empty() || host.empty()) {
+            LOGE("ERROR: failed to allocate debug output %s %s", engine.getBindingName(i), printDims(dims).c_str());
+            return false;
+        }
+        mNames.push_back(engine.getBindingName(i));
+        mDevice.push_back(move(device));
+        mHost.push_back(move(host));
+    }
+    return true;
+}
+
+void DebugOutputs::bind(nvinfer1::ICudaEngine& engine, vector<void*>& bindings) {
+    for (size_t i = 0; i < mNames.size(); i++) {
+        int index = engine.getBindingIndex(mNames[i].c_str());
+        if (index >= 0 && index < (int)bindings.size()) {
+            bindings[index] = mDevice[i].data();
+        }
+    }
+}
+
+void DebugOutputs::download(cudaStream_t stream) {
+    for (size_t i = 0; i < mDevice.size(); i++) {
+        mHost[i].copyFrom(mDevice[i], stream);
+    }
+}
+
+bool DebugOutputs::save(const string& dir) const {
+    bool ok = true;
+    for (size_t i = 0; i < mNames.size(); i++) {
+        ok = npy::save(dir + "/" + mNames[i] + ".npy", mHost[i].data(), mHost[i].dtype(), mHost[i].shape()) && ok;
+    }
+    return ok;
+}
+
+vector<DiffStats> DebugOutputs::compare(const string& refDir) const {
+    vector<DiffStats> results;
+    for (size_t i = 0; i < mNames.size(); i++) {
+        DiffStats s;
+        Tensor    out = mHost[i].cast(nvinfer1::DataType::kFLOAT);
+        if (compareWithReference(mNames[i], out.data<float>(), out.count(), refDir, s)) {
+            results.push_back(s);
+        }
+    }
+    return results;
+}
+
+} // namespace diff
@@ -0,0 +1,74 @@
+#ifndef __DIFF_HPP__
+#define __DIFF_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include "NvInfer.h"
+#include "cuda_runtime.h"
+#include "tensor.hpp"
+
+// 逐层的精度对比工具, 用来定位FP16/INT8的engine是从哪一层开始和参考值对不上的
+// 使用的流程:
+//     1. debug编译(DEBUG=1), 通过Model::setDebugTensors指定想看的层, 这些层的输出会被mark成额外的network output
+//     2. 推理的时候把这些额外的output也拷贝回host, 保存成.npy(Model::setDumpDir)
+//     3. 和参考值(比如PyTorch里用hook导出的.npy)逐个对比, 打印max abs/rel error, cosine similarity和ULP的分布
+// 对比部分只依赖CPU, 可以直接对两个目录里保存好的.npy做对比
+
+namespace diff {
+
+// ULP的分布: bucket 0表示完全相同, bucket k表示ULP在[2^(k-1), 2^k)之间
+static const int kUlpBuckets = 34;
+
+struct DiffStats {
+    std::string name;
+    int64_t     count       = 0;
+    int64_t     nanMismatch = 0;
+    double      maxAbs      = 0;
+    double      meanAbs     = 0;
+    double      maxRel      = 0;
+    double      cosine      = 0;
+    uint64_t    maxUlp      = 0;
+    int64_t     ulp[kUlpBuckets] = {0};
+};
+
+// 相对误差的分母是max(|ref|, atol), 防止参考值接近0的时候相对误差爆炸
+DiffStats compare(const float* out, const float* ref, int64_t count, double atol = 1e-5, int threads = 0);
+
+// 在refDir下找name.npy作为参考值
+bool compareWithReference(const std::string& name, const float* out, int64_t count, const std::string& refDir, DiffStats& stats);
+
+// 对比两个目录下同名的.npy文件, names为空的时候对比outDir下所有的.npy
+std::vector<DiffStats> compareDirs(const std::string& outDir, const std::string& refDir, std::vector<std::string> names = {});
+
+void report(const std::vector<DiffStats>& stats);
+
+// 把名字(支持*通配)匹配上的层的第一个输出mark成network output, tensor的名字改成层的名字
+// 返回一共mark了多少个tensor
+int markDebugOutputs(nvinfer1::INetworkDefinition& network, const std::vector<std::string>& patterns);
+
+// 推理时给额外的output分配buffer, 并在推理结束后拷贝回host, 非float的output对比的时候转换成float
+class DebugOutputs {
+public:
+    DebugOutputs() {}
+    DebugOutputs(const DebugOutputs&) = delete;
+    DebugOutputs& operator=(const DebugOutputs&) = delete;
+
+    // 从firstBinding开始的所有output binding都认为是debug的tensor, 有一个分配不了(比如动态的-1)就返回false
+    bool allocate(nvinfer1::ICudaEngine& engine, int firstBinding);
+    // 按getBindingIndex把debug output的buffer填到bindings里, bindings的长度是engine.getNbBindings()
+    void bind(nvinfer1::ICudaEngine& engine, std::vector<void*>& bindings);
+    void download(cudaStream_t stream);
+    bool save(const std::string& dir) const;
+    std::vector<DiffStats> compare(const std::string& refDir) const;
+
+private:
+    std::vector<std::string>        mNames;
+    std::vector<Tensor>             mDevice;
+    std::vector<Tensor>             mHost;      // pinned
+};
+
+} // namespace diff
+
+#endif //__DIFF_HPP__
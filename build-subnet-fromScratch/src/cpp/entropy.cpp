@@ -0,0 +1,368 @@
+#include <experimental/filesystem>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "entropy.hpp"
+#include "calibrator.hpp"
+#include "npy.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace calib {
+
+static const int64_t kMinChunk = 1 << 16;
+
+static int chunkThreads(int64_t count, int threads) {
+    if (threads <= 0) {
+        threads = std::max(1u, thread::hardware_concurrency());
+    }
+    return (int)std::max<int64_t>(1, std::min<int64_t>(threads, count / kMinChunk));
+}
+
+// 把[0, count)切成threads段, 第0段在当前线程里做
+template <typename Fn>
+static void parallelFor(int64_t count, int threads, Fn fn) {
+    vector<thread> workers;
+    int64_t chunk = (count + threads - 1) / threads;
+    for (int t = 1; t < threads; t++) {
+        int64_t begin = std::min(count, t * chunk);
+        int64_t end   = std::min(count, begin + chunk);
+        workers.emplace_back(fn, t, begin, end);
+    }
+    fn(0, 0, std::min(count, chunk));
+    for (auto& w : workers) w.join();
+}
+
+/* ------------------------------- absmax ------------------------------- */
+
+static float absMaxPartial(const float* data, int64_t begin, int64_t end) {
+    int64_t i = begin;
+    float   m = 0;
+
+#if defined(__AVX__)
+    __m256 vabs = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 vinf = _mm256_set1_ps(INFINITY);
+    __m256 vmax = _mm256_setzero_ps();
+    for (; i + 8 <= end; i += 8) {
+        __m256 v = _mm256_and_ps(_mm256_loadu_ps(data + i), vabs);
+        // NaN和inf在比较的时候都是false, 直接变成0
+        v    = _mm256_and_ps(v, _mm256_cmp_ps(v, vinf, _CMP_LT_OQ));
+        vmax = _mm256_max_ps(vmax, v);
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, vmax);
+    for (int k = 0; k < 8; k++) m = std::max(m, lanes[k]);
+#elif defined(__SSE2__)
+    __m128 vabs = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 vinf = _mm_set1_ps(INFINITY);
+    __m128 vmax = _mm_setzero_ps();
+    for (; i + 4 <= end; i += 4) {
+        __m128 v = _mm_and_ps(_mm_loadu_ps(data + i), vabs);
+        v    = _mm_and_ps(v, _mm_cmplt_ps(v, vinf));
+        vmax = _mm_max_ps(vmax, v);
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, vmax);
+    for (int k = 0; k < 4; k++) m = std::max(m, lanes[k]);
+#elif defined(__aarch64__)
+    float32x4_t vinf = vdupq_n_f32(INFINITY);
+    float32x4_t vmax = vdupq_n_f32(0);
+    for (; i + 4 <= end; i += 4) {
+        float32x4_t v = vabsq_f32(vld1q_f32(data + i));
+        v    = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(v), vcltq_f32(v, vinf)));
+        vmax = vmaxq_f32(vmax, v);
+    }
+    m = vmaxvq_f32(vmax);
+#endif
+
+    for (; i < end; i++) {
+        float v = fabsf(data[i]);
+        if (v < INFINITY) m = std::max(m, v);
+    }
+    return m;
+}
+
+float absMax(const float* data, int64_t count, int threads) {
+    threads = chunkThreads(count, threads);
+    vector<float> partials(threads, 0);
+    parallelFor(count, threads, [&](int t, int64_t begin, int64_t end) {
+        partials[t] = absMaxPartial(data, begin, end);
+    });
+    return *std::max_element(partials.begin(), partials.end());
+}
+
+/* ------------------------------- binning ------------------------------- */
+
+// bin的下标用SIMD算, 计数只能一个一个加. 返回有效(有限)的数据个数
+static int64_t binPartial(const float* data, int64_t begin, int64_t end, float invWidth, uint64_t* hist) {
+    int64_t i     = begin;
+    int64_t valid = 0;
+
+#if defined(__SSE2__)
+    __m128 vabs  = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 vinf  = _mm_set1_ps(INFINITY);
+    __m128 vinv  = _mm_set1_ps(invWidth);
+    __m128 vlast = _mm_set1_ps((float)(kHistBins - 1));
+    int32_t idx[4];
+    for (; i + 4 <= end; i += 4) {
+        __m128 v    = _mm_and_ps(_mm_loadu_ps(data + i), vabs);
+        int    mask = _mm_movemask_ps(_mm_cmplt_ps(v, vinf));
+        _mm_storeu_si128((__m128i*)idx, _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(v, vinv), vlast)));
+        if (mask == 0xf) {
+            hist[idx[0]]++; hist[idx[1]]++; hist[idx[2]]++; hist[idx[3]]++;
+            valid += 4;
+        } else {
+            for (int k = 0; k < 4; k++) {
+                if (mask & (1 << k)) { hist[idx[k]]++; valid++; }
+            }
+        }
+    }
+#elif defined(__aarch64__)
+    float32x4_t vinf  = vdupq_n_f32(INFINITY);
+    float32x4_t vinv  = vdupq_n_f32(invWidth);
+    float32x4_t vlast = vdupq_n_f32((float)(kHistBins - 1));
+    int32_t  idx[4];
+    uint32_t finite[4];
+    for (; i + 4 <= end; i += 4) {
+        float32x4_t v = vabsq_f32(vld1q_f32(data + i));
+        vst1q_u32(finite, vcltq_f32(v, vinf));
+        vst1q_s32(idx, vcvtq_s32_f32(vminq_f32(vmulq_f32(v, vinv), vlast)));
+        for (int k = 0; k < 4; k++) {
+            if (finite[k]) { hist[idx[k]]++; valid++; }
+        }
+    }
+#endif
+
+    for (; i < end; i++) {
+        float v = fabsf(data[i]);
+        if (!(v < INFINITY)) continue;
+        int b = (int)std::min(v * invWidth, (float)(kHistBins - 1));
+        hist[b]++;
+        valid++;
+    }
+    return valid;
+}
+
+void ActivationHistogram::add(const float* data, int64_t count, int threads) {
+    float m = absMax(data, count, threads);
+
+    // 范围变大的时候, 新的bin宽度是原来的k倍, 原来的第i个bin正好落在新的第i/k个bin里
+    if (m > mRange) {
+        if (mRange == 0) {
+            mRange = m;
+        } else {
+            int k = (int)ceil(m / mRange);
+            vector<uint64_t> merged(kHistBins, 0);
+            for (int i = 0; i < kHistBins; i++) merged[i / k] += mBins[i];
+            mBins.swap(merged);
+            mRange *= k;
+        }
+    }
+
+    float invWidth = mRange > 0 ? kHistBins / mRange : 0;
+    threads = chunkThreads(count, threads);
+    vector<vector<uint64_t>> locals(threads, vector<uint64_t>(kHistBins, 0));
+    vector<int64_t>          valid(threads, 0);
+    parallelFor(count, threads, [&](int t, int64_t begin, int64_t end) {
+        valid[t] = binPartial(data, begin, end, invWidth, locals[t].data());
+    });
+    for (int t = 0; t < threads; t++) {
+        for (int b = 0; b < kHistBins; b++) mBins[b] += locals[t][b];
+        mTotal += valid[t];
+    }
+}
+
+float ActivationHistogram::threshold(Method method, double percentile) const {
+    float width = mRange / kHistBins;
+    switch (method) {
+        case Method::ENTROPY:    return entropyThreshold(mBins.data(), kHistBins, width);
+        case Method::PERCENTILE: return percentileThreshold(mBins.data(), kHistBins, width, percentile);
+        default:                 return mRange;
+    }
+}
+
+/* ------------------------------- threshold ------------------------------- */
+
+static inline double xlogx(double x) { return x > 0 ? x * log(x) : 0; }
+
+// 对每一个候选的截断位置i:
+//     P: hist[0, i), 超出i的部分全部加到最后一个bin上
+//     Q: 把hist[0, i)合并成128个bin, 再平均展开回P里非0的位置
+// KL(P||Q) = sum(p*log(p)) / T - log(T) + log(Qt) - sum_j(P_j * log(q_j)) / T
+// 其中T是P的总数, Qt是Q的总数, P_j是第j个量化bin里P的和. 用前缀和以后每个i只需要O(128)
+float entropyThreshold(const uint64_t* hist, int bins, float binWidth) {
+    if (bins <= kQuantBins) return bins * binWidth;
+
+    vector<double>  sum(bins + 1, 0), plogp(bins + 1, 0);
+    vector<int32_t> nonzero(bins + 1, 0);
+    for (int k = 0; k < bins; k++) {
+        sum[k + 1]     = sum[k] + hist[k];
+        plogp[k + 1]   = plogp[k] + xlogx((double)hist[k]);
+        nonzero[k + 1] = nonzero[k] + (hist[k] != 0);
+    }
+    double total = sum[bins];
+    if (total == 0) return bins * binWidth;
+
+    // Q里0的位置P不为0的时候, 用一个很小的值代替, 防止KL变成无穷大
+    static const double kEps = 1e-10;
+
+    double bestKL = INFINITY;
+    int    best   = bins;
+    for (int i = kQuantBins; i <= bins; i++) {
+        double qTotal = sum[i];
+        if (qTotal == 0) continue;
+        double outliers = total - sum[i];
+        double last     = hist[i - 1] + outliers;
+
+        double kl = (plogp[i - 1] + xlogx(last)) / total - log(total) + log(qTotal);
+        double merged = (double)i / kQuantBins;
+        for (int j = 0; j < kQuantBins; j++) {
+            int start = (int)(j * merged);
+            int stop  = j == kQuantBins - 1 ? i : (int)((j + 1) * merged);
+            double qsum = sum[stop] - sum[start];
+            double psum = qsum;
+            int    nz   = nonzero[stop] - nonzero[start];
+            if (j == kQuantBins - 1) {
+                psum += outliers;
+                if (hist[i - 1] == 0 && outliers > 0) nz++;
+            }
+            if (psum == 0) continue;
+            double q = qsum > 0 ? qsum / nz : kEps * qTotal;
+            kl -= psum * log(q) / total;
+        }
+        if (kl < bestKL) {
+            bestKL = kl;
+            best   = i;
+        }
+    }
+    return best * binWidth;
+}
+
+float percentileThreshold(const uint64_t* hist, int bins, float binWidth, double percentile) {
+    uint64_t total = 0;
+    for (int k = 0; k < bins; k++) total += hist[k];
+
+    double   target = total * std::min(100.0, std::max(0.0, percentile)) / 100.0;
+    uint64_t acc    = 0;
+    for (int k = 0; k < bins; k++) {
+        acc += hist[k];
+        if (acc >= target) return (k + 1) * binWidth;
+    }
+    return bins * binWidth;
+}
+
+/* ------------------------------- ScaleEngine ------------------------------- */
+
+map<string, float> ScaleEngine::computeScales(Method method, double percentile) const {
+    vector<const string*>              names;
+    vector<const ActivationHistogram*> hists;
+    for (auto& h : mHists) {
+        names.push_back(&h.first);
+        hists.push_back(&h.second);
+    }
+
+    vector<float> thresholds(hists.size(), 0);
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < hists.size(); i = next++) {
+            thresholds[i] = hists[i]->threshold(method, percentile);
+        }
+    };
+    int threads = mThreads > 0 ? mThreads : (int)std::max(1u, thread::hardware_concurrency());
+    threads = (int)std::min<size_t>(threads, std::max<size_t>(1, hists.size()));
+    vector<thread> workers;
+    for (int t = 1; t < threads; t++) workers.emplace_back(work);
+    work();
+    for (auto& w : workers) w.join();
+
+    // threshold为0的tensor(全是0)给一个很小的scale, scale为0的时候TensorRT会报错
+    map<string, float> scales;
+    for (size_t i = 0; i < hists.size(); i++) {
+        scales[*names[i]] = std::max(thresholds[i], 1e-8f) / 127.0f;
+    }
+    return scales;
+}
+
+/* ------------------------------- calibration table ------------------------------- */
+
+bool writeCalibrationTable(const string& path, const map<string, float>& scales, const string& header) {
+    string table = header + "\n";
+    char   line[32];
+    for (auto& s : scales) {
+        uint32_t bits;
+        memcpy(&bits, &s.second, sizeof(bits));
+        snprintf(line, sizeof(line), ": %08x\n", bits);
+        table += s.first + line;
+    }
+    return writeCalibrationCache(path, table.data(), table.size());
+}
+
+bool readCalibrationTable(const string& path, map<string, float>& scales) {
+    ifstream f(path);
+    if (!f.is_open()) {
+        LOGE("ERROR: failed to open %s", path.c_str());
+        return false;
+    }
+    string line;
+    getline(f, line);  // header
+    while (getline(f, line)) {
+        size_t pos = line.rfind(": ");
+        if (pos == string::npos) continue;
+        uint32_t bits = (uint32_t)strtoul(line.c_str() + pos + 2, nullptr, 16);
+        float    scale;
+        memcpy(&scale, &bits, sizeof(scale));
+        scales[line.substr(0, pos)] = scale;
+    }
+    return true;
+}
+
+bool calibrateFromDumps(const vector<string>& dirs, const string& outPath, Method method, double percentile) {
+    namespace fs = experimental::filesystem;
+
+    ScaleEngine engine;
+    for (auto& dir : dirs) {
+        if (!fileExists(dir)) {
+            LOGE("ERROR: %s not found", dir.c_str());
+            return false;
+        }
+        vector<string> files;
+        for (auto& entry : fs::directory_iterator(dir)) {
+            if (entry.path().extension() == ".npy") files.push_back(entry.path().string());
+        }
+        sort(files.begin(), files.end());
+        for (auto& file : files) {
+            npy::Array array;
+            if (!npy::load(file, array)) continue;
+            if (array.type() != nvinfer1::DataType::kFLOAT) {
+                LOGW("%s is not float32, skipped", file.c_str());
+                continue;
+            }
+            engine.add(fs::path(file).stem().string(), array.as<float>(), array.count());
+        }
+    }
+    if (engine.histograms().empty()) {
+        LOGE("ERROR: no activation found for calibration");
+        return false;
+    }
+
+    auto scales = engine.computeScales(method, percentile);
+    for (auto& h : engine.histograms()) {
+        LOGV("%-32s range: %10.4f, scale: %.6g", h.first.c_str(), h.second.range(), scales[h.first]);
+    }
+    if (!writeCalibrationTable(outPath, scales)) return false;
+    LOG("wrote %zu scales to %s", scales.size(), outPath.c_str());
+    return true;
+}
+
+} // namespace calib
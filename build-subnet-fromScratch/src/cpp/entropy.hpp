@@ -0,0 +1,81 @@
+#ifndef __ENTROPY_HPP__
+#define __ENTROPY_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+// 在CPU上计算INT8的scale, 不需要GPU和builder:
+//     1. 把每一层的activation(比如DEBUG=1的时候用setDumpDir导出的.npy)统计成2048个bin的|x|直方图
+//     2. 用KL divergence(entropy), percentile或者max的方式找到截断的threshold, scale = threshold / 127
+//     3. 按照TensorRT的calibration cache格式保存, 可以直接交给Int8EntropyCalibrator读取
+// 多个batch的数据可以分多次add进来, 数值范围变大的时候直方图会按整数倍合并bin
+
+namespace calib {
+
+static const int kHistBins  = 2048;
+static const int kQuantBins = 128;
+
+// 和TensorRT 8.6 IInt8EntropyCalibrator2写出来的cache的第一行一致
+static const char* const kCalibrationHeader = "TRT-8601-EntropyCalibration2";
+
+enum class Method {
+    ENTROPY,
+    PERCENTILE,
+    MAX
+};
+
+// 忽略NaN和inf
+float absMax(const float* data, int64_t count, int threads = 0);
+
+// hist是|x|的直方图, 每个bin的宽度是binWidth, 返回使KL divergence最小的threshold
+float entropyThreshold(const uint64_t* hist, int bins, float binWidth);
+float percentileThreshold(const uint64_t* hist, int bins, float binWidth, double percentile);
+
+class ActivationHistogram {
+public:
+    ActivationHistogram() : mBins(kHistBins, 0) {}
+
+    void  add(const float* data, int64_t count, int threads = 0);
+    float threshold(Method method, double percentile = 99.99) const;
+
+    float                        range() const { return mRange; }
+    int64_t                      total() const { return mTotal; }
+    const std::vector<uint64_t>& bins() const { return mBins; }
+
+private:
+    float                 mRange = 0;
+    int64_t               mTotal = 0;
+    std::vector<uint64_t> mBins;
+};
+
+class ScaleEngine {
+public:
+    void add(const std::string& name, const float* data, int64_t count) { mHists[name].add(data, count, mThreads); }
+    void setThreads(int threads) { mThreads = threads; }
+
+    // 不同的tensor之间并行计算
+    std::map<std::string, float> computeScales(Method method, double percentile = 99.99) const;
+
+    const std::map<std::string, ActivationHistogram>& histograms() const { return mHists; }
+
+private:
+    std::map<std::string, ActivationHistogram> mHists;
+    int                                        mThreads = 0;
+};
+
+// 每一行是"name: scale", scale是float的bit按照16进制保存
+bool writeCalibrationTable(const std::string& path, const std::map<std::string, float>& scales,
+                           const std::string& header = kCalibrationHeader);
+bool readCalibrationTable(const std::string& path, std::map<std::string, float>& scales);
+
+// dirs里的每一个目录是一个batch的dump, 同名的.npy属于同一个tensor.
+// 文件名是层名(debug output按层名命名), 从weights创建的network里中间的tensor也按层名命名(network::nameTensors),
+// 所以写出来的cache和INT8 build时TensorRT按tensor名读取的cache是同一套名字; input0/output0本来就是tensor名
+bool calibrateFromDumps(const std::vector<std::string>& dirs, const std::string& outPath,
+                        Method method = Method::ENTROPY, double percentile = 99.99);
+
+} // namespace calib
+
+#endif //__ENTROPY_HPP__
@@ -0,0 +1,496 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+
+#include "graph.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace graph {
+
+static const char* layerTypeName(nvinfer1::LayerType type) {
+    switch (type) {
+        case nvinfer1::LayerType::kCONVOLUTION:     return "Convolution";
+        case nvinfer1::LayerType::kFULLY_CONNECTED: return "FullyConnected";
+        case nvinfer1::LayerType::kACTIVATION:      return "Activation";
+        case nvinfer1::LayerType::kPOOLING:         return "Pooling";
+        case nvinfer1::LayerType::kSCALE:           return "Scale";
+        case nvinfer1::LayerType::kSOFTMAX:         return "SoftMax";
+        case nvinfer1::LayerType::kDECONVOLUTION:   return "Deconvolution";
+        case nvinfer1::LayerType::kCONCATENATION:   return "Concatenation";
+        case nvinfer1::LayerType::kELEMENTWISE:     return "ElementWise";
+        case nvinfer1::LayerType::kUNARY:           return "Unary";
+        case nvinfer1::LayerType::kPADDING:         return "Padding";
+        case nvinfer1::LayerType::kSHUFFLE:         return "Shuffle";
+        case nvinfer1::LayerType::kREDUCE:          return "Reduce";
+        case nvinfer1::LayerType::kTOPK:            return "TopK";
+        case nvinfer1::LayerType::kGATHER:          return "Gather";
+        case nvinfer1::LayerType::kMATRIX_MULTIPLY: return "MatrixMultiply";
+        case nvinfer1::LayerType::kCONSTANT:        return "Constant";
+        case nvinfer1::LayerType::kIDENTITY:        return "Identity";
+        case nvinfer1::LayerType::kPLUGIN_V2:       return "PluginV2";
+        case nvinfer1::LayerType::kSLICE:           return "Slice";
+        case nvinfer1::LayerType::kSHAPE:           return "Shape";
+        case nvinfer1::LayerType::kRESIZE:          return "Resize";
+        case nvinfer1::LayerType::kSELECT:          return "Select";
+        case nvinfer1::LayerType::kQUANTIZE:        return "Quantize";
+        case nvinfer1::LayerType::kDEQUANTIZE:      return "Dequantize";
+        case nvinfer1::LayerType::kEINSUM:          return "Einsum";
+        case nvinfer1::LayerType::kNORMALIZATION:   return "Normalization";
+        case nvinfer1::LayerType::kCAST:            return "Cast";
+        default:                                    return "Other";
+    }
+}
+
+static int64_t typeSize(nvinfer1::DataType type) {
+    switch (type) {
+        case nvinfer1::DataType::kHALF: return 2;
+        case nvinfer1::DataType::kINT8: return 1;
+        default:                        return 4;
+    }
+}
+
+static int64_t weightsBytes(const nvinfer1::Weights& w) {
+    return w.count * typeSize(w.type);
+}
+
+static int64_t layerWeightsBytes(nvinfer1::ILayer* layer) {
+    switch (layer->getType()) {
+        case nvinfer1::LayerType::kCONVOLUTION: {
+            auto l = static_cast<nvinfer1::IConvolutionLayer*>(layer);
+            return weightsBytes(l->getKernelWeights()) + weightsBytes(l->getBiasWeights());
+        }
+        case nvinfer1::LayerType::kDECONVOLUTION: {
+            auto l = static_cast<nvinfer1::IDeconvolutionLayer*>(layer);
+            return weightsBytes(l->getKernelWeights()) + weightsBytes(l->getBiasWeights());
+        }
+        case nvinfer1::LayerType::kFULLY_CONNECTED: {
+            auto l = static_cast<nvinfer1::IFullyConnectedLayer*>(layer);
+            return weightsBytes(l->getKernelWeights()) + weightsBytes(l->getBiasWeights());
+        }
+        case nvinfer1::LayerType::kSCALE: {
+            auto l = static_cast<nvinfer1::IScaleLayer*>(layer);
+            return weightsBytes(l->getShift()) + weightsBytes(l->getScale()) + weightsBytes(l->getPower());
+        }
+        case nvinfer1::LayerType::kCONSTANT:
+            return weightsBytes(static_cast<nvinfer1::IConstantLayer*>(layer)->getWeights());
+        default:
+            return 0;
+    }
+}
+
+static TensorInfo tensorInfo(nvinfer1::ITensor* tensor) {
+    TensorInfo t;
+    t.name = tensor->getName();
+    t.type = getPrecision(tensor->getType());
+    auto dims = tensor->getDimensions();
+    for (int i = 0; i < dims.nbDims; i++) t.dims.push_back(dims.d[i]);
+    return t;
+}
+
+Graph fromNetwork(nvinfer1::INetworkDefinition& network) {
+    Graph g;
+    for (int i = 0; i < network.getNbInputs(); i++)  g.inputs.push_back(tensorInfo(network.getInput(i)));
+    for (int i = 0; i < network.getNbOutputs(); i++) g.outputs.push_back(tensorInfo(network.getOutput(i)));
+
+    for (int i = 0; i < network.getNbLayers(); i++) {
+        auto      layer = network.getLayer(i);
+        LayerInfo l;
+        l.name         = layer->getName();
+        l.type         = layerTypeName(layer->getType());
+        l.precision    = getPrecision(layer->getPrecision());
+        l.weightsBytes = layerWeightsBytes(layer);
+        for (int j = 0; j < layer->getNbInputs(); j++) {
+            // 可选的input(例如Q/DQ的conv的bias)是nullptr
+            if (layer->getInput(j) != nullptr) l.inputs.push_back(tensorInfo(layer->getInput(j)));
+        }
+        for (int j = 0; j < layer->getNbOutputs(); j++) l.outputs.push_back(tensorInfo(layer->getOutput(j)));
+        g.layers.push_back(l);
+    }
+    return g;
+}
+
+/* ------------------------------- engine ------------------------------- */
+
+// "Row major linear FP32", "Channel major FP16 format where channel % 8 == 0", "Two wide channel vectorized row major Int8 format"
+static string formatType(const string& format) {
+    if (format.find("FP16") != string::npos || format.find("Half") != string::npos) return "FP16";
+    if (format.find("Int8") != string::npos || format.find("INT8") != string::npos) return "INT8";
+    if (format.find("Int32") != string::npos || format.find("INT32") != string::npos) return "INT32";
+    if (format.find("FP32") != string::npos || format.find("Float") != string::npos) return "FP32";
+    return "unknown";
+}
+
+static int64_t engineWeightsBytes(const json::Value& w) {
+    const string& type = w.get("Type").asString();
+    int64_t       size = type == "Half" ? 2 : type == "Int8" ? 1 : 4;
+    return (int64_t)w.get("Count").asNumber() * size;
+}
+
+static void parseTensors(const json::Value& array, vector<TensorInfo>& tensors) {
+    for (size_t i = 0; i < array.size() && array.isArray(); i++) {
+        const json::Value& v = array[i];
+        TensorInfo         t;
+        t.name   = v.get("Name").asString();
+        t.format = v.get("Format/Datatype").asString();
+        t.type   = formatType(t.format);
+        const json::Value& dims = v.get("Dimensions");
+        for (size_t k = 0; k < dims.size() && dims.isArray(); k++) t.dims.push_back((int64_t)dims[k].asNumber());
+        tensors.push_back(t);
+    }
+}
+
+bool parseEngineLayer(const string& info, LayerInfo& layer) {
+    json::Value v;
+    string      error;
+    if (!json::parse(info, v, &error)) {
+        LOGW("failed to parse layer information: %s", error.c_str());
+        return false;
+    }
+    if (v.isString()) {
+        layer.name = v.asString();
+        return true;
+    }
+    if (!v.isObject()) return false;
+
+    layer.name = v.get("Name").asString();
+    layer.type = v.get("LayerType").asString();
+    parseTensors(v.get("Inputs"), layer.inputs);
+    parseTensors(v.get("Outputs"), layer.outputs);
+    layer.precision = layer.outputs.empty() ? "" : layer.outputs[0].type;
+
+    if (v.get("Weights").isObject()) layer.weightsBytes += engineWeightsBytes(v.get("Weights"));
+    if (v.get("Bias").isObject())    layer.weightsBytes += engineWeightsBytes(v.get("Bias"));
+
+    layer.tactic = v.get("TacticName").asString();
+    if (layer.tactic.empty()) layer.tactic = v.get("TacticValue").asString();
+
+    // 融合了多个层的时候, 各个层的metadata用\x1E隔开
+    const string& metadata = v.get("Metadata").asString();
+    size_t        start    = 0;
+    while (start < metadata.size()) {
+        size_t end = metadata.find('\x1E', start);
+        if (end == string::npos) end = metadata.size();
+        if (end > start) layer.metadata.push_back(metadata.substr(start, end - start));
+        start = end + 1;
+    }
+    return true;
+}
+
+static TensorInfo engineTensor(nvinfer1::ICudaEngine& engine, const char* name) {
+    TensorInfo t;
+    t.name = name;
+    t.type = getPrecision(engine.getTensorDataType(name));
+    auto dims = engine.getTensorShape(name);
+    for (int i = 0; i < dims.nbDims; i++) t.dims.push_back(dims.d[i]);
+    return t;
+}
+
+Graph fromEngine(nvinfer1::ICudaEngine& engine) {
+    Graph g;
+    for (int i = 0; i < engine.getNbIOTensors(); i++) {
+        const char* name = engine.getIOTensorName(i);
+        if (engine.getTensorIOMode(name) == nvinfer1::TensorIOMode::kINPUT) {
+            g.inputs.push_back(engineTensor(engine, name));
+        } else {
+            g.outputs.push_back(engineTensor(engine, name));
+        }
+    }
+
+    unique_ptr<nvinfer1::IEngineInspector> inspector(engine.createEngineInspector());
+    for (int i = 0; i < engine.getNbLayers(); i++) {
+        LayerInfo l;
+        if (!parseEngineLayer(inspector->getLayerInformation(i, nvinfer1::LayerInformationFormat::kJSON), l)) {
+            l.name = "layer " + to_string(i);
+        }
+        g.layers.push_back(l);
+    }
+    return g;
+}
+
+/* ------------------------------- fusion ------------------------------- */
+
+static bool isDelimiter(char c) {
+    return c == ' ' || c == '+' || c == '(' || c == ')' || c == ',' || c == '[' || c == ']' || c == '{' || c == '}';
+}
+
+// name在fused里作为一个完整的名字出现, 前后是分隔符或者字符串的两端
+static bool containsName(const string& fused, const string& name) {
+    if (name.empty()) return false;
+    size_t pos = fused.find(name);
+    while (pos != string::npos) {
+        size_t end = pos + name.size();
+        if ((pos == 0 || isDelimiter(fused[pos - 1])) && (end == fused.size() || isDelimiter(fused[end]))) {
+            return true;
+        }
+        pos = fused.find(name, pos + 1);
+    }
+    return false;
+}
+
+// TensorRT自己插入的层, 没有对应的原始层
+static bool isInserted(const LayerInfo& layer) {
+    return layer.type == "Reformat" || layer.name.compare(0, 12, "Reformatting") == 0 ||
+           layer.name.compare(0, 11, "Reformatted") == 0;
+}
+
+void mapFusions(const Graph& network, Graph& engine) {
+    map<string, int> index;
+    for (size_t i = 0; i < network.layers.size(); i++) index[network.layers[i].name] = (int)i;
+
+    for (auto& layer : engine.layers) {
+        layer.origins.clear();
+        if (isInserted(layer)) continue;
+
+        set<int> found;
+        // Myelin: {ForeignNode[first...last]}, 按照network里的顺序取first到last之间所有的层
+        size_t foreign = layer.name.find("ForeignNode[");
+        if (foreign != string::npos) {
+            size_t begin = foreign + 12;
+            size_t dots  = layer.name.find("...", begin);
+            size_t end   = layer.name.rfind(']');
+            if (dots != string::npos && end != string::npos && end > dots) {
+                auto first = index.find(layer.name.substr(begin, dots - begin));
+                auto last  = index.find(layer.name.substr(dots + 3, end - dots - 3));
+                if (first != index.end() && last != index.end()) {
+                    for (int k = min(first->second, last->second); k <= max(first->second, last->second); k++) {
+                        found.insert(k);
+                    }
+                }
+            }
+        }
+
+        // onnx parser写的metadata是"[ONNX Layer: name]"
+        for (auto& m : layer.metadata) {
+            string name = m;
+            if (name.compare(0, 13, "[ONNX Layer: ") == 0 && name.back() == ']') name = name.substr(13, name.size() - 14);
+            auto it = index.find(name);
+            if (it != index.end()) found.insert(it->second);
+        }
+
+        if (found.empty()) {
+            for (size_t k = 0; k < network.layers.size(); k++) {
+                if (containsName(layer.name, network.layers[k].name)) found.insert((int)k);
+            }
+        }
+        for (int k : found) layer.origins.push_back(network.layers[k].name);
+    }
+}
+
+vector<string> eliminatedLayers(const Graph& network, const Graph& engine) {
+    set<string> used;
+    for (auto& layer : engine.layers) used.insert(layer.origins.begin(), layer.origins.end());
+
+    vector<string> eliminated;
+    for (auto& layer : network.layers) {
+        if (used.count(layer.name) == 0) eliminated.push_back(layer.name);
+    }
+    return eliminated;
+}
+
+/* ------------------------------- export ------------------------------- */
+
+static json::Value tensorJson(const TensorInfo& t) {
+    json::Value v = json::Value::object();
+    v["name"] = t.name;
+    json::Value dims = json::Value::array();
+    for (auto d : t.dims) dims.push(d);
+    v["dims"] = dims;
+    v["type"] = t.type;
+    if (!t.format.empty()) v["format"] = t.format;
+    return v;
+}
+
+static json::Value stringsJson(const vector<string>& strs) {
+    json::Value v = json::Value::array();
+    for (auto& s : strs) v.push(s);
+    return v;
+}
+
+json::Value toJson(const Graph& graph) {
+    json::Value root = json::Value::object();
+    json::Value inputs = json::Value::array(), outputs = json::Value::array(), layers = json::Value::array();
+    for (auto& t : graph.inputs)  inputs.push(tensorJson(t));
+    for (auto& t : graph.outputs) outputs.push(tensorJson(t));
+
+    for (auto& layer : graph.layers) {
+        json::Value l = json::Value::object();
+        l["name"]      = layer.name;
+        l["type"]      = layer.type;
+        l["precision"] = layer.precision;
+        json::Value in = json::Value::array(), out = json::Value::array();
+        for (auto& t : layer.inputs)  in.push(tensorJson(t));
+        for (auto& t : layer.outputs) out.push(tensorJson(t));
+        l["inputs"]       = in;
+        l["outputs"]      = out;
+        l["weightsBytes"] = layer.weightsBytes;
+        if (!layer.tactic.empty())   l["tactic"]    = layer.tactic;
+        if (!layer.metadata.empty()) l["metadata"]  = stringsJson(layer.metadata);
+        if (!layer.origins.empty())  l["fusedFrom"] = stringsJson(layer.origins);
+        layers.push(l);
+    }
+    root["inputs"]  = inputs;
+    root["outputs"] = outputs;
+    root["layers"]  = layers;
+    return root;
+}
+
+static string dotEscape(const string& str) {
+    string out;
+    for (char c : str) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+static string dimsLabel(const vector<int64_t>& dims) {
+    string str = "[";
+    for (size_t i = 0; i < dims.size(); i++) {
+        if (i > 0) str += "x";
+        str += to_string(dims[i]);
+    }
+    return str + "]";
+}
+
+static string bytesLabel(int64_t bytes) {
+    char buff[32];
+    if (bytes >= (1 << 20)) snprintf(buff, sizeof(buff), "%.2f MB", bytes / 1048576.0);
+    else                    snprintf(buff, sizeof(buff), "%.2f KB", bytes / 1024.0);
+    return buff;
+}
+
+string toDot(const Graph& graph, const string& title) {
+    string           dot = "digraph \"" + dotEscape(title) + "\" {\n";
+    map<string, string> producer;
+    set<string>      declared;
+    dot += "    rankdir=TB;\n";
+    dot += "    node [shape=box, fontname=\"Helvetica\", fontsize=10];\n";
+    dot += "    edge [fontname=\"Helvetica\", fontsize=8];\n";
+
+    auto tensorNode = [&](const TensorInfo& t, const char* shape) {
+        string id = "t:" + t.name;
+        if (declared.insert(id).second) {
+            dot += "    \"" + dotEscape(id) + "\" [shape=" + shape + ", label=\"" + dotEscape(t.name) + "\\n" +
+                   dimsLabel(t.dims) + " " + t.type + "\"];\n";
+        }
+        return id;
+    };
+
+    for (auto& t : graph.inputs) producer[t.name] = tensorNode(t, "ellipse");
+
+    for (size_t i = 0; i < graph.layers.size(); i++) {
+        auto&  layer = graph.layers[i];
+        string id    = "l:" + to_string(i);
+        string label = dotEscape(layer.name) + "\\n" + dotEscape(layer.type) + " " + layer.precision;
+        if (layer.weightsBytes > 0) label += "\\nweights: " + bytesLabel(layer.weightsBytes);
+        if (layer.origins.size() > 1) label += "\\nfused " + to_string(layer.origins.size()) + " layers";
+        dot += "    \"" + id + "\" [label=\"" + label + "\"" + (layer.origins.size() > 1 ? ", style=filled, fillcolor=\"#dae8fc\"" : "") + "];\n";
+
+        for (auto& t : layer.inputs) {
+            // 不是由某一层产生的tensor(例如engine里的常量)单独画一个节点
+            string from = producer.count(t.name) ? producer[t.name] : tensorNode(t, "ellipse");
+            dot += "    \"" + dotEscape(from) + "\" -> \"" + id + "\" [label=\"" + dimsLabel(t.dims) + "\"];\n";
+        }
+        for (auto& t : layer.outputs) producer[t.name] = id;
+    }
+
+    for (auto& t : graph.outputs) {
+        string id = "o:" + t.name;
+        dot += "    \"" + dotEscape(id) + "\" [shape=ellipse, style=bold, label=\"" + dotEscape(t.name) + "\\n" +
+               dimsLabel(t.dims) + " " + t.type + "\"];\n";
+        if (producer.count(t.name)) {
+            dot += "    \"" + dotEscape(producer[t.name]) + "\" -> \"" + dotEscape(id) + "\";\n";
+        }
+    }
+    dot += "}\n";
+    return dot;
+}
+
+static bool writeText(const string& path, const string& text) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (f == nullptr) {
+        LOGE("ERROR: failed to open %s", path.c_str());
+        return false;
+    }
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) LOGE("ERROR: failed to write %s", path.c_str());
+    return ok;
+}
+
+bool exportGraph(const Graph& network, Graph engine, const string& prefix) {
+    mapFusions(network, engine);
+    vector<string> eliminated = eliminatedLayers(network, engine);
+
+    json::Value fusions = json::Value::array();
+    int         inserted = 0;
+    for (auto& layer : engine.layers) {
+        inserted += layer.origins.empty();
+        if (layer.origins.size() < 2) continue;
+        json::Value f = json::Value::object();
+        f["engineLayer"] = layer.name;
+        f["layers"]      = stringsJson(layer.origins);
+        fusions.push(f);
+    }
+
+    json::Value summary = json::Value::object();
+    summary["networkLayers"] = (int)network.layers.size();
+    summary["engineLayers"]  = (int)engine.layers.size();
+    summary["fusions"]       = (int)fusions.size();
+    summary["eliminated"]    = (int)eliminated.size();
+    summary["inserted"]      = inserted;
+
+    json::Value root = json::Value::object();
+    root["summary"]    = summary;
+    root["network"]    = toJson(network);
+    root["engine"]     = toJson(engine);
+    root["fusions"]    = fusions;
+    root["eliminated"] = stringsJson(eliminated);
+
+    bool ok = writeText(prefix + ".json", root.dump(2) + "\n");
+    ok = writeText(prefix + "_network.dot", toDot(network, "network")) && ok;
+    ok = writeText(prefix + "_engine.dot", toDot(engine, "engine")) && ok;
+    if (ok) {
+        LOG("exported graph to %s.json, %s_network.dot, %s_engine.dot (%zu -> %zu layers, %zu fusions, %zu eliminated)",
+            prefix.c_str(), prefix.c_str(), prefix.c_str(), network.layers.size(), engine.layers.size(),
+            fusions.size(), eliminated.size());
+    }
+    return ok;
+}
+
+static string tensorsLabel(const vector<TensorInfo>& tensors) {
+    if (tensors.empty()) return "-";
+    string str;
+    for (size_t i = 0; i < tensors.size(); i++) {
+        if (i > 0) str += ", ";
+        str += dimsLabel(tensors[i].dims);
+    }
+    return str;
+}
+
+void printGraph(const Graph& graph) {
+    for (auto& t : graph.inputs) {
+        LOG("Input info: %s:%s %s", t.name.c_str(), dimsLabel(t.dims).c_str(), t.type.c_str());
+    }
+    for (auto& t : graph.outputs) {
+        LOG("Output info: %s:%s %s", t.name.c_str(), dimsLabel(t.dims).c_str(), t.type.c_str());
+    }
+    LOG("network has %zu layers", graph.layers.size());
+
+    for (auto& layer : graph.layers) {
+        LOG("layer_info: %-40s:%-25s->%-25s[%s]", layer.name.c_str(), tensorsLabel(layer.inputs).c_str(),
+            tensorsLabel(layer.outputs).c_str(), layer.precision.c_str());
+        if (layer.origins.size() > 1) {
+            string origins;
+            for (auto& o : layer.origins) origins += (origins.empty() ? "" : ", ") + o;
+            LOGV("    fused from: %s", origins.c_str());
+        }
+    }
+}
+
+} // namespace graph
@@ -0,0 +1,67 @@
+#ifndef __GRAPH_HPP__
+#define __GRAPH_HPP__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "NvInfer.h"
+#include "json.hpp"
+
+// 把优化前的INetworkDefinition和优化后的engine导出成JSON和Graphviz DOT, 方便对比TensorRT做了哪些融合
+//     - network: 每一层所有的input/output(名字, shape, 类型), 精度, 权重的大小
+//     - engine: IEngineInspector给出的每一层(需要ProfilingVerbosity::kDETAILED), 以及它是由network里的哪些层融合来的
+// engine的层名是TensorRT把融合前的层名拼起来的("conv + relu", "PWN(sigmoid, mul)", "{ForeignNode[a...b]}"),
+// 8.6以后还可能带Metadata, 按照这些规则映射回network的层. Reformat这样TensorRT自己插入的层没有对应的原始层
+// 解析和导出只依赖CPU, fromNetwork/fromEngine负责从TensorRT里取数据
+
+namespace graph {
+
+struct TensorInfo {
+    std::string          name;
+    std::vector<int64_t> dims;
+    std::string          type;      // FP32, FP16, INT8, INT32
+    std::string          format;    // engine里的format, 例如"Channel major FP16 format where channel % 8 == 0"
+};
+
+struct LayerInfo {
+    std::string              name;
+    std::string              type;
+    std::string              precision;
+    std::vector<TensorInfo>  inputs;
+    std::vector<TensorInfo>  outputs;
+    int64_t                  weightsBytes = 0;
+    std::string              tactic;
+    std::vector<std::string> metadata;
+    std::vector<std::string> origins;    // engine的层: 融合前的network层
+};
+
+struct Graph {
+    std::vector<TensorInfo> inputs;
+    std::vector<TensorInfo> outputs;
+    std::vector<LayerInfo>  layers;
+};
+
+Graph fromNetwork(nvinfer1::INetworkDefinition& network);
+Graph fromEngine(nvinfer1::ICudaEngine& engine);
+
+// 解析inspector给出的一层的JSON, kLAYER_NAMES_ONLY的时候只有层名
+bool parseEngineLayer(const std::string& info, LayerInfo& layer);
+
+// 填好engine每一层的origins
+void mapFusions(const Graph& network, Graph& engine);
+// network里没有出现在任何engine层里的层(常量折叠, 被消掉的shuffle等)
+std::vector<std::string> eliminatedLayers(const Graph& network, const Graph& engine);
+
+json::Value toJson(const Graph& graph);
+std::string toDot(const Graph& graph, const std::string& title);
+
+// 写prefix.json(network, engine, 融合的对应关系), prefix_network.dot和prefix_engine.dot
+bool exportGraph(const Graph& network, Graph engine, const std::string& prefix);
+
+// 日志里打印每一层的所有input/output
+void printGraph(const Graph& graph);
+
+} // namespace graph
+
+#endif //__GRAPH_HPP__
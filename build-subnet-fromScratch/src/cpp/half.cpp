@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#if defined(__AVX512F__) || defined(__F16C__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "half.hpp"
+#include "quant.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace fp16 {
+
+void ConvertStats::merge(const ConvertStats& other) {
+    count     += other.count;
+    overflow  += other.overflow;
+    underflow += other.underflow;
+    subnormal += other.subnormal;
+    nan       += other.nan;
+}
+
+uint16_t floatToHalf(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t mag  = bits & 0x7fffffff;
+
+    if (mag >= 0x7f800000) {
+        // inf保持inf, NaN保留mantissa的高位并且设置quiet bit
+        return sign | 0x7c00 | (mag > 0x7f800000 ? 0x0200 | ((mag >> 13) & 0x3ff) : 0);
+    }
+    if (mag >= 0x477ff000) return sign | 0x7c00;   // >= 65520, 舍入以后超过了65504
+    if (mag < 0x33000000)  return sign;            // < 2^-25, 舍入以后是0
+
+    if (mag < 0x38800000) {
+        // 结果是subnormal: 单位是2^-24, 需要把24位的mantissa右移(126 - e)
+        uint32_t m     = (mag & 0x7fffff) | 0x800000;
+        int      shift = 126 - (int)(mag >> 23);
+        uint32_t h     = m >> shift;
+        uint32_t rem   = m & ((1u << shift) - 1);
+        uint32_t half  = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1))) h++;
+        return sign | (uint16_t)h;
+    }
+
+    // normal: 指数的bias从127变成15, mantissa从23位舍入到10位
+    uint32_t m = mag - (112u << 23);
+    m += 0xfff + ((m >> 13) & 1);
+    return sign | (uint16_t)(m >> 13);
+}
+
+float halfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp  = (h >> 10) & 0x1f;
+    uint32_t man  = h & 0x3ff;
+    uint32_t bits;
+
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (man << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (man << 13);
+    } else if (man == 0) {
+        bits = sign;
+    } else {
+        // subnormal, 规格化成float的normal
+        int e = 113;
+        while ((man & 0x400) == 0) {
+            man <<= 1;
+            e--;
+        }
+        bits = sign | ((uint32_t)e << 23) | ((man & 0x3ff) << 13);
+    }
+    float x;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+/* ------------------------------- 统计 ------------------------------- */
+
+static inline void countScalar(float x, uint16_t h, ConvertStats& s) {
+    uint16_t mag = h & 0x7fff;
+    if (mag > 0x7c00)                          s.nan++;
+    else if (mag == 0x7c00 && std::isfinite(x)) s.overflow++;
+    else if (mag == 0 && x != 0)               s.underflow++;
+    else if (mag != 0 && mag < 0x0400)         s.subnormal++;
+}
+
+// 转换完一段以后趁数据还在cache里统计, 和转换用的指令集无关
+static void countRange(const float* src, const uint16_t* dst, int64_t count, ConvertStats& s) {
+    int64_t i = 0;
+
+#if defined(__SSE2__)
+    // 16位的计数器, 每一段最多4096个元素, 不会溢出
+    static const int64_t kChunk = 4096;
+    const __m128  zero   = _mm_setzero_ps();
+    const __m128  vabs   = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128  vinf   = _mm_set1_ps(INFINITY);
+    const __m128i magBit = _mm_set1_epi16(0x7fff);
+    const __m128i inf    = _mm_set1_epi16(0x7c00);
+    const __m128i minNrm = _mm_set1_epi16(0x0400);
+    const __m128i zero16 = _mm_setzero_si128();
+
+    while (i + 8 <= count) {
+        int64_t end = std::min(count, i + kChunk);
+        __m128i accOver = zero16, accUnder = zero16, accSub = zero16, accNan = zero16;
+        for (; i + 8 <= end; i += 8) {
+            __m128  a0 = _mm_loadu_ps(src + i);
+            __m128  a1 = _mm_loadu_ps(src + i + 4);
+            __m128i h  = _mm_and_si128(_mm_loadu_si128((const __m128i*)(dst + i)), magBit);
+
+            __m128i nonzero = _mm_packs_epi32(_mm_castps_si128(_mm_cmpneq_ps(a0, zero)),
+                                              _mm_castps_si128(_mm_cmpneq_ps(a1, zero)));
+            __m128i finite  = _mm_packs_epi32(_mm_castps_si128(_mm_cmplt_ps(_mm_and_ps(a0, vabs), vinf)),
+                                              _mm_castps_si128(_mm_cmplt_ps(_mm_and_ps(a1, vabs), vinf)));
+
+            __m128i isNan  = _mm_cmpgt_epi16(h, inf);
+            __m128i isOver = _mm_and_si128(_mm_cmpeq_epi16(h, inf), finite);
+            __m128i isZero = _mm_and_si128(_mm_cmpeq_epi16(h, zero16), nonzero);
+            __m128i isSub  = _mm_and_si128(_mm_cmpgt_epi16(h, zero16), _mm_cmplt_epi16(h, minNrm));
+
+            // mask是-1, 减掉就是加1
+            accNan   = _mm_sub_epi16(accNan, isNan);
+            accOver  = _mm_sub_epi16(accOver, isOver);
+            accUnder = _mm_sub_epi16(accUnder, isZero);
+            accSub   = _mm_sub_epi16(accSub, isSub);
+        }
+        int16_t lanes[8];
+        auto sum = [&](__m128i v) {
+            _mm_storeu_si128((__m128i*)lanes, v);
+            int64_t t = 0;
+            for (int k = 0; k < 8; k++) t += (uint16_t)lanes[k];
+            return t;
+        };
+        s.nan       += sum(accNan);
+        s.overflow  += sum(accOver);
+        s.underflow += sum(accUnder);
+        s.subnormal += sum(accSub);
+    }
+#endif
+
+    for (; i < count; i++) {
+        countScalar(src[i], dst[i], s);
+    }
+}
+
+/* ------------------------------- 转换 ------------------------------- */
+
+void convertFast(const float* src, uint16_t* dst, int64_t count) {
+    int64_t i = 0;
+
+#if defined(__AVX512F__)
+    for (; i + 16 <= count; i += 16) {
+        __m256i h = _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm256_storeu_si256((__m256i*)(dst + i), h);
+    }
+#elif defined(__F16C__)
+    for (; i + 8 <= count; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm_storeu_si128((__m128i*)(dst + i), h);
+    }
+#elif defined(__aarch64__)
+    // FPCR默认就是round to nearest even
+    for (; i + 4 <= count; i += 4) {
+        vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+    }
+#endif
+
+    for (; i < count; i++) {
+        dst[i] = floatToHalf(src[i]);
+    }
+}
+
+ConvertStats convert(const float* src, uint16_t* dst, int64_t count) {
+    static const int64_t kBlock = 1 << 14;
+
+    ConvertStats s;
+    s.count = count;
+    for (int64_t i = 0; i < count; i += kBlock) {
+        int64_t n = std::min(kBlock, count - i);
+        convertFast(src + i, dst + i, n);
+        countRange(src + i, dst + i, n, s);
+    }
+    return s;
+}
+
+void convert(const uint16_t* src, float* dst, int64_t count) {
+    int64_t i = 0;
+
+#if defined(__AVX512F__)
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(src + i))));
+    }
+#elif defined(__F16C__)
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+    }
+#elif defined(__aarch64__)
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+    }
+#endif
+
+    for (; i < count; i++) {
+        dst[i] = halfToFloat(src[i]);
+    }
+}
+
+/* ------------------------------- weights ------------------------------- */
+
+nvinfer1::Weights toHalf(const nvinfer1::Weights& w, ConvertStats* stats) {
+    if (w.type != nvinfer1::DataType::kFLOAT) return w;
+
+    uint16_t* values = (uint16_t*)malloc(sizeof(uint16_t) * w.count);
+    ConvertStats s   = convert((const float*)w.values, values, w.count);
+    if (stats != nullptr) *stats = s;
+    return nvinfer1::Weights{nvinfer1::DataType::kHALF, values, w.count};
+}
+
+static void report(const string& name, const ConvertStats& s) {
+    if (s.overflow > 0 || s.nan > 0) {
+        LOGW("%-32s count: %8ld, overflow: %ld, underflow: %ld, subnormal: %ld, nan: %ld", name.c_str(),
+             (long)s.count, (long)s.overflow, (long)s.underflow, (long)s.subnormal, (long)s.nan);
+    } else {
+        LOGV("%-32s count: %8ld, overflow: %ld, underflow: %ld, subnormal: %ld, nan: %ld", name.c_str(),
+             (long)s.count, (long)s.overflow, (long)s.underflow, (long)s.subnormal, (long)s.nan);
+    }
+}
+
+static bool matchAny(const vector<string>& patterns, const string& name) {
+    for (auto& p : patterns) {
+        if (globMatch(p, name)) return true;
+    }
+    return false;
+}
+
+void toHalf(map<string, nvinfer1::Weights>& weights, const vector<string>& patterns) {
+    ConvertStats total;
+    for (auto& w : weights) {
+        if (w.second.type != nvinfer1::DataType::kFLOAT || !matchAny(patterns, w.first)) continue;
+        ConvertStats s;
+        nvinfer1::Weights half = toHalf(w.second, &s);
+        free((void*)w.second.values);
+        w.second = half;
+        report(w.first, s);
+        total.merge(s);
+    }
+    LOG("converted %ld weights to FP16, overflow: %ld, underflow: %ld, subnormal: %ld", (long)total.count,
+        (long)total.overflow, (long)total.underflow, (long)total.subnormal);
+}
+
+bool convertWeights(const string& inPath, const string& outPath, const vector<string>& patterns) {
+    vector<quant::WeightEntry> entries;
+    if (!quant::readWeights(inPath, entries)) return false;
+
+    ConvertStats total;
+    for (auto& e : entries) {
+        if (e.type != nvinfer1::DataType::kFLOAT || !matchAny(patterns, e.name)) continue;
+        vector<uint16_t> half(e.bits.size());
+        ConvertStats s = convert((const float*)e.bits.data(), half.data(), e.bits.size());
+        e.bits.assign(half.begin(), half.end());
+        e.type = nvinfer1::DataType::kHALF;
+        report(e.name, s);
+        total.merge(s);
+    }
+
+    if (!quant::writeWeights(outPath, entries)) return false;
+    LOG("%s -> %s, %ld values converted to FP16, overflow: %ld, underflow: %ld, subnormal: %ld",
+        inPath.c_str(), outPath.c_str(), (long)total.count, (long)total.overflow, (long)total.underflow, (long)total.subnormal);
+    return true;
+}
+
+} // namespace fp16
@@ -0,0 +1,49 @@
+#ifndef __HALF_HPP__
+#define __HALF_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include "NvInfer.h"
+
+// FP32 -> FP16(IEEE half)的转换, round to nearest even
+//     - 有AVX-512或者F16C的时候使用硬件指令, aarch64上使用NEON, 其它情况下用scalar的实现, 结果完全一致
+//     - 同时统计溢出(变成inf), 下溢(非0变成0), 变成subnormal以及NaN的个数
+// FP16的engine可以直接使用kHALF的weights, .weights里保存成4位的hex, 文件大小和parse的时间都差不多减半
+
+namespace fp16 {
+
+struct ConvertStats {
+    int64_t count     = 0;
+    int64_t overflow  = 0;   // 有限的值超出了half的范围(|x| >= 65520)
+    int64_t underflow = 0;   // 非0的值变成了0(|x| <= 2^-25)
+    int64_t subnormal = 0;   // 结果是subnormal, 精度会变差
+    int64_t nan       = 0;
+
+    void merge(const ConvertStats& other);
+};
+
+uint16_t floatToHalf(float x);
+float    halfToFloat(uint16_t h);
+
+ConvertStats convert(const float* src, uint16_t* dst, int64_t count);
+// 不做统计, 用在每一帧都要转换的热路径上(layout.hpp)
+void         convertFast(const float* src, uint16_t* dst, int64_t count);
+void         convert(const uint16_t* src, float* dst, int64_t count);
+
+// 返回一个新的kHALF的Weights(malloc出来的, 和Model::loadWeights一样不释放), 已经是kHALF的直接返回
+nvinfer1::Weights toHalf(const nvinfer1::Weights& w, ConvertStats* stats = nullptr);
+
+// 把名字匹配上patterns的weights转换成kHALF, 并打印每个tensor的统计
+// 原来的values是malloc出来的(Model::loadWeights), 转换以后free掉
+void toHalf(std::map<std::string, nvinfer1::Weights>& weights, const std::vector<std::string>& patterns);
+
+// 离线转换.weights文件, 匹配上patterns的tensor保存成half
+// 默认只转换conv的kernel, BN的参数在addBatchNorm里是按照float读取的
+bool convertWeights(const std::string& inPath, const std::string& outPath,
+                    const std::vector<std::string>& patterns = {"*conv*.weight"});
+
+} // namespace fp16
+
+#endif //__HALF_HPP__
@@ -0,0 +1,291 @@
+#include <cstdio>
+#include <sys/stat.h>
+
+#include "hotreload.hpp"
+#include "metrics.hpp"
+#include "utils.hpp"
+#include "tensor.hpp"
+#include "NvInfer.h"
+#include "cuda_runtime.h"
+
+using namespace std;
+
+namespace reload {
+
+static metrics::Counter& reloads() {
+    static auto& c = metrics::Registry::instance().counter("trt_reload_total", "number of model versions swapped in");
+    return c;
+}
+
+static metrics::Counter& reloadFailures() {
+    static auto& c = metrics::Registry::instance().counter("trt_reload_failures_total", "number of model versions that failed to load");
+    return c;
+}
+
+static metrics::Gauge& modelVersion() {
+    static auto& g = metrics::Registry::instance().gauge("trt_model_version", "version of the model serving new requests");
+    return g;
+}
+
+static metrics::Histogram& swapLatency() {
+    static auto& h = metrics::Registry::instance().histogram("trt_reload_swap_latency_us", "time from a reload request to the new version serving, in microseconds");
+    return h;
+}
+
+// 一个版本的统计, Version释放以后还在
+struct HotModel::Info {
+    int                   version = 0;
+    string                source;
+    double                loadMs  = 0;
+    double                swapUs  = 0;
+    atomic<uint64_t>      served{0};
+    atomic<int64_t>       inflight{0};
+    atomic<bool>          released{false};
+};
+
+struct HotModel::Version {
+    shared_ptr<Info>    info;
+    unique_ptr<Backend> backend;
+
+    ~Version() {
+        // 最后一个请求结束的时候在那个线程上析构
+        backend.reset();
+        info->released = true;
+        LOG("model version %d released after %llu requests", info->version, (unsigned long long)info->served.load());
+    }
+};
+
+HotModel::HotModel(Loader loader) : mLoader(loader) {}
+
+HotModel::~HotModel() {
+    stop();
+}
+
+bool HotModel::reload(const string& path) {
+    // 同一时间只做一次reload, 版本号按swap的顺序递增
+    lock_guard<mutex> lock(mLock);
+    auto start = chrono::steady_clock::now();
+
+    int version = mNextVersion;
+    LOG("loading model version %d from %s", version, path.c_str());
+    unique_ptr<Backend> backend = mLoader(path, version);
+    auto loaded = chrono::steady_clock::now();
+    if (backend == nullptr) {
+        LOGE("ERROR: failed to load %s, keeping version %d", path.c_str(), currentVersion());
+        reloadFailures().inc();
+        return false;
+    }
+    mNextVersion++;
+
+    auto info     = make_shared<Info>();
+    info->version = version;
+    info->source  = path;
+    info->loadMs  = chrono::duration<double, milli>(loaded - start).count();
+    auto next     = make_shared<Version>();
+    next->info    = info;
+    next->backend = move(backend);
+    mInfos.push_back(info);
+
+    // RCU: 新的请求从这里开始拿到新版本, 旧版本由还没结束的请求持有
+    auto old  = atomic_exchange(&mCurrent, next);
+    auto done = chrono::steady_clock::now();
+    info->swapUs = chrono::duration<double, micro>(done - loaded).count();
+    modelVersion().set(version);
+    reloads().inc();
+    swapLatency().record((uint64_t)chrono::duration_cast<chrono::microseconds>(done - start).count());
+
+    LOG("model version %d is serving (load %.1f ms, swap %.1f us), version %d has %lld requests in flight",
+        version, info->loadMs, info->swapUs, old ? old->info->version : 0,
+        old ? (long long)old->info->inflight.load() : 0ll);
+    return true;
+}
+
+bool HotModel::infer(const vector<float>& input, vector<float>& output, int* version) {
+    shared_ptr<Version> v = atomic_load(&mCurrent);
+    if (v == nullptr) {
+        LOGE("ERROR: no model version is loaded");
+        return false;
+    }
+    if (version != nullptr) *version = v->info->version;
+    v->info->inflight.fetch_add(1, memory_order_relaxed);
+    bool ok = v->backend->infer(input, output);
+    v->info->inflight.fetch_sub(1, memory_order_relaxed);
+    if (ok) v->info->served.fetch_add(1, memory_order_relaxed);
+    return ok;
+}
+
+int HotModel::currentVersion() const {
+    shared_ptr<Version> v = atomic_load(&mCurrent);
+    return v ? v->info->version : 0;
+}
+
+vector<VersionStats> HotModel::stats() const {
+    int current = currentVersion();
+    lock_guard<mutex> lock(mLock);
+    vector<VersionStats> out;
+    for (auto& info : mInfos) {
+        VersionStats s;
+        s.version  = info->version;
+        s.source   = info->source;
+        s.loadMs   = info->loadMs;
+        s.swapUs   = info->swapUs;
+        s.served   = info->served.load();
+        s.inflight = info->inflight.load();
+        s.current  = info->version == current;
+        s.released = info->released.load();
+        out.push_back(s);
+    }
+    return out;
+}
+
+void HotModel::report() const {
+    LOG("model versions:");
+    LOG("    %7s %10s %10s %10s %8s  %s", "version", "load(ms)", "swap(us)", "served", "state", "source");
+    for (auto& s : stats()) {
+        LOG("    %7d %10.1f %10.1f %10llu %8s  %s", s.version, s.loadMs, s.swapUs, (unsigned long long)s.served,
+            s.current ? "current" : (s.released ? "released" : "draining"), s.source.c_str());
+    }
+}
+
+/* ------------------------------- watcher ------------------------------- */
+
+void HotModel::watch(const string& path, int intervalMs) {
+    stop();
+    mWatching = true;
+    mWatcher  = thread(&HotModel::watchLoop, this, path, intervalMs);
+}
+
+void HotModel::stop() {
+    mWatching = false;
+    if (mWatcher.joinable()) mWatcher.join();
+}
+
+// mtime(ns)和大小, 文件不存在的时候返回false
+static bool fileVersion(const string& path, pair<int64_t, int64_t>& version) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    version = make_pair((int64_t)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec, (int64_t)st.st_size);
+    return true;
+}
+
+void HotModel::watchLoop(string path, int intervalMs) {
+    // 启动时的文件就是当前版本(已经reload过)或者之后第一次出现的版本
+    pair<int64_t, int64_t> loaded(-1, -1), pending(-1, -1);
+    if (currentVersion() > 0) fileVersion(path, loaded);
+
+    const int kStep = 10;
+    while (mWatching) {
+        for (int waited = 0; waited < intervalMs && mWatching; waited += kStep) {
+            this_thread::sleep_for(chrono::milliseconds(min(kStep, intervalMs - waited)));
+        }
+        if (!mWatching) break;
+
+        pair<int64_t, int64_t> now;
+        if (!fileVersion(path, now) || now == loaded) {
+            pending = make_pair(-1, -1);
+            continue;
+        }
+        // 第一次看到变化只记下来, 下一次轮询还是一样的时候才认为写完了
+        if (now != pending) {
+            pending = now;
+            continue;
+        }
+        // 失败的版本也记下来, 文件再次变化之前不重试
+        reload(path);
+        loaded  = now;
+        pending = make_pair(-1, -1);
+    }
+}
+
+/* ------------------------------- TensorRT backend ------------------------------- */
+
+namespace {
+
+// 一个engine只有一个execution context, 请求在context上串行
+class EngineBackend : public Backend {
+public:
+    ~EngineBackend() {
+        if (mStream != nullptr) cudaStreamDestroy(mStream);
+        mContext.reset();
+        mEngine.reset();
+        mRuntime.reset();
+    }
+
+    bool load(const vector<unsigned char>& plan) {
+        mRuntime.reset(nvinfer1::createInferRuntime(mLogger));
+        if (mRuntime == nullptr) return false;
+        mEngine.reset(mRuntime->deserializeCudaEngine(plan.data(), plan.size()));
+        if (mEngine == nullptr) return false;
+        mContext.reset(mEngine->createExecutionContext());
+        if (mContext == nullptr || mEngine->getNbBindings() < 2) return false;
+
+        auto inputDims  = mContext->getBindingDimensions(0);
+        auto outputDims = mContext->getBindingDimensions(1);
+        if (getDimSize(inputDims) <= 0 || getDimSize(outputDims) <= 0) {
+            LOGE("ERROR: hot reload only supports engines with static shapes");
+            return false;
+        }
+        // Backend的接口是float, 其他dtype的engine需要在外面转换
+        if (mEngine->getBindingDataType(0) != nvinfer1::DataType::kFLOAT ||
+            mEngine->getBindingDataType(1) != nvinfer1::DataType::kFLOAT) {
+            LOGE("ERROR: hot reload only supports engines with float32 input and output");
+            return false;
+        }
+        mInput  = Tensor::fromDims(inputDims, nvinfer1::DataType::kFLOAT, Location::Device);
+        mOutput = Tensor::fromDims(outputDims, nvinfer1::DataType::kFLOAT, Location::Device);
+        return !mInput.empty() && !mOutput.empty() && cudaStreamCreate(&mStream) == cudaSuccess;
+    }
+
+    bool infer(const vector<float>& input, vector<float>& output) override {
+        if ((int64_t)input.size() != mInput.count()) {
+            LOGE("ERROR: input has %zu elements, the engine expects %ld", input.size(), (long)mInput.count());
+            return false;
+        }
+        lock_guard<mutex> lock(mLock);
+        output.resize(mOutput.count());
+        void* bindings[] = {mInput.data(), mOutput.data()};
+        // 用户的vector包装成tensor, 不拷贝到中间的buffer
+        bool ok = mInput.copyFrom(Tensor::wrap(const_cast<float*>(input.data()), mInput.shape(), nvinfer1::DataType::kFLOAT), mStream);
+        ok = ok && mContext->enqueueV2(bindings, mStream, nullptr);
+        ok = ok && Tensor::wrap(output.data(), mOutput.shape(), nvinfer1::DataType::kFLOAT).copyFrom(mOutput, mStream);
+        return cudaStreamSynchronize(mStream) == cudaSuccess && ok;
+    }
+
+private:
+    Logger                                  mLogger;
+    unique_ptr<nvinfer1::IRuntime>          mRuntime;
+    unique_ptr<nvinfer1::ICudaEngine>       mEngine;
+    unique_ptr<nvinfer1::IExecutionContext> mContext;
+    mutex                                   mLock;
+    cudaStream_t                            mStream = nullptr;
+    Tensor                                  mInput;     // device
+    Tensor                                  mOutput;    // device
+};
+
+bool endsWith(const string& str, const string& suffix) {
+    return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+Loader engineLoader(Model::precision prec) {
+    return [prec](const string& path, int version) -> unique_ptr<Backend> {
+        string enginePath = path;
+        if (!endsWith(path, ".engine")) {
+            // 每个版本都要重新build, 不能用models/engine下已经存在的engine
+            Model model(path, prec);
+            enginePath = model.enginePath() + ".v" + to_string(version);
+            remove(enginePath.c_str());
+            model.setEnginePath(enginePath);
+            if (!model.build()) return nullptr;
+        }
+
+        unique_ptr<EngineBackend> backend(new EngineBackend());
+        bool ok = fileExists(enginePath) && backend->load(loadFile(enginePath));
+        if (enginePath != path) remove(enginePath.c_str());
+        if (!ok) return nullptr;
+        return unique_ptr<Backend>(move(backend));
+    };
+}
+
+} // namespace reload
@@ -0,0 +1,89 @@
+#ifndef __HOTRELOAD_HPP__
+#define __HOTRELOAD_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "model.hpp"
+
+// 不停服务地更新模型: 新的engine/weights在后台加载好以后, 用RCU的方式替换当前的版本
+//     - 每个请求开始的时候acquire一次当前版本(shared_ptr), 整个请求都在这个版本上完成
+//     - swap只是一次shared_ptr的atomic exchange, 新的请求马上用新版本, 正在进行的请求在旧版本上做完
+//     - 旧版本最后一个引用释放的时候(最后一个请求结束的线程上)析构, engine和显存在那时释放
+//     - 加载失败的时候保留当前的版本
+// watch会在后台线程里轮询文件的mtime和大小, 变化并且稳定了一个周期以后(避免读到写了一半的文件)reload
+// 推理的实现是Backend, 默认的engineLoader用TensorRT, 也可以换成别的(例如测试用的假backend)
+
+namespace reload {
+
+class Backend {
+public:
+    virtual ~Backend() {}
+    // 同一个backend可能同时被多个线程调用, 需要自己保证线程安全
+    virtual bool infer(const std::vector<float>& input, std::vector<float>& output) = 0;
+};
+
+// 在后台线程里从path加载第version个版本, 失败的时候返回nullptr
+typedef std::function<std::unique_ptr<Backend>(const std::string& path, int version)> Loader;
+
+// 一个版本的统计, 版本释放以后也会保留
+struct VersionStats {
+    int         version  = 0;
+    std::string source;
+    double      loadMs   = 0;     // 后台加载(build/deserialize)的耗时
+    double      swapUs   = 0;     // 替换当前版本的耗时, 不包括加载
+    uint64_t    served   = 0;     // 这个版本完成的请求数
+    int64_t     inflight = 0;
+    bool        current  = false;
+    bool        released = false; // 所有的请求都结束, backend已经析构
+};
+
+class HotModel {
+public:
+    explicit HotModel(Loader loader);
+    ~HotModel();
+
+    // 同步加载path并替换当前版本, 第一次调用前infer会失败
+    bool reload(const std::string& path);
+
+    // 后台轮询path, 变化以后reload. 重复调用会先停掉之前的watcher
+    void watch(const std::string& path, int intervalMs = 1000);
+    void stop();
+
+    // 在当前版本上推理, version返回实际使用的版本
+    bool infer(const std::vector<float>& input, std::vector<float>& output, int* version = nullptr);
+
+    int                       currentVersion() const;
+    std::vector<VersionStats> stats() const;
+    void                      report() const;
+
+private:
+    struct Info;
+    struct Version;
+
+    void watchLoop(std::string path, int intervalMs);
+
+private:
+    Loader                             mLoader;
+    std::shared_ptr<Version>           mCurrent;      // 只用std::atomic_load/atomic_exchange访问
+    mutable std::mutex                 mLock;         // 保护mInfos和reload的顺序
+    std::vector<std::shared_ptr<Info>> mInfos;
+    int                                mNextVersion = 1;
+
+    std::atomic<bool>                  mWatching{false};
+    std::thread                        mWatcher;
+};
+
+// .engine直接deserialize, .onnx/.weights先用Model按prec build(engine写到临时文件, 加载以后删除)
+Loader engineLoader(Model::precision prec);
+
+} // namespace reload
+
+#endif //__HOTRELOAD_HPP__
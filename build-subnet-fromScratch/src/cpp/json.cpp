@@ -0,0 +1,366 @@
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "json.hpp"
+
+using namespace std;
+
+namespace json {
+
+const string& Value::asString() const {
+    static const string empty;
+    return mType == Type::STRING ? mString : empty;
+}
+
+void Value::push(const Value& v) {
+    if (mType == Type::NUL) mType = Type::ARRAY;
+    mArray.push_back(v);
+}
+
+size_t Value::size() const {
+    if (mType == Type::ARRAY) return mArray.size();
+    if (mType == Type::OBJECT) return mObject.size();
+    return 0;
+}
+
+Value& Value::operator[](const string& key) {
+    if (mType == Type::NUL) mType = Type::OBJECT;
+    for (auto& item : mObject) {
+        if (item.first == key) return item.second;
+    }
+    mObject.push_back(make_pair(key, Value()));
+    return mObject.back().second;
+}
+
+const Value* Value::find(const string& key) const {
+    if (mType != Type::OBJECT) return nullptr;
+    for (auto& item : mObject) {
+        if (item.first == key) return &item.second;
+    }
+    return nullptr;
+}
+
+const Value& Value::get(const string& key) const {
+    static const Value null;
+    const Value* v = find(key);
+    return v != nullptr ? *v : null;
+}
+
+/* ------------------------------- dump ------------------------------- */
+
+string escape(const string& str) {
+    string out;
+    out.reserve(str.size() + 2);
+    for (unsigned char c : str) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b";  break;
+            case '\f': out += "\\f";  break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                if (c < 0x20) {
+                    char buff[8];
+                    snprintf(buff, sizeof(buff), "\\u%04x", c);
+                    out += buff;
+                } else {
+                    out += (char)c;
+                }
+        }
+    }
+    return out;
+}
+
+static void newline(string& out, int indent, int depth) {
+    if (indent < 0) return;
+    out += '\n';
+    out.append((size_t)indent * depth, ' ');
+}
+
+void Value::dump(string& out, int indent, int depth) const {
+    switch (mType) {
+        case Type::NUL:    out += "null"; break;
+        case Type::BOOL:   out += mBool ? "true" : "false"; break;
+        case Type::STRING: out += '"' + escape(mString) + '"'; break;
+        case Type::NUMBER: {
+            // JSON里没有nan和inf
+            if (!std::isfinite(mNumber)) {
+                out += "null";
+                break;
+            }
+            char buff[32];
+            if (mNumber == floor(mNumber) && fabs(mNumber) < 9007199254740992.0) {
+                snprintf(buff, sizeof(buff), "%lld", (long long)mNumber);
+            } else {
+                // 先用15位, 不能精确还原的时候再用17位
+                snprintf(buff, sizeof(buff), "%.15g", mNumber);
+                if (strtod(buff, nullptr) != mNumber) snprintf(buff, sizeof(buff), "%.17g", mNumber);
+            }
+            out += buff;
+            break;
+        }
+        case Type::ARRAY: {
+            // 只有number/string这样的值的array(例如shape)放在一行里
+            bool flat = true;
+            for (auto& v : mArray) flat = flat && v.mType != Type::ARRAY && v.mType != Type::OBJECT;
+            int  inner = flat ? -1 : indent;
+            out += '[';
+            for (size_t i = 0; i < mArray.size(); i++) {
+                if (i > 0) out += (flat && indent >= 0) ? ", " : ",";
+                newline(out, inner, depth + 1);
+                mArray[i].dump(out, indent, depth + 1);
+            }
+            if (!mArray.empty()) newline(out, inner, depth);
+            out += ']';
+            break;
+        }
+        case Type::OBJECT: {
+            out += '{';
+            for (size_t i = 0; i < mObject.size(); i++) {
+                if (i > 0) out += ',';
+                newline(out, indent, depth + 1);
+                out += '"' + escape(mObject[i].first) + (indent < 0 ? "\":" : "\": ");
+                mObject[i].second.dump(out, indent, depth + 1);
+            }
+            if (!mObject.empty()) newline(out, indent, depth);
+            out += '}';
+            break;
+        }
+    }
+}
+
+string Value::dump(int indent) const {
+    string out;
+    dump(out, indent, 0);
+    return out;
+}
+
+/* ------------------------------- parse ------------------------------- */
+
+namespace {
+
+// 递归下降, 嵌套超过kMaxDepth层的时候报错, 避免栈溢出
+class Parser {
+public:
+    Parser(const string& text) : mText(text) {}
+
+    bool parse(Value& value) {
+        skipSpace();
+        if (!parseValue(value, 0)) return false;
+        skipSpace();
+        if (mPos != mText.size()) return fail("unexpected trailing characters");
+        return true;
+    }
+
+    string error() const { return mError; }
+
+private:
+    static const int kMaxDepth = 256;
+
+    bool fail(const char* msg) {
+        if (mError.empty()) mError = "offset " + to_string(mPos) + ": " + msg;
+        return false;
+    }
+
+    void skipSpace() {
+        while (mPos < mText.size() && (mText[mPos] == ' ' || mText[mPos] == '\t' || mText[mPos] == '\n' || mText[mPos] == '\r')) {
+            mPos++;
+        }
+    }
+
+    bool literal(const char* word) {
+        size_t n = strlen(word);
+        if (mText.compare(mPos, n, word) != 0) return fail("invalid literal");
+        mPos += n;
+        return true;
+    }
+
+    bool parseValue(Value& value, int depth) {
+        if (depth > kMaxDepth) return fail("nested too deep");
+        if (mPos >= mText.size()) return fail("unexpected end");
+
+        char c = mText[mPos];
+        if (c == '{') return parseObject(value, depth);
+        if (c == '[') return parseArray(value, depth);
+        if (c == '"') {
+            string s;
+            if (!parseString(s)) return false;
+            value = Value(s);
+            return true;
+        }
+        if (c == 't') { value = Value(true);  return literal("true"); }
+        if (c == 'f') { value = Value(false); return literal("false"); }
+        if (c == 'n') { value = Value();      return literal("null"); }
+        return parseNumber(value);
+    }
+
+    bool parseNumber(Value& value) {
+        // 先按JSON的语法检查一遍, strtod能接受的格式比JSON多(hex, inf, 前导的+)
+        size_t start = mPos;
+        if (mPos < mText.size() && mText[mPos] == '-') mPos++;
+        if (mPos < mText.size() && mText[mPos] == '0') {
+            mPos++;
+        } else if (mPos < mText.size() && isdigit((unsigned char)mText[mPos])) {
+            while (mPos < mText.size() && isdigit((unsigned char)mText[mPos])) mPos++;
+        } else {
+            return fail("invalid value");
+        }
+        if (mPos < mText.size() && mText[mPos] == '.') {
+            mPos++;
+            if (mPos >= mText.size() || !isdigit((unsigned char)mText[mPos])) return fail("invalid number");
+            while (mPos < mText.size() && isdigit((unsigned char)mText[mPos])) mPos++;
+        }
+        if (mPos < mText.size() && (mText[mPos] == 'e' || mText[mPos] == 'E')) {
+            mPos++;
+            if (mPos < mText.size() && (mText[mPos] == '+' || mText[mPos] == '-')) mPos++;
+            if (mPos >= mText.size() || !isdigit((unsigned char)mText[mPos])) return fail("invalid number");
+            while (mPos < mText.size() && isdigit((unsigned char)mText[mPos])) mPos++;
+        }
+        value = Value(strtod(mText.c_str() + start, nullptr));
+        return true;
+    }
+
+    bool parseHex4(uint32_t& code) {
+        if (mPos + 4 > mText.size()) return fail("invalid unicode escape");
+        code = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = mText[mPos++];
+            code <<= 4;
+            if (c >= '0' && c <= '9')      code |= c - '0';
+            else if (c >= 'a' && c <= 'f') code |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') code |= c - 'A' + 10;
+            else return fail("invalid unicode escape");
+        }
+        return true;
+    }
+
+    static void appendUtf8(string& out, uint32_t code) {
+        if (code < 0x80) {
+            out += (char)code;
+        } else if (code < 0x800) {
+            out += (char)(0xc0 | (code >> 6));
+            out += (char)(0x80 | (code & 0x3f));
+        } else if (code < 0x10000) {
+            out += (char)(0xe0 | (code >> 12));
+            out += (char)(0x80 | ((code >> 6) & 0x3f));
+            out += (char)(0x80 | (code & 0x3f));
+        } else {
+            out += (char)(0xf0 | (code >> 18));
+            out += (char)(0x80 | ((code >> 12) & 0x3f));
+            out += (char)(0x80 | ((code >> 6) & 0x3f));
+            out += (char)(0x80 | (code & 0x3f));
+        }
+    }
+
+    bool parseString(string& out) {
+        mPos++;
+        while (mPos < mText.size()) {
+            char c = mText[mPos++];
+            if (c == '"') return true;
+            if ((unsigned char)c < 0x20) return fail("control character in string");
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (mPos >= mText.size()) break;
+            c = mText[mPos++];
+            switch (c) {
+                case '"':  out += '"';  break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/';  break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u': {
+                    uint32_t code;
+                    if (!parseHex4(code)) return false;
+                    if (code >= 0xd800 && code < 0xdc00) {
+                        uint32_t low;
+                        if (mText.compare(mPos, 2, "\\u") != 0) return fail("unpaired surrogate");
+                        mPos += 2;
+                        if (!parseHex4(low)) return false;
+                        if (low < 0xdc00 || low >= 0xe000) return fail("unpaired surrogate");
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                    } else if (code >= 0xdc00 && code < 0xe000) {
+                        return fail("unpaired surrogate");
+                    }
+                    appendUtf8(out, code);
+                    break;
+                }
+                default: return fail("invalid escape");
+            }
+        }
+        return fail("unterminated string");
+    }
+
+    bool parseArray(Value& value, int depth) {
+        value = Value::array();
+        mPos++;
+        skipSpace();
+        if (mPos < mText.size() && mText[mPos] == ']') {
+            mPos++;
+            return true;
+        }
+        while (true) {
+            Value item;
+            skipSpace();
+            if (!parseValue(item, depth + 1)) return false;
+            value.push(item);
+            skipSpace();
+            if (mPos >= mText.size()) return fail("unterminated array");
+            char c = mText[mPos++];
+            if (c == ']') return true;
+            if (c != ',') return fail("expected ',' or ']'");
+        }
+    }
+
+    bool parseObject(Value& value, int depth) {
+        value = Value::object();
+        mPos++;
+        skipSpace();
+        if (mPos < mText.size() && mText[mPos] == '}') {
+            mPos++;
+            return true;
+        }
+        while (true) {
+            string key;
+            skipSpace();
+            if (mPos >= mText.size() || mText[mPos] != '"') return fail("expected key");
+            if (!parseString(key)) return false;
+            skipSpace();
+            if (mPos >= mText.size() || mText[mPos] != ':') return fail("expected ':'");
+            mPos++;
+            skipSpace();
+            if (!parseValue(value[key], depth + 1)) return false;
+            skipSpace();
+            if (mPos >= mText.size()) return fail("unterminated object");
+            char c = mText[mPos++];
+            if (c == '}') return true;
+            if (c != ',') return fail("expected ',' or '}'");
+        }
+    }
+
+private:
+    const string& mText;
+    size_t        mPos = 0;
+    string        mError;
+};
+
+} // namespace
+
+bool parse(const string& text, Value& value, string* error) {
+    Parser parser(text);
+    if (parser.parse(value)) return true;
+    value = Value();
+    if (error != nullptr) *error = parser.error();
+    return false;
+}
+
+} // namespace json
@@ -0,0 +1,78 @@
+#ifndef __JSON_HPP__
+#define __JSON_HPP__
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+// 一个很小的JSON模型, 用来解析IEngineInspector输出的layer信息和导出graph
+//     - object保持插入的顺序, 查找是线性的, 只适合key不多的object
+//     - number统一用double保存, 整数在2^53以内没有精度损失
+//     - parse支持完整的JSON语法(包括\uXXXX和surrogate pair), dump的结果可以再parse回来
+
+namespace json {
+
+enum class Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+
+class Value {
+public:
+    Value() {}
+    Value(bool b) : mType(Type::BOOL), mBool(b) {}
+    Value(int n) : mType(Type::NUMBER), mNumber(n) {}
+    Value(int64_t n) : mType(Type::NUMBER), mNumber((double)n) {}
+    Value(double n) : mType(Type::NUMBER), mNumber(n) {}
+    Value(const char* s) : mType(Type::STRING), mString(s) {}
+    Value(const std::string& s) : mType(Type::STRING), mString(s) {}
+
+    static Value array()  { Value v; v.mType = Type::ARRAY;  return v; }
+    static Value object() { Value v; v.mType = Type::OBJECT; return v; }
+
+    Type type() const { return mType; }
+    bool isNull() const   { return mType == Type::NUL; }
+    bool isNumber() const { return mType == Type::NUMBER; }
+    bool isString() const { return mType == Type::STRING; }
+    bool isArray() const  { return mType == Type::ARRAY; }
+    bool isObject() const { return mType == Type::OBJECT; }
+
+    // 类型不对的时候返回默认值
+    bool               asBool(bool def = false) const { return mType == Type::BOOL ? mBool : def; }
+    double             asNumber(double def = 0) const { return mType == Type::NUMBER ? mNumber : def; }
+    const std::string& asString() const;
+
+    // array, push会把null变成array
+    void         push(const Value& v);
+    size_t       size() const;
+    const Value& operator[](size_t index) const { return mArray[index]; }
+
+    // object, 不存在的key会插入一个null, null会变成object
+    Value&       operator[](const std::string& key);
+    // 找不到或者不是object的时候返回nullptr
+    const Value* find(const std::string& key) const;
+    // key不存在的时候返回null
+    const Value& get(const std::string& key) const;
+    const std::vector<std::pair<std::string, Value>>& items() const { return mObject; }
+
+    // indent小于0的时候输出在一行里
+    std::string dump(int indent = -1) const;
+
+private:
+    void dump(std::string& out, int indent, int depth) const;
+
+private:
+    Type                                     mType   = Type::NUL;
+    bool                                     mBool   = false;
+    double                                   mNumber = 0;
+    std::string                              mString;
+    std::vector<Value>                       mArray;
+    std::vector<std::pair<std::string, Value>> mObject;
+};
+
+// 失败的时候error里是出错的位置和原因
+bool parse(const std::string& text, Value& value, std::string* error = nullptr);
+
+std::string escape(const std::string& str);
+
+} // namespace json
+
+#endif //__JSON_HPP__
@@ -0,0 +1,538 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "layout.hpp"
+#include "half.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace layout {
+
+const char* layoutName(Layout layout) {
+    return layout == Layout::NCHW ? "NCHW" : "NHWC";
+}
+
+/* ------------------------------- 转置 ------------------------------- */
+
+// 外层的分块: 64x64的float, src和dst各16KB, 一起放得进L1/L2
+static const int64_t kTile = 64;
+
+#if defined(__AVX__)
+static const int64_t kMicro = 8;
+
+static inline void transposeMicro(const float* src, int64_t srcLd, float* dst, int64_t dstLd) {
+    __m256 r0 = _mm256_loadu_ps(src + 0 * srcLd);
+    __m256 r1 = _mm256_loadu_ps(src + 1 * srcLd);
+    __m256 r2 = _mm256_loadu_ps(src + 2 * srcLd);
+    __m256 r3 = _mm256_loadu_ps(src + 3 * srcLd);
+    __m256 r4 = _mm256_loadu_ps(src + 4 * srcLd);
+    __m256 r5 = _mm256_loadu_ps(src + 5 * srcLd);
+    __m256 r6 = _mm256_loadu_ps(src + 6 * srcLd);
+    __m256 r7 = _mm256_loadu_ps(src + 7 * srcLd);
+    // 先两两交错, 再按64bit交错, 最后交换两个128bit的lane
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+    __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5);
+    __m256 t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7);
+    __m256 t7 = _mm256_unpackhi_ps(r6, r7);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    _mm256_storeu_ps(dst + 0 * dstLd, _mm256_permute2f128_ps(s0, s4, 0x20));
+    _mm256_storeu_ps(dst + 1 * dstLd, _mm256_permute2f128_ps(s1, s5, 0x20));
+    _mm256_storeu_ps(dst + 2 * dstLd, _mm256_permute2f128_ps(s2, s6, 0x20));
+    _mm256_storeu_ps(dst + 3 * dstLd, _mm256_permute2f128_ps(s3, s7, 0x20));
+    _mm256_storeu_ps(dst + 4 * dstLd, _mm256_permute2f128_ps(s0, s4, 0x31));
+    _mm256_storeu_ps(dst + 5 * dstLd, _mm256_permute2f128_ps(s1, s5, 0x31));
+    _mm256_storeu_ps(dst + 6 * dstLd, _mm256_permute2f128_ps(s2, s6, 0x31));
+    _mm256_storeu_ps(dst + 7 * dstLd, _mm256_permute2f128_ps(s3, s7, 0x31));
+}
+#elif defined(__SSE2__)
+static const int64_t kMicro = 4;
+
+static inline void transposeMicro(const float* src, int64_t srcLd, float* dst, int64_t dstLd) {
+    __m128 r0 = _mm_loadu_ps(src + 0 * srcLd);
+    __m128 r1 = _mm_loadu_ps(src + 1 * srcLd);
+    __m128 r2 = _mm_loadu_ps(src + 2 * srcLd);
+    __m128 r3 = _mm_loadu_ps(src + 3 * srcLd);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_storeu_ps(dst + 0 * dstLd, r0);
+    _mm_storeu_ps(dst + 1 * dstLd, r1);
+    _mm_storeu_ps(dst + 2 * dstLd, r2);
+    _mm_storeu_ps(dst + 3 * dstLd, r3);
+}
+#elif defined(__aarch64__)
+static const int64_t kMicro = 4;
+
+static inline void transposeMicro(const float* src, int64_t srcLd, float* dst, int64_t dstLd) {
+    float32x4x2_t a = vtrnq_f32(vld1q_f32(src + 0 * srcLd), vld1q_f32(src + 1 * srcLd));
+    float32x4x2_t b = vtrnq_f32(vld1q_f32(src + 2 * srcLd), vld1q_f32(src + 3 * srcLd));
+    vst1q_f32(dst + 0 * dstLd, vcombine_f32(vget_low_f32(a.val[0]), vget_low_f32(b.val[0])));
+    vst1q_f32(dst + 1 * dstLd, vcombine_f32(vget_low_f32(a.val[1]), vget_low_f32(b.val[1])));
+    vst1q_f32(dst + 2 * dstLd, vcombine_f32(vget_high_f32(a.val[0]), vget_high_f32(b.val[0])));
+    vst1q_f32(dst + 3 * dstLd, vcombine_f32(vget_high_f32(a.val[1]), vget_high_f32(b.val[1])));
+}
+#else
+static const int64_t kMicro = 1;
+
+static inline void transposeMicro(const float* src, int64_t, float* dst, int64_t) {
+    *dst = *src;
+}
+#endif
+
+// 一个块: 整的kMicro x kMicro用寄存器转置, 边上剩下的逐个元素
+static void transposeBlock(const float* src, int64_t srcLd, float* dst, int64_t dstLd, int64_t rows, int64_t cols) {
+    int64_t i = 0;
+    for (; i + kMicro <= rows; i += kMicro) {
+        int64_t j = 0;
+        for (; j + kMicro <= cols; j += kMicro) {
+            transposeMicro(src + i * srcLd + j, srcLd, dst + j * dstLd + i, dstLd);
+        }
+        for (; j < cols; j++) {
+            for (int64_t k = 0; k < kMicro; k++) dst[j * dstLd + i + k] = src[(i + k) * srcLd + j];
+        }
+    }
+    for (; i < rows; i++) {
+        for (int64_t j = 0; j < cols; j++) dst[j * dstLd + i] = src[i * srcLd + j];
+    }
+}
+
+void transpose(const float* src, int64_t srcLd, float* dst, int64_t dstLd, int64_t rows, int64_t cols) {
+    for (int64_t i = 0; i < rows; i += kTile) {
+        for (int64_t j = 0; j < cols; j += kTile) {
+            transposeBlock(src + i * srcLd + j, srcLd, dst + j * dstLd + i, dstLd, min(kTile, rows - i), min(kTile, cols - j));
+        }
+    }
+}
+
+void transpose(const float* src, int64_t srcLd, uint16_t* dst, int64_t dstLd, int64_t rows, int64_t cols) {
+    // 块先转置到栈上, 再按dst的行转换成half
+    float tile[kTile * kTile];
+    for (int64_t i = 0; i < rows; i += kTile) {
+        int64_t r = min(kTile, rows - i);
+        for (int64_t j = 0; j < cols; j += kTile) {
+            int64_t c = min(kTile, cols - j);
+            transposeBlock(src + i * srcLd + j, srcLd, tile, kTile, r, c);
+            for (int64_t k = 0; k < c; k++) fp16::convertFast(tile + k * kTile, dst + (j + k) * dstLd + i, r);
+        }
+    }
+}
+
+void transpose(const uint16_t* src, int64_t srcLd, float* dst, int64_t dstLd, int64_t rows, int64_t cols) {
+    // 块的每一行先转换成float, 再转置到dst
+    float tile[kTile * kTile];
+    for (int64_t i = 0; i < rows; i += kTile) {
+        int64_t r = min(kTile, rows - i);
+        for (int64_t j = 0; j < cols; j += kTile) {
+            int64_t c = min(kTile, cols - j);
+            for (int64_t k = 0; k < r; k++) fp16::convert(src + (i + k) * srcLd + j, tile + k * kTile, c);
+            transposeBlock(tile, kTile, dst + j * dstLd + i, dstLd, r, c);
+        }
+    }
+}
+
+// half -> half没有转换, 只分块
+static void transpose(const uint16_t* src, int64_t srcLd, uint16_t* dst, int64_t dstLd, int64_t rows, int64_t cols) {
+    for (int64_t i0 = 0; i0 < rows; i0 += kTile) {
+        for (int64_t j0 = 0; j0 < cols; j0 += kTile) {
+            int64_t i1 = min(i0 + kTile, rows);
+            int64_t j1 = min(j0 + kTile, cols);
+            for (int64_t i = i0; i < i1; i++) {
+                for (int64_t j = j0; j < j1; j++) dst[j * dstLd + i] = src[i * srcLd + j];
+            }
+        }
+    }
+}
+
+/* ------------------------------- 图片 ------------------------------- */
+
+// dst的每个plane之间隔planeStride个元素
+template <int C>
+static void deinterleaveN(const uint8_t* src, float* dst, int64_t pixels, int64_t planeStride, float scale, bool swapRB) {
+    float* planes[C];
+    for (int c = 0; c < C; c++) {
+        int to    = (swapRB && C >= 3 && c != 1 && c < 3) ? 2 - c : c;
+        planes[c] = dst + to * planeStride;
+    }
+    int64_t p = 0;
+#if defined(__aarch64__)
+    if (C == 3) {
+        for (; p + 16 <= pixels; p += 16) {
+            uint8x16x3_t v = vld3q_u8(src + p * 3);
+            for (int c = 0; c < 3; c++) {
+                uint16x8_t lo = vmovl_u8(vget_low_u8(v.val[c]));
+                uint16x8_t hi = vmovl_u8(vget_high_u8(v.val[c]));
+                vst1q_f32(planes[c] + p + 0,  vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), scale));
+                vst1q_f32(planes[c] + p + 4,  vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), scale));
+                vst1q_f32(planes[c] + p + 8,  vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), scale));
+                vst1q_f32(planes[c] + p + 12, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), scale));
+            }
+        }
+    }
+#endif
+    // C是常数, 编译器可以把固定步长的load展开和向量化
+    for (; p < pixels; p++) {
+        for (int c = 0; c < C; c++) planes[c][p] = src[p * C + c] * scale;
+    }
+}
+
+static void deinterleaveAny(const uint8_t* src, float* dst, int64_t pixels, int channels, int64_t planeStride,
+                            float scale, bool swapRB) {
+    switch (channels) {
+        case 1: deinterleaveN<1>(src, dst, pixels, planeStride, scale, swapRB); return;
+        case 3: deinterleaveN<3>(src, dst, pixels, planeStride, scale, swapRB); return;
+        case 4: deinterleaveN<4>(src, dst, pixels, planeStride, scale, swapRB); return;
+    }
+    for (int c = 0; c < channels; c++) {
+        int    from  = (swapRB && channels >= 3 && c != 1 && c < 3) ? 2 - c : c;
+        float* plane = dst + c * planeStride;
+        for (int64_t p = 0; p < pixels; p++) plane[p] = src[p * channels + from] * scale;
+    }
+}
+
+void deinterleave(const uint8_t* src, float* dst, int64_t pixels, int channels, float scale, bool swapRB) {
+    deinterleaveAny(src, dst, pixels, channels, pixels, scale, swapRB);
+}
+
+bool stageImage(const uint8_t* hwc, int height, int width, int channels, bool swapRB, Tensor& dst) {
+    bool half  = dst.dtype() == nvinfer1::DataType::kHALF;
+    int  rank  = dst.rank();
+    bool shape = (rank == 3 || (rank == 4 && dst.dim(0) == 1)) && dst.dim(-3) == channels &&
+                 dst.dim(-2) == height && dst.dim(-1) == width;
+    if (!shape || !dst.hostAccessible() || !dst.contiguous() ||
+        (dst.dtype() != nvinfer1::DataType::kFLOAT && !half)) {
+        LOGE("ERROR: cannot stage a %dx%dx%d image into %s", height, width, channels, dst.str().c_str());
+        return false;
+    }
+    const float  kScale = 1.f / 255.f;
+    const int64_t pixels = (int64_t)height * width;
+    if (!half) {
+        deinterleave(hwc, dst.data<float>(), pixels, channels, kScale, swapRB);
+        return true;
+    }
+    // half的时候按块转换成float再转换, 中间的buffer在cache里
+    const int64_t kChunk = 1024;
+    vector<float> tmp(kChunk * channels);
+    uint16_t*     out = dst.data<uint16_t>();
+    for (int64_t p = 0; p < pixels; p += kChunk) {
+        int64_t n = min(kChunk, pixels - p);
+        deinterleaveAny(hwc + p * channels, tmp.data(), n, channels, kChunk, kScale, swapRB);
+        for (int c = 0; c < channels; c++) fp16::convertFast(tmp.data() + c * kChunk, out + c * pixels + p, n);
+    }
+    return true;
+}
+
+/* ------------------------------- Tensor ------------------------------- */
+
+struct Shape4 {
+    int64_t n = 1, c = 0, h = 0, w = 0;
+};
+
+static bool shapeOf(const Tensor& t, Layout layout, Shape4& s) {
+    int r = t.rank();
+    if (r != 3 && r != 4) return false;
+    s.n = r == 4 ? t.dim(0) : 1;
+    if (layout == Layout::NCHW) {
+        s.c = t.dim(-3);
+        s.h = t.dim(-2);
+        s.w = t.dim(-1);
+    } else {
+        s.h = t.dim(-3);
+        s.w = t.dim(-2);
+        s.c = t.dim(-1);
+    }
+    return true;
+}
+
+static bool halfOrFloat(nvinfer1::DataType type) {
+    return type == nvinfer1::DataType::kFLOAT || type == nvinfer1::DataType::kHALF;
+}
+
+// 二维的转置按dtype分派
+static void transposeAny(const Tensor& src, int64_t srcOffset, int64_t srcLd, Tensor& dst, int64_t dstOffset,
+                         int64_t dstLd, int64_t rows, int64_t cols) {
+    bool srcHalf = src.dtype() == nvinfer1::DataType::kHALF;
+    bool dstHalf = dst.dtype() == nvinfer1::DataType::kHALF;
+    if (!srcHalf && !dstHalf) {
+        transpose(src.data<float>() + srcOffset, srcLd, dst.data<float>() + dstOffset, dstLd, rows, cols);
+    } else if (!srcHalf && dstHalf) {
+        transpose(src.data<float>() + srcOffset, srcLd, dst.data<uint16_t>() + dstOffset, dstLd, rows, cols);
+    } else if (srcHalf && !dstHalf) {
+        transpose(src.data<uint16_t>() + srcOffset, srcLd, dst.data<float>() + dstOffset, dstLd, rows, cols);
+    } else {
+        transpose(src.data<uint16_t>() + srcOffset, srcLd, dst.data<uint16_t>() + dstOffset, dstLd, rows, cols);
+    }
+}
+
+// channel很少的图片: 按像素处理, C是常数的时候内层循环展开
+template <int C>
+static void interleaveN(const float* src, int64_t planeStride, float* dst, int64_t dstC, int64_t pixels) {
+    for (int64_t p = 0; p < pixels; p++) {
+        for (int c = 0; c < C; c++) dst[p * dstC + c] = src[c * planeStride + p];
+    }
+}
+
+template <int C>
+static void deinterleaveN(const float* src, int64_t srcC, float* dst, int64_t planeStride, int64_t pixels) {
+    for (int c = 0; c < C; c++) {
+        for (int64_t p = 0; p < pixels; p++) dst[c * planeStride + p] = src[p * srcC + c];
+    }
+}
+
+static void interleaveAny(const float* src, int64_t planeStride, int channels, float* dst, int64_t dstC, int64_t pixels) {
+    switch (channels) {
+        case 1: interleaveN<1>(src, planeStride, dst, dstC, pixels); return;
+        case 2: interleaveN<2>(src, planeStride, dst, dstC, pixels); return;
+        case 3: interleaveN<3>(src, planeStride, dst, dstC, pixels); return;
+        default: interleaveN<4>(src, planeStride, dst, dstC, pixels); return;
+    }
+}
+
+static void deinterleaveAny(const float* src, int64_t srcC, int channels, float* dst, int64_t planeStride, int64_t pixels) {
+    switch (channels) {
+        case 1: deinterleaveN<1>(src, srcC, dst, planeStride, pixels); return;
+        case 2: deinterleaveN<2>(src, srcC, dst, planeStride, pixels); return;
+        case 3: deinterleaveN<3>(src, srcC, dst, planeStride, pixels); return;
+        default: deinterleaveN<4>(src, srcC, dst, planeStride, pixels); return;
+    }
+}
+
+// 一个batch的planar <-> interleaved, channels <= 4. half的一边按块经过栈上的float buffer
+static void convertImage(const Tensor& src, int64_t srcOffset, Layout from, Tensor& dst, int64_t dstOffset,
+                         int channels, int64_t srcC, int64_t dstC, int64_t hw) {
+    const int64_t kChunk  = 1024;
+    bool          srcHalf = src.dtype() == nvinfer1::DataType::kHALF;
+    bool          dstHalf = dst.dtype() == nvinfer1::DataType::kHALF;
+    float         in[kChunk * 16];
+    float         out[kChunk * 16];
+    // 补齐的channel在out里一直是0
+    if (dstHalf) memset(out, 0, sizeof(out));
+
+    for (int64_t p = 0; p < hw; p += kChunk) {
+        int64_t n = min(kChunk, hw - p);
+        if (from == Layout::NCHW) {
+            const float* planes = srcHalf ? in : src.data<float>() + srcOffset + p;
+            int64_t      stride = srcHalf ? kChunk : hw;
+            for (int c = 0; c < channels && srcHalf; c++) {
+                fp16::convert(src.data<uint16_t>() + srcOffset + c * hw + p, in + c * kChunk, n);
+            }
+            float* pixels = dstHalf ? out : dst.data<float>() + dstOffset + p * dstC;
+            interleaveAny(planes, stride, channels, pixels, dstC, n);
+            if (dstHalf) fp16::convertFast(out, dst.data<uint16_t>() + dstOffset + p * dstC, n * dstC);
+        } else {
+            const float* pixels = srcHalf ? in : src.data<float>() + srcOffset + p * srcC;
+            if (srcHalf) fp16::convert(src.data<uint16_t>() + srcOffset + p * srcC, in, n * srcC);
+            float*  planes = dstHalf ? out : dst.data<float>() + dstOffset + p;
+            int64_t stride = dstHalf ? kChunk : hw;
+            deinterleaveAny(pixels, srcC, channels, planes, stride, n);
+            for (int c = 0; c < channels && dstHalf; c++) {
+                fp16::convertFast(out + c * kChunk, dst.data<uint16_t>() + dstOffset + c * hw + p, n);
+            }
+        }
+    }
+}
+
+bool convert(const Tensor& src, Layout from, Tensor& dst, Layout to) {
+    Shape4 s, d;
+    bool   ok = !src.empty() && !dst.empty() && src.hostAccessible() && dst.hostAccessible() &&
+                src.contiguous() && dst.contiguous() && halfOrFloat(src.dtype()) && halfOrFloat(dst.dtype()) &&
+                shapeOf(src, from, s) && shapeOf(dst, to, d) && s.n == d.n && s.h == d.h && s.w == d.w;
+    // NHWC的一边可以多出补齐用的channel
+    if (ok && from == to)                                   ok = s.c == d.c;
+    if (ok && from == Layout::NCHW && to == Layout::NHWC)   ok = d.c >= s.c;
+    if (ok && from == Layout::NHWC && to == Layout::NCHW)   ok = d.c <= s.c;
+    if (!ok) {
+        LOGE("ERROR: cannot convert %s %s to %s %s", src.str().c_str(), layoutName(from), dst.str().c_str(), layoutName(to));
+        return false;
+    }
+
+    if (from == to) {
+        if (src.dtype() == dst.dtype()) {
+            memcpy(dst.data(), src.data(), src.bytes());
+        } else if (dst.dtype() == nvinfer1::DataType::kHALF) {
+            fp16::convertFast(src.data<float>(), dst.data<uint16_t>(), src.count());
+        } else {
+            fp16::convert(src.data<uint16_t>(), dst.data<float>(), src.count());
+        }
+        return true;
+    }
+
+    int64_t hw       = s.h * s.w;
+    int64_t channels = min(s.c, d.c);
+    // 补齐以后的channel不超过16的时候, 栈上的buffer放得下一块
+    if (channels <= 4 && max(s.c, d.c) <= 16) {
+        if (from == Layout::NCHW && d.c > s.c && dst.dtype() == nvinfer1::DataType::kFLOAT) memset(dst.data(), 0, dst.bytes());
+        for (int64_t n = 0; n < s.n; n++) {
+            convertImage(src, n * s.c * hw, from, dst, n * d.c * hw, (int)channels, s.c, d.c, hw);
+        }
+        return true;
+    }
+
+    if (from == Layout::NCHW) {
+        if (d.c > s.c) memset(dst.data(), 0, dst.bytes());
+        for (int64_t n = 0; n < s.n; n++) {
+            // [C][HW] -> [HW][C']
+            transposeAny(src, n * s.c * hw, hw, dst, n * hw * d.c, d.c, s.c, hw);
+        }
+    } else {
+        for (int64_t n = 0; n < s.n; n++) {
+            // [HW][C'] -> [C][HW], 补齐的channel丢掉
+            transposeAny(src, n * hw * s.c, s.c, dst, n * d.c * hw, hw, hw, d.c);
+        }
+    }
+    return true;
+}
+
+Layout hostLayout(nvinfer1::TensorFormat format) {
+    switch (format) {
+        case nvinfer1::TensorFormat::kHWC:
+        case nvinfer1::TensorFormat::kHWC8:
+        case nvinfer1::TensorFormat::kHWC16:
+            return Layout::NHWC;
+        default:
+            return Layout::NCHW;
+    }
+}
+
+int channelAlignment(nvinfer1::TensorFormat format) {
+    switch (format) {
+        case nvinfer1::TensorFormat::kHWC8:  return 8;
+        case nvinfer1::TensorFormat::kHWC16: return 16;
+        default:                             return 1;
+    }
+}
+
+/* ------------------------------- benchmark ------------------------------- */
+
+namespace {
+
+struct Case {
+    const char*        name;
+    Layout             from;
+    Layout             to;
+    nvinfer1::DataType dstType;
+    int64_t            c, h, w;
+    int64_t            dstC;     // NHWC补齐以后的channel
+};
+
+typedef chrono::steady_clock Clock;
+
+template <typename Fn>
+double timeMs(int iterations, Fn fn) {
+    fn();   // warmup, 也让dst的page都分配好
+    auto start = Clock::now();
+    for (int i = 0; i < iterations; i++) fn();
+    return chrono::duration<double, milli>(Clock::now() - start).count() / iterations;
+}
+
+// 参考实现: 按dst的顺序逐个元素计算
+void naiveConvert(const float* src, const Case& k, void* dst) {
+    int64_t hw   = k.h * k.w;
+    bool    half = k.dstType == nvinfer1::DataType::kHALF;
+    float*    f = static_cast<float*>(dst);
+    uint16_t* h = static_cast<uint16_t*>(dst);
+    if (k.from == Layout::NCHW) {
+        for (int64_t p = 0; p < hw; p++) {
+            for (int64_t c = 0; c < k.dstC; c++) {
+                float v = c < k.c ? src[c * hw + p] : 0.f;
+                if (half) h[p * k.dstC + c] = fp16::floatToHalf(v);
+                else      f[p * k.dstC + c] = v;
+            }
+        }
+    } else {
+        for (int64_t c = 0; c < k.c; c++) {
+            for (int64_t p = 0; p < hw; p++) {
+                float v = src[p * k.c + c];
+                if (half) h[c * hw + p] = fp16::floatToHalf(v);
+                else      f[c * hw + p] = v;
+            }
+        }
+    }
+}
+
+} // namespace
+
+vector<BenchResult> benchmark(int iterations) {
+    const nvinfer1::DataType kF32 = nvinfer1::DataType::kFLOAT;
+    const nvinfer1::DataType kF16 = nvinfer1::DataType::kHALF;
+    const Case cases[] = {
+        {"image 3x640x640 planar->interleaved",   Layout::NCHW, Layout::NHWC, kF32, 3,    640, 640, 3},
+        {"image 3x640x640 interleaved->planar",   Layout::NHWC, Layout::NCHW, kF32, 3,    640, 640, 3},
+        {"fmap 64x160x160 NCHW->NHWC",            Layout::NCHW, Layout::NHWC, kF32, 64,   160, 160, 64},
+        {"fmap 256x80x80 NCHW->NHWC",             Layout::NCHW, Layout::NHWC, kF32, 256,  80,  80,  256},
+        {"fmap 256x80x80 NHWC->NCHW",             Layout::NHWC, Layout::NCHW, kF32, 256,  80,  80,  256},
+        {"fmap 1024x20x20 NCHW->NHWC",            Layout::NCHW, Layout::NHWC, kF32, 1024, 20,  20,  1024},
+        {"fmap 256x80x80 NCHW->NHWC fp16",        Layout::NCHW, Layout::NHWC, kF16, 256,  80,  80,  256},
+        {"image 3x640x640 NCHW->HWC8 fp16",       Layout::NCHW, Layout::NHWC, kF16, 3,    640, 640, 8},
+        {"fmap 256x80x80 NHWC->NCHW fp16",        Layout::NHWC, Layout::NCHW, kF16, 256,  80,  80,  256},
+    };
+
+    vector<BenchResult> results;
+    for (auto& k : cases) {
+        vector<int64_t> srcShape = k.from == Layout::NCHW ? vector<int64_t>{1, k.c, k.h, k.w} : vector<int64_t>{1, k.h, k.w, k.c};
+        vector<int64_t> dstShape = k.to == Layout::NCHW ? vector<int64_t>{1, k.c, k.h, k.w} : vector<int64_t>{1, k.h, k.w, k.dstC};
+        Tensor src(srcShape, kF32, Location::Host);
+        Tensor fast(dstShape, k.dstType, Location::Pinned);
+        Tensor naive(dstShape, k.dstType, Location::Pinned);
+        if (src.empty() || fast.empty() || naive.empty()) break;
+        float* s = src.data<float>();
+        for (int64_t i = 0; i < src.count(); i++) s[i] = (float)((i * 7919) % 1000) * 0.01f - 5.f;
+
+        BenchResult r;
+        r.name    = k.name;
+        r.bytes   = src.bytes() + fast.bytes();
+        r.naiveMs = timeMs(iterations, [&]() { naiveConvert(s, k, naive.data()); });
+        r.fastMs  = timeMs(iterations, [&]() { convert(src, k.from, fast, k.to); });
+        r.ok      = memcmp(fast.data(), naive.data(), fast.bytes()) == 0;
+        results.push_back(r);
+    }
+
+    // decode的输出直接到normalize以后的planar
+    {
+        const int h = 640, w = 640, c = 3;
+        vector<uint8_t> hwc((size_t)h * w * c);
+        for (size_t i = 0; i < hwc.size(); i++) hwc[i] = (uint8_t)(i * 31);
+        Tensor fast({1, c, h, w}, kF32, Location::Pinned);
+        Tensor naive({1, c, h, w}, kF32, Location::Pinned);
+        BenchResult r;
+        r.name  = "uint8 640x640x3 BGR->RGB planar /255";
+        r.bytes = hwc.size() + fast.bytes();
+        if (!fast.empty() && !naive.empty()) {
+            float* out = naive.data<float>();
+            r.naiveMs = timeMs(iterations, [&]() {
+                for (int ch = 0; ch < c; ch++) {
+                    for (int64_t p = 0; p < (int64_t)h * w; p++) out[ch * h * w + p] = hwc[p * c + (2 - ch)] * (1.f / 255.f);
+                }
+            });
+            r.fastMs = timeMs(iterations, [&]() { stageImage(hwc.data(), h, w, c, true, fast); });
+            r.ok     = memcmp(fast.data(), naive.data(), fast.bytes()) == 0;
+        }
+        results.push_back(r);
+    }
+    return results;
+}
+
+void report(const vector<BenchResult>& results) {
+    LOG("%-40s %10s %10s %10s %10s %8s", "layout transform", "naive ms", "GB/s", "blocked ms", "GB/s", "speedup");
+    for (auto& r : results) {
+        LOG("%-40s %10.3f %10.2f %10.3f %10.2f %7.1fx %s", r.name.c_str(), r.naiveMs, r.naiveGBs(), r.fastMs, r.fastGBs(),
+            r.fastMs > 0 ? r.naiveMs / r.fastMs : 0.0, r.ok ? "" : "MISMATCH");
+    }
+}
+
+} // namespace layout
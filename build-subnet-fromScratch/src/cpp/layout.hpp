@@ -0,0 +1,65 @@
+#ifndef __LAYOUT_HPP__
+#define __LAYOUT_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "NvInfer.h"
+#include "tensor.hpp"
+
+// host上的layout转换, 在拷贝到pinned memory的同时完成, 不再在engine里用shuffle层(addPermute/addReshape)做
+//     - NCHW <-> NHWC是每个batch一次[C][HW]和[HW][C]之间的转置: 按64x64分块保证src和dst都在cache里,
+//       块里面用8x8(AVX)或者4x4(SSE2/NEON)的寄存器转置
+//     - 转换的同时可以做FP32 <-> FP16, 先在块里转置再转换, 不需要完整的中间buffer
+//     - C <= 4的图片(planar <-> interleaved)按像素处理, uint8的HWC(decode的输出)直接转换成归一化以后的planar
+//     - NHWC的dst的channel可以比src多(kHWC8/kHWC16要求channel补齐到8/16), 多出来的channel填0
+// 配合BuildProfile的input_format/output_format/io_type(buildconfig.hpp)让engine直接使用这个layout
+
+namespace layout {
+
+enum class Layout { NCHW, NHWC };
+
+const char* layoutName(Layout layout);
+
+// dst[j * dstLd + i] = src[i * srcLd + j], i < rows, j < cols
+void transpose(const float* src, int64_t srcLd, float* dst, int64_t dstLd, int64_t rows, int64_t cols);
+// 转置的同时转换成half
+void transpose(const float* src, int64_t srcLd, uint16_t* dst, int64_t dstLd, int64_t rows, int64_t cols);
+// half转置成float
+void transpose(const uint16_t* src, int64_t srcLd, float* dst, int64_t dstLd, int64_t rows, int64_t cols);
+
+// uint8的HWC -> float的CHW, x * scale, swapRB的时候channel 0和2交换(BGR -> RGB)
+void deinterleave(const uint8_t* src, float* dst, int64_t pixels, int channels, float scale, bool swapRB);
+
+// src和dst都在host上(Host或者Pinned)并且是contiguous的, rank是4(NCHW/NHWC)或者3(没有batch)
+// dtype支持float -> float/half和half -> float/half, dst的shape需要和按to的layout排列的src一致(NHWC的channel可以更多)
+bool convert(const Tensor& src, Layout from, Tensor& dst, Layout to);
+
+// decode出来的HWC, uint8图片 -> dst([1, C, H, W]或者[C, H, W], float或者half), /255
+bool stageImage(const uint8_t* hwc, int height, int width, int channels, bool swapRB, Tensor& dst);
+
+// TensorRT的format对应的host layout, 以及channel需要补齐的倍数
+Layout hostLayout(nvinfer1::TensorFormat format);
+int    channelAlignment(nvinfer1::TensorFormat format);
+
+/* ------------------------------- benchmark ------------------------------- */
+
+struct BenchResult {
+    std::string name;
+    size_t      bytes   = 0;     // 一次转换读写的字节数
+    double      naiveMs = 0;     // 按dst的下标顺序逐个元素计算的循环
+    double      fastMs  = 0;
+    bool        ok      = false; // 两种实现的结果完全一样
+
+    double naiveGBs() const { return naiveMs > 0 ? bytes / naiveMs / 1e6 : 0; }
+    double fastGBs() const { return fastMs > 0 ? bytes / fastMs / 1e6 : 0; }
+};
+
+// 常见的图片和feature map的shape, dst在pinned memory上
+std::vector<BenchResult> benchmark(int iterations = 20);
+void                     report(const std::vector<BenchResult>& results);
+
+} // namespace layout
+
+#endif //__LAYOUT_HPP__
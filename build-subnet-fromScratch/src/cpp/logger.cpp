@@ -0,0 +1,362 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+
+#include "logger.hpp"
+
+using namespace std;
+
+namespace logger {
+
+atomic<int> gLevel{(int)Level::VERB};
+
+namespace {
+
+struct Record {
+    atomic<uint64_t> seq;
+    Level            level;
+    int              len;
+    char             msg[kMaxMessage];
+};
+
+const char* prefix(Level level, int& len) {
+    static const char info[]  = YELLOW "[info]"  CLEAR;
+    static const char verb[]  = PURPLE "[verb]"  CLEAR;
+    static const char warn[]  = BLUE   "[warn]"  CLEAR;
+    static const char error[] = RED    "[error]" CLEAR;
+    switch (level) {
+        case Level::INFO:  len = sizeof(info)  - 1; return info;
+        case Level::VERB:  len = sizeof(verb)  - 1; return verb;
+        case Level::WARN:  len = sizeof(warn)  - 1; return warn;
+        default:           len = sizeof(error) - 1; return error;
+    }
+}
+
+// 格式化到msg里, 返回长度. 超过kMaxMessage的时候把末尾换成kTruncated, 让人知道消息不完整
+int formatMessage(char* msg, const char* format, va_list args) {
+    int n = vsnprintf(msg, kMaxMessage, format, args);
+    if (n < 0) {
+        msg[0] = '\0';
+        return 0;
+    }
+    if (n < kMaxMessage) return n;
+    int len = kMaxMessage - 1;
+    memcpy(msg + len - (sizeof(kTruncated) - 1), kTruncated, sizeof(kTruncated));
+    return len;
+}
+
+// 有界的MPSC队列, 每一个slot带一个序号(Vyukov的做法):
+//     seq == pos:      slot是空的, 可以被写入
+//     seq == pos + 1:  slot已经写好了, 可以被读出
+class AsyncLogger {
+public:
+    AsyncLogger() : mRecords(new Record[kRingCapacity]) {
+        for (int i = 0; i < kRingCapacity; i++) {
+            mRecords[i].seq.store(i, memory_order_relaxed);
+        }
+        mThread = thread(&AsyncLogger::run, this);
+    }
+
+    void push(Level level, const char* format, va_list args) {
+        if (mStopped.load(memory_order_acquire)) {
+            writeDirect(level, format, args);
+            return;
+        }
+
+        uint64_t pos;
+        Record*  rec;
+        while (!claim(pos, rec)) {
+            // 队列满了: WARN/ERROR必须写出去, INFO/VERB直接丢掉
+            if (level == Level::INFO || level == Level::VERB) {
+                mDropped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            wake();
+            this_thread::yield();
+        }
+
+        rec->len   = formatMessage(rec->msg, format, args);
+        rec->level = level;
+        rec->seq.store(pos + 1, memory_order_release);
+
+        if (mSleeping.load(memory_order_relaxed)) {
+            wake();
+        }
+        if (level == Level::ERROR) {
+            waitWritten(pos + 1);
+        }
+    }
+
+    void flush() {
+        if (mStopped.load(memory_order_acquire)) {
+            fflush(stdout);
+            return;
+        }
+        waitWritten(mEnqueue.load(memory_order_acquire));
+    }
+
+    void stop() {
+        if (mStopped.exchange(true)) return;
+        wake();
+        mThread.join();
+    }
+
+    uint64_t dropped() const {
+        return mDropped.load(memory_order_relaxed);
+    }
+
+    uint64_t written() const {
+        return mWritten.load(memory_order_acquire);
+    }
+
+    // fork出来的子进程里没有后台线程, 之后的消息同步写出去, ERROR也不能去等一个不存在的线程
+    void afterFork() {
+        mStopped.store(true, memory_order_release);
+        mExited.store(true, memory_order_release);
+    }
+
+    // 只给benchmark用, 换之前先flush
+    FILE* setOutput(FILE* output) {
+        return mOutput.exchange(output);
+    }
+
+private:
+    bool claim(uint64_t& pos, Record*& rec) {
+        pos = mEnqueue.load(memory_order_relaxed);
+        for (;;) {
+            rec = &mRecords[pos & (kRingCapacity - 1)];
+            uint64_t seq = rec->seq.load(memory_order_acquire);
+            int64_t  dif = (int64_t)seq - (int64_t)pos;
+            if (dif == 0) {
+                if (mEnqueue.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) return true;
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = mEnqueue.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    void wake() {
+        lock_guard<mutex> lock(mLock);
+        mCond.notify_one();
+    }
+
+    void waitWritten(uint64_t target) {
+        // 和stop同时发生的时候, 后台线程可能已经退出了, 这时候不能一直等
+        while (mWritten.load(memory_order_acquire) < target && !mExited.load(memory_order_acquire)) {
+            wake();
+            this_thread::yield();
+        }
+    }
+
+    // 后台线程: 把队列里所有已经写好的record格式化到一块buffer里, 一次fwrite出去
+    void run() {
+        static const size_t kBatchBytes = 64 * 1024;
+        char* batch = (char*)malloc(kBatchBytes);
+
+        for (;;) {
+            size_t   used  = 0;
+            uint64_t count = 0;
+
+            FILE* output = mOutput.load(memory_order_relaxed);
+            for (;;) {
+                Record&  rec = mRecords[mDequeue & (kRingCapacity - 1)];
+                if (rec.seq.load(memory_order_acquire) != mDequeue + 1) break;
+
+                int plen;
+                const char* pre = prefix(rec.level, plen);
+                if (used + plen + rec.len + 1 > kBatchBytes) {
+                    fwrite(batch, 1, used, output);
+                    used = 0;
+                }
+                memcpy(batch + used, pre, plen);          used += plen;
+                memcpy(batch + used, rec.msg, rec.len);   used += rec.len;
+                batch[used++] = '\n';
+
+                rec.seq.store(mDequeue + kRingCapacity, memory_order_release);
+                mDequeue++;
+                count++;
+            }
+
+            if (count > 0) {
+                fwrite(batch, 1, used, output);
+                fflush(output);
+                mWritten.fetch_add(count, memory_order_release);
+                continue;
+            }
+
+            if (mStopped.load(memory_order_acquire) && mEnqueue.load(memory_order_acquire) == mDequeue) {
+                break;
+            }
+
+            unique_lock<mutex> lock(mLock);
+            mSleeping.store(true, memory_order_relaxed);
+            mCond.wait_for(lock, chrono::milliseconds(2));
+            mSleeping.store(false, memory_order_relaxed);
+        }
+        free(batch);
+        mExited.store(true, memory_order_release);
+    }
+
+    void writeDirect(Level level, const char* format, va_list args) {
+        int  plen;
+        char msg[kMaxMessage];
+        const char* pre = prefix(level, plen);
+        formatMessage(msg, format, args);
+        fprintf(stdout, "%s%s\n", pre, msg);
+        fflush(stdout);     // 子进程通常用_exit退出, 不会再flush
+    }
+
+private:
+    unique_ptr<Record[]>  mRecords;
+    alignas(64) atomic<uint64_t> mEnqueue{0};
+    alignas(64) uint64_t         mDequeue = 0;
+    alignas(64) atomic<uint64_t> mWritten{0};
+    atomic<uint64_t>      mDropped{0};
+    atomic<bool>          mSleeping{false};
+    atomic<bool>          mStopped{false};
+    atomic<bool>          mExited{false};
+    atomic<FILE*>         mOutput{stdout};
+    mutex                 mLock;
+    condition_variable    mCond;
+    thread                mThread;
+};
+
+// 故意不析构: 其他静态对象的析构函数里也可能会打日志, 退出的时候由atexit负责把剩下的消息写完
+AsyncLogger& instance() {
+    static aligned_storage<sizeof(AsyncLogger), alignof(AsyncLogger)>::type storage;
+    static AsyncLogger* logger = [] {
+        AsyncLogger* l = new (&storage) AsyncLogger();
+        atexit([] { instance().stop(); });
+        pthread_atfork(nullptr, nullptr, [] { instance().afterFork(); });
+        return l;
+    }();
+    return *logger;
+}
+
+} // namespace
+
+void vlog(Level level, const char* format, va_list args) {
+    if (!enabled(level)) return;
+    instance().push(level, format, args);
+}
+
+void log(Level level, const char* format, ...) {
+    if (!enabled(level)) return;
+    va_list args;
+    va_start(args, format);
+    instance().push(level, format, args);
+    va_end(args);
+}
+
+void setLevel(Level level) {
+    gLevel.store((int)level, memory_order_relaxed);
+}
+
+Level getLevel() {
+    return (Level)gLevel.load(memory_order_relaxed);
+}
+
+void flush() {
+    instance().flush();
+}
+
+uint64_t dropped() {
+    return instance().dropped();
+}
+
+BenchResult benchmark(int threads, uint64_t messages) {
+    BenchResult result;
+    result.threads  = std::max(threads, 1);
+    result.messages = messages * result.threads;
+#if LOG_LEVEL < 3
+    result.enabled = false;
+    return result;
+#endif
+
+    FILE* null = fopen("/dev/null", "w");
+    if (null == nullptr) {
+        LOGE("ERROR: failed to open /dev/null for the logger benchmark");
+        return result;
+    }
+    Level level = getLevel();
+    setLevel(Level::VERB);
+    AsyncLogger& logger = instance();
+    logger.flush();
+    FILE*    output  = logger.setOutput(null);
+    uint64_t written = logger.written();
+    uint64_t dropped = logger.dropped();
+
+    // 每个线程先把自己的耗时存下来, 结束以后再合并排序
+    vector<vector<int64_t>> latencies(result.threads, vector<int64_t>(messages));
+    auto           start = chrono::steady_clock::now();
+    vector<thread> producers;
+    for (int t = 0; t < result.threads; t++) {
+        producers.emplace_back([t, messages, &latencies]() {
+            int64_t* out = latencies[t].data();
+            for (uint64_t i = 0; i < messages; i++) {
+                auto begin = chrono::steady_clock::now();
+                LOGV("benchmark thread %d message %llu: %s", t, (unsigned long long)i, "0123456789abcdef0123456789abcdef");
+                out[i] = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count();
+            }
+        });
+    }
+    for (auto& p : producers) p.join();
+    logger.flush();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<int64_t> all;
+    all.reserve(result.messages);
+    for (auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    if (!all.empty()) {
+        auto at = [&all](double q) {
+            size_t k = std::min(all.size() - 1, (size_t)(q * all.size()));
+            nth_element(all.begin(), all.begin() + k, all.end());
+            return (double)all[k];
+        };
+        result.p50Ns = at(0.50);
+        result.p99Ns = at(0.99);
+        result.maxNs = (double)*max_element(all.begin(), all.end());
+    }
+
+    result.dropped = logger.dropped() - dropped;
+    result.ok      = logger.written() - written + result.dropped == result.messages;
+    logger.setOutput(output);
+    fclose(null);
+    setLevel(level);
+    return result;
+}
+
+void report(const BenchResult& r) {
+    if (!r.enabled) {
+        LOG("logger %2d threads: disabled, LOG_LEVEL %d compiles LOGV out", r.threads, LOG_LEVEL);
+        return;
+    }
+    double rate = r.seconds > 0 ? r.messages / r.seconds : 0;
+    LOG("logger %2d threads: %8.2f M msgs/s, push p50 %6.0f ns, p99 %6.0f ns, max %8.0f ns, %llu dropped, %s",
+        r.threads, rate / 1e6, r.p50Ns, r.p99Ns, r.maxNs, (unsigned long long)r.dropped,
+        r.ok ? "ok" : "FAILED (lost messages)");
+}
+
+bool RateLimiter::allow() {
+    int64_t now    = chrono::duration_cast<chrono::milliseconds>(
+                        chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t window = mWindow.load(memory_order_relaxed);
+    if (now - window >= 1000 && mWindow.compare_exchange_strong(window, now, memory_order_relaxed)) {
+        mCount.store(0, memory_order_relaxed);
+    }
+    return mCount.fetch_add(1, memory_order_relaxed) < mLimit;
+}
+
+} // namespace logger
@@ -0,0 +1,119 @@
+#ifndef __LOGGER_HPP__
+#define __LOGGER_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <stdarg.h>
+
+// 异步的日志模块, 用来替换之前同步printf到stdout的__log_info
+//     1. 生产者(调用LOG的线程)只做一次vsnprintf, 把消息写进一个固定大小的record里, 不分配内存
+//     2. record放在一个无锁的MPSC环形队列里, 由后台线程批量地加上前缀, 合并成一次fwrite写出去
+//     3. 编译时通过LOG_LEVEL把不需要的等级直接去掉(参数都不会被求值), 运行时还可以通过setLevel再过滤
+//     4. 对于容易刷屏的地方, 可以使用LOG_EVERY_SEC限制每一个调用点每秒输出的条数
+// 队列满了的时候, INFO/VERB的消息会被丢掉并计数; WARN/ERROR的消息会等到有空位为止, ERROR还会等后台线程写完才返回
+// 超过kMaxMessage的消息被截断, 末尾换成kTruncated
+
+#define DGREEN    "\033[1;36m"
+#define BLUE      "\033[1;34m"
+#define PURPLE    "\033[1;35m"
+#define GREEN     "\033[1;32m"
+#define YELLOW    "\033[1;33m"
+#define RED       "\033[1;31m"
+#define CLEAR     "\033[0m"
+
+// 0: 只保留ERROR, 1: +WARN, 2: +INFO, 3: +VERB
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 3
+#endif
+
+enum struct Level {
+    ERROR,
+    WARN,
+    INFO,
+    VERB
+};
+
+#define LOG_AT(level, ...)           logger::log(level, __VA_ARGS__)
+#define LOG_NONE(...)                do {} while (0)
+
+#if LOG_LEVEL >= 1
+#define LOGW(...)                    LOG_AT(Level::WARN, __VA_ARGS__)
+#else
+#define LOGW(...)                    LOG_NONE(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= 2
+#define LOG(...)                     LOG_AT(Level::INFO, __VA_ARGS__)
+#else
+#define LOG(...)                     LOG_NONE(__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= 3
+#define LOGV(...)                    LOG_AT(Level::VERB, __VA_ARGS__)
+#else
+#define LOGV(...)                    LOG_NONE(__VA_ARGS__)
+#endif
+
+#define LOGE(...)                    LOG_AT(Level::ERROR, __VA_ARGS__)
+
+// 每一个调用点每秒最多输出n条, 比如: LOG_EVERY_SEC(10, LOGV, "%s", msg);
+#define LOG_EVERY_SEC(n, LOGX, ...)                                 \
+    do {                                                            \
+        static logger::RateLimiter __limiter(n);                    \
+        if (__limiter.allow()) LOGX(__VA_ARGS__);                   \
+    } while (0)
+
+namespace logger {
+
+static const int  kMaxMessage   = 1000;
+static const int  kRingCapacity = 1024;
+static const char kTruncated[]  = "...(truncated)";
+
+void log(Level level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+void vlog(Level level, const char* format, va_list args);
+
+// 运行时的过滤等级, 比编译时的LOG_LEVEL更严格的时候才有意义
+extern std::atomic<int> gLevel;
+void  setLevel(Level level);
+Level getLevel();
+inline bool enabled(Level level) {
+    return (int)level <= gLevel.load(std::memory_order_relaxed);
+}
+
+// 等待后台线程把队列里所有的消息都写出去
+void flush();
+
+// 因为队列满被丢掉的消息数
+uint64_t dropped();
+
+struct BenchResult {
+    bool     enabled  = true;  // LOG_LEVEL把LOGV编译掉的时候什么都测不到
+    int      threads  = 0;
+    uint64_t messages = 0;     // 所有线程一共打的条数
+    double   seconds  = 0;     // 从开始打到全部写出去
+    uint64_t dropped  = 0;
+    double   p50Ns    = 0;     // 生产者一次LOGV的耗时(包括两次取时间)
+    double   p99Ns    = 0;
+    double   maxNs    = 0;
+    bool     ok       = false; // 写出去的加上丢掉的正好是打的条数
+};
+
+// threads个线程同时用LOGV刷messages条消息(运行时的等级临时打开到VERB), 输出临时换成/dev/null.
+// 记录每一次LOGV在生产者线程里的耗时(p50/p99/max), 以及生产者加后台线程写完的吞吐
+BenchResult benchmark(int threads, uint64_t messages);
+void        report(const BenchResult& result);
+
+class RateLimiter {
+public:
+    explicit RateLimiter(int perSecond) : mLimit(perSecond) {}
+    bool allow();
+
+private:
+    int                  mLimit;
+    std::atomic<int64_t> mWindow{0};
+    std::atomic<int>     mCount{0};
+};
+
+} // namespace logger
+
+#endif //__LOGGER_HPP__
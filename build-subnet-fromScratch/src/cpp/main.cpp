@@ -3,6 +3,25 @@
 
 #include "utils.hpp"
 #include "model.hpp"
+#include "metrics.hpp"
+#include "entropy.hpp"
+#include "quant.hpp"
+#include "half.hpp"
+#include "sparse.hpp"
+#include "buildfarm.hpp"
+#include "policy.hpp"
+#include "hotreload.hpp"
+#include "refit.hpp"
+#include "shmring.hpp"
+#include "queue.hpp"
+#include "pipeline.hpp"
+#include "sched.hpp"
+#include "tensor.hpp"
+#include "layout.hpp"
+#include "shuffle.hpp"
+#include "shapes.hpp"
+#include "npy.hpp"
+#include "blocks.hpp"
 
 using namespace std;
 
@@ -24,6 +43,143 @@ int main(int argc, char const *argv[])
     // Model model("models/weights/sample_c2f.weights", Model::precision::FP32);
     Model model("models/weights/sample_c2f.weights", Model::precision::FP16);
 
+    // 逐层对比FP16和PyTorch的结果(需要DEBUG=1编译, 参考值由src/python/export_reference.py导出)
+    // model.setDebugTensors({"cv1.*", "m.0.*"});
+    // model.setReferenceDir("models/reference/sample_c2f");
+    // 对比用的.npy的读写: 每种dtype save再load一遍
+    // npy::check();
+    // 流式的printTensor和原来的snprintf对比
+    // benchmarkPrintTensor();
+
+    // INT8需要calibration的数据, 第一次build以后会生成.calib的cache, 之后可以不再提供数据
+    // Model model("models/weights/sample_c2f.weights", Model::precision::INT8);
+    // model.setCalibrationData("data/calibration");
+    // 也可以在CPU上用逐层dump出来的activation离线计算scale, 生成的cache和calibrator写的格式一样
+    // 路径和INT8的build读取的cache一样(models/engine/sample_c2f_int8.calib), dump的文件名是层名,
+    // build的时候中间的tensor也按层名命名(network::nameTensors), 所以cache里的每一项都能对上
+    // string calibCache = getCalibrationCachePath(getEnginePath("models/weights/sample_c2f.weights", Model::precision::INT8));
+    // calib::calibrateFromDumps({"data/dump/0", "data/dump/1"}, calibCache);
+    // 把per-channel的weight scale和上面的activation scale写进.weights, INT8的时候parser会插入Q/DQ
+    // quant::addQuantScales("models/weights/sample_c2f.weights", calibCache);
+
+    // 离线把conv的kernel转换成FP16保存, 文件大小和load的时间都差不多减半
+    // fp16::convertWeights("models/weights/sample_c2f.weights", "models/weights/sample_c2f.weights");
+
+    // 2:4剪枝, 需要告诉工具每个conv的kernel size. 剪枝以后build的时候打开kSPARSE_WEIGHTS
+    // sparse::pruneWeights("models/weights/sample_c2f.weights", "models/weights/sample_c2f.weights",
+    //                      {{"cv1.conv", 1}, {"cv2.conv", 1}, {"m.0.*", 3}});
+    // model.setSparseWeights(true);
+
+    // build的设置(workspace, tactic, DLA等)从配置文件读取, 也可以让它自动选择workspace的大小
+    // model.loadBuildProfile("config/build.profiles", "auto-workspace");
+
+    // 所有模型和精度默认共用models/engine/timing.cache, 可以换一个路径或者限制文件的大小
+    // model.setTimingCache("/tmp/trt/timing.cache", 64 << 20);
+
+    // 把优化前后的graph和TensorRT做的融合导出来, 可以用dot -Tsvg画出来
+    // model.setGraphExport("models/engine/sample_c2f_graph");
+
+    // 按层指定精度, 例如FP16的build里让误差大的层回到FP32
+    // model.setPrecisionPolicy("config/sample_c2f.policy");
+    // 自动搜索: 从全部FP16开始, 把误差贡献最大的层依次放回FP32, 直到output0的1 - cosine小于1e-4
+    // policy::searchModel("models/weights/sample_c2f.weights", Model::precision::FP16,
+    //                     "models/reference/sample_c2f", 1e-4, "config/sample_c2f.policy");
+
+    // 按照manifest一次build所有的模型和精度, 2个worker同时build, 一共最多用2GB
+    // return farm::buildAll("config/build.manifest", 2, 2048ull << 20) ? 0 : 1;
+
+    // 网络结构不变, 只有权重更新的时候, 用refit代替重新build(engine需要用setRefittable(true)来build)
+    // refit::refitEngine("models/engine/sample_c2f_fp16.engine", "models/weights/sample_c2f.weights",
+    //                    "models/weights/sample_c2f_v2.weights", Model::precision::FP16);
+
+    // 不停服务地更新模型: engine文件变化以后在后台加载, 新的请求用新版本, 正在进行的请求在旧版本上做完
+    // reload::HotModel server(reload::engineLoader(Model::precision::FP16));
+    // server.reload("models/engine/sample_c2f_fp16.engine");
+    // server.watch("models/engine/sample_c2f_fp16.engine", 1000);
+    // vector<float> input(25), output;
+    // server.infer(input, output);
+    // server.report();
+
+    // 同一台机器上的采集进程通过共享内存把tensor交给推理进程, 不经过socket和序列化
+    // shm::TensorRing ring;
+    // ring.create("trt_ingest", 16, 3 * 640 * 640 * sizeof(float));
+    // ring.pin();
+    // std::atomic<bool> stop(false);
+    // shm::serve(ring, [&](const shm::Request& r) { /* 直接从r.input做H2D, 结果写到r.output */ return (size_t)0; }, stop);
+    // 和127.0.0.1上的TCP对比吞吐和延迟
+    // shm::report(shm::benchmark("shm", 4, 10000, 3 * 224 * 224 * sizeof(float)));
+    // shm::report(shm::benchmark("tcp", 4, 10000, 3 * 224 * 224 * sizeof(float)));
+
+    // 视频流的pipeline: 每一级一个线程, 实时的源在队列满的时候丢掉最旧的帧, 结束以后打印每一级的占用和等待
+    // pipeline::Pipeline video(std::unique_ptr<pipeline::Source>(new pipeline::SyntheticSource(1280, 720, 30, 900)));
+    // video.add(std::unique_ptr<pipeline::Stage>(new pipeline::PreprocessStage(224, 224)), 4, pipeline::Overflow::DropOldest)
+    //      .add(std::unique_ptr<pipeline::Stage>(new pipeline::InferStage(pipeline::simulatedInfer(5000, 1000))), 2)
+    //      .add(std::unique_ptr<pipeline::Stage>(new pipeline::TopKStage(5)), 4);
+    // video.start();
+    // video.wait();
+    // video.report();
+
+    // 队列的吞吐和正确性(不丢, 不重复, 每个producer的顺序不变), 和mutex + condition_variable对比
+    // for (int threads : {1, 2, 4, 8}) {
+    //     queue::report(queue::benchmark("mpmc", threads, threads, 1000000, 1024, 16));
+    //     queue::report(queue::benchmark("mutex", threads, threads, 1000000, 1024, 16));
+    // }
+    // queue::stress();
+
+    // 多个线程同时写一个指标: 分shard的Counter/Histogram和不分shard的Gauge对比
+    // for (int threads : {1, 2, 4, 8, 16}) {
+    //     metrics::report(metrics::benchmark("counter", threads, 10000000));
+    //     metrics::report(metrics::benchmark("histogram", threads, 10000000));
+    //     metrics::report(metrics::benchmark("gauge", threads, 10000000));
+    // }
+
+    // 多个线程同时刷VERB日志: 每次LOGV在调用线程里的耗时(p50/p99), 吞吐以及队列满的时候丢掉了多少条
+    // for (int threads : {1, 2, 4, 8}) logger::report(logger::benchmark(threads, 1000000));
+
+    // 交互请求(15ms deadline)和批量请求(200ms)混在一起的时候, EDF + 丢弃过期请求和按到达顺序处理的对比
+    // sched::SimConfig sim;
+    // sched::ClassConfig interactive, bulk;
+    // interactive.rate = 150;  interactive.deadlineMs = 15;
+    // bulk.rate        = 1500; bulk.deadlineMs        = 200;
+    // sim.classes = {interactive, bulk};
+    // sched::simulate(sim);
+    // sim.options.policy = sched::Policy::Fifo;
+    // sched::simulate(sim);
+    // 正常负载和过载下各跑一次, 检查请求没有丢失, 并且过载的时候EDF保住了交互请求
+    // sched::check();
+
+    // 带dtype的tensor: 从池子里分配, slice/permute不拷贝, 需要拷贝的时候显式地clone/to
+    // Tensor frames({8, 3, 640, 640}, nvinfer1::DataType::kFLOAT, Location::Pinned);
+    // Tensor nhwc   = frames.slice(0, 0, 4).permute({0, 2, 3, 1}).clone(Location::Host);
+    // Tensor device = frames.to(Location::Device);
+    // LOG("%s -> %s, %s", frames.str().c_str(), nhwc.str().c_str(), device.str().c_str());
+
+    // engine的input直接用half的NHWC(HWC8), 转换在host上拷贝到pinned memory的时候完成, 和逐个元素的循环对比带宽
+    // model.setIOFormats(nvinfer1::TensorFormat::kHWC8, nvinfer1::TensorFormat::kLINEAR, nvinfer1::DataType::kHALF);
+    // layout::report(layout::benchmark());
+
+    // detection head的reshape + permute在CPU上化简成一个IShuffleLayer(reshape + second transpose), network里用shuffle::from
+    // vector<shuffle::Spec> head;
+    // shuffle::simplify({shuffle::reshape({1, 3, 85, -1}), shuffle::transpose({0, 1, 3, 2})}, nvinfer1::Dims4{1, 255, 80, 80}, head);
+    // LOG("%d layer(s): %s", (int)head.size(), shuffle::describe(head[0]).c_str());
+    // 化简前后在CPU上对下标数据执行一遍, 检查结果一样
+    // shuffle::check();
+
+    // build之前在CPU上推导shape并估计activation内存, model.build里超过memory_budget的时候直接失败
+    // shapes::Network net;
+    // int x    = net.addInput("images", nvinfer1::Dims4{1, 3, 640, 640});
+    // int stem = net.addConvolution("stem", x, 16, shapes::window({3, 3}, {2, 2}, {1, 1}));
+    // net.markOutput(net.addPooling("pool", stem, shapes::window({2, 2}, {2, 2})));
+    // shapes::Estimate estimate;
+    // if (shapes::estimate(net, nvinfer1::DataType::kHALF, estimate)) LOG("%s", shapes::summary(estimate).c_str());
+    // 几个sample的network: CPU上推导的每一层的shape和TensorRT的对比
+    // for (auto path : {"models/weights/sample_cbr.weights", "models/weights/sample_resBlock.weights",
+    //                   "models/weights/sample_convBNSiLU.weights", "models/weights/sample_c2f.weights"}) {
+    //     Model(path, Model::precision::FP32).checkShapes();
+    // }
+    // yolov8m的C2F用模板的blocks和parser::addC2F各构建一遍, 比较构建时间, 层名和CPU上推导的shape
+    // network::blocks::check();
+
     if(!model.build()){
         LOGE("fail in building model");
         return 0;
@@ -32,5 +188,8 @@ int main(int argc, char const *argv[])
         LOGE("fail in infering model");
         return 0;
     }
+
+    // 把运行过程中统计的指标以Prometheus的格式导出
+    metrics::exportToFile("metrics.prom");
     return 0;
 }
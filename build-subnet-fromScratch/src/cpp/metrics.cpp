@@ -0,0 +1,378 @@
+#include <chrono>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace metrics {
+
+void* CacheAligned::operator new(size_t size) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, kCacheLine, size) != 0) throw bad_alloc();
+    return ptr;
+}
+
+void* CacheAligned::operator new[](size_t size) {
+    return CacheAligned::operator new(size);
+}
+
+void CacheAligned::operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void CacheAligned::operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+int shardIndex() {
+    static atomic<int> next{0};
+    static thread_local int index = next.fetch_add(1, memory_order_relaxed) % kShards;
+    return index;
+}
+
+/* ------------------------------- Counter / Gauge ------------------------------- */
+
+Counter::Counter(string name, string help) : mName(name), mHelp(help) {}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (int i = 0; i < kShards; i++) {
+        total += mShards[i].value.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+Gauge::Gauge(string name, string help) : mName(name), mHelp(help) {}
+
+/* ------------------------------- Histogram ------------------------------- */
+
+int bucketIndex(uint64_t value) {
+    if (value < (uint64_t)kSubBuckets) {
+        return (int)value;
+    }
+    int e = 63 - __builtin_clzll(value);
+    return (e - kSubBucketBits + 1) * kSubBuckets + (int)(value >> (e - kSubBucketBits)) - kSubBuckets;
+}
+
+uint64_t bucketLowerBound(int index) {
+    if (index < kSubBuckets) {
+        return (uint64_t)index;
+    }
+    int e   = index / kSubBuckets + kSubBucketBits - 1;
+    int sub = index % kSubBuckets;
+    return ((uint64_t)(kSubBuckets + sub)) << (e - kSubBucketBits);
+}
+
+uint64_t bucketUpperBound(int index) {
+    if (index < kSubBuckets) {
+        return (uint64_t)index;
+    }
+    int e = index / kSubBuckets + kSubBucketBits - 1;
+    return bucketLowerBound(index) + ((uint64_t)1 << (e - kSubBucketBits)) - 1;
+}
+
+void HistogramSnapshot::merge(const HistogramSnapshot& other) {
+    for (int i = 0; i < kBuckets; i++) {
+        counts[i] += other.counts[i];
+    }
+    count += other.count;
+    sum   += other.sum;
+    min    = std::min(min, other.min);
+    max    = std::max(max, other.max);
+}
+
+uint64_t HistogramSnapshot::percentile(double p) const {
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            // 用bucket的上界表示, 但不要超过实际观察到的最大值
+            return std::min(std::max(bucketUpperBound(i), min), max);
+        }
+    }
+    return max;
+}
+
+Histogram::Histogram(string name, string help) :
+    mName(name), mHelp(help), mShards(new Shard[kShards])
+{
+    for (int s = 0; s < kShards; s++) {
+        for (int i = 0; i < kBuckets; i++) {
+            mShards[s].counts[i].store(0, memory_order_relaxed);
+        }
+        mShards[s].sum.store(0, memory_order_relaxed);
+        mShards[s].min.store(UINT64_MAX, memory_order_relaxed);
+        mShards[s].max.store(0, memory_order_relaxed);
+    }
+}
+
+void Histogram::record(uint64_t value) {
+    Shard& shard = mShards[shardIndex()];
+    shard.counts[bucketIndex(value)].fetch_add(1, memory_order_relaxed);
+    shard.sum.fetch_add(value, memory_order_relaxed);
+
+    // min/max只有在真的需要更新的时候才做CAS, 稳定以后基本上只有一次load
+    // 一个shard通常只被一个线程写, CAS很少失败; 线程多于kShards的时候可能要重试几次
+    uint64_t cur = shard.min.load(memory_order_relaxed);
+    while (value < cur && !shard.min.compare_exchange_weak(cur, value, memory_order_relaxed)) {}
+    cur = shard.max.load(memory_order_relaxed);
+    while (value > cur && !shard.max.compare_exchange_weak(cur, value, memory_order_relaxed)) {}
+}
+
+HistogramSnapshot Histogram::snapshot() const {
+    HistogramSnapshot snap;
+    for (int s = 0; s < kShards; s++) {
+        const Shard& shard = mShards[s];
+        for (int i = 0; i < kBuckets; i++) {
+            uint64_t c = shard.counts[i].load(memory_order_relaxed);
+            snap.counts[i] += c;
+            snap.count     += c;
+        }
+        snap.sum += shard.sum.load(memory_order_relaxed);
+        snap.min  = std::min(snap.min, shard.min.load(memory_order_relaxed));
+        snap.max  = std::max(snap.max, shard.max.load(memory_order_relaxed));
+    }
+    return snap;
+}
+
+/* ------------------------------- Registry ------------------------------- */
+
+Registry& Registry::instance() {
+    static Registry registry;
+    return registry;
+}
+
+Counter& Registry::counter(const string& name, const string& help) {
+    lock_guard<mutex> lock(mLock);
+    auto& slot = mCounters[name];
+    if (!slot) slot.reset(new Counter(name, help));
+    return *slot;
+}
+
+Gauge& Registry::gauge(const string& name, const string& help) {
+    lock_guard<mutex> lock(mLock);
+    auto& slot = mGauges[name];
+    if (!slot) slot.reset(new Gauge(name, help));
+    return *slot;
+}
+
+Histogram& Registry::histogram(const string& name, const string& help) {
+    lock_guard<mutex> lock(mLock);
+    auto& slot = mHistograms[name];
+    if (!slot) slot.reset(new Histogram(name, help));
+    return *slot;
+}
+
+// Prometheus的histogram要求bucket是累加的, 这里只在每一个2的幂次的边界上输出一个bucket,
+// 否则一个histogram会有上千行. 更细的分布可以通过snapshot直接拿到
+void Registry::writePrometheus(ostream& os) const {
+    lock_guard<mutex> lock(mLock);
+
+    for (auto& item : mCounters) {
+        auto& c = *item.second;
+        os << "# HELP " << c.name() << " " << c.help() << "\n";
+        os << "# TYPE " << c.name() << " counter\n";
+        os << c.name() << " " << c.value() << "\n";
+    }
+
+    for (auto& item : mGauges) {
+        auto& g = *item.second;
+        os << "# HELP " << g.name() << " " << g.help() << "\n";
+        os << "# TYPE " << g.name() << " gauge\n";
+        os << g.name() << " " << g.value() << "\n";
+    }
+
+    for (auto& item : mHistograms) {
+        auto& h   = *item.second;
+        auto snap = h.snapshot();
+        os << "# HELP " << h.name() << " " << h.help() << "\n";
+        os << "# TYPE " << h.name() << " histogram\n";
+
+        uint64_t cumulative = 0;
+        int      last       = 0;
+        for (int i = kBuckets - 1; i >= 0; i--) {
+            if (snap.counts[i] != 0) { last = i; break; }
+        }
+        for (int i = 0; i <= last; i++) {
+            cumulative += snap.counts[i];
+            bool boundary = (i < kSubBuckets) ? (i == kSubBuckets - 1) : (i % kSubBuckets == kSubBuckets - 1);
+            if (boundary || i == last) {
+                os << h.name() << "_bucket{le=\"" << bucketUpperBound(i) << "\"} " << cumulative << "\n";
+            }
+        }
+        os << h.name() << "_bucket{le=\"+Inf\"} " << snap.count << "\n";
+        os << h.name() << "_sum "   << snap.sum   << "\n";
+        os << h.name() << "_count " << snap.count << "\n";
+    }
+}
+
+string Registry::toPrometheus() const {
+    stringstream ss;
+    writePrometheus(ss);
+    return ss.str();
+}
+
+bool exportToFile(const string& path) {
+    string tmp = path + ".tmp";
+    {
+        ofstream f(tmp);
+        if (!f.is_open()) {
+            LOGE("ERROR: failed to open %s", tmp.c_str());
+            return false;
+        }
+        Registry::instance().writePrometheus(f);
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGE("ERROR: failed to rename %s to %s", tmp.c_str(), path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* ------------------------------- Exporter ------------------------------- */
+
+Exporter::~Exporter() {
+    stop();
+}
+
+bool Exporter::start(int port) {
+    mSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (mSocket < 0) {
+        LOGE("ERROR: failed to create metrics socket");
+        return false;
+    }
+
+    int opt = 1;
+    setsockopt(mSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (::bind(mSocket, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(mSocket, 8) < 0) {
+        LOGE("ERROR: failed to listen on 127.0.0.1:%d", port);
+        close(mSocket);
+        mSocket = -1;
+        return false;
+    }
+
+    mRunning = true;
+    mThread  = thread(&Exporter::serve, this);
+    LOG("metrics exporter listening on 127.0.0.1:%d", port);
+    return true;
+}
+
+void Exporter::stop() {
+    if (!mRunning.exchange(false)) return;
+    // 让poll/accept马上返回, 不用等到超时
+    shutdown(mSocket, SHUT_RDWR);
+    if (mThread.joinable()) mThread.join();
+    close(mSocket);
+    mSocket = -1;
+}
+
+void Exporter::serve() {
+    while (mRunning) {
+        // 用poll加超时, 这样stop的时候不会一直卡在accept上
+        pollfd pfd = {mSocket, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0) continue;
+
+        int client = accept(mSocket, nullptr, nullptr);
+        if (client < 0) continue;
+
+        // 连上以后不发请求(或者不读响应)的客户端最多占住serve kClientTimeoutMs
+        timeval timeout;
+        timeout.tv_sec  = kClientTimeoutMs / 1000;
+        timeout.tv_usec = (kClientTimeoutMs % 1000) * 1000;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // 不关心请求的内容, 读掉以后直接返回metrics
+        char request[1024];
+        if (recv(client, request, sizeof(request), 0) < 0) {
+            close(client);
+            continue;
+        }
+
+        string body = Registry::instance().toPrometheus();
+        string head = "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: " + to_string(body.size()) + "\r\n\r\n";
+        string resp = head + body;
+
+        size_t sent = 0;
+        while (sent < resp.size()) {
+            ssize_t n = send(client, resp.data() + sent, resp.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+        close(client);
+    }
+}
+
+/* ------------------------------- benchmark ------------------------------- */
+
+BenchResult benchmark(const string& kind, int threads, uint64_t iterations) {
+    BenchResult result;
+    result.kind       = kind;
+    result.threads    = std::max(threads, 1);
+    result.operations = iterations * result.threads;
+    if (kind != "counter" && kind != "histogram" && kind != "gauge") {
+        LOGE("ERROR: unknown metric %s, should be counter, histogram or gauge", kind.c_str());
+        return result;
+    }
+
+    // 不注册到Registry里, 不会出现在导出的metrics里
+    unique_ptr<Counter>       counter(new Counter("bench_counter", "metrics benchmark"));
+    unique_ptr<Histogram>     histogram(new Histogram("bench_histogram", "metrics benchmark"));
+    unique_ptr<Gauge>         shared(new Gauge("bench_gauge", "metrics benchmark"));
+
+    auto           start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < result.threads; t++) {
+        workers.emplace_back([&kind, &counter, &histogram, &shared, iterations]() {
+            if (kind == "counter") {
+                for (uint64_t i = 0; i < iterations; i++) counter->inc();
+            } else if (kind == "histogram") {
+                for (uint64_t i = 0; i < iterations; i++) histogram->record(i & 0xffff);
+            } else {
+                for (uint64_t i = 0; i < iterations; i++) shared->add(1);
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (kind == "counter")        result.ok = counter->value() == result.operations;
+    else if (kind == "histogram") result.ok = histogram->snapshot().count == result.operations;
+    else                          result.ok = (uint64_t)shared->value() == result.operations;
+    return result;
+}
+
+void report(const BenchResult& r) {
+    double rate = r.seconds > 0 ? r.operations / r.seconds : 0;
+    LOG("%-9s %2d threads: %10.2f M ops/s, %6.1f ns/op per thread, %s", r.kind.c_str(), r.threads, rate / 1e6,
+        rate > 0 ? 1e9 * r.threads / rate : 0.0, r.ok ? "ok" : "FAILED (lost updates)");
+}
+
+} // namespace metrics
@@ -0,0 +1,188 @@
+#ifndef __METRICS_HPP__
+#define __METRICS_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <ostream>
+#include <cstddef>
+
+// 一个简单的metrics模块, 用来统计部署时需要关心的一些数据:
+//     请求数, batch大小, 队列深度, H2D的数据量, engine的加载次数, cache命中次数等等
+// 设计上的几个点:
+//     1. 热路径没有锁: inc是一次relaxed的fetch_add, record是两次fetch_add加上min/max需要更新时的CAS循环.
+//        CAS失败会重试, 所以record是lock-free而不是wait-free(线程数超过kShards的时候shard是共享的)
+//     2. 为了避免多线程在同一个cache line上打架, 每个指标按线程分成kShards份, 读的时候再合并
+//     3. histogram使用log-linear(HDR)的分桶方式, 相对误差固定在1/16以内, snapshot之间可以merge
+//     4. 导出的格式是Prometheus的text format, 可以写到文件, 也可以在本地端口上提供给Prometheus抓取
+
+namespace metrics {
+
+static const int kShards        = 16;
+static const int kCacheLine     = 64;
+
+// HDR histogram的参数: 每一个2的幂次区间被线性地分成2^kSubBucketBits份
+static const int kSubBucketBits = 4;
+static const int kSubBuckets    = 1 << kSubBucketBits;
+static const int kBuckets       = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+// 当前线程对应的shard, 第一次调用的时候按照round-robin分配
+int shardIndex();
+
+// C++11的operator new不保证超过16字节的对齐, 需要按cache line对齐的对象从这里继承
+struct CacheAligned {
+    static void* operator new(size_t size);
+    static void* operator new[](size_t size);
+    static void  operator delete(void* ptr) noexcept;
+    static void  operator delete[](void* ptr) noexcept;
+};
+
+struct alignas(kCacheLine) PaddedCounter {
+    std::atomic<uint64_t> value{0};
+};
+
+class Counter : public CacheAligned {
+public:
+    Counter(std::string name, std::string help);
+    void inc(uint64_t n = 1) {
+        mShards[shardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const;
+    const std::string& name() const { return mName; }
+    const std::string& help() const { return mHelp; }
+
+private:
+    std::string   mName;
+    std::string   mHelp;
+    PaddedCounter mShards[kShards];
+};
+
+// gauge表示的是一个当前值(比如队列深度), 所以不分shard, 直接用一个atomic
+class Gauge : public CacheAligned {
+public:
+    Gauge(std::string name, std::string help);
+    void set(int64_t v) { mValue.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { mValue.fetch_add(n, std::memory_order_relaxed); }
+    void sub(int64_t n) { mValue.fetch_sub(n, std::memory_order_relaxed); }
+    int64_t value() const { return mValue.load(std::memory_order_relaxed); }
+    const std::string& name() const { return mName; }
+    const std::string& help() const { return mHelp; }
+
+private:
+    std::string                       mName;
+    std::string                       mHelp;
+    alignas(kCacheLine) std::atomic<int64_t> mValue{0};
+};
+
+// value -> bucket的映射:
+//     v <  2^S:  index = v
+//     v >= 2^S:  e = floor(log2(v)), index = (e - S + 1) * 2^S + (v >> (e - S)) - 2^S
+int      bucketIndex(uint64_t value);
+uint64_t bucketLowerBound(int index);
+uint64_t bucketUpperBound(int index);
+
+// histogram的一个快照, 可以和其他快照(比如其他进程, 其他时间段)合并
+struct HistogramSnapshot {
+    std::vector<uint64_t> counts;
+    uint64_t count = 0;
+    uint64_t sum   = 0;
+    uint64_t min   = UINT64_MAX;
+    uint64_t max   = 0;
+
+    HistogramSnapshot() : counts(kBuckets, 0) {}
+    void     merge(const HistogramSnapshot& other);
+    uint64_t percentile(double p) const;
+    double   mean() const { return count == 0 ? 0.0 : (double)sum / count; }
+};
+
+class Histogram {
+public:
+    Histogram(std::string name, std::string help);
+    void record(uint64_t value);
+    HistogramSnapshot snapshot() const;
+    const std::string& name() const { return mName; }
+    const std::string& help() const { return mHelp; }
+
+private:
+    struct alignas(kCacheLine) Shard : public CacheAligned {
+        std::atomic<uint64_t> counts[kBuckets];
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> min;
+        std::atomic<uint64_t> max;
+    };
+
+    std::string              mName;
+    std::string              mHelp;
+    std::unique_ptr<Shard[]> mShards;
+};
+
+// 所有指标的注册表, 注册是冷路径(加锁), 返回的引用在程序运行期间一直有效
+// 同名的指标只会创建一次, 所以热路径上可以用static引用缓存下来:
+//     static auto& requests = metrics::Registry::instance().counter("trt_infer_requests_total", "...");
+//     requests.inc();
+class Registry {
+public:
+    static Registry& instance();
+
+    Counter&   counter(const std::string& name, const std::string& help);
+    Gauge&     gauge(const std::string& name, const std::string& help);
+    Histogram& histogram(const std::string& name, const std::string& help);
+
+    // 以Prometheus text format导出所有的指标
+    void        writePrometheus(std::ostream& os) const;
+    std::string toPrometheus() const;
+
+private:
+    Registry() {}
+    mutable std::mutex                                 mLock;
+    std::map<std::string, std::unique_ptr<Counter>>    mCounters;
+    std::map<std::string, std::unique_ptr<Gauge>>      mGauges;
+    std::map<std::string, std::unique_ptr<Histogram>>  mHistograms;
+};
+
+// 先写到临时文件再rename, 这样node_exporter的textfile collector不会读到写了一半的文件
+bool exportToFile(const std::string& path);
+
+// 在127.0.0.1:port上提供一个最简单的HTTP服务, 任何请求都返回当前的metrics.
+// 一个连接最多等kClientTimeoutMs, 不发请求的客户端不会卡住serve; stop的时候shutdown监听的socket
+class Exporter {
+public:
+    Exporter() {}
+    ~Exporter();
+    bool start(int port);
+    void stop();
+
+private:
+    void serve();
+
+private:
+    static const int  kClientTimeoutMs = 1000;
+
+    int               mSocket = -1;
+    std::atomic<bool> mRunning{false};
+    std::thread       mThread;
+};
+
+/* ------------------------------- benchmark ------------------------------- */
+
+struct BenchResult {
+    std::string kind;
+    int         threads    = 0;
+    uint64_t    operations = 0;     // 所有线程一共的次数
+    double      seconds    = 0;
+    bool        ok         = false; // 读出来的总数和写进去的一样
+};
+
+// threads个线程同时写同一个指标, 每个线程iterations次, 用来看分shard以后的多线程开销
+// kind: counter(Counter::inc) | histogram(Histogram::record) | gauge(Gauge::add, 不分shard的一个atomic, 用来对比)
+BenchResult benchmark(const std::string& kind, int threads, uint64_t iterations);
+void        report(const BenchResult& result);
+
+} // namespace metrics
+
+#endif //__METRICS_HPP__
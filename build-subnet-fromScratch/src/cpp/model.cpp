@@ -13,6 +13,21 @@
 #include "cuda_runtime.h"
 #include "math.h"
 #include "network.hpp"
+#include "metrics.hpp"
+#include "npy.hpp"
+#include "diff.hpp"
+#include "calibrator.hpp"
+#include "quant.hpp"
+#include "half.hpp"
+#include "timingcache.hpp"
+#include "graph.hpp"
+#include "policy.hpp"
+#include "buildconfig.hpp"
+#include "tensor.hpp"
+#include "layout.hpp"
+#include "shapes.hpp"
+#include <chrono>
+#include <set>
 
 float input_5x5[] = {
     0.7576, 0.2793, 0.4031, 0.7347, 0.0293,
@@ -27,22 +42,6 @@ float input_1x5[] = {
 
 using namespace std;
 
-class Logger : public nvinfer1::ILogger{
-public:
-    virtual void log (Severity severity, const char* msg) noexcept override{
-        string str;
-        switch (severity){
-            case Severity::kINTERNAL_ERROR: str = RED    "[fatal]: " CLEAR; break;
-            case Severity::kERROR:          str = RED    "[error]: " CLEAR; break;
-            case Severity::kWARNING:        str = BLUE   "[warn]: "  CLEAR; break;
-            case Severity::kINFO:           str = YELLOW "[info]: "  CLEAR; break;
-            case Severity::kVERBOSE:        str = PURPLE "[verb]: "  CLEAR; break;
-        }
-        if (severity <= Severity::kINFO)
-            cout << str << string(msg) << endl;
-    }
-};
-
 struct InferDeleter
 {
     template <typename T>
@@ -56,6 +55,40 @@ template <typename T>
 // using make_unique = std::unique_ptr<T, InferDeleter>;
 using make_unique = std::unique_ptr<T>;
 
+// 部署时需要关心的一些指标, 具体的说明参考metrics.hpp
+static metrics::Counter& engineCacheHits() {
+    static auto& c = metrics::Registry::instance().counter("trt_engine_cache_hits_total", "number of builds skipped because the engine file already exists");
+    return c;
+}
+
+static metrics::Counter& engineLoads() {
+    static auto& c = metrics::Registry::instance().counter("trt_engine_loads_total", "number of deserialized engines");
+    return c;
+}
+
+static metrics::Counter& inferRequests() {
+    static auto& c = metrics::Registry::instance().counter("trt_infer_requests_total", "number of inference requests");
+    return c;
+}
+
+static metrics::Counter& h2dBytes() {
+    static auto& c = metrics::Registry::instance().counter("trt_h2d_bytes_total", "bytes copied from host to device");
+    return c;
+}
+
+static metrics::Histogram& batchSizes() {
+    static auto& h = metrics::Registry::instance().histogram("trt_infer_batch_size", "batch size of each inference request");
+    return h;
+}
+
+static metrics::Histogram& inferLatency() {
+    static auto& h = metrics::Registry::instance().histogram("trt_infer_latency_us", "end-to-end latency of each inference request in microseconds");
+    return h;
+}
+
+// 超过这个数量的tensor只打印统计信息, 否则一行日志会太长
+static const int64_t kPrintLimit = 100;
+
 Model::Model(string path, precision prec){
     if (getFileType(path) == ".onnx")
         mOnnxPath = path;
@@ -73,6 +106,20 @@ Model::Model(string path, precision prec){
     }
 
     mEnginePath = getEnginePath(path, prec);
+    // 所有的模型和精度共用一个timing cache
+    mTimingCachePath = mEnginePath.substr(0, mEnginePath.rfind("/") + 1) + "timing.cache";
+}
+
+void Model::setDebugTensors(vector<string> patterns) {
+    mDebugTensors = patterns;
+#ifdef DEBUG_TENSORS
+    // 带debug output的engine和正常的engine分开保存
+    if (!mDebugTensors.empty() && mEnginePath.find("_debug.engine") == string::npos) {
+        mEnginePath = mEnginePath.substr(0, mEnginePath.rfind(".engine")) + "_debug.engine";
+    }
+#else
+    LOGW("debug tensors are only available in debug build (DEBUG=1)");
+#endif
 }
 
 // decode一个weights文件，并保存到map中
@@ -81,47 +128,47 @@ Model::Model(string path, precision prec){
 //    [name][len][weights value in hex mode]
 //    [name][len][weights value in hex mode]
 //    ...
+// 8位的hex是float, 4位的hex是half(fp16::convertWeights转换过的), parse在quant::readWeights里
 map<string, nvinfer1::Weights> Model::loadWeights(){
-    ifstream f;
-    if (!fileExists(mWtsPath)){ 
-        LOGE("ERROR: %s not found", mWtsPath.c_str());
-    }
-
-    f.open(mWtsPath);
-
-    int32_t size;
     map<string, nvinfer1::Weights> maps;
-    f >> size;
+    vector<quant::WeightEntry> entries;
 
-    if (size <= 0) {
+    if (!quant::readWeights(mWtsPath, entries) || entries.empty()) {
         LOGE("ERROR: no weights found in %s", mWtsPath.c_str());
+        return maps;
     }
 
-    while (size > 0) {
+    for (auto& entry : entries) {
         nvinfer1::Weights weight;
-        string name;
-        int weight_length;
+        int weight_length = entry.bits.size();
 
-        f >> name;
-        f >> std::dec >> weight_length;
-
-        uint32_t* values = (uint32_t*)malloc(sizeof(uint32_t) * weight_length);
-        for (int i = 0; i < weight_length; i ++) {
-            f >> std::hex >> values[i];
+        if (entry.type == nvinfer1::DataType::kHALF) {
+            uint16_t* values = (uint16_t*)malloc(sizeof(uint16_t) * weight_length);
+            for (int i = 0; i < weight_length; i ++) {
+                values[i] = (uint16_t)entry.bits[i];
+            }
+            weight.values = values;
+        } else {
+            uint32_t* values = (uint32_t*)malloc(sizeof(uint32_t) * weight_length);
+            memcpy(values, entry.bits.data(), sizeof(uint32_t) * weight_length);
+            weight.values = values;
         }
-
-        weight.type = nvinfer1::DataType::kFLOAT;
+        weight.type  = entry.type;
         weight.count = weight_length;
-        weight.values = values;
-
-        maps[name] = weight;
 
-        size --;
+        maps[entry.name] = weight;
     }
 
     return maps;
 }
 
+void Model::releaseWeights() {
+    for (auto& mem : mWts) {
+        free((void*) (mem.second.values));
+    }
+    mWts.clear();
+}
+
 bool Model::build() {
     if (mOnnxPath != "") {
         return build_from_onnx();
@@ -133,59 +180,77 @@ bool Model::build() {
 bool Model::build_from_weights(){
     if (fileExists(mEnginePath)){
         LOG("%s has been generated!", mEnginePath.c_str());
+        engineCacheHits().inc();
         return true;
     } else {
         LOG("%s not found. Building engine...", mEnginePath.c_str());
     }
 
+    if (!mBuildProfile.shapes.empty()) {
+        LOGW("%s: the network built from weights has static shapes, profiles are ignored", mWtsPath.c_str());
+    }
+
+    PhaseTimer timer;
+    timer.start("load weights");
     mWts = loadWeights();
+    // mWts只在build的时候用, buildEngine/精度策略/build profile等任何一步失败提前返回的时候也要释放
+    WeightsGuard guard{this};
+    if (mWts.empty()) {
+        return false;
+    }
+
+    // FP16的时候conv的kernel直接以kHALF交给TensorRT, 顺便检查有没有溢出
+    if (mPrecision == nvinfer1::DataType::kHALF) {
+        fp16::toHalf(mWts, {"*conv*.weight"});
+    }
 
     // 这里和之前的创建方式是一样的
+    timer.start("create network");
     Logger logger;
     auto builder       = make_unique<nvinfer1::IBuilder>(nvinfer1::createInferBuilder(logger));
     auto config        = make_unique<nvinfer1::IBuilderConfig>(builder->createBuilderConfig());
     auto network       = make_unique<nvinfer1::INetworkDefinition>(builder->createNetworkV2(1));
 
-    // 根据不同的网络架构创建不同的TensorRT网络，这里使用几个简单的例子
-    if (mWtsPath == "models/weights/sample_cbr.weights") {
-        network::build_cbr(*network, mPrecision, mWts);
-    } else if (mWtsPath == "models/weights/sample_resBlock.weights") {
-        network::build_resBlock(*network, mPrecision, mWts);
-    } else if (mWtsPath == "models/weights/sample_convBNSiLU.weights") {
-        network::build_convBNSiLU(*network, mPrecision, mWts);
-    } else if (mWtsPath == "models/weights/sample_c2f.weights") {
-        network::build_C2F(*network, mPrecision, mWts);
-    } else {
+    if (!createNetwork(*network)) {
         return false;
     }
+    buildcfg::applyIO(mBuildProfile, *network);
 
-    // 接下来的事情也是一样的
-    config->setMaxWorkspaceSize(1<<28);
-    config->setProfilingVerbosity(nvinfer1::ProfilingVerbosity::kDETAILED);
-    builder->setMaxBatchSize(1);
+#ifdef DEBUG_TENSORS
+    if (!mDebugTensors.empty()) {
+        LOG("marked %d debug outputs", diff::markDebugOutputs(*network, mDebugTensors));
+    }
+#endif
 
-    // 设置量化参数
-    // 注意一点的是，kPREFER_PRECISION_CONSTRAINTS是用来保证所有的层是按照指定的精度计算
-    // 如果没有的话，TensorRT会根据计算效率有可能不做转换
-    // 这个是配合layer的精度指定使用的
-    
+    // build之前在CPU上估计activation内存, 明显放不下的时候不用等builder
+    if (!checkMemoryEstimate(*network)) {
+        return false;
+    }
+
+    // 接下来的事情也是一样的, workspace, tactic, DLA, precision constraints等由build profile设置
+    buildcfg::apply(mBuildProfile, *builder, *config);
+    LOG("build profile %s", buildcfg::describe(mBuildProfile).c_str());
+
+    // calibrator需要一直活到build结束
+    unique_ptr<nvinfer1::IInt8Calibrator> calibrator;
     if (builder->platformHasFastFp16() && mPrecision == nvinfer1::DataType::kHALF) {
         config->setFlag(nvinfer1::BuilderFlag::kFP16);
-        config->setFlag(nvinfer1::BuilderFlag::kPREFER_PRECISION_CONSTRAINTS);
     } else if (builder->platformHasFastInt8() && mPrecision == nvinfer1::DataType::kINT8) {
         config->setFlag(nvinfer1::BuilderFlag::kINT8);
-        config->setFlag(nvinfer1::BuilderFlag::kPREFER_PRECISION_CONSTRAINTS);
+        if (!createCalibrator(*network, nullptr, calibrator)) {
+            return false;
+        }
+        config->setInt8Calibrator(calibrator.get());
     }
 
-    auto engine        = make_unique<nvinfer1::ICudaEngine>(builder->buildEngineWithConfig(*network, *config));
-    auto plan          = builder->buildSerializedNetwork(*network, *config);
-    auto runtime       = make_unique<nvinfer1::IRuntime>(nvinfer1::createInferRuntime(logger));
-
-    auto f = fopen(mEnginePath.c_str(), "wb");
-    fwrite(plan->data(), 1, plan->size(), f);
-    fclose(f);
+    // 按层的精度策略覆盖上面统一设置的精度
+    if (!applyPrecisionPolicy(*builder, *network, *config)) {
+        return false;
+    }
 
-    mEngine            = shared_ptr<nvinfer1::ICudaEngine>(runtime->deserializeCudaEngine(plan->data(), plan->size()));
+    if (!buildEngine(*builder, *network, *config, logger, timer)) {
+        return false;
+    }
     mInputDims         = network->getInput(0)->getDimensions();
     mOutputDims        = network->getOutput(0)->getDimensions();
 
@@ -196,52 +261,424 @@ bool Model::build_from_weights(){
     LOG("After TensorRT optimization");
     print_network(*network, true);
 
-    // 最后把map给free掉
-    for (auto& mem : mWts) {
-        free((void*) (mem.second.values));
+    // 优化前后的graph以及融合的对应关系导出成JSON和DOT
+    if (!mGraphPrefix.empty()) {
+        graph::exportGraph(graph::fromNetwork(*network), graph::fromEngine(*mEngine), mGraphPrefix);
+    }
+
+    timer.report("Finished building engine");
+    return true;
+}
+
+// 记录所有的层名, 再把按层的精度策略(mPolicyPath)应用到network上
+bool Model::applyPrecisionPolicy(nvinfer1::IBuilder &builder, nvinfer1::INetworkDefinition &network,
+                                 nvinfer1::IBuilderConfig &config) {
+    mLayerNames.clear();
+    for (int i = 0; i < network.getNbLayers(); i++) {
+        mLayerNames.push_back(network.getLayer(i)->getName());
+    }
+    if (mPolicyPath.empty()) return true;
+
+    policy::PrecisionPolicy policy;
+    if (!policy.load(mPolicyPath)) return false;
+
+    // FP32的build里也可以让一部分层用FP16, INT8的层需要calibration, 只在INT8的build里有效
+    if (policy.uses(nvinfer1::DataType::kHALF) && builder.platformHasFastFp16()) {
+        config.setFlag(nvinfer1::BuilderFlag::kFP16);
+    }
+    // build profile里是none的时候, policy也需要constraints才会生效
+    if (!config.getFlag(nvinfer1::BuilderFlag::kOBEY_PRECISION_CONSTRAINTS)) {
+        config.setFlag(nvinfer1::BuilderFlag::kPREFER_PRECISION_CONSTRAINTS);
+    }
+    int count = policy.apply(network, config.getFlag(nvinfer1::BuilderFlag::kINT8));
+    LOG("precision policy %s is applied to %d layers", mPolicyPath.c_str(), count);
+    return true;
+}
+
+// 根据不同的网络架构创建不同的TensorRT网络，这里使用几个简单的例子
+bool Model::createNetwork(nvinfer1::INetworkDefinition &network) {
+    bool created;
+    if (mWtsPath == "models/weights/sample_cbr.weights") {
+        created = network::build_cbr(network, mPrecision, mWts);
+    } else if (mWtsPath == "models/weights/sample_resBlock.weights") {
+        created = network::build_resBlock(network, mPrecision, mWts);
+    } else if (mWtsPath == "models/weights/sample_convBNSiLU.weights") {
+        created = network::build_convBNSiLU(network, mPrecision, mWts);
+    } else if (mWtsPath == "models/weights/sample_c2f.weights") {
+        created = network::build_C2F(network, mPrecision, mWts);
+    } else {
+        LOGE("ERROR: no network is defined for %s", mWtsPath.c_str());
+        return false;
+    }
+    if (!created) {
+        LOGE("ERROR: failed to create the network for %s", mWtsPath.c_str());
+        return false;
     }
-    LOG("Finished building engine");
+    // 中间的tensor用层名命名, calibration cache和逐层dump的名字才能对上
+    int named = network::nameTensors(network);
+    LOGV("named %d tensors after their layers", named);
+    return true;
+}
+
+bool Model::checkShapes() {
+    if (mWtsPath.empty()) {
+        LOGE("ERROR: checkShapes only supports networks built from weights");
+        return false;
+    }
+    mWts = loadWeights();
+    WeightsGuard guard{this};
+    if (mWts.empty()) {
+        return false;
+    }
+
+    Logger logger;
+    auto builder = make_unique<nvinfer1::IBuilder>(nvinfer1::createInferBuilder(logger));
+    auto network = make_unique<nvinfer1::INetworkDefinition>(builder->createNetworkV2(1));
+    if (!createNetwork(*network)) {
+        return false;
+    }
+
+    shapes::Network  desc;
+    shapes::Estimate estimate;
+    if (!shapes::check(*network, desc) || !shapes::estimate(desc, mPrecision, estimate)) {
+        LOGE("ERROR: shape check failed for %s", mWtsPath.c_str());
+        return false;
+    }
+    LOG("%s: %d layers match TensorRT, %s", mWtsPath.c_str(), (int)desc.layers.size(), shapes::summary(estimate).c_str());
+    return true;
+}
+
+// shape推导或者估计失败(不支持的层等)的时候只打印警告, 照常build
+bool Model::checkMemoryEstimate(nvinfer1::INetworkDefinition &network) {
+    shapes::Network desc;
+    if (!shapes::fromNetwork(network, desc)) {
+        LOGW("skip the memory estimate, the network has unsupported layers");
+        return true;
+    }
+    // 动态shape的input按profile里最大的shape估计
+    for (auto& p : mBuildProfile.shapes) {
+        int index = desc.find(p.input);
+        if (index >= 0 && desc.tensors[index].producer < 0) desc.tensors[index].dims = p.max;
+    }
+
+    shapes::Estimate estimate;
+    if (!shapes::estimate(desc, mPrecision, estimate)) {
+        LOGW("skip the memory estimate, shape inference failed");
+        return true;
+    }
+    LOG("memory estimate: %s", shapes::summary(estimate).c_str());
+
+    if (mBuildProfile.memoryBudget == 0) return true;
+    // activation的peak是按不融合, 不复用input估计的, 只会偏大, 超了只提醒, 真正的限制由autoSizeWorkspace保证.
+    // weights和input/output不管怎么优化都要占着, 这部分超了才不可能放得下
+    size_t fixedBytes = (size_t)(estimate.weightsBytes + estimate.ioBytes);
+    if (fixedBytes > mBuildProfile.memoryBudget) {
+        LOGE("ERROR: weights and I/O need %s, more than the memory budget %s",
+             buildcfg::formatSize(fixedBytes).c_str(), buildcfg::formatSize(mBuildProfile.memoryBudget).c_str());
+        return false;
+    }
+    if ((size_t)estimate.peakBytes > mBuildProfile.memoryBudget) {
+        LOGW("estimated activation peak %s at %s exceeds the memory budget %s, the estimate is an upper bound",
+             buildcfg::formatSize(estimate.peakBytes).c_str(), estimate.peakLayer.c_str(),
+             buildcfg::formatSize(mBuildProfile.memoryBudget).c_str());
+    }
+    return true;
+}
+
+bool Model::loadBuildProfile(string path, string name) {
+    buildcfg::ProfileSet profiles;
+    buildcfg::BuildProfile profile;
+    if (!profiles.load(path) || !profiles.resolve(name, profile)) {
+        return false;
+    }
+    mBuildProfile = profile;
+    return true;
+}
+
+// 用opt的shape跑几次executeV2, 只用来比较不同workspace的engine, 不需要真实的数据
+static bool timeEngine(nvinfer1::ICudaEngine &engine, const vector<ShapeProfile> &shapes, double &latencyMs) {
+    const int kWarmup = 3;
+    const int kIters  = 20;
+    auto context = make_unique<nvinfer1::IExecutionContext>(engine.createExecutionContext());
+    if (context == nullptr) return false;
+    for (auto& s : shapes) {
+        int index = engine.getBindingIndex(s.input.c_str());
+        if (index >= 0) context->setBindingDimensions(index, s.opt);
+    }
+
+    bool ok = true;
+    vector<Tensor> buffers;
+    vector<void*>  bindings(engine.getNbBindings(), nullptr);
+    for (size_t i = 0; i < bindings.size() && ok; i++) {
+        auto dims = context->getBindingDimensions(i);
+        ok = getDimSize(dims) > 0;
+        if (!ok) break;
+        buffers.push_back(Tensor::fromDims(dims, engine.getBindingDataType(i), Location::Device));
+        bindings[i] = buffers.back().data();
+        ok = bindings[i] != nullptr;
+    }
+    for (int i = 0; i < kWarmup && ok; i++) {
+        ok = context->executeV2(bindings.data());
+    }
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < kIters && ok; i++) {
+        ok = context->executeV2(bindings.data());
+    }
+    latencyMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / kIters;
+    return ok;
+}
+
+// 每个候选的workspace都build一次, 留下满足memory budget里最快的plan
+unique_ptr<nvinfer1::IHostMemory> Model::autoSizeWorkspace(nvinfer1::IBuilder &builder, nvinfer1::INetworkDefinition &network,
+                                                           nvinfer1::IBuilderConfig &config, nvinfer1::ILogger &logger,
+                                                           PhaseTimer &timer) {
+    auto runtime = make_unique<nvinfer1::IRuntime>(nvinfer1::createInferRuntime(logger));
+    // 只留下目前最好的plan, 每个plan都是一个完整的engine, 全部留着的话host memory是候选个数倍
+    unique_ptr<nvinfer1::IHostMemory> best;
+    buildcfg::WorkspaceTrial          bestTrial;
+    auto trial = [&](size_t workspace, buildcfg::WorkspaceTrial& t) {
+        timer.start("build (workspace " + buildcfg::formatSize(workspace) + ")");
+        config.setMemoryPoolLimit(nvinfer1::MemoryPoolType::kWORKSPACE, workspace);
+        unique_ptr<nvinfer1::IHostMemory> plan(builder.buildSerializedNetwork(network, config));
+        if (plan == nullptr) return false;
+        auto engine = make_unique<nvinfer1::ICudaEngine>(runtime->deserializeCudaEngine(plan->data(), plan->size()));
+        if (engine == nullptr) return false;
+        t.deviceMemory = engine->getDeviceMemorySize();
+        if (!timeEngine(*engine, mBuildProfile.shapes, t.latencyMs)) return false;
+        if (buildcfg::improves(t, best ? &bestTrial : nullptr, mBuildProfile.memoryBudget)) {
+            best      = move(plan);
+            bestTrial = t;
+        }
+        return true;
+    };
+
+    vector<buildcfg::WorkspaceTrial> trials;
+    int picked = buildcfg::pickWorkspace(mBuildProfile.workspaceCandidates, mBuildProfile.memoryBudget, trial, trials);
+    timer.stop();
+    buildcfg::reportWorkspace(trials, picked, mBuildProfile.memoryBudget);
+    if (picked < 0) {
+        LOGE("ERROR: none of the workspace candidates fits the memory budget %s",
+             buildcfg::formatSize(mBuildProfile.memoryBudget).c_str());
+        return nullptr;
+    }
+
+    // improves和pickWorkspace的选择是一样的, 留下来的就是选中的plan
+    size_t workspace = trials[picked].workspace;
+    if (bestTrial.workspace != workspace) {
+        LOGE("ERROR: kept the plan for workspace %s, but %s was picked",
+             buildcfg::formatSize(bestTrial.workspace).c_str(), buildcfg::formatSize(workspace).c_str());
+        return nullptr;
+    }
+    config.setMemoryPoolLimit(nvinfer1::MemoryPoolType::kWORKSPACE, workspace);
+    return best;
+}
+
+// 两种build方式共用的部分: build一次得到序列化的plan, 写到文件里再deserialize
+// 以前会先buildEngineWithConfig再buildSerializedNetwork, 同一个engine被build了两次
+bool Model::buildEngine(nvinfer1::IBuilder &builder, nvinfer1::INetworkDefinition &network,
+                        nvinfer1::IBuilderConfig &config, nvinfer1::ILogger &logger, PhaseTimer &timer) {
+    auto key = timingcache::currentKey();
+    unique_ptr<nvinfer1::ITimingCache> timingCache;
+    if (!mTimingCachePath.empty()) {
+        timer.start("load timing cache");
+        vector<char> blob;
+        if (timingcache::load(mTimingCachePath, key, blob)) {
+            LOG("using timing cache %s (%zu bytes)", mTimingCachePath.c_str(), blob.size());
+        }
+        timingCache.reset(config.createTimingCache(blob.data(), blob.size()));
+        if (timingCache == nullptr || !config.setTimingCache(*timingCache, false)) {
+            LOGW("failed to set timing cache, tactics will be timed from scratch");
+            timingCache.reset();
+        }
+    }
+
+    unique_ptr<nvinfer1::IHostMemory> plan;
+    if (mBuildProfile.autoWorkspace) {
+        plan = autoSizeWorkspace(builder, network, config, logger, timer);
+    } else {
+        timer.start("build");
+        plan.reset(builder.buildSerializedNetwork(network, config));
+    }
+    if (plan == nullptr) {
+        LOGE("ERROR: failed to build %s", mEnginePath.c_str());
+        return false;
+    }
+
+    // 加锁以后和文件里已有的cache合并, 其它模型或者精度build出来的tactic也会保留
+    if (timingCache != nullptr) {
+        timer.start("save timing cache");
+        auto mem = make_unique<nvinfer1::IHostMemory>(config.getTimingCache()->serialize());
+        vector<char> mine((const char*)mem->data(), (const char*)mem->data() + mem->size());
+        timingcache::save(mTimingCachePath, key, mine, [&](const vector<char>& existing, const vector<char>& current, vector<char>& merged) {
+            auto a = make_unique<nvinfer1::ITimingCache>(config.createTimingCache(existing.data(), existing.size()));
+            auto b = make_unique<nvinfer1::ITimingCache>(config.createTimingCache(current.data(), current.size()));
+            if (a == nullptr || b == nullptr || !a->combine(*b, false)) return false;
+            auto out = make_unique<nvinfer1::IHostMemory>(a->serialize());
+            merged.assign((const char*)out->data(), (const char*)out->data() + out->size());
+            return true;
+        }, mTimingCacheLimit);
+    }
+
+    // 先写到临时文件再rename, 写到一半失败(磁盘满)的时候不会留下一个截断的engine, 下次启动还会去加载它
+    timer.start("write engine");
+    string tmp = mEnginePath + ".tmp";
+    auto   f   = fopen(tmp.c_str(), "wb");
+    if (f == nullptr) {
+        LOGE("ERROR: failed to open %s", tmp.c_str());
+        return false;
+    }
+    bool written = fwrite(plan->data(), 1, plan->size(), f) == plan->size();
+    written = (fclose(f) == 0) && written;
+    if (!written || rename(tmp.c_str(), mEnginePath.c_str()) != 0) {
+        LOGE("ERROR: failed to write %s", mEnginePath.c_str());
+        remove(tmp.c_str());
+        return false;
+    }
+
+    timer.start("deserialize");
+    auto runtime       = make_unique<nvinfer1::IRuntime>(nvinfer1::createInferRuntime(logger));
+    mEngine            = shared_ptr<nvinfer1::ICudaEngine>(runtime->deserializeCudaEngine(plan->data(), plan->size()));
+    engineLoads().inc();
+    timer.stop();
+    return mEngine != nullptr;
+}
+
+string Model::calibrationCachePath() const {
+    return getCalibrationCachePath(mEnginePath);
+}
+
+// calibration的cache和engine放在一起, 例如models/engine/sample_c2f_int8.calib(getCalibrationCachePath)
+// cache存在的时候TensorRT会直接使用cache, 不会再去读calibration的数据
+// input是动态shape的时候, calibration的batch按optimization profile的kOPT的shape
+bool Model::createCalibrator(nvinfer1::INetworkDefinition &network, const nvinfer1::IOptimizationProfile* profile,
+                             unique_ptr<nvinfer1::IInt8Calibrator> &calibrator) {
+    calibrator.reset();
+    // weights里已经有activation的scale的时候, parser会插入Q/DQ(显式量化), 不需要calibrator
+    // 这时没有calibrator, 有weight scale但是没有Q/DQ的conv拿不到INT8的scale, 直接让build失败
+    for (auto& w : mWts) {
+        const string suffix = ".act_scale";
+        if (w.first.size() > suffix.size() && w.first.compare(w.first.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            set<string> names;
+            for (int i = 0; i < network.getNbLayers(); i++) names.insert(network.getLayer(i)->getName());
+            int missing = 0;
+            for (int i = 0; i < network.getNbLayers(); i++) {
+                auto   layer = network.getLayer(i);
+                string name  = layer->getName();
+                if (layer->getType() != nvinfer1::LayerType::kCONVOLUTION) continue;
+                if (mWts.count(name + ".weight_scale") == 0 || names.count(name + ".input.dequant") != 0) continue;
+                LOGE("ERROR: %s has a weight scale but no activation scale for its input", name.c_str());
+                missing++;
+            }
+            if (missing > 0) {
+                LOGE("ERROR: %d conv layers are not covered by the activation scales in %s, "
+                     "rerun quant::addQuantScales with a calibration cache that covers them", missing, mWtsPath.c_str());
+                return false;
+            }
+            LOG("found activation scales in %s, using explicit quantization", mWtsPath.c_str());
+            return true;
+        }
+    }
+
+    string cachePath = calibrationCachePath();
+
+    shared_ptr<calib::CalibrationDataset> dataset;
+    if (!mCalibDir.empty()) {
+        auto input = network.getInput(0);
+        auto dims  = input->getDimensions();
+        if (profile != nullptr) {
+            auto opt = profile->getDimensions(input->getName(), nvinfer1::OptProfileSelector::kOPT);
+            if (opt.nbDims == dims.nbDims) dims = opt;
+        }
+        for (int i = 0; i < dims.nbDims; i++) {
+            if (dims.d[i] < 0) {
+                LOGE("ERROR: calibration input %s has dynamic shape %s, set its kOPT shape in the profile",
+                     input->getName(), printDims(dims).c_str());
+                return false;
+            }
+        }
+        dataset = make_shared<calib::CalibrationDataset>(mCalibDir, dims);
+    } else if (!fileExists(cachePath)) {
+        LOGW("neither calibration data nor %s is provided, INT8 scales will be missing", cachePath.c_str());
+    }
+    calibrator.reset(new calib::Int8EntropyCalibrator(dataset, cachePath));
     return true;
 }
 
 bool Model::build_from_onnx(){
     if (fileExists(mEnginePath)){
         LOG("%s has been generated!", mEnginePath.c_str());
+        engineCacheHits().inc();
         return true;
     } else {
         LOG("%s not found. Building engine...", mEnginePath.c_str());
     }
+    PhaseTimer timer;
+    timer.start("parse onnx");
     Logger logger;
     auto builder       = make_unique<nvinfer1::IBuilder>(nvinfer1::createInferBuilder(logger));
     auto network       = make_unique<nvinfer1::INetworkDefinition>(builder->createNetworkV2(1));
     auto config        = make_unique<nvinfer1::IBuilderConfig>(builder->createBuilderConfig());
     auto parser        = make_unique<nvonnxparser::IParser>(nvonnxparser::createParser(*network, logger));
 
-    config->setMaxWorkspaceSize(1<<28);
-    config->setProfilingVerbosity(nvinfer1::ProfilingVerbosity::kDETAILED);
+    buildcfg::apply(mBuildProfile, *builder, *config);
+    LOG("build profile %s", buildcfg::describe(mBuildProfile).c_str());
 
     if (!parser->parseFromFile(mOnnxPath.c_str(), 1)){
         LOGE("ERROR: failed to %s", mOnnxPath.c_str());
         return false;
     }
+    buildcfg::applyIO(mBuildProfile, *network);
+
+    // 动态shape的input需要optimization profile
+    nvinfer1::IOptimizationProfile* profile = nullptr;
+    if (!mBuildProfile.shapes.empty()) {
+        profile = builder->createOptimizationProfile();
+        for (auto& p : mBuildProfile.shapes) {
+            profile->setDimensions(p.input.c_str(), nvinfer1::OptProfileSelector::kMIN, p.min);
+            profile->setDimensions(p.input.c_str(), nvinfer1::OptProfileSelector::kOPT, p.opt);
+            profile->setDimensions(p.input.c_str(), nvinfer1::OptProfileSelector::kMAX, p.max);
+            LOG("profile %s: %s, %s, %s", p.input.c_str(), printDims(p.min).c_str(),
+                printDims(p.opt).c_str(), printDims(p.max).c_str());
+        }
+        if (!profile->isValid()) {
+            LOGE("ERROR: invalid optimization profile for %s", mOnnxPath.c_str());
+            return false;
+        }
+        config->addOptimizationProfile(profile);
+    }
 
+#ifdef DEBUG_TENSORS
+    if (!mDebugTensors.empty()) {
+        LOG("marked %d debug outputs", diff::markDebugOutputs(*network, mDebugTensors));
+    }
+#endif
+
+    // build之前在CPU上估计activation内存, 明显放不下的时候不用等builder
+    if (!checkMemoryEstimate(*network)) {
+        return false;
+    }
+
+    // calibrator需要一直活到build结束
+    unique_ptr<nvinfer1::IInt8Calibrator> calibrator;
     if (builder->platformHasFastFp16() && mPrecision == nvinfer1::DataType::kHALF) {
         config->setFlag(nvinfer1::BuilderFlag::kFP16);
-        config->setFlag(nvinfer1::BuilderFlag::kPREFER_PRECISION_CONSTRAINTS);
     } else if (builder->platformHasFastInt8() && mPrecision == nvinfer1::DataType::kINT8) {
         config->setFlag(nvinfer1::BuilderFlag::kINT8);
-        config->setFlag(nvinfer1::BuilderFlag::kPREFER_PRECISION_CONSTRAINTS);
+        if (!createCalibrator(*network, profile, calibrator)) {
+            return false;
+        }
+        config->setInt8Calibrator(calibrator.get());
+        if (profile != nullptr) config->setCalibrationProfile(profile);
     }
 
-    auto engine        = make_unique<nvinfer1::ICudaEngine>(builder->buildEngineWithConfig(*network, *config));
-    auto plan          = builder->buildSerializedNetwork(*network, *config);
-    auto runtime       = make_unique<nvinfer1::IRuntime>(nvinfer1::createInferRuntime(logger));
-
-    auto f = fopen(mEnginePath.c_str(), "wb");
-    fwrite(plan->data(), 1, plan->size(), f);
-    fclose(f);
+    // 按层的精度策略覆盖上面统一设置的精度
+    if (!applyPrecisionPolicy(*builder, *network, *config)) {
+        return false;
+    }
 
-    mEngine            = shared_ptr<nvinfer1::ICudaEngine>(runtime->deserializeCudaEngine(plan->data(), plan->size()));
+    if (!buildEngine(*builder, *network, *config, logger, timer)) {
+        return false;
+    }
     mInputDims         = network->getInput(0)->getDimensions();
     mOutputDims        = network->getOutput(0)->getDimensions();
 
@@ -252,7 +689,12 @@ bool Model::build_from_onnx(){
     LOG("After TensorRT optimization");
     print_network(*network, true);
 
-    LOG("Finished building engine");
+    // 优化前后的graph以及融合的对应关系导出成JSON和DOT
+    if (!mGraphPrefix.empty()) {
+        graph::exportGraph(graph::fromNetwork(*network), graph::fromEngine(*mEngine), mGraphPrefix);
+    }
+
+    timer.report("Finished building engine");
     return true;
 };
 
@@ -278,6 +720,7 @@ bool Model::infer(){
     auto runtime     = make_unique<nvinfer1::IRuntime>(nvinfer1::createInferRuntime(logger));
     auto engine      = make_unique<nvinfer1::ICudaEngine>(runtime->deserializeCudaEngine(modelData.data(), modelData.size()));
     auto context     = make_unique<nvinfer1::IExecutionContext>(engine->createExecutionContext());
+    engineLoads().inc();
 
     auto input_dims   = context->getBindingDimensions(0);
     auto output_dims  = context->getBindingDimensions(1);
@@ -290,88 +733,144 @@ bool Model::infer(){
     cudaStreamCreate(&stream);
 
     /* 2. 初始化input，以及在host/device上分配空间 */
-    init_data(input_dims, output_dims);
+    if (!init_data(*engine, input_dims, output_dims)) {
+        cudaStreamDestroy(stream);
+        return false;
+    }
+
+    auto start = chrono::steady_clock::now();
 
     /* 2. host->device的数据传递*/
-    cudaMemcpyAsync(mInputDevice, mInputHost, mInputSize, cudaMemcpyKind::cudaMemcpyHostToDevice, stream);
+    mInputDevice.copyFrom(mInputHost, stream);
+    h2dBytes().inc(mInputHost.bytes());
 
     /* 3. 模型推理, 最后做同步处理 */
-    float* bindings[] = {mInputDevice, mOutputDevice};
-    bool success = context->enqueueV2((void**)bindings, stream, nullptr);
+    // binding 0/1是input0/output0, 后面的都是debug用的额外的output, 按binding的index填进去
+    diff::DebugOutputs debug;
+    if (!debug.allocate(*engine, 2)) {
+        LOGE("ERROR: failed to allocate debug outputs of %s", mEnginePath.c_str());
+        cudaStreamDestroy(stream);
+        return false;
+    }
+    vector<void*> bindings(engine->getNbBindings(), nullptr);
+    bindings[0] = mInputDevice.data();
+    bindings[1] = mOutputDevice.data();
+    debug.bind(*engine, bindings);
+    for (int i = 0; i < (int)bindings.size(); i++) {
+        if (bindings[i] == nullptr) {
+            LOGE("ERROR: binding %d (%s) has no buffer", i, engine->getBindingName(i));
+            cudaStreamDestroy(stream);
+            return false;
+        }
+    }
+    bool success = context->enqueueV2(bindings.data(), stream, nullptr);
 
     /* 4. device->host的数据传递 */
-    cudaMemcpyAsync(mOutputHost, mOutputDevice, mOutputSize, cudaMemcpyKind::cudaMemcpyDeviceToHost, stream);
+    mOutputHost.copyFrom(mOutputDevice, stream);
+    debug.download(stream);
     cudaStreamSynchronize(stream);
-
-    LOG("input data is:  %s", printTensor(mInputHost, mInputSize / sizeof(float), input_dims).c_str());
-    LOG("output data is: %s", printTensor(mOutputHost, mOutputSize / sizeof(float), output_dims).c_str());
-    LOG("finished inference");
-    return true;
-}
-
-void Model::print_network(nvinfer1::INetworkDefinition &network, bool optimized) {
-
-    int inputCount = network.getNbInputs();
-    int outputCount = network.getNbOutputs();
-    string layer_info;
-
-    for (int i = 0; i < inputCount; i++) {
-        auto input = network.getInput(i);
-        LOG("Input info: %s:%s", input->getName(), printTensorShape(input).c_str());
+    cudaStreamDestroy(stream);
+
+    inferRequests().inc();
+    batchSizes().record(input_dims.nbDims > 0 ? input_dims.d[0] : 1);
+    mLastLatencyMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    inferLatency().record((int64_t)(mLastLatencyMs * 1000));
+
+    // engine的output是NHWC的时候先转换回NCHW, 再打印, 保存和对比
+    Tensor hostOutput = mOutputHost.view();
+    if (engine->getBindingFormat(1) != nvinfer1::TensorFormat::kLINEAR) {
+        hostOutput = Tensor::fromDims(output_dims, mOutputHost.dtype());
+        layout::convert(mOutputHost, layout::Layout::NHWC, hostOutput, layout::Layout::NCHW);
     }
 
-    for (int i = 0; i < outputCount; i++) {
-        auto output = network.getOutput(i);
-        LOG("Output info: %s:%s", output->getName(), printTensorShape(output).c_str());
+    // 小的tensor直接打印出来, 大的只打印统计信息, 完整的数据可以dump成.npy在python里看
+    if (mInputHost.count() <= kPrintLimit) {
+        LOG("input data is:  %s", printTensor(mInputHost).c_str());
+    } else {
+        LOG("input data is:  %s", printTensorSummary(mInputHost).c_str());
+    }
+    if (hostOutput.count() <= kPrintLimit) {
+        LOG("output data is: %s", printTensor(hostOutput).c_str());
+    } else {
+        LOG("output data is: %s", printTensorSummary(hostOutput).c_str());
     }
-    
-    int layerCount = optimized ? mEngine->getNbLayers() : network.getNbLayers();
-    LOG("network has %d layers", layerCount);
-
-    if (!optimized) {
-        for (int i = 0; i < layerCount; i++) {
-            char layer_info[1000];
-            auto layer   = network.getLayer(i);
-            auto input   = layer->getInput(0);
-            int n = 0;
-            if (input == nullptr){
-                continue;
-            }
-            auto output  = layer->getOutput(0);
 
-            LOG("layer_info: %-40s:%-25s->%-25s[%s]", 
-                layer->getName(),
-                printTensorShape(input).c_str(),
-                printTensorShape(output).c_str(),
-                getPrecision(layer->getPrecision()).c_str());
-        }
+    if (mDumpDir != "") {
+        npy::save(mDumpDir + "/input0.npy", mInputHost.data(), mInputHost.dtype(), mInputHost.shape());
+        npy::save(mDumpDir + "/output0.npy", hostOutput.data(), hostOutput.dtype(), hostOutput.shape());
+        debug.save(mDumpDir);
+        LOG("dumped input and output tensors to %s", mDumpDir.c_str());
+    }
 
-    } else {
-        auto inspector = make_unique<nvinfer1::IEngineInspector>(mEngine->createEngineInspector());
-        for (int i = 0; i < layerCount; i++) {
-            string info = inspector->getLayerInformation(i, nvinfer1::LayerInformationFormat::kJSON);
-            info = info.substr(0, info.size() - 1);
-            LOG("layer_info: %s", info.c_str());
+    if (mRefDir != "") {
+        vector<diff::DiffStats> stats = debug.compare(mRefDir);
+        diff::DiffStats output;
+        Tensor out = hostOutput.cast(nvinfer1::DataType::kFLOAT);
+        if (diff::compareWithReference("output0", out.data<float>(), out.count(), mRefDir, output)) {
+            stats.push_back(output);
         }
+        diff::report(stats);
+        mLastErrors.clear();
+        for (auto& st : stats) mLastErrors[st.name] = 1.0 - st.cosine;
     }
+    LOG("finished inference");
+    return true;
 }
 
+void Model::print_network(nvinfer1::INetworkDefinition &network, bool optimized) {
+    // 打印每一层所有的input和output, 优化以后的层还会标出是由哪些层融合来的(LOGV)
+    graph::Graph net = graph::fromNetwork(network);
+    if (!optimized) {
+        graph::printGraph(net);
+        return;
+    }
+    graph::Graph engine = graph::fromEngine(*mEngine);
+    graph::mapFusions(net, engine);
+    graph::printGraph(engine);
+}
 
-void Model::init_data(nvinfer1::Dims input_dims, nvinfer1::Dims output_dims){
-    mInputSize  = getDimSize(input_dims) * sizeof(float);
-    mOutputSize = getDimSize(output_dims) * sizeof(float);
-
-    cudaMallocHost(&mInputHost, mInputSize);
-    cudaMallocHost(&mOutputHost, mOutputSize);
 
-    if (mInputSize == 5) {
-        mInputHost = input_1x5;
-    } else {
-        mInputHost = input_5x5;
+// binding在host上的shape: channel-last的format是NHWC并且channel补齐, linear的就是dims
+static bool bindingShape(nvinfer1::ICudaEngine &engine, int index, nvinfer1::Dims dims, vector<int64_t> &shape) {
+    auto format = engine.getBindingFormat(index);
+    shape.assign(dims.d, dims.d + dims.nbDims);
+    if (format == nvinfer1::TensorFormat::kLINEAR) return true;
+    if (layout::hostLayout(format) == layout::Layout::NHWC && dims.nbDims == 4) {
+        int64_t align = layout::channelAlignment(format);
+        shape = {dims.d[0], dims.d[2], dims.d[3], (dims.d[1] + align - 1) / align * align};
+        return true;
     }
-
-    cudaMalloc(&mInputDevice, mInputSize);
-    cudaMalloc(&mOutputDevice, mOutputSize);
-    
+    LOGE("ERROR: %s uses format %s, which has no host layout conversion", engine.getBindingName(index),
+         buildcfg::formatName(format).c_str());
+    return false;
 }
 
+bool Model::init_data(nvinfer1::ICudaEngine &engine, nvinfer1::Dims input_dims, nvinfer1::Dims output_dims){
+    if (getDimSize(input_dims) <= 0 || getDimSize(output_dims) <= 0) {
+        LOGE("ERROR: input/output shape %s/%s is not static", printDims(input_dims).c_str(), printDims(output_dims).c_str());
+        return false;
+    }
+    vector<int64_t> inputShape, outputShape;
+    if (!bindingShape(engine, 0, input_dims, inputShape) || !bindingShape(engine, 1, output_dims, outputShape)) return false;
+
+    // 重新赋值的时候之前的buffer回到池子里, 反复infer不会再调用cudaMalloc
+    mInputHost    = Tensor(inputShape, engine.getBindingDataType(0), Location::Pinned);
+    mOutputHost   = Tensor(outputShape, engine.getBindingDataType(1), Location::Pinned);
+    mInputDevice  = Tensor(inputShape, engine.getBindingDataType(0), Location::Device);
+    mOutputDevice = Tensor(outputShape, engine.getBindingDataType(1), Location::Device);
+    if (mInputHost.empty() || mOutputHost.empty() || mInputDevice.empty() || mOutputDevice.empty()) return false;
+
+    // sample的数据按input的元素个数循环填充(NCHW, float), 再转换成binding的layout和dtype
+    int64_t      count  = getDimSize(input_dims);
+    const float* sample = count == 5 ? input_1x5 : input_5x5;
+    int64_t      length = count == 5 ? 5 : 25;
+    Tensor       input  = Tensor::fromDims(input_dims, nvinfer1::DataType::kFLOAT);
+    float*       ptr    = input.data<float>();
+    for (int64_t i = 0; i < count; i++) ptr[i] = sample[i % length];
+
+    if (engine.getBindingFormat(0) != nvinfer1::TensorFormat::kLINEAR) {
+        return layout::convert(input, layout::Layout::NCHW, mInputHost, layout::Layout::NHWC);
+    }
+    Tensor typed = input.cast(mInputHost.dtype());
+    return !typed.empty() && mInputHost.copyFrom(typed);
+}
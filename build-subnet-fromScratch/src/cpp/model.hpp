@@ -7,9 +7,13 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <memory>
 
+#include "buildconfig.hpp"
+#include "tensor.hpp"
 
+class PhaseTimer;
 
 class Model{
 
@@ -24,9 +28,53 @@ public:
     Model(std::string onnxPath, precision prec);
     bool build();
     bool infer();
+    // 不build, 只创建network: CPU上推导的每一层的shape和TensorRT的对比, 并打印内存的估计(只支持从weights创建的network)
+    bool checkShapes();
+    // 设置以后, infer会把input和output保存成.npy到这个目录下
+    void setDumpDir(std::string dir) { mDumpDir = dir; }
+    // 把匹配上的层的输出也作为network output(只在DEBUG=1的时候有效), 用于逐层的精度对比
+    void setDebugTensors(std::vector<std::string> patterns);
+    // 设置以后, infer会把output和debug的tensor与这个目录下同名的.npy做对比
+    void setReferenceDir(std::string dir) { mRefDir = dir; }
+    // INT8的calibration数据, 目录下的每一个.npy是一个或者多个预处理前的input sample
+    void setCalibrationData(std::string dir) { mCalibDir = dir; }
+    // 权重是2:4稀疏的时候打开kSPARSE_WEIGHTS
+    void setSparseWeights(bool enable) { mBuildProfile.sparseWeights = enable; }
+    // build的时候打开kREFIT, 之后只有权重变化的时候可以用refit::refitEngine更新engine
+    void setRefittable(bool enable) { mBuildProfile.refittable = enable; }
+    // 默认和engine放在同一个目录下(timing.cache), 设置成空字符串的时候不使用timing cache
+    // maxBytes为0的时候不限制大小
+    void setTimingCache(std::string path, size_t maxBytes = 0) { mTimingCachePath = path; mTimingCacheLimit = maxBytes; }
+    // 只对onnx有效, 所有的input组成一个optimization profile
+    void setProfiles(std::vector<ShapeProfile> profiles) { mBuildProfile.shapes = profiles; }
+    // builder的workspace上限, 默认256MB
+    void setWorkspaceSize(size_t bytes) { mBuildProfile.workspace = bytes; mBuildProfile.autoWorkspace = false; }
+    // 从配置文件里读取build的设置(格式见buildconfig.hpp), 会覆盖之前的setProfiles/setWorkspaceSize/setSparseWeights
+    bool loadBuildProfile(std::string path, std::string name = "default");
+    void setBuildProfile(const buildcfg::BuildProfile& profile) { mBuildProfile = profile; }
+    const buildcfg::BuildProfile& buildProfile() const { return mBuildProfile; }
+    // 按层指定精度的policy文件(格式见policy.hpp), 覆盖build时统一设置的精度
+    void setPrecisionPolicy(std::string path) { mPolicyPath = path; }
+    // engine的input/output的layout和dtype(比如kHWC8 + kHALF), host上在拷贝到pinned memory的时候转换
+    void setIOFormats(nvinfer1::TensorFormat input, nvinfer1::TensorFormat output, nvinfer1::DataType type = nvinfer1::DataType::kFLOAT) {
+        mBuildProfile.inputFormat = input; mBuildProfile.outputFormat = output; mBuildProfile.ioType = type;
+    }
+    // 默认是models/engine/<name>_<precision>.engine
+    void setEnginePath(std::string path) { mEnginePath = path; }
+    // build以后把优化前后的graph导出到prefix.json, prefix_network.dot, prefix_engine.dot
+    void setGraphExport(std::string prefix) { mGraphPrefix = prefix; }
+    const std::string& enginePath() const { return mEnginePath; }
+    // INT8的calibration cache, 和engine放在一起(getCalibrationCachePath)
+    std::string calibrationCachePath() const;
+    // build的时候network里所有的层名
+    const std::vector<std::string>& layerNames() const { return mLayerNames; }
+    // 最近一次infer的耗时(H2D + 推理 + D2H), 以及和参考值对比的误差(1 - cosine, key是tensor名)
+    double lastLatencyMs() const { return mLastLatencyMs; }
+    const std::map<std::string, double>& lastErrors() const { return mLastErrors; }
 
 private:
-    void init_data(nvinfer1::Dims input_dims, nvinfer1::Dims output_dims);
+    // 按engine的binding的dtype分配pinned和device上的buffer, 用sample数据填充input
+    bool init_data(nvinfer1::ICudaEngine &engine, nvinfer1::Dims input_dims, nvinfer1::Dims output_dims);
     bool build_from_onnx();
     bool build_from_weights();
 
@@ -34,21 +82,50 @@ private:
     bool preprocess();
     void print_network(nvinfer1::INetworkDefinition &network, bool optimized);
     std::map<std::string, nvinfer1::Weights> loadWeights();
+    // 释放loadWeights malloc出来的values
+    void releaseWeights();
+    // 离开作用域的时候releaseWeights, 不管从哪里返回mWts都会被释放
+    struct WeightsGuard {
+        Model* model;
+        ~WeightsGuard() { model->releaseWeights(); }
+    };
+    // 根据weights的路径创建对应的network(network::build_*)
+    bool createNetwork(nvinfer1::INetworkDefinition &network);
+    bool createCalibrator(nvinfer1::INetworkDefinition &network, const nvinfer1::IOptimizationProfile* profile,
+                          std::unique_ptr<nvinfer1::IInt8Calibrator> &calibrator);
+    bool applyPrecisionPolicy(nvinfer1::IBuilder &builder, nvinfer1::INetworkDefinition &network,
+                              nvinfer1::IBuilderConfig &config);
+    bool checkMemoryEstimate(nvinfer1::INetworkDefinition &network);
+    std::unique_ptr<nvinfer1::IHostMemory> autoSizeWorkspace(nvinfer1::IBuilder &builder, nvinfer1::INetworkDefinition &network,
+                                                             nvinfer1::IBuilderConfig &config, nvinfer1::ILogger &logger,
+                                                             PhaseTimer &timer);
+    bool buildEngine(nvinfer1::IBuilder &builder, nvinfer1::INetworkDefinition &network,
+                     nvinfer1::IBuilderConfig &config, nvinfer1::ILogger &logger, PhaseTimer &timer);
 
 private:
     std::string mWtsPath = "";
     std::string mOnnxPath = "";
     std::string mEnginePath = "";
+    std::string mDumpDir = "";
+    std::string mRefDir = "";
+    std::string mCalibDir = "";
+    std::string mTimingCachePath = "";
+    size_t mTimingCacheLimit = 0;
+    buildcfg::BuildProfile mBuildProfile;
+    std::string mGraphPrefix = "";
+    std::string mPolicyPath = "";
+    std::vector<std::string> mLayerNames;
+    double mLastLatencyMs = 0;
+    std::map<std::string, double> mLastErrors;
+    std::vector<std::string> mDebugTensors;
     std::map<std::string, nvinfer1::Weights> mWts;
     nvinfer1::Dims mInputDims;
     nvinfer1::Dims mOutputDims;
     std::shared_ptr<nvinfer1::ICudaEngine> mEngine;
-    float* mInputHost;
-    float* mInputDevice;
-    float* mOutputHost;
-    float* mOutputDevice;
-    int mInputSize;
-    int mOutputSize;
+    Tensor mInputHost;      // pinned
+    Tensor mInputDevice;
+    Tensor mOutputHost;     // pinned
+    Tensor mOutputDevice;
     nvinfer1::DataType mPrecision;
 };
 
@@ -1,6 +1,7 @@
 #include "NvInfer.h"
 #include "math.h"
 #include "network.hpp"
+#include "blocks.hpp"
 #include <assert.h>
 #include <utils.hpp>
 
@@ -11,6 +12,38 @@ namespace network{
 // 这里写的每一个小模块其实都可以单独拿出来封装成一个小网络使用
 // 如果需要扩展，其实把这些放在parser.cpp里面
 
+// 最后一层的输出命名为output0并标记成network的输出, 没有创建出来的时候返回false
+static bool markOutput(nvinfer1::INetworkDefinition& network, nvinfer1::ITensor* output, const char* name)
+{
+    if (output == nullptr) {
+        LOGE("ERROR: failed to build %s", name);
+        return false;
+    }
+    output->setName("output0");
+    network.markOutput(*output);
+    return true;
+}
+
+int nameTensors(nvinfer1::INetworkDefinition& network)
+{
+    int named = 0;
+    for (int i = 0; i < network.getNbLayers(); i++) {
+        auto   layer = network.getLayer(i);
+        string name  = layer->getName();
+        for (int j = 0; j < layer->getNbOutputs(); j++) {
+            auto output = layer->getOutput(j);
+            if (output == nullptr || output->isNetworkOutput()) continue;
+            output->setName((j == 0 ? name : name + ":" + to_string(j)).c_str());
+            named++;
+        }
+    }
+    return named;
+}
+
+static nvinfer1::ITensor* output0(nvinfer1::ILayer* layer)
+{
+    return layer == nullptr ? nullptr : layer->getOutput(0);
+}
 
 // 做一个conv + batchNorm + LeakyReLU的网络
 //      conv
@@ -19,7 +52,7 @@ namespace network{
 //       |
 //    LeakyReLU
 
-void build_cbr(
+bool build_cbr(
     nvinfer1::INetworkDefinition& network, 
     nvinfer1::DataType prec,
     map<string, nvinfer1::Weights> weights) 
@@ -30,8 +63,7 @@ void build_cbr(
     auto bn     = parser::addBatchNorm("norm", *conv->getOutput(0), network, weights);
     auto leaky  = parser::addActivation("leaky", *bn->getOutput(0), nvinfer1::ActivationType::kLEAKY_RELU, network);
 
-    leaky->getOutput(0) ->setName("output0");
-    network.markOutput(*leaky->getOutput(0));
+    return markOutput(network, output0(leaky), "cbr");
 }
 
 // 做一个residual block: 
@@ -54,7 +86,7 @@ void build_cbr(
 //       relu2
 //
 
-void build_resBlock(
+bool build_resBlock(
     nvinfer1::INetworkDefinition& network,
     nvinfer1::DataType prec,
     map<string, nvinfer1::Weights> weights) 
@@ -73,8 +105,7 @@ void build_resBlock(
     auto add2  = parser::addElementWise("add2", *conv0->getOutput(0), *bn2->getOutput(0), nvinfer1::ElementWiseOperation::kSUM, network);
     auto relu2 = parser::addActivation("relu2", *add2->getOutput(0), nvinfer1::ActivationType::kRELU, network);
 
-    relu2->getOutput(0) ->setName("output0");
-    network.markOutput(*relu2->getOutput(0));
+    return markOutput(network, output0(relu2), "resBlock");
 }
 
 // 做一个conv + bn + SiLU: (yolov8的模块测试)
@@ -89,7 +120,7 @@ void build_resBlock(
 //        Mul
 //
 
-void build_convBNSiLU(
+bool build_convBNSiLU(
     nvinfer1::INetworkDefinition& network,
     nvinfer1::DataType prec,
     map<string, nvinfer1::Weights> weights) 
@@ -99,8 +130,7 @@ void build_convBNSiLU(
     auto silu  = parser::addConvBNSiLU("", *data, 3, 3, 1, 1, prec, network, weights);
 
 
-    silu->getOutput(0) ->setName("output0");
-    network.markOutput(*silu->getOutput(0));
+    return markOutput(network, output0(silu), "convBNSiLU");
 }
 
 
@@ -124,17 +154,18 @@ void build_convBNSiLU(
 //        |
 //    convBNSiLU (n * ch)
 
-void build_C2F(
+bool build_C2F(
     nvinfer1::INetworkDefinition& network,
     nvinfer1::DataType prec,
     map<string, nvinfer1::Weights> weights) 
 {
     auto data  = network.addInput("input0", nvinfer1::DataType::kFLOAT, nvinfer1::Dims4{1, 1, 5, 5});
 
-    auto c2f  = parser::addC2F("", *data, 4, prec, network, weights);
-
-    c2f->getOutput(0) ->setName("output0");
-    network.markOutput(*c2f->getOutput(0));
+    // 1 -> 4 channel, 一个带shortcut的bottleneck, channel在编译期检查(blocks.hpp)
+    blocks::Context ctx{network, prec, weights};
+    blocks::Key     key;
+    auto c2f  = blocks::C2F<1, 4, 1, true>::add(key, *data, ctx);
+    return markOutput(network, c2f, "C2F");
 }
 
 
@@ -6,6 +6,7 @@
 #include <map>
 #include <memory>
 #include <model.hpp>
+#include "shuffle.hpp"
 
 namespace network {
 
@@ -25,18 +26,63 @@ nvinfer1::IShuffleLayer* addPermute(
     std::vector<int> perm,
     nvinfer1::INetworkDefinition& network);
 
+// rank在编译期检查的版本, 返回输出的tensor. 和前后的shuffle一起用的时候直接用shuffle::from,
+// 相邻的reshape/permute会合并成一个IShuffleLayer, identity的不添加层(返回input)
+//     parser::addReshape("head0.reshape", input, network, 1, 3, 85, -1);
+//     parser::addPermute<0, 2, 3, 1>("head0.permute", input, network);
+template <typename... D>
+nvinfer1::ITensor* addReshape(
+    std::string layer_name,
+    nvinfer1::ITensor& input,
+    nvinfer1::INetworkDefinition& network,
+    D... dims)
+{
+    return shuffle::from(network, input, layer_name).reshape(dims...).build();
+}
+
+template <int... Order>
+nvinfer1::ITensor* addPermute(
+    std::string layer_name,
+    nvinfer1::ITensor& input,
+    nvinfer1::INetworkDefinition& network)
+{
+    return shuffle::from(network, input, layer_name).permute<Order...>().build();
+}
+
 nvinfer1::IFullyConnectedLayer* addFullyConnected(
     std::string layer_name,
     nvinfer1::ITensor& input, 
     int output_channel,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights);
+    const std::map<std::string, nvinfer1::Weights>& weights);
+
+// BN折叠成IScaleLayer的scale和shift: scale = gamma / sqrt(var + eps), shift = beta - mean * scale
+// refit的时候也用这个重新计算, 保证和build时一致
+void foldBatchNorm(const float* gamma, const float* beta, const float* mean, const float* var, int count,
+                   float* scales, float* shifts, float eps = 1e-5f);
 
 nvinfer1::IScaleLayer* addBatchNorm(
     std::string layer_name,
     nvinfer1::ITensor& input,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights);
+    const std::map<std::string, nvinfer1::Weights>& weights);
+
+// 权重已经找好的版本, 不再拼接名字(blocks.hpp)
+nvinfer1::IScaleLayer* addBatchNorm(
+    const char* layer_name,
+    nvinfer1::ITensor& input,
+    const nvinfer1::Weights& gamma,
+    const nvinfer1::Weights& beta,
+    const nvinfer1::Weights& mean,
+    const nvinfer1::Weights& var,
+    nvinfer1::INetworkDefinition& network);
+
+nvinfer1::ITensor* addQDQ(
+    std::string layer_name,
+    nvinfer1::ITensor& input,
+    nvinfer1::Weights scale,
+    int axis,
+    nvinfer1::INetworkDefinition& network);
 
 nvinfer1::IConvolutionLayer* addConv2d(
     std::string layer_name, 
@@ -44,7 +90,7 @@ nvinfer1::IConvolutionLayer* addConv2d(
     int kernel_size, int output_channel, int stride, int pad,
     nvinfer1::DataType prec,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights);
+    const std::map<std::string, nvinfer1::Weights>& weights);
 
 nvinfer1::IActivationLayer* addActivation(
     std::string layer_name,
@@ -68,15 +114,27 @@ nvinfer1::IElementWiseLayer* addConvBNSiLU(
     int pad,
     nvinfer1::DataType prec,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights);
+    const std::map<std::string, nvinfer1::Weights>& weights);
 
+nvinfer1::ILayer* addBottleNeck(
+    std::string layer_name, 
+    nvinfer1::ITensor& input, 
+    int ch1, int ch2,
+    bool shortcut,
+    nvinfer1::DataType prec,
+    nvinfer1::INetworkDefinition& network,
+    const std::map<std::string, nvinfer1::Weights>& weights);
+
+// n个bottleneck(m.0., m.1., ...), 编译期检查channel并且不拼接名字的版本见blocks.hpp
 nvinfer1::ILayer* addC2F(
     std::string layer_name, 
     nvinfer1::ITensor& input, 
     int output_channel, 
     nvinfer1::DataType prec,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights);
+    const std::map<std::string, nvinfer1::Weights>& weights,
+    int n = 1,
+    bool shortcut = true);
 
 
 } // namespace parser
@@ -87,22 +145,28 @@ nvinfer1::ILayer* addC2F(
 // void build_reshape(nvinfer1::INetworkDefinition& network, std::map<std::string, nvinfer1::Weights> mWts);
 // void build_batchNorm(nvinfer1::INetworkDefinition& network, std::map<std::string, nvinfer1::Weights> mWts);
 
-void build_cbr(
+// 每一层的输出tensor用层的名字命名(第j > 0个输出是"name:j"), network的input/output保留原来的名字.
+// 这样TensorRT的calibration cache(按tensor名), 逐层dump的.npy(按层名, diff::markDebugOutputs)
+// 以及.weights里的act_scale(按层名, parser::addConv2d)用的是同一套名字. 返回改了名字的tensor的个数
+int nameTensors(nvinfer1::INetworkDefinition& network);
+
+// 下面的build_*创建整个network并把输出标记为output0, 有层没有创建出来的时候打印错误并返回false
+bool build_cbr(
     nvinfer1::INetworkDefinition& network, 
     nvinfer1::DataType prec,
     std::map<std::string, nvinfer1::Weights> weights) ;
 
-void build_resBlock(
+bool build_resBlock(
     nvinfer1::INetworkDefinition& network,
     nvinfer1::DataType prec,
     std::map<std::string, nvinfer1::Weights> weights) ;
 
-void build_convBNSiLU(
+bool build_convBNSiLU(
     nvinfer1::INetworkDefinition& network,
     nvinfer1::DataType prec,
     std::map<std::string, nvinfer1::Weights> weights) ;
 
-void build_C2F(
+bool build_C2F(
     nvinfer1::INetworkDefinition& network,
     nvinfer1::DataType prec,
     std::map<std::string, nvinfer1::Weights> weights);
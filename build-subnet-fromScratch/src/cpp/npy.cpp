@@ -0,0 +1,333 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "npy.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace npy {
+
+static const char kMagic[]   = "\x93NUMPY";
+static const int  kMagicLen  = 6;
+static const int  kAlignment = 64;
+
+string typeDescr(nvinfer1::DataType type) {
+    switch (type) {
+        case nvinfer1::DataType::kFLOAT: return "<f4";
+        case nvinfer1::DataType::kHALF:  return "<f2";
+        case nvinfer1::DataType::kINT8:  return "|i1";
+        case nvinfer1::DataType::kINT32: return "<i4";
+        case nvinfer1::DataType::kBOOL:  return "|b1";
+        case nvinfer1::DataType::kUINT8: return "|u1";
+        default:                         return "";
+    }
+}
+
+bool parseDescr(const string& descr, nvinfer1::DataType& type) {
+    // numpy对单字节类型会写'|', 对小端写'<', 在小端机器上'='也是一样的
+    if (descr.size() != 3 || descr[0] == '>') return false;
+    string kind = descr.substr(1);
+    if      (kind == "f4") type = nvinfer1::DataType::kFLOAT;
+    else if (kind == "f2") type = nvinfer1::DataType::kHALF;
+    else if (kind == "i1") type = nvinfer1::DataType::kINT8;
+    else if (kind == "i4") type = nvinfer1::DataType::kINT32;
+    else if (kind == "b1") type = nvinfer1::DataType::kBOOL;
+    else if (kind == "u1") type = nvinfer1::DataType::kUINT8;
+    else return false;
+    return true;
+}
+
+size_t typeSize(nvinfer1::DataType type) {
+    switch (type) {
+        case nvinfer1::DataType::kFLOAT: return 4;
+        case nvinfer1::DataType::kHALF:  return 2;
+        case nvinfer1::DataType::kINT32: return 4;
+        default:                         return 1;
+    }
+}
+
+bool save(const string& path, const void* data, nvinfer1::DataType type, const vector<int64_t>& shape) {
+    string descr = typeDescr(type);
+    if (descr.empty()) {
+        LOGE("ERROR: %s, unsupported data type for npy", path.c_str());
+        return false;
+    }
+
+    string header = "{'descr': '" + descr + "', 'fortran_order': False, 'shape': (";
+    int64_t count = 1;
+    for (size_t i = 0; i < shape.size(); i++) {
+        header += to_string(shape[i]);
+        header += (shape.size() == 1 || i != shape.size() - 1) ? "," : "";
+        header += (i != shape.size() - 1) ? " " : "";
+        count  *= shape[i];
+    }
+    header += "), }";
+
+    // magic(6) + version(2) + header_len(2) + header + '\n', 整体按64字节对齐
+    size_t prefix = kMagicLen + 2 + 2;
+    size_t total  = (prefix + header.size() + 1 + kAlignment - 1) / kAlignment * kAlignment;
+    header.append(total - prefix - header.size() - 1, ' ');
+    header += '\n';
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f == nullptr) {
+        LOGE("ERROR: failed to open %s", path.c_str());
+        return false;
+    }
+
+    uint16_t len = (uint16_t)header.size();
+    unsigned char version[2] = {1, 0};
+    unsigned char hlen[2]    = {(unsigned char)(len & 0xff), (unsigned char)(len >> 8)};
+    size_t bytes = count * typeSize(type);
+
+    bool ok = fwrite(kMagic, 1, kMagicLen, f) == (size_t)kMagicLen &&
+              fwrite(version, 1, 2, f) == 2 &&
+              fwrite(hlen, 1, 2, f) == 2 &&
+              fwrite(header.data(), 1, header.size(), f) == header.size() &&
+              (bytes == 0 || fwrite(data, 1, bytes, f) == bytes);      // 没有元素的数组data可以是nullptr
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        LOGE("ERROR: failed to write %s", path.c_str());
+    }
+    return ok;
+}
+
+bool save(const string& path, const float* data, nvinfer1::Dims dims) {
+    vector<int64_t> shape(dims.d, dims.d + dims.nbDims);
+    return save(path, data, nvinfer1::DataType::kFLOAT, shape);
+}
+
+/* ------------------------------- Array ------------------------------- */
+
+Array::~Array() {
+    release();
+}
+
+Array::Array(Array&& other) noexcept {
+    *this = std::move(other);
+}
+
+Array& Array::operator=(Array&& other) noexcept {
+    if (this != &other) {
+        release();
+        mMap     = other.mMap;
+        mMapSize = other.mMapSize;
+        mData    = other.mData;
+        mType    = other.mType;
+        mShape   = std::move(other.mShape);
+        other.mMap     = nullptr;
+        other.mMapSize = 0;
+        other.mData    = nullptr;
+    }
+    return *this;
+}
+
+void Array::release() {
+    if (mMap != nullptr) {
+        munmap(mMap, mMapSize);
+    }
+    mMap     = nullptr;
+    mMapSize = 0;
+    mData    = nullptr;
+    mShape.clear();
+}
+
+int64_t Array::count() const {
+    int64_t count = 1;
+    for (auto d : mShape) count *= d;
+    return count;
+}
+
+nvinfer1::Dims Array::dims() const {
+    nvinfer1::Dims dims;
+    dims.nbDims = (int)mShape.size();
+    for (int i = 0; i < dims.nbDims && i < nvinfer1::Dims::MAX_DIMS; i++) {
+        dims.d[i] = (int)mShape[i];
+    }
+    return dims;
+}
+
+// 从header里取出一个key对应的值, 例如'shape': (1, 3) -> "(1, 3)"
+static bool headerValue(const string& header, const string& key, string& value) {
+    size_t pos = header.find("'" + key + "'");
+    if (pos == string::npos) return false;
+    pos = header.find(':', pos);
+    if (pos == string::npos) return false;
+    pos = header.find_first_not_of(' ', pos + 1);
+    if (pos == string::npos) return false;
+
+    size_t end;
+    if (header[pos] == '(') {
+        end = header.find(')', pos);
+        if (end == string::npos) return false;
+        end += 1;
+    } else if (header[pos] == '\'') {
+        end = header.find('\'', pos + 1);
+        if (end == string::npos) return false;
+        pos += 1;
+    } else {
+        end = header.find_first_of(",}", pos);
+    }
+    value = header.substr(pos, end - pos);
+    return true;
+}
+
+bool load(const string& path, Array& array) {
+    array.release();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOGE("ERROR: %s not found", path.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < kMagicLen + 4) {
+        LOGE("ERROR: %s is not a npy file", path.c_str());
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void*  map  = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOGE("ERROR: failed to mmap %s", path.c_str());
+        return false;
+    }
+
+    array.mMap     = map;
+    array.mMapSize = size;
+
+    const unsigned char* bytes = (const unsigned char*)map;
+    if (memcmp(bytes, kMagic, kMagicLen) != 0) {
+        LOGE("ERROR: %s is not a npy file", path.c_str());
+        array.release();
+        return false;
+    }
+
+    // 1.0版本的header长度是2字节, 2.0/3.0是4字节
+    int    major  = bytes[kMagicLen];
+    size_t offset = kMagicLen + 2;
+    size_t hlen;
+    if (major == 1) {
+        hlen    = bytes[offset] | (bytes[offset + 1] << 8);
+        offset += 2;
+    } else {
+        hlen    = bytes[offset] | (bytes[offset + 1] << 8) | (bytes[offset + 2] << 16) | ((size_t)bytes[offset + 3] << 24);
+        offset += 4;
+    }
+    if (offset + hlen > size) {
+        LOGE("ERROR: %s has a broken header", path.c_str());
+        array.release();
+        return false;
+    }
+
+    string header((const char*)bytes + offset, hlen);
+    string descr, order, shape;
+    if (!headerValue(header, "descr", descr) ||
+        !headerValue(header, "fortran_order", order) ||
+        !headerValue(header, "shape", shape)) {
+        LOGE("ERROR: %s has a broken header", path.c_str());
+        array.release();
+        return false;
+    }
+    if (!parseDescr(descr, array.mType)) {
+        LOGE("ERROR: %s, unsupported dtype %s", path.c_str(), descr.c_str());
+        array.release();
+        return false;
+    }
+    if (order.find("True") != string::npos) {
+        LOGE("ERROR: %s, fortran_order is not supported", path.c_str());
+        array.release();
+        return false;
+    }
+
+    // "(1, 3, 5, 5)" 或者 "(25,)" 或者 "()"
+    const char* p = shape.c_str();
+    while (*p != '\0') {
+        if (*p >= '0' && *p <= '9') {
+            char* end;
+            array.mShape.push_back(strtoll(p, &end, 10));
+            p = end;
+        } else {
+            p++;
+        }
+    }
+
+    array.mData = bytes + offset + hlen;
+    if (offset + hlen + array.bytes() > size) {
+        LOGE("ERROR: %s is truncated", path.c_str());
+        array.release();
+        return false;
+    }
+    return true;
+}
+
+/* ------------------------------- check ------------------------------- */
+
+bool check(const string& dir) {
+    struct Case {
+        nvinfer1::DataType type;
+        vector<int64_t>    shape;
+    };
+    vector<Case> cases = {
+        {nvinfer1::DataType::kFLOAT, {1, 3, 5, 5}},
+        {nvinfer1::DataType::kFLOAT, {}},             // 标量
+        {nvinfer1::DataType::kFLOAT, {0, 4}},         // 没有元素
+        {nvinfer1::DataType::kHALF,  {7}},
+        {nvinfer1::DataType::kINT32, {2, 3}},
+        {nvinfer1::DataType::kINT8,  {3, 1, 2}},
+        {nvinfer1::DataType::kUINT8, {5}},
+        {nvinfer1::DataType::kBOOL,  {2, 2}},
+    };
+
+    bool   ok   = true;
+    string path = dir + "/npy_check.npy";
+    for (auto& c : cases) {
+        int64_t count = 1;
+        for (auto d : c.shape) count *= d;
+        vector<unsigned char> data(count * typeSize(c.type));
+        for (size_t i = 0; i < data.size(); i++) data[i] = (unsigned char)(i * 7 + 1);
+        if (c.type == nvinfer1::DataType::kBOOL) {
+            for (auto& b : data) b &= 1;
+        }
+
+        Array array;
+        string what = typeDescr(c.type) + " " + to_string(c.shape.size()) + "-d";
+        if (!save(path, data.data(), c.type, c.shape) || !load(path, array)) {
+            LOGE("ERROR: npy check %s: save/load failed", what.c_str());
+            ok = false;
+            continue;
+        }
+        // header按kAlignment对齐, 数据的地址也是对齐的
+        if (array.type() != c.type || array.shape() != c.shape || array.bytes() != data.size() ||
+            (!data.empty() && memcmp(array.data(), data.data(), data.size()) != 0) || (uintptr_t)array.data() % kAlignment != 0) {
+            LOGE("ERROR: npy check %s: the loaded array does not match what was saved", what.c_str());
+            ok = false;
+        }
+    }
+
+    // 截断的文件要报错, 不能读到文件外面
+    vector<float> values(100, 1.0f);
+    if (save(path, values.data(), nvinfer1::DataType::kFLOAT, {100}) && truncate(path.c_str(), 200) == 0) {
+        Array array;
+        LOG("npy check: loading a truncated file, the error below is expected");
+        if (load(path, array)) {
+            LOGE("ERROR: npy check: a truncated file was loaded");
+            ok = false;
+        }
+    } else {
+        LOGE("ERROR: npy check: failed to write %s", path.c_str());
+        ok = false;
+    }
+    remove(path.c_str());
+
+    if (ok) LOG("npy check passed (%d arrays)", (int)cases.size());
+    return ok;
+}
+
+} // namespace npy
@@ -0,0 +1,64 @@
+#ifndef __NPY_HPP__
+#define __NPY_HPP__
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "NvInfer.h"
+
+// host上的tensor和numpy的.npy文件之间的互相转换, 方便在python里直接np.load做对比
+// .npy的格式:
+//     "\x93NUMPY" + major + minor + header_len + header(python dict的字符串) + 数据
+//     header例如: {'descr': '<f4', 'fortran_order': False, 'shape': (1, 3, 5, 5), }
+// 写的时候使用1.0版本, header按64字节对齐; 读的时候用mmap把文件映射进来, 数据不做拷贝
+
+namespace npy {
+
+// 把TensorRT的DataType转成numpy的descr, 不支持的返回空字符串
+std::string typeDescr(nvinfer1::DataType type);
+bool        parseDescr(const std::string& descr, nvinfer1::DataType& type);
+size_t      typeSize(nvinfer1::DataType type);
+
+bool save(const std::string& path, const void* data, nvinfer1::DataType type, const std::vector<int64_t>& shape);
+bool save(const std::string& path, const float* data, nvinfer1::Dims dims);
+
+// 读出来的数组, 数据直接指向mmap的内存, 析构的时候unmap
+class Array {
+public:
+    Array() {}
+    ~Array();
+    Array(Array&& other) noexcept;
+    Array& operator=(Array&& other) noexcept;
+    Array(const Array&) = delete;
+    Array& operator=(const Array&) = delete;
+
+    const void*  data() const { return mData; }
+    template <typename T>
+    const T*     as() const { return (const T*)mData; }
+    int64_t      count() const;
+    size_t       bytes() const { return count() * typeSize(mType); }
+    nvinfer1::DataType          type() const { return mType; }
+    const std::vector<int64_t>& shape() const { return mShape; }
+    nvinfer1::Dims              dims() const;
+
+private:
+    friend bool load(const std::string& path, Array& array);
+
+    void release();
+
+    void*                mMap     = nullptr;
+    size_t               mMapSize = 0;
+    const void*          mData    = nullptr;
+    nvinfer1::DataType   mType    = nvinfer1::DataType::kFLOAT;
+    std::vector<int64_t> mShape;
+};
+
+// fortran_order为True的数组不支持(TensorRT这边都是行优先)
+bool load(const std::string& path, Array& array);
+
+// 每种dtype在dir下save再load一遍, 检查dtype/shape/数据一样并且数据是对齐的, 截断的文件load失败
+bool check(const std::string& dir = "/tmp");
+
+} // namespace npy
+
+#endif //__NPY_HPP__
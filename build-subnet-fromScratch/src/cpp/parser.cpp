@@ -12,7 +12,7 @@ namespace network{
 
 namespace parser{
 
-// TODO... vargs
+// reshape成dims, perm不为空的时候再做一次transpose(second transpose), 都在一个IShuffleLayer里
 nvinfer1::IShuffleLayer* addReshape(
     string layer_name,
     nvinfer1::ITensor& input, 
@@ -20,26 +20,26 @@ nvinfer1::IShuffleLayer* addReshape(
     vector<int> perm,
     nvinfer1::INetworkDefinition& network)
 {
-    auto reshape = network.addShuffle(input);
-    reshape->setReshapeDimensions(nvinfer1::Dims3{1, 3, -1});
-    reshape->setSecondTranspose(nvinfer1::Permutation{0, 2, 1});      
-    reshape->setName(layer_name.c_str());
-
-    return reshape;
+    shuffle::Spec spec;
+    spec.reshape = dims;
+    spec.second  = perm;
+    return shuffle::addLayer(network, input, spec, layer_name);
 }
 
-
-// TODO... vargs
+// 结果的第i维是输入的第perm[i]维, 比如B, C, H, W -> B, H, W, C是{0, 2, 3, 1}
 nvinfer1::IShuffleLayer* addPermute(
     string layer_name,
     nvinfer1::ITensor& input, 
     vector<int> perm,
     nvinfer1::INetworkDefinition& network)
 {
-    auto permute = network.addShuffle(input);
-    permute->setFirstTranspose(nvinfer1::Permutation{perm[0], perm[1], perm[2], perm[3]}); // B, C, H, W -> B, H, W, C
-    permute->setName(layer_name.c_str());
-    return permute;
+    return shuffle::addLayer(network, input, shuffle::transpose(perm), layer_name);
+}
+
+// 找不到的时候返回空的Weights, 和map::operator[]的结果一样, 但是不往map里插入, weights可以传const引用
+static nvinfer1::Weights lookup(const map<string, nvinfer1::Weights>& weights, const string& name) {
+    auto it = weights.find(name);
+    return it == weights.end() ? nvinfer1::Weights{nvinfer1::DataType::kFLOAT, nullptr, 0} : it->second;
 }
 
 nvinfer1::IFullyConnectedLayer* addFullyConnected(
@@ -47,41 +47,65 @@ nvinfer1::IFullyConnectedLayer* addFullyConnected(
     nvinfer1::ITensor& input, 
     int output_channel,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights)
+    const std::map<std::string, nvinfer1::Weights>& weights)
 {
-    auto fc = network.addFullyConnected(input, output_channel, weights[layer_name + ".weight"], {});
+    auto fc = network.addFullyConnected(input, output_channel, lookup(weights, layer_name + ".weight"), {});
     fc->setName(layer_name.c_str());
     
     return fc;
 }
 
 
+// 这里具体参考一下batch normalization的计算公式，网上有很多
+void foldBatchNorm(const float* gamma, const float* beta, const float* mean, const float* var, int count,
+                   float* scales, float* shifts, float eps)
+{
+    for (int i = 0; i < count; i ++) {
+        scales[i] = gamma[i] / sqrt(var[i] + eps);
+        shifts[i] = beta[i] - (mean[i] * gamma[i] / sqrt(var[i] + eps));
+    }
+}
+
 nvinfer1::IScaleLayer* addBatchNorm(
     string layer_name,
     nvinfer1::ITensor& input,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights)
+    const std::map<std::string, nvinfer1::Weights>& weights)
+{
+    return addBatchNorm(
+        layer_name.c_str(), input,
+        lookup(weights, layer_name + ".weight"),
+        lookup(weights, layer_name + ".bias"),
+        lookup(weights, layer_name + ".running_mean"),
+        lookup(weights, layer_name + ".running_var"),
+        network);
+}
+
+nvinfer1::IScaleLayer* addBatchNorm(
+    const char* layer_name,
+    nvinfer1::ITensor& input,
+    const nvinfer1::Weights& gamma_weights,
+    const nvinfer1::Weights& beta_weights,
+    const nvinfer1::Weights& mean_weights,
+    const nvinfer1::Weights& var_weights,
+    nvinfer1::INetworkDefinition& network)
 {
     // 因为TensorRT内部没有BatchNorm的实现，但是我们只要知道BatchNorm的计算原理，就可以使用IScaleLayer来创建BN的计算
     // IScaleLayer主要是用在quantization和dequantization，作为提前了解，我们试着使用IScaleLayer来搭建于一个BN的parser
     // IScaleLayer可以实现: y = (x * scale + shift) ^ pow
-
-    float* gamma   = (float*)weights[layer_name + ".weight"].values;
-    float* beta    = (float*)weights[layer_name + ".bias"].values;
-    float* mean    = (float*)weights[layer_name + ".running_mean"].values;
-    float* var     = (float*)weights[layer_name + ".running_var"].values;
-    float  eps     = 1e-5;
+    float* gamma   = (float*)gamma_weights.values;
+    float* beta    = (float*)beta_weights.values;
+    float* mean    = (float*)mean_weights.values;
+    float* var     = (float*)var_weights.values;
     
-    int    count   = weights[layer_name + ".running_var"].count;
+    int    count   = var_weights.count;
 
     float* scales  = (float*)malloc(count * sizeof(float));
     float* shifts  = (float*)malloc(count * sizeof(float));
     float* pows    = (float*)malloc(count * sizeof(float));
     
-    // 这里具体参考一下batch normalization的计算公式，网上有很多
+    foldBatchNorm(gamma, beta, mean, var, count, scales, shifts);
     for (int i = 0; i < count; i ++) {
-        scales[i] = gamma[i] / sqrt(var[i] + eps);
-        shifts[i] = beta[i] - (mean[i] * gamma[i] / sqrt(var[i] + eps));
         pows[i]   = 1.0;
     }
 
@@ -92,13 +116,49 @@ nvinfer1::IScaleLayer* addBatchNorm(
 
     // 创建IScaleLayer并将这些weights传进去，这里使用channel作为scale model
     auto bn = network.addScale(input, nvinfer1::ScaleMode::kCHANNEL, shifts_weights, scales_weights, pows_weights);
-    bn->setName(layer_name.c_str());
+    bn->setName(layer_name);
 
     LOGV("%s, %s", bn->getName(), (printDims(bn->getOutput(0)->getDimensions())).c_str());
 
     return bn;
 }
 
+// 找到产生tensor的层的名字, 网络的输入没有对应的层, 直接使用tensor的名字
+static string producerName(nvinfer1::ITensor& tensor, nvinfer1::INetworkDefinition& network) {
+    for (int i = 0; i < network.getNbLayers(); i++) {
+        auto layer = network.getLayer(i);
+        for (int j = 0; j < layer->getNbOutputs(); j++) {
+            if (layer->getOutput(j) == &tensor) return layer->getName();
+        }
+    }
+    return tensor.getName();
+}
+
+// 插入一对Q/DQ. scale只有一个值的时候是per-tensor, 否则是沿着axis的per-channel
+nvinfer1::ITensor* addQDQ(
+    string layer_name,
+    nvinfer1::ITensor& input,
+    nvinfer1::Weights scale,
+    int axis,
+    nvinfer1::INetworkDefinition& network)
+{
+    nvinfer1::Dims dims;
+    dims.nbDims = scale.count == 1 ? 0 : 1;
+    dims.d[0]   = scale.count;
+    auto s  = network.addConstant(dims, scale);
+    s->setName((layer_name + ".scale").c_str());
+
+    auto q  = network.addQuantize(input, *s->getOutput(0));
+    q->setAxis(axis);
+    q->setName((layer_name + ".quant").c_str());
+
+    auto dq = network.addDequantize(*q->getOutput(0), *s->getOutput(0));
+    dq->setAxis(axis);
+    dq->setName((layer_name + ".dequant").c_str());
+
+    return dq->getOutput(0);
+}
+
 nvinfer1::IConvolutionLayer* addConv2d(
     string layer_name, 
     nvinfer1::ITensor& input, 
@@ -108,19 +168,52 @@ nvinfer1::IConvolutionLayer* addConv2d(
     int pad,
     nvinfer1::DataType prec,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights)
+    const std::map<std::string, nvinfer1::Weights>& weights)
 {
-    auto conv = network.addConvolutionNd(
-            input, output_channel, 
-            nvinfer1::DimsHW{kernel_size, kernel_size}, 
-            weights[layer_name + ".weight"], 
-            weights[layer_name + ".bias"]);
+    // INT8的时候如果有离线计算好的scale(quant::addQuantScales), 就在input和weight前面插入Q/DQ
+    // 这样哪些层跑INT8是确定的, 不需要calibrator
+    // producerName要遍历整个network, 只在需要的时候查, 否则构建大网络的时候是O(层数^2)
+    auto wScale = prec == nvinfer1::DataType::kINT8 ? weights.find(layer_name + ".weight_scale") : weights.end();
+    auto aScale = wScale != weights.end() ? weights.find(producerName(input, network) + ".act_scale") : weights.end();
+    bool explicitQuant = wScale != weights.end() && aScale != weights.end();
+    if (wScale != weights.end() && aScale == weights.end()) {
+        // 其他层有activation scale的时候没有calibrator, Model::createCalibrator会让build失败
+        LOGW("%s has no activation scale (%s.act_scale)", layer_name.c_str(), producerName(input, network).c_str());
+    }
+
+    nvinfer1::IConvolutionLayer* conv;
+    if (explicitQuant) {
+        auto kernel  = lookup(weights, layer_name + ".weight");
+        int  channel = kernel.count / (output_channel * kernel_size * kernel_size);
+        auto w       = network.addConstant(nvinfer1::Dims4{output_channel, channel, kernel_size, kernel_size}, kernel);
+        w->setName((layer_name + ".weight").c_str());
+
+        auto x  = addQDQ(layer_name + ".input", input, aScale->second, 0, network);
+        auto wq = addQDQ(layer_name + ".weight", *w->getOutput(0), wScale->second, 0, network);
+
+        // kernel为空的时候需要通过setInput(1)把weight作为tensor传进去
+        conv = network.addConvolutionNd(
+                *x, output_channel,
+                nvinfer1::DimsHW{kernel_size, kernel_size},
+                nvinfer1::Weights{nvinfer1::DataType::kFLOAT, nullptr, 0},
+                lookup(weights, layer_name + ".bias"));
+        conv->setInput(1, *wq);
+    } else {
+        conv = network.addConvolutionNd(
+                input, output_channel, 
+                nvinfer1::DimsHW{kernel_size, kernel_size}, 
+                lookup(weights, layer_name + ".weight"), 
+                lookup(weights, layer_name + ".bias"));
+    }
     conv->setName(layer_name.c_str());
     conv->setStride(nvinfer1::DimsHW(stride, stride));
     conv->setPaddingNd(nvinfer1::DimsHW(pad, pad));
 
     // 注意，这里setPrecision需要跟config->setFlag配合使用，否则无效
-    conv->setPrecision(prec);
+    // 显式量化的时候精度由Q/DQ决定, 不能再设置
+    if (!explicitQuant) {
+        conv->setPrecision(prec);
+    }
     LOGV("%s, %s", conv->getName(), (printDims(conv->getOutput(0)->getDimensions())).c_str());
 
     return conv;
@@ -192,7 +285,7 @@ nvinfer1::IElementWiseLayer* addConvBNSiLU(
     int pad,
     nvinfer1::DataType prec,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights)
+    const std::map<std::string, nvinfer1::Weights>& weights)
 {
     auto conv    = addConv2d(layer_name + "conv", input, kernel_size, output_channel, stride, pad, prec, network, weights);
     auto bn      = addBatchNorm(layer_name + "norm", *conv->getOutput(0), network, weights);
@@ -221,7 +314,7 @@ nvinfer1::ILayer* addBottleNeck(
     bool shortcut,
     nvinfer1::DataType prec,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights)
+    const std::map<std::string, nvinfer1::Weights>& weights)
 {
     auto silu1 = addConvBNSiLU(layer_name + "cv1.", input,                3, ch1, 1, 1, prec, network, weights);
     auto silu2 = addConvBNSiLU(layer_name + "cv2.", *silu1->getOutput(0), 3, ch2, 1, 1, prec, network, weights);
@@ -233,26 +326,24 @@ nvinfer1::ILayer* addBottleNeck(
         return add;
     }
     
-    return silu1;
+    return silu2;
 }
 
-// 做一个C2F: (yolov8的模块测试)
-//      convBNSiLU (n * ch)
+// 做一个C2F: (yolov8的模块测试), n个bottleneck依次串起来, 每一个的输出都参与concat
+//      convBNSiLU (2c)
 //       /  |  \
 //      /   |   \
 //     |    |    |
-//     |    | convBNSiLU ( 0.5n * ch)
-//     |    |    |
-//     |    | convBNSiLU ( 0.5n * ch)
-//     |    |    |
-//     |    \    /
-//     |     \  /
-//     |     add (0.5n * ch)
-//      \    /
-//       \  /
-//      Concat (1.5n * ch)
+//     |    | bottleneck m.0 (c)
+//     |    |    |   \
+//     |    |    |  bottleneck m.1 (c) ...
+//     |    |    |    |
+//      \   |   /    /
+//       \  |  /    /
+//      Concat ((2 + n) * c)
 //        |
-//    convBNSiLU (n * ch)
+//    convBNSiLU (2c)
+// 这里c = output_channel / 2, 编译期检查channel的版本见blocks.hpp
 
 nvinfer1::ILayer* addC2F(
     string layer_name, 
@@ -260,28 +351,30 @@ nvinfer1::ILayer* addC2F(
     int output_channel, 
     nvinfer1::DataType prec,
     nvinfer1::INetworkDefinition& network,
-    std::map<std::string, nvinfer1::Weights> weights)
+    const std::map<std::string, nvinfer1::Weights>& weights,
+    int n,
+    bool shortcut)
 {
-    auto cv1     = addConvBNSiLU(layer_name + "cv1.", input, 1, output_channel, 1, 0, prec, network, weights);
+    int  hidden  = output_channel / 2;
+    auto cv1     = addConvBNSiLU(layer_name + "cv1.", input, 1, 2 * hidden, 1, 0, prec, network, weights);
     auto dim     = cv1->getOutput(0)->getDimensions();
 
-    auto slice1  = addSlice(layer_name + "slice1", 
-                            *cv1->getOutput(0), 
-                            nvinfer1::Dims4{0,        0,          0,        0},         // B, C, H, W (0, 0, 0, 0)
-                            nvinfer1::Dims4{dim.d[0], dim.d[1]/2, dim.d[2], dim.d[3]},  // B, 1/2 * C, H, W
-                            nvinfer1::Dims4{1,        1,          1,        1},         // 1, 1, 1, 1
-                            network);
+    // cv1的前一半直接参与concat, 和cv1的输出一起concat等价于split以后的两半, 所以只需要后一半
     auto slice2  = addSlice(layer_name + "slice2", 
                             *cv1->getOutput(0), 
-                            nvinfer1::Dims4{0,        dim.d[1]/2, 0,        0},         // B, C, H, W (0, 1/2 * C, 0, 0)
-                            nvinfer1::Dims4{dim.d[0], dim.d[1]/2, dim.d[2], dim.d[3]},  // B, 1/2 * C, H, W
+                            nvinfer1::Dims4{0,        hidden,     0,        0},         // B, C, H, W (0, 1/2 * C, 0, 0)
+                            nvinfer1::Dims4{dim.d[0], hidden,     dim.d[2], dim.d[3]},  // B, 1/2 * C, H, W
                             nvinfer1::Dims4{1,        1,          1,        1},         // 1, 1, 1, 1
                             network);
 
-    auto add     = addBottleNeck(layer_name + "m.0.", *slice2->getOutput(0), 2, 2, true, prec, network, weights);
-
-    nvinfer1::ITensor* concat2Input[] = {cv1->getOutput(0), add->getOutput(0)};
-    auto concat2 = addConcat(layer_name + "concat2", concat2Input, 2, network);
+    vector<nvinfer1::ITensor*> concatInput = {cv1->getOutput(0)};
+    nvinfer1::ITensor*         tail        = slice2->getOutput(0);
+    for (int i = 0; i < n; i++) {
+        auto m = addBottleNeck(layer_name + "m." + to_string(i) + ".", *tail, hidden, hidden, shortcut, prec, network, weights);
+        tail   = m->getOutput(0);
+        concatInput.push_back(tail);
+    }
+    auto concat2 = addConcat(layer_name + "concat2", concatInput.data(), (int)concatInput.size(), network);
 
     auto cv2     = addConvBNSiLU(layer_name + "cv2.", *concat2->getOutput(0), 1, output_channel, 1, 0, prec, network, weights);
 
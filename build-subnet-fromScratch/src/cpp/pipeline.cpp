@@ -0,0 +1,400 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+
+#include "pipeline.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace pipeline {
+
+static metrics::Counter& framesTotal() {
+    static auto& c = metrics::Registry::instance().counter("trt_pipeline_frames_total", "number of frames that reached the end of a pipeline");
+    return c;
+}
+
+static metrics::Counter& droppedTotal() {
+    static auto& c = metrics::Registry::instance().counter("trt_pipeline_dropped_total", "number of frames dropped by drop-oldest queues");
+    return c;
+}
+
+static metrics::Histogram& latencyHistogram() {
+    static auto& h = metrics::Registry::instance().histogram("trt_pipeline_latency_us", "time from a frame being produced to leaving the pipeline, in microseconds");
+    return h;
+}
+
+static int64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 输入队列: Block用SPSC, DropOldest的时候producer也要pop, 用MPMC
+struct Pipeline::Node {
+    unique_ptr<Stage>                      stage;       // source是nullptr
+    unique_ptr<queue::SpscQueue<FramePtr>> blocking;
+    unique_ptr<queue::MpmcQueue<FramePtr>> evicting;
+    Overflow                               overflow = Overflow::Block;
+    thread                                 worker;
+
+    atomic<uint64_t> frames{0};
+    atomic<uint64_t> dropped{0};
+    atomic<uint64_t> failed{0};
+    atomic<int64_t>  busyNs{0};
+    atomic<int64_t>  starvedNs{0};
+    atomic<int64_t>  blockedNs{0};
+    atomic<uint64_t> occupancySum{0};
+    atomic<uint64_t> occupancySamples{0};
+    atomic<uint64_t> maxOccupancy{0};
+
+    bool   hasInput() const { return blocking != nullptr || evicting != nullptr; }
+    size_t capacity() const { return blocking ? blocking->capacity() : evicting->capacity(); }
+    size_t size() const { return blocking ? blocking->size() : evicting->size(); }
+    bool   tryPop(FramePtr& frame) { return blocking ? blocking->tryPop(frame) : evicting->tryPop(frame); }
+    bool   pop(FramePtr& frame) { return blocking ? blocking->pop(frame) : evicting->pop(frame); }
+    void   close() { blocking ? blocking->close() : evicting->close(); }
+};
+
+Pipeline::Pipeline(unique_ptr<Source> source)
+    : mSource(move(source)), mLatency("pipeline_latency_us", "") {
+    mNodes.emplace_back(new Node());
+}
+
+Pipeline::~Pipeline() {
+    if (mRunning) {
+        stop();
+        wait();
+    }
+}
+
+Pipeline& Pipeline::add(unique_ptr<Stage> stage, size_t depth, Overflow overflow) {
+    if (mRunning) {
+        LOGE("ERROR: cannot add stage %s to a running pipeline", stage->name());
+        return *this;
+    }
+    unique_ptr<Node> node(new Node());
+    node->stage    = move(stage);
+    node->overflow = overflow;
+    if (overflow == Overflow::DropOldest) {
+        node->evicting.reset(new queue::MpmcQueue<FramePtr>(std::max<size_t>(depth, 1)));
+    } else {
+        node->blocking.reset(new queue::SpscQueue<FramePtr>(std::max<size_t>(depth, 1)));
+    }
+    mNodes.push_back(move(node));
+    return *this;
+}
+
+void Pipeline::setSink(function<void(const Frame&)> sink) {
+    mSink = move(sink);
+}
+
+bool Pipeline::start() {
+    if (mRunning) return true;
+    if (mSource == nullptr) {
+        LOGE("ERROR: pipeline has no source");
+        return false;
+    }
+    size_t frames = 2;
+    for (size_t i = 1; i < mNodes.size(); i++) frames += mNodes[i]->capacity() + 1;
+    mRecycle.reset(new queue::MpmcQueue<FramePtr>(frames));
+
+    mStop    = false;
+    mStartNs = nowNs();
+    mEndNs   = 0;
+    mRunning = true;
+    for (size_t i = 1; i < mNodes.size(); i++) {
+        mNodes[i]->worker = thread(&Pipeline::runStage, this, i);
+    }
+    mNodes[0]->worker = thread(&Pipeline::runSource, this);
+
+    string chain = mSource->name();
+    for (size_t i = 1; i < mNodes.size(); i++) {
+        chain += string(" -[") + to_string(mNodes[i]->capacity()) +
+                 (mNodes[i]->overflow == Overflow::DropOldest ? ", drop-oldest]-> " : "]-> ") + mNodes[i]->stage->name();
+    }
+    LOG("pipeline started: %s", chain.c_str());
+    return true;
+}
+
+void Pipeline::stop() {
+    mStop = true;
+}
+
+void Pipeline::wait() {
+    for (auto& node : mNodes) {
+        if (node->worker.joinable()) node->worker.join();
+    }
+    if (mEndNs == 0) mEndNs = nowNs();
+    mRunning = false;
+}
+
+FramePtr Pipeline::allocate() {
+    // source线程自己丢掉的帧放在mSpare里, 其它线程还回来的帧从mRecycle回来
+    FramePtr frame;
+    if (!mSpare.empty()) {
+        frame = move(mSpare.back());
+        mSpare.pop_back();
+    } else if (!mRecycle->tryPop(frame)) {
+        frame.reset(new Frame());
+    }
+    return frame;
+}
+
+void Pipeline::recycle(Node& from, FramePtr frame) {
+    if (&from == mNodes[0].get()) {
+        mSpare.push_back(move(frame));
+    } else {
+        mRecycle->tryPush(move(frame));    // 满的时候直接释放
+    }
+}
+
+void Pipeline::forward(Node& from, size_t next, FramePtr frame) {
+    if (next == mNodes.size()) {
+        int64_t now = nowNs();
+        uint64_t us = (uint64_t)std::max<int64_t>(0, (now - frame->captureNs) / 1000);
+        mLatency.record(us);
+        latencyHistogram().record(us);
+        if (mSink) mSink(*frame);
+        mCompleted.fetch_add(1, memory_order_relaxed);
+        framesTotal().inc();
+        mEndNs.store(now, memory_order_relaxed);
+        recycle(from, move(frame));
+        return;
+    }
+
+    Node& to = *mNodes[next];
+    if (to.overflow == Overflow::DropOldest) {
+        FramePtr evicted;
+        if (size_t dropped = to.evicting->pushEvict(move(frame), evicted)) {
+            to.dropped.fetch_add(dropped, memory_order_relaxed);
+            droppedTotal().inc(dropped);
+            recycle(from, move(evicted));
+        }
+        return;
+    }
+
+    if (to.blocking->tryPush(move(frame))) return;
+    int64_t start = nowNs();
+    to.blocking->push(move(frame));
+    from.blockedNs.fetch_add(nowNs() - start, memory_order_relaxed);
+}
+
+void Pipeline::runSource() {
+    Node& self = *mNodes[0];
+    if (!mSource->open()) {
+        LOGE("ERROR: failed to open source %s", mSource->name());
+    } else {
+        while (!mStop) {
+            FramePtr frame = allocate();
+            int64_t  start = nowNs();
+            bool     ok    = mSource->read(*frame);
+            int64_t  end   = nowNs();
+            self.busyNs.fetch_add(end - start, memory_order_relaxed);
+            if (!ok) break;
+            frame->id        = self.frames.fetch_add(1, memory_order_relaxed);
+            frame->captureNs = end;
+            forward(self, 1, move(frame));
+        }
+        mSource->close();
+    }
+    mSpare.clear();
+    if (mNodes.size() > 1) mNodes[1]->close();
+}
+
+void Pipeline::runStage(size_t index) {
+    Node& self   = *mNodes[index];
+    bool  opened = self.stage->open();
+    if (!opened) {
+        // 继续从队列里取帧并丢掉, 上游不会卡住
+        LOGE("ERROR: failed to open stage %s, its frames will be dropped", self.stage->name());
+    }
+
+    while (true) {
+        size_t   occupancy = self.size();
+        FramePtr frame;
+        if (!self.tryPop(frame)) {
+            // 上一级close以后, 队列里剩下的帧取完pop才返回false
+            int64_t start = nowNs();
+            bool    ok    = self.pop(frame);
+            self.starvedNs.fetch_add(nowNs() - start, memory_order_relaxed);
+            if (!ok) break;
+        }
+        self.occupancySum.fetch_add(occupancy, memory_order_relaxed);
+        self.occupancySamples.fetch_add(1, memory_order_relaxed);
+        if (occupancy > self.maxOccupancy.load(memory_order_relaxed)) {
+            self.maxOccupancy.store(occupancy, memory_order_relaxed);
+        }
+
+        int64_t start = nowNs();
+        bool    ok    = opened && self.stage->process(*frame);
+        self.busyNs.fetch_add(nowNs() - start, memory_order_relaxed);
+        self.frames.fetch_add(1, memory_order_relaxed);
+        if (!ok) {
+            self.failed.fetch_add(1, memory_order_relaxed);
+            recycle(self, move(frame));
+            continue;
+        }
+        forward(self, index + 1, move(frame));
+    }
+
+    if (opened) self.stage->close();
+    if (index + 1 < mNodes.size()) mNodes[index + 1]->close();
+}
+
+double Pipeline::seconds() const {
+    if (mStartNs == 0) return 0;
+    int64_t end = mRunning ? nowNs() : mEndNs.load();
+    return (end - mStartNs) / 1e9;
+}
+
+vector<StageStats> Pipeline::stats() const {
+    vector<StageStats> out;
+    for (size_t i = 0; i < mNodes.size(); i++) {
+        const Node& node = *mNodes[i];
+        StageStats  s;
+        s.name      = i == 0 ? mSource->name() : node.stage->name();
+        s.frames    = node.frames.load();
+        s.dropped   = node.dropped.load();
+        s.failed    = node.failed.load();
+        s.busyMs    = node.busyNs.load() / 1e6;
+        s.starvedMs = node.starvedNs.load() / 1e6;
+        s.blockedMs = node.blockedNs.load() / 1e6;
+        if (node.hasInput()) {
+            uint64_t samples = node.occupancySamples.load();
+            s.capacity       = node.capacity();
+            s.avgOccupancy   = samples == 0 ? 0 : (double)node.occupancySum.load() / samples;
+            s.maxOccupancy   = node.maxOccupancy.load();
+        }
+        out.push_back(s);
+    }
+    return out;
+}
+
+void Pipeline::report() const {
+    double                     elapsed = seconds();
+    double                     wallMs  = std::max(elapsed * 1000, 1e-6);
+    metrics::HistogramSnapshot lat     = latency();
+    LOG("pipeline: %llu frames in %.2f s (%.1f fps), latency p50 %.2f ms, p99 %.2f ms, max %.2f ms",
+        (unsigned long long)completed(), elapsed, elapsed > 0 ? completed() / elapsed : 0.0,
+        lat.percentile(50) / 1000.0, lat.percentile(99) / 1000.0, lat.max == 0 ? 0.0 : lat.max / 1000.0);
+    LOG("    %-12s %8s %8s %6s %8s %8s %14s %8s %7s", "stage", "frames", "fps", "busy", "starved", "blocked",
+        "queue avg/cap", "max", "dropped");
+
+    string bottleneck;
+    double mostBusy = -1;
+    for (auto& s : stats()) {
+        double busy = 100 * s.busyMs / wallMs;
+        if (busy > mostBusy) {
+            mostBusy   = busy;
+            bottleneck = s.name;
+        }
+        char queue[32] = "-";
+        char failed[32] = "";
+        if (s.capacity != 0) snprintf(queue, sizeof(queue), "%.1f/%zu", s.avgOccupancy, s.capacity);
+        if (s.failed != 0)   snprintf(failed, sizeof(failed), " (%llu failed)", (unsigned long long)s.failed);
+        LOG("    %-12s %8llu %8.1f %5.1f%% %7.1f%% %7.1f%% %14s %8zu %7llu%s", s.name.c_str(),
+            (unsigned long long)s.frames, elapsed > 0 ? s.frames / elapsed : 0.0, busy,
+            100 * s.starvedMs / wallMs, 100 * s.blockedMs / wallMs, queue, s.maxOccupancy, (unsigned long long)s.dropped,
+            failed);
+    }
+    LOG("    bottleneck: %s (busy %.1f%%)", bottleneck.c_str(), mostBusy);
+}
+
+/* ------------------------------- stages ------------------------------- */
+
+SyntheticSource::SyntheticSource(int width, int height, double fps, uint64_t frames)
+    : mWidth(width), mHeight(height), mFps(fps), mFrames(frames) {}
+
+bool SyntheticSource::read(Frame& frame) {
+    if (mFrames != 0 && mNext >= mFrames) return false;
+    if (mFps > 0) {
+        // 按照帧率产生, 下游慢的时候不会补帧
+        if (mStartNs == 0) mStartNs = nowNs();
+        int64_t due = mStartNs + (int64_t)(mNext * 1e9 / mFps);
+        int64_t now = nowNs();
+        if (due > now) this_thread::sleep_for(chrono::nanoseconds(due - now));
+    }
+    frame.width    = mWidth;
+    frame.height   = mHeight;
+    frame.channels = 3;
+    frame.pixels.resize((size_t)mWidth * mHeight * 3);
+    // 每一帧整体移动一行的渐变, 代替解码的输出
+    size_t rowBytes = (size_t)mWidth * 3;
+    for (int y = 0; y < mHeight; y++) {
+        memset(frame.pixels.data() + y * rowBytes, (int)((y + mNext) & 0xff), rowBytes);
+    }
+    mNext++;
+    return true;
+}
+
+bool PreprocessStage::process(Frame& frame) {
+    if (frame.pixels.size() < (size_t)frame.width * frame.height * frame.channels || frame.channels != 3) {
+        LOGE("ERROR: frame %llu is not a %dx%d BGR image", (unsigned long long)frame.id, frame.width, frame.height);
+        return false;
+    }
+    size_t area = (size_t)mWidth * mHeight;
+    frame.input.resize(3 * area);
+    float  scaleX = (float)frame.width / mWidth;
+    float  scaleY = (float)frame.height / mHeight;
+    float* r      = frame.input.data();
+    float* g      = r + area;
+    float* b      = g + area;
+    const uint8_t* src = frame.pixels.data();
+    size_t         rowBytes = (size_t)frame.width * 3;
+
+    for (int y = 0; y < mHeight; y++) {
+        float fy = std::max(0.0f, (y + 0.5f) * scaleY - 0.5f);
+        int   y0 = std::min((int)fy, frame.height - 1);
+        int   y1 = std::min(y0 + 1, frame.height - 1);
+        float wy = fy - y0;
+        const uint8_t* row0 = src + y0 * rowBytes;
+        const uint8_t* row1 = src + y1 * rowBytes;
+        for (int x = 0; x < mWidth; x++) {
+            float fx = std::max(0.0f, (x + 0.5f) * scaleX - 0.5f);
+            int   x0 = std::min((int)fx, frame.width - 1);
+            int   x1 = std::min(x0 + 1, frame.width - 1);
+            float wx = fx - x0;
+            float v[3];
+            for (int c = 0; c < 3; c++) {
+                float top    = row0[x0 * 3 + c] + (row0[x1 * 3 + c] - row0[x0 * 3 + c]) * wx;
+                float bottom = row1[x0 * 3 + c] + (row1[x1 * 3 + c] - row1[x0 * 3 + c]) * wx;
+                v[c]         = (top + (bottom - top) * wy) / 255.0f;
+            }
+            size_t i = (size_t)y * mWidth + x;
+            b[i] = v[0];
+            g[i] = v[1];
+            r[i] = v[2];
+        }
+    }
+    return true;
+}
+
+InferFn simulatedInfer(int latencyUs, size_t outputSize) {
+    return [latencyUs, outputSize](const vector<float>& input, vector<float>& output) {
+        // 真正的推理线程大部分时间在等GPU, 所以这里sleep而不是占着CPU
+        auto due = chrono::steady_clock::now() + chrono::microseconds(latencyUs);
+        output.resize(outputSize);
+        for (size_t i = 0; i < outputSize; i++) {
+            output[i] = input.empty() ? 0.0f : input[(i * 7919) % input.size()];
+        }
+        this_thread::sleep_until(due);
+        return true;
+    };
+}
+
+bool TopKStage::process(Frame& frame) {
+    int k = std::min<int>(mK, (int)frame.output.size());
+    mIndex.resize(frame.output.size());
+    iota(mIndex.begin(), mIndex.end(), 0);
+    partial_sort(mIndex.begin(), mIndex.begin() + k, mIndex.end(),
+                 [&](int a, int b) { return frame.output[a] > frame.output[b]; });
+    frame.result.resize(2 * k);
+    for (int i = 0; i < k; i++) {
+        frame.result[2 * i]     = (float)mIndex[i];
+        frame.result[2 * i + 1] = frame.output[mIndex[i]];
+    }
+    return true;
+}
+
+} // namespace pipeline
@@ -0,0 +1,194 @@
+#ifndef __PIPELINE_HPP__
+#define __PIPELINE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+#include "queue.hpp"
+
+// 视频流的多级pipeline: source(decode) -> preprocess -> infer -> postprocess -> sink
+//     - source和每个stage都在自己的线程里运行, 相邻的两级之间是一个有界的无锁队列(queue.hpp),
+//       空/满的时候先spin再park, 不占CPU
+//     - 队列满的时候:
+//           Overflow::Block       上一级等待(backpressure), 离线的视频文件不丢帧
+//           Overflow::DropOldest  丢掉队列里最旧的一帧, 实时的相机只处理最新的帧
+//     - frame处理完以后回到source重用, 稳定以后不会再分配内存
+//     - 每一级统计处理的帧数, 处理的时间, 等输入的时间(starved), 等输出的时间(blocked)和输入队列的占用,
+//       瓶颈是busy接近100%的那一级, 它前面的队列是满的, 后面的stage在starved
+// infer是可以替换的函数, 可以接reload::HotModel, 也可以用simulatedInfer做压测
+
+namespace pipeline {
+
+struct Frame {
+    uint64_t             id        = 0;
+    int64_t              captureNs = 0;    // source产生这一帧的时间(steady_clock)
+    int                  width     = 0;
+    int                  height    = 0;
+    int                  channels  = 3;
+    std::vector<uint8_t> pixels;           // decode之后的HWC, BGR, uint8
+    std::vector<float>   input;            // preprocess之后的CHW float, 交给infer
+    std::vector<float>   output;           // infer的结果
+    std::vector<float>   result;           // postprocess的结果
+};
+
+typedef std::unique_ptr<Frame> FramePtr;
+
+// 产生frame(读文件, 解码, 相机). frame是重用的, 里面的vector保留上一次的容量
+class Source {
+public:
+    virtual ~Source() {}
+    virtual const char* name() const { return "source"; }
+    // 在source自己的线程里调用
+    virtual bool open() { return true; }
+    // 返回false表示流结束
+    virtual bool read(Frame& frame) = 0;
+    virtual void close() {}
+};
+
+class Stage {
+public:
+    virtual ~Stage() {}
+    virtual const char* name() const = 0;
+    // 在stage自己的线程里调用, 需要绑定线程的资源(CUDA stream等)在这里创建
+    virtual bool open() { return true; }
+    // 返回false的时候丢掉这一帧
+    virtual bool process(Frame& frame) = 0;
+    virtual void close() {}
+};
+
+enum class Overflow { Block, DropOldest };
+
+struct StageStats {
+    std::string name;
+    uint64_t    frames       = 0;
+    uint64_t    dropped      = 0;     // 输入队列满的时候被丢掉的帧
+    uint64_t    failed       = 0;     // process返回false
+    double      busyMs       = 0;     // 在read/process里的时间(限速的source包括等下一帧的时间)
+    double      starvedMs    = 0;     // 等输入的时间
+    double      blockedMs    = 0;     // 等下一级队列有空位的时间
+    size_t      capacity     = 0;     // 输入队列的长度, source是0
+    double      avgOccupancy = 0;     // 每次取输入的时候队列里的帧数的平均
+    size_t      maxOccupancy = 0;
+};
+
+class Pipeline {
+public:
+    explicit Pipeline(std::unique_ptr<Source> source);
+    ~Pipeline();
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    // stage按add的顺序连接, depth和overflow是这个stage的输入队列
+    Pipeline& add(std::unique_ptr<Stage> stage, size_t depth = 4, Overflow overflow = Overflow::Block);
+    // 最后一个stage处理完以后在它的线程上调用
+    void setSink(std::function<void(const Frame& frame)> sink);
+
+    bool start();
+    // source停止产生新的帧, 已经在队列里的帧会处理完
+    void stop();
+    // 等source结束并且所有的帧处理完
+    void wait();
+    bool running() const { return mRunning; }
+
+    // 第0个是source
+    std::vector<StageStats> stats() const;
+    double                  seconds() const;
+    uint64_t                completed() const { return mCompleted.load(std::memory_order_relaxed); }
+    // source产生到sink的延迟
+    metrics::HistogramSnapshot latency() const { return mLatency.snapshot(); }
+    void                    report() const;
+
+private:
+    struct Node;
+
+    void runSource();
+    void runStage(size_t index);
+    void forward(Node& from, size_t next, FramePtr frame);
+    FramePtr allocate();
+    // 用完, 被drop-oldest挤掉或者处理失败的帧都还给source, from是调用的线程所在的node
+    void recycle(Node& from, FramePtr frame);
+
+private:
+    std::unique_ptr<Source>            mSource;
+    std::vector<std::unique_ptr<Node>> mNodes;      // 第0个是source
+    std::function<void(const Frame&)>  mSink;
+    // 其它线程把frame还给source, 最后一个stage和每一个丢帧的stage都会push, 所以是MPMC
+    std::unique_ptr<queue::MpmcQueue<FramePtr>> mRecycle;
+    // source线程自己drop-oldest丢掉的帧, 只有source线程访问
+    std::vector<FramePtr>                       mSpare;
+
+    std::atomic<bool>     mStop{false};
+    bool                  mRunning = false;
+    int64_t               mStartNs = 0;
+    std::atomic<int64_t>  mEndNs{0};
+    std::atomic<uint64_t> mCompleted{0};
+    metrics::Histogram    mLatency;
+};
+
+/* ------------------------------- stages ------------------------------- */
+
+// 合成的视频源: width x height的BGR帧, fps为0的时候不限速, frames为0的时候一直产生
+class SyntheticSource : public Source {
+public:
+    SyntheticSource(int width, int height, double fps = 0, uint64_t frames = 0);
+    const char* name() const override { return "synthetic"; }
+    bool        read(Frame& frame) override;
+
+private:
+    int      mWidth;
+    int      mHeight;
+    double   mFps;
+    uint64_t mFrames;
+    uint64_t mNext   = 0;
+    int64_t  mStartNs = 0;
+};
+
+// 双线性resize到width x height, BGR->RGB, /255, HWC->CHW
+class PreprocessStage : public Stage {
+public:
+    PreprocessStage(int width, int height) : mWidth(width), mHeight(height) {}
+    const char* name() const override { return "preprocess"; }
+    bool        process(Frame& frame) override;
+
+private:
+    int mWidth;
+    int mHeight;
+};
+
+typedef std::function<bool(const std::vector<float>& input, std::vector<float>& output)> InferFn;
+
+// frame.input -> frame.output
+class InferStage : public Stage {
+public:
+    explicit InferStage(InferFn fn) : mFn(std::move(fn)) {}
+    const char* name() const override { return "infer"; }
+    bool        process(Frame& frame) override { return mFn(frame.input, frame.output); }
+
+private:
+    InferFn mFn;
+};
+
+// 压测用的假推理: 每次占用latencyUs, output是outputSize个数
+InferFn simulatedInfer(int latencyUs, size_t outputSize);
+
+// 分类的后处理: frame.result是分数最高的k个(index, score)
+class TopKStage : public Stage {
+public:
+    explicit TopKStage(int k) : mK(k) {}
+    const char* name() const override { return "postprocess"; }
+    bool        process(Frame& frame) override;
+
+private:
+    int              mK;
+    std::vector<int> mIndex;     // 每一帧都复用, 不再分配
+};
+
+} // namespace pipeline
+
+#endif //__PIPELINE_HPP__
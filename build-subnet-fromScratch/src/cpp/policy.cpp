@@ -0,0 +1,357 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <set>
+
+#include "policy.hpp"
+#include "calibrator.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace policy {
+
+static bool parsePrecision(const string& str, nvinfer1::DataType& prec) {
+    if (str == "fp32")      prec = nvinfer1::DataType::kFLOAT;
+    else if (str == "fp16") prec = nvinfer1::DataType::kHALF;
+    else if (str == "int8") prec = nvinfer1::DataType::kINT8;
+    else return false;
+    return true;
+}
+
+static const char* precisionName(nvinfer1::DataType prec) {
+    switch (prec) {
+        case nvinfer1::DataType::kHALF: return "fp16";
+        case nvinfer1::DataType::kINT8: return "int8";
+        default:                        return "fp32";
+    }
+}
+
+static bool matchRule(const string& pattern, const string& layer) {
+    if (!pattern.empty() && pattern[0] == '=') return pattern.compare(1, string::npos, layer) == 0;
+    return globMatch(pattern, layer);
+}
+
+bool PrecisionPolicy::load(const string& path) {
+    ifstream f(path);
+    if (!f.is_open()) {
+        LOGE("ERROR: failed to open %s", path.c_str());
+        return false;
+    }
+
+    mRules.clear();
+    string line;
+    int    lineNo = 0;
+    while (getline(f, line)) {
+        lineNo++;
+        // 层名里可能有空格, 精度后面的整行都是pattern
+        size_t begin = line.find_first_not_of(" \t");
+        if (begin == string::npos || line[begin] == '#') continue;
+        size_t end     = line.find_first_of(" \t", begin);
+        size_t pattern = end == string::npos ? string::npos : line.find_first_not_of(" \t", end);
+        size_t last    = line.find_last_not_of(" \t\r");
+
+        nvinfer1::DataType prec;
+        if (pattern == string::npos || !parsePrecision(line.substr(begin, end - begin), prec)) {
+            LOGE("ERROR: %s:%d: expected \"<fp32|fp16|int8> <layer>\"", path.c_str(), lineNo);
+            return false;
+        }
+        add(line.substr(pattern, last + 1 - pattern), prec);
+    }
+    LOG("loaded %zu precision rules from %s", mRules.size(), path.c_str());
+    return true;
+}
+
+bool PrecisionPolicy::save(const string& path) const {
+    string text = "# <fp32|fp16|int8> <layer>, first match wins, '=' means exact name\n";
+    for (auto& r : mRules) text += string(precisionName(r.prec)) + " " + r.pattern + "\n";
+    return calib::writeCalibrationCache(path, text.data(), text.size());
+}
+
+bool PrecisionPolicy::lookup(const string& layer, nvinfer1::DataType& prec) const {
+    for (auto& r : mRules) {
+        if (matchRule(r.pattern, layer)) {
+            prec = r.prec;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PrecisionPolicy::uses(nvinfer1::DataType prec) const {
+    for (auto& r : mRules) {
+        if (r.prec == prec) return true;
+    }
+    return false;
+}
+
+static bool isFloat(nvinfer1::DataType type) {
+    return type == nvinfer1::DataType::kFLOAT || type == nvinfer1::DataType::kHALF;
+}
+
+int PrecisionPolicy::apply(nvinfer1::INetworkDefinition& network, bool allowInt8) const {
+    int count = 0, ignored = 0;
+    for (int i = 0; i < network.getNbLayers(); i++) {
+        auto               layer = network.getLayer(i);
+        nvinfer1::DataType prec;
+        if (!lookup(layer->getName(), prec)) continue;
+
+        auto type = layer->getType();
+        if (type == nvinfer1::LayerType::kCONSTANT || type == nvinfer1::LayerType::kSHAPE ||
+            type == nvinfer1::LayerType::kQUANTIZE || type == nvinfer1::LayerType::kDEQUANTIZE) {
+            continue;
+        }
+        bool floatOutputs = true;
+        for (int j = 0; j < layer->getNbOutputs(); j++) floatOutputs = floatOutputs && isFloat(layer->getOutput(j)->getType());
+        if (!floatOutputs) continue;
+        if (prec == nvinfer1::DataType::kINT8 && !allowInt8) {
+            ignored++;
+            continue;
+        }
+
+        layer->setPrecision(prec);
+        // INT8的输出类型需要scale, 交给TensorRT决定
+        if (prec != nvinfer1::DataType::kINT8) {
+            for (int j = 0; j < layer->getNbOutputs(); j++) layer->setOutputType(j, prec);
+        }
+        LOGV("%-40s -> %s", layer->getName(), precisionName(prec));
+        count++;
+    }
+    if (ignored > 0) {
+        LOGW("%d layers are set to int8 in a non-INT8 build, ignored", ignored);
+    }
+    return count;
+}
+
+/* ------------------------------- search ------------------------------- */
+
+static PrecisionPolicy makePolicy(const vector<string>& promoted, nvinfer1::DataType base) {
+    PrecisionPolicy p;
+    for (auto& l : promoted) p.add("=" + l, nvinfer1::DataType::kFLOAT);
+    p.add("*", base);
+    return p;
+}
+
+// 逐层的误差会往后累积, 一层自己的贡献近似为它的误差减去前面所有层的最大误差
+static map<string, double> contributions(const vector<string>& layers, const map<string, double>& errors) {
+    map<string, double> result;
+    double              upstream = 0;
+    for (auto& l : layers) {
+        auto it = errors.find(l);
+        if (it == errors.end()) continue;
+        result[l] = it->second - upstream;
+        upstream  = max(upstream, it->second);
+    }
+    return result;
+}
+
+SearchResult search(const vector<string>& layers, nvinfer1::DataType base, double targetError,
+                    AccuracyOracle accuracy, LatencyOracle latency, int maxSteps) {
+    SearchResult   result;
+    vector<string> promoted;
+    set<string>    used;
+    if (maxSteps <= 0) maxSteps = (int)layers.size();
+
+    auto evaluate = [&](const vector<string>& p) {
+        result.evaluations++;
+        return accuracy(makePolicy(p, base));
+    };
+
+    Accuracy current = evaluate(promoted);
+    while (true) {
+        Trial t;
+        t.promoted   = promoted.empty() ? "" : promoted.back();
+        t.fp32Layers = (int)promoted.size();
+        t.error      = current.error;
+        t.latencyMs  = latency(makePolicy(promoted, base));
+        result.trials.push_back(t);
+        LOG("step %d: %d fp32 layers, error %.6g, latency %.3f ms", (int)result.trials.size() - 1,
+            t.fp32Layers, t.error, t.latencyMs);
+
+        if (current.error <= targetError) {
+            result.met = true;
+            break;
+        }
+        if ((int)promoted.size() >= maxSteps || used.size() == layers.size()) break;
+
+        // 有逐层的误差时直接选贡献最大的层
+        string   next;
+        Accuracy nextAccuracy;
+        bool     evaluated = false;
+        double   worst     = -numeric_limits<double>::infinity();
+        for (auto& c : contributions(layers, current.layerErrors)) {
+            if (used.count(c.first) == 0 && c.second > worst) {
+                worst = c.second;
+                next  = c.first;
+            }
+        }
+
+        // 否则每个候选层单独放回FP32试一次
+        if (next.empty()) {
+            double best = numeric_limits<double>::infinity();
+            for (auto& l : layers) {
+                if (used.count(l)) continue;
+                vector<string> trial = promoted;
+                trial.push_back(l);
+                Accuracy a = evaluate(trial);
+                if (a.error < best) {
+                    best         = a.error;
+                    next         = l;
+                    nextAccuracy = a;
+                    evaluated    = true;
+                }
+            }
+        }
+        if (next.empty()) break;
+
+        promoted.push_back(next);
+        used.insert(next);
+        current = evaluated ? nextAccuracy : evaluate(promoted);
+    }
+
+    result.policy = makePolicy(promoted, base);
+    return result;
+}
+
+void report(const SearchResult& result, double targetError) {
+    if (result.trials.empty()) return;
+    double base = result.trials[0].latencyMs;
+    LOG("%-5s %-40s %6s %14s %12s %10s", "step", "promoted to fp32", "fp32", "error", "latency ms", "vs base");
+    for (size_t i = 0; i < result.trials.size(); i++) {
+        auto& t = result.trials[i];
+        LOG("%-5zu %-40s %6d %14.6g %12.3f %+9.1f%%", i, t.promoted.empty() ? "-" : t.promoted.c_str(),
+            t.fp32Layers, t.error, t.latencyMs, base > 0 ? 100.0 * (t.latencyMs - base) / base : 0.0);
+    }
+    auto& last = result.trials.back();
+    if (result.met) {
+        LOG("target error %.6g met with %d fp32 layers after %d evaluations", targetError, last.fp32Layers, result.evaluations);
+    } else {
+        LOGW("target error %.6g not met, best error %.6g with %d fp32 layers", targetError, last.error, last.fp32Layers);
+    }
+}
+
+/* ------------------------------- Model ------------------------------- */
+
+namespace {
+
+// 一次build + infer同时得到误差和延迟, 同一个policy的第二次调用直接用上一次的结果
+class ModelEvaluator {
+public:
+    ModelEvaluator(const string& modelPath, Model::precision prec, const string& refDir) :
+        mModelPath(modelPath), mPrec(prec), mRefDir(refDir) {
+        string engine = getEnginePath(modelPath, prec);
+        mEnginePath   = engine.substr(0, engine.rfind(".engine")) + "_search.engine";
+        mDebugPath    = engine.substr(0, engine.rfind(".engine")) + "_search_debug.engine";
+        mPolicyPath   = engine.substr(0, engine.rfind(".engine")) + "_search.policy";
+    }
+    ~ModelEvaluator() {
+        remove(mEnginePath.c_str());
+        remove(mDebugPath.c_str());
+        remove(mPolicyPath.c_str());
+    }
+
+    bool evaluate(const PrecisionPolicy& policy) {
+        string key;
+        for (auto& r : policy.rules()) key += string(precisionName(r.prec)) + " " + r.pattern + "\n";
+        if (key == mKey) return mOk;
+        mKey = key;
+        mOk  = false;
+
+        remove(mEnginePath.c_str());
+        if (!policy.save(mPolicyPath)) return false;
+
+        // 计时用的engine不带debug output, 每一层的输出都拷出来的话延迟和部署的engine不一样
+        Model model(mModelPath, mPrec);
+        model.setEnginePath(mEnginePath);
+        model.setPrecisionPolicy(mPolicyPath);
+        model.setReferenceDir(mRefDir);
+        if (!model.build()) return false;
+
+        // 取几次里最快的, 排除第一次的warmup
+        mLatencyMs = numeric_limits<double>::infinity();
+        for (int i = 0; i < kRuns; i++) {
+            if (!model.infer()) return false;
+            mLatencyMs = min(mLatencyMs, model.lastLatencyMs());
+        }
+        collectErrors(model);
+        if (mLayers.empty()) mLayers = model.layerNames();
+
+#ifdef DEBUG_TENSORS
+        // 逐层的误差用另外一个带debug output的engine, 只跑一次, 不计时.
+        // setDebugTensors会修改engine的路径, 需要在setEnginePath之前
+        remove(mDebugPath.c_str());
+        Model debug(mModelPath, mPrec);
+        debug.setDebugTensors({"*"});
+        debug.setEnginePath(mDebugPath);
+        debug.setPrecisionPolicy(mPolicyPath);
+        debug.setReferenceDir(mRefDir);
+        if (!debug.build() || !debug.infer()) return false;
+        collectErrors(debug);
+#endif
+        mOk = true;
+        return true;
+    }
+
+    const Accuracy&        accuracy() const { return mAccuracy; }
+    double                 latencyMs() const { return mLatencyMs; }
+    const vector<string>&  layers() const { return mLayers; }
+
+private:
+    static const int kRuns = 3;
+
+    void collectErrors(Model& model) {
+        mAccuracy = Accuracy();
+        for (auto& e : model.lastErrors()) {
+            if (e.first == "output0") mAccuracy.error = e.second;
+            else                      mAccuracy.layerErrors[e.first] = e.second;
+        }
+    }
+
+    string         mModelPath;
+    Model::precision mPrec;
+    string         mRefDir;
+    string         mEnginePath;
+    string         mDebugPath;
+    string         mPolicyPath;
+    string         mKey;
+    bool           mOk        = false;
+    Accuracy       mAccuracy;
+    double         mLatencyMs = 0;
+    vector<string> mLayers;
+};
+
+} // namespace
+
+bool searchModel(const string& modelPath, Model::precision prec, const string& refDir,
+                 double targetError, const string& outPolicy, int maxSteps) {
+    nvinfer1::DataType base = prec == Model::INT8 ? nvinfer1::DataType::kINT8 : nvinfer1::DataType::kHALF;
+    ModelEvaluator     evaluator(modelPath, prec, refDir);
+
+    // 先用统一的精度build一次, 拿到所有的层名
+    if (!evaluator.evaluate(makePolicy({}, base)) || evaluator.layers().empty()) {
+        LOGE("ERROR: failed to evaluate %s", modelPath.c_str());
+        return false;
+    }
+
+    bool ok  = true;
+    auto acc = [&](const PrecisionPolicy& p) {
+        if (!evaluator.evaluate(p)) {
+            ok = false;
+            Accuracy failed;
+            failed.error = numeric_limits<double>::infinity();
+            return failed;
+        }
+        return evaluator.accuracy();
+    };
+    auto lat = [&](const PrecisionPolicy& p) {
+        return evaluator.evaluate(p) ? evaluator.latencyMs() : 0.0;
+    };
+
+    SearchResult result = search(evaluator.layers(), base, targetError, acc, lat, maxSteps);
+    report(result, targetError);
+    if (!ok) LOGW("some of the trials failed to build or run");
+    return result.policy.save(outPolicy) && result.met;
+}
+
+} // namespace policy
@@ -0,0 +1,90 @@
+#ifndef __POLICY_HPP__
+#define __POLICY_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+
+#include "NvInfer.h"
+#include "model.hpp"
+
+// 按层指定精度(Model::setPrecisionPolicy), 以及自动搜索哪些层需要回到FP32
+// policy文件每一行是"<fp32|fp16|int8> <层名>", #开头的是注释, 按顺序匹配, 第一条匹配上的生效:
+//     fp32 cv1.*
+//     fp32 =(Unnamed Layer* 3) [Convolution]    <- =开头的是完整的层名, 不做通配
+//     fp16 *
+// 匹配不上的层保持build时统一的精度. INT8需要calibration或者Q/DQ, 只在INT8的build里生效
+//
+// search从全部FP16/INT8开始, 每一步把误差贡献最大的一层放回FP32, 直到误差满足要求
+//     - 精度和延迟由oracle提供, Model的实现见searchModel, 也可以换成别的(例如CPU上的模拟)
+//     - oracle给出了每一层的误差(逐层对比, 误差会往后累积)的时候, 一层的贡献近似为
+//       它的误差减去前面所有层误差的最大值, 一次评估就可以选出下一层
+//     - 没有逐层误差的时候, 把每个候选层单独放回FP32试一次, 选误差最小的(每一步评估n次)
+
+namespace policy {
+
+struct Rule {
+    std::string        pattern;
+    nvinfer1::DataType prec;
+};
+
+class PrecisionPolicy {
+public:
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+
+    void add(const std::string& pattern, nvinfer1::DataType prec) { mRules.push_back(Rule{pattern, prec}); }
+    // 找不到匹配的规则的时候返回false
+    bool lookup(const std::string& layer, nvinfer1::DataType& prec) const;
+    bool uses(nvinfer1::DataType prec) const;
+    const std::vector<Rule>& rules() const { return mRules; }
+
+    // 设置匹配上的层的精度和输出类型, 返回设置了多少层
+    // 常量, shape, Q/DQ, 以及输出不是浮点的层不会被修改, allowInt8为false的时候忽略INT8的规则
+    int apply(nvinfer1::INetworkDefinition& network, bool allowInt8) const;
+
+private:
+    std::vector<Rule> mRules;
+};
+
+/* ------------------------------- search ------------------------------- */
+
+struct Accuracy {
+    double                        error = 0;     // 越小越好, 例如1 - cosine
+    std::map<std::string, double> layerErrors;   // 可选, 每一层的输出和参考值的误差
+};
+
+typedef std::function<Accuracy(const PrecisionPolicy& policy)> AccuracyOracle;
+typedef std::function<double(const PrecisionPolicy& policy)>   LatencyOracle;    // ms
+
+struct Trial {
+    std::string promoted;     // 这一步放回FP32的层, 第一步为空
+    int         fp32Layers = 0;
+    double      error      = 0;
+    double      latencyMs  = 0;
+};
+
+struct SearchResult {
+    PrecisionPolicy    policy;
+    std::vector<Trial> trials;
+    bool               met         = false;
+    int                evaluations = 0;    // accuracy oracle被调用的次数
+};
+
+// layers是network里按顺序的层名, base是开始时所有层的精度
+// maxSteps为0的时候最多把所有层都放回FP32
+SearchResult search(const std::vector<std::string>& layers, nvinfer1::DataType base, double targetError,
+                    AccuracyOracle accuracy, LatencyOracle latency, int maxSteps = 0);
+
+void report(const SearchResult& result, double targetError);
+
+// 用Model作为oracle: 每次用不同的policy重新build一个临时的engine, 和refDir里的参考值对比
+//     误差是output0的1 - cosine, DEBUG=1编译的时候会mark所有的层, 有逐层的误差
+// 搜索的结果保存到outPolicy
+bool searchModel(const std::string& modelPath, Model::precision prec, const std::string& refDir,
+                 double targetError, const std::string& outPolicy, int maxSteps = 0);
+
+} // namespace policy
+
+#endif //__POLICY_HPP__
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "quant.hpp"
+#include "entropy.hpp"
+#include "calibrator.hpp"
+#include "half.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace quant {
+
+static inline uint32_t floatBits(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+// 原来用ifstream >> std::hex一个一个读, 大一点的模型parse的时间比build还长
+// 这里把整个文件读进来以后手动parse
+static inline int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+bool readWeights(const string& path, vector<WeightEntry>& entries) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == nullptr) {
+        LOGE("ERROR: %s not found", path.c_str());
+        return false;
+    }
+    string text;
+    fseek(f, 0, SEEK_END);
+    text.resize(ftell(f));
+    fseek(f, 0, SEEK_SET);
+    size_t n = fread(&text[0], 1, text.size(), f);
+    fclose(f);
+    text.resize(n);
+
+    const char* p   = text.c_str();
+    const char* end = p + text.size();
+    auto skipSpace  = [&]() { while (p < end && isspace((unsigned char)*p)) p++; };
+    auto readToken  = [&]() {
+        skipSpace();
+        const char* begin = p;
+        while (p < end && !isspace((unsigned char)*p)) p++;
+        return string(begin, p);
+    };
+
+    long size = strtol(readToken().c_str(), nullptr, 10);
+    entries.clear();
+    entries.reserve(std::max(0L, size));
+    for (long i = 0; i < size; i++) {
+        WeightEntry entry;
+        entry.name = readToken();
+        long length = strtol(readToken().c_str(), nullptr, 10);
+        if (entry.name.empty() || length < 0) {
+            LOGE("ERROR: %s is truncated after %ld weights", path.c_str(), i);
+            return false;
+        }
+        entry.bits.resize(length);
+        for (long k = 0; k < length; k++) {
+            skipSpace();
+            uint32_t v      = 0;
+            int      digits = 0;
+            for (int d; p < end && (d = hexDigit(*p)) >= 0; p++, digits++) {
+                v = (v << 4) | d;
+            }
+            if (digits == 0 || digits > 8) {
+                LOGE("ERROR: %s has a bad value in %s", path.c_str(), entry.name.c_str());
+                return false;
+            }
+            if (k == 0 && digits <= 4) entry.type = nvinfer1::DataType::kHALF;
+            entry.bits[k] = v;
+        }
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
+
+bool writeWeights(const string& path, const vector<WeightEntry>& entries) {
+    // 和export_*.py写出来的格式保持一致: [name][len][weights value in hex mode], half只写4位
+    string text = to_string(entries.size()) + "\n";
+    char   hex[16];
+    for (auto& entry : entries) {
+        const char* format = entry.type == nvinfer1::DataType::kHALF ? " %04x" : " %08x";
+        text += entry.name + " " + to_string(entry.bits.size());
+        for (auto bits : entry.bits) {
+            snprintf(hex, sizeof(hex), format, bits);
+            text += hex;
+        }
+        text += "\n";
+    }
+    return calib::writeCalibrationCache(path, text.data(), text.size());
+}
+
+static int64_t countOf(const vector<WeightEntry>& entries, const string& name) {
+    for (auto& e : entries) {
+        if (e.name == name) return e.bits.size();
+    }
+    return 0;
+}
+
+int64_t convOutputChannels(const vector<WeightEntry>& entries, size_t i) {
+    const string  suffix = ".weight";
+    const string& name   = entries[i].name;
+    if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+        return 0;
+    }
+    string layer = name.substr(0, name.size() - suffix.size());
+    if (countOf(entries, layer + ".running_var") > 0) return 0;  // BN的gamma
+
+    // output channel的个数: conv自己有bias的时候就是bias的长度, 否则看后面的BN(xxx.conv -> xxx.norm)
+    int64_t channels = countOf(entries, layer + ".bias");
+    if (channels == 0 && layer.size() >= 4 && layer.compare(layer.size() - 4, 4, "conv") == 0) {
+        channels = countOf(entries, layer.substr(0, layer.size() - 4) + "norm.running_var");
+    }
+    if (channels == 0 || entries[i].bits.size() % channels != 0) {
+        LOGV("%s is not a conv weight, skipped", name.c_str());
+        return 0;
+    }
+    return channels;
+}
+
+vector<float> toFloat(const WeightEntry& entry) {
+    vector<float> w(entry.bits.size());
+    for (size_t k = 0; k < w.size(); k++) {
+        uint32_t bits = entry.bits[k];
+        if (entry.type == nvinfer1::DataType::kHALF) w[k] = fp16::halfToFloat((uint16_t)bits);
+        else memcpy(&w[k], &bits, sizeof(float));
+    }
+    return w;
+}
+
+vector<float> perChannelScales(const float* w, int64_t count, int channels) {
+    vector<float> scales(channels, 0);
+    int64_t       perChannel = count / channels;
+    for (int c = 0; c < channels; c++) {
+        scales[c] = std::max(calib::absMax(w + c * perChannel, perChannel, 1), 1e-8f) / 127.0f;
+    }
+    return scales;
+}
+
+bool addQuantScales(const string& wtsPath, const string& calibTable) {
+    vector<WeightEntry> entries;
+    if (!readWeights(wtsPath, entries)) return false;
+
+    map<string, size_t> index;
+    for (size_t i = 0; i < entries.size(); i++) index[entries[i].name] = i;
+
+    // 已经存在的scale直接覆盖, 否则加到最后
+    auto put = [&](const string& name, const vector<float>& values) {
+        WeightEntry entry;
+        entry.name = name;
+        for (auto v : values) entry.bits.push_back(floatBits(v));
+        auto it = index.find(name);
+        if (it != index.end()) {
+            entries[it->second] = std::move(entry);
+        } else {
+            index[name] = entries.size();
+            entries.push_back(std::move(entry));
+        }
+    };
+
+    int convs = 0;
+    for (size_t i = 0, n = entries.size(); i < n; i++) {
+        int64_t channels = convOutputChannels(entries, i);
+        if (channels == 0) continue;
+
+        string layer = entries[i].name.substr(0, entries[i].name.rfind(".weight"));
+        vector<float> w = toFloat(entries[i]);
+        put(layer + ".weight_scale", perChannelScales(w.data(), w.size(), (int)channels));
+        convs++;
+    }
+
+    int acts = 0;
+    if (!calibTable.empty()) {
+        map<string, float> scales;
+        if (!calib::readCalibrationTable(calibTable, scales)) return false;
+        for (auto& s : scales) {
+            // .weights按空格分隔, 名字里有空格写出去就读不回来了(没有用network::nameTensors命名的tensor)
+            if (s.first.find_first_of(" \t\n") != string::npos) {
+                LOGE("ERROR: tensor name \"%s\" in %s contains whitespace, "
+                     "the cache was not written for a network with named tensors", s.first.c_str(), calibTable.c_str());
+                return false;
+            }
+            put(s.first + ".act_scale", {s.second});
+            acts++;
+        }
+    }
+
+    if (!writeWeights(wtsPath, entries)) return false;
+    LOG("added %d per-channel weight scales and %d activation scales to %s", convs, acts, wtsPath.c_str());
+    return true;
+}
+
+} // namespace quant
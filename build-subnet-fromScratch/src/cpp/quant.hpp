@@ -0,0 +1,42 @@
+#ifndef __QUANT_HPP__
+#define __QUANT_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include "NvInfer.h"
+
+// 显式量化(Q/DQ)需要的scale, 离线计算以后和权重一起保存在.weights里:
+//     xxx.conv.weight_scale  每个output channel一个, 对称量化, scale = max(|w|) / 127
+//     xxx.act_scale          每个activation一个(名字是产生它的层的名字, 网络的输入就是input0)
+// network::parser::addConv2d在INT8的时候如果找到了这两种scale, 就会插入IQuantizeLayer/IDequantizeLayer,
+// 不再依赖setPrecision + kPREFER_PRECISION_CONSTRAINTS这种soft的约束
+
+namespace quant {
+
+// .weights的格式: 第一行是tensor的个数, 之后每一行是[name][len][values in hex]
+// 保持文件里的顺序, 数值保留原始的bit. 8位的hex是float, 4位的hex是half(fp16::convertWeights)
+struct WeightEntry {
+    std::string           name;
+    nvinfer1::DataType    type = nvinfer1::DataType::kFLOAT;
+    std::vector<uint32_t> bits;
+};
+
+bool readWeights(const std::string& path, std::vector<WeightEntry>& entries);
+bool writeWeights(const std::string& path, const std::vector<WeightEntry>& entries);
+
+// entries[i]是conv的kernel的时候返回output channel的个数(从bias或者后面的BN的长度得到), 否则返回0
+int64_t            convOutputChannels(const std::vector<WeightEntry>& entries, size_t i);
+std::vector<float> toFloat(const WeightEntry& entry);
+
+// w的layout是[K, C, kh, kw], 每个K一个scale. 全是0的channel给一个很小的scale
+std::vector<float> perChannelScales(const float* w, int64_t count, int channels);
+
+// 给wtsPath里所有的conv weight计算per-channel scale, calibTable不为空的时候把里面的activation scale也写进去
+// 结果直接覆盖wtsPath(先写临时文件再rename), 重复执行会更新已有的scale
+bool addQuantScales(const std::string& wtsPath, const std::string& calibTable = "");
+
+} // namespace quant
+
+#endif //__QUANT_HPP__
@@ -0,0 +1,226 @@
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+
+#include "queue.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace queue {
+
+int maxSpin() {
+    static const int spin = thread::hardware_concurrency() > 1 ? 4000 : 0;
+    return spin;
+}
+
+namespace {
+
+// 元素是(producer << 40) | seq
+const int kSeqBits = 40;
+
+struct Check {
+    vector<uint64_t> count;
+    vector<uint64_t> sum;
+    vector<uint64_t> last;     // 这个consumer看到的每个producer的上一个seq + 1
+    bool             ordered = true;
+
+    explicit Check(int producers) : count(producers), sum(producers), last(producers) {}
+
+    void see(uint64_t item) {
+        size_t   p   = item >> kSeqBits;
+        uint64_t seq = item & ((1ull << kSeqBits) - 1);
+        if (p >= count.size()) {
+            ordered = false;
+            return;
+        }
+        // 同一个producer的元素在一个consumer上必须按push的顺序出现
+        if (seq + 1 <= last[p]) ordered = false;
+        last[p] = seq + 1;
+        count[p]++;
+        sum[p] += seq;
+    }
+};
+
+template <typename Q>
+BenchResult run(Q& q, BenchResult result, uint64_t items) {
+    int    producers = result.producers;
+    int    consumers = result.consumers;
+    size_t batch     = result.batch;
+
+    vector<unique_ptr<Check>> checks;
+    for (int c = 0; c < consumers; c++) checks.emplace_back(new Check(producers));
+
+    auto           start = chrono::steady_clock::now();
+    vector<thread> consumerThreads;
+    for (int c = 0; c < consumers; c++) {
+        consumerThreads.emplace_back([&q, &checks, c, batch]() {
+            Check&           check = *checks[c];
+            vector<uint64_t> buffer(batch);
+            while (true) {
+                size_t n = batch > 1 ? q.popBatch(buffer.data(), batch) : (q.pop(buffer[0]) ? 1 : 0);
+                if (n == 0) break;
+                for (size_t i = 0; i < n; i++) check.see(buffer[i]);
+            }
+        });
+    }
+    vector<thread> producerThreads;
+    for (int p = 0; p < producers; p++) {
+        producerThreads.emplace_back([&q, p, items, batch]() {
+            uint64_t         base = (uint64_t)p << kSeqBits;
+            vector<uint64_t> buffer(batch);
+            for (uint64_t i = 0; i < items;) {
+                size_t n = (size_t)std::min<uint64_t>(batch, items - i);
+                for (size_t k = 0; k < n; k++) buffer[k] = base | (i + k);
+                if (batch > 1) {
+                    q.pushBatch(buffer.data(), n);
+                } else {
+                    q.push(move(buffer[0]));
+                }
+                i += n;
+            }
+        });
+    }
+    for (auto& t : producerThreads) t.join();
+    q.close();
+    for (auto& t : consumerThreads) t.join();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // 每个producer的元素都被取出了一次: 个数和seq的和都对
+    result.ok = true;
+    for (int p = 0; p < producers; p++) {
+        uint64_t count = 0, sum = 0;
+        for (auto& check : checks) {
+            count += check->count[p];
+            sum   += check->sum[p];
+            result.ok = result.ok && check->ordered;
+        }
+        result.ok = result.ok && count == items && sum == items * (items - 1) / 2;
+    }
+    return result;
+}
+
+} // namespace
+
+BenchResult benchmark(const string& kind, int producers, int consumers, uint64_t items, size_t capacity, size_t batch) {
+    BenchResult result;
+    result.kind      = kind;
+    result.producers = std::max(producers, 1);
+    result.consumers = std::max(consumers, 1);
+    result.batch     = std::max<size_t>(batch, 1);
+    result.items     = items * result.producers;
+
+    if (kind == "spsc") {
+        if (result.producers != 1 || result.consumers != 1) {
+            LOGE("ERROR: spsc queue supports exactly one producer and one consumer");
+            return result;
+        }
+        unique_ptr<SpscQueue<uint64_t>> q(new SpscQueue<uint64_t>(capacity));
+        return run(*q, result, items);
+    }
+    if (kind == "mpmc") {
+        unique_ptr<MpmcQueue<uint64_t>> q(new MpmcQueue<uint64_t>(capacity));
+        return run(*q, result, items);
+    }
+    if (kind == "mutex") {
+        MutexQueue<uint64_t> q(capacity);
+        return run(q, result, items);
+    }
+    LOGE("ERROR: unknown queue %s, should be spsc, mpmc or mutex", kind.c_str());
+    return result;
+}
+
+void report(const BenchResult& r) {
+    double rate = r.seconds > 0 ? r.items / r.seconds : 0;
+    LOG("%-5s %2dp/%2dc batch %3zu: %10.2f M items/s, %6.1f ns/item, %s", r.kind.c_str(), r.producers, r.consumers,
+        r.batch, rate / 1e6, rate > 0 ? 1e9 / rate : 0.0, r.ok ? "ok" : "FAILED (lost, duplicated or reordered items)");
+}
+
+/* ------------------------------- stress ------------------------------- */
+
+namespace {
+
+// 多个producer用pushEvict往很小的队列里写, 多个consumer同时取.
+// 每个元素要么被consumer取出要么被evict: 取出的个数加上evict的个数正好是push的个数, consumer看到的仍然按顺序
+bool stressEvict(int producers, int consumers, uint64_t items, size_t capacity) {
+    MpmcQueue<uint64_t>       q(capacity);
+    vector<unique_ptr<Check>> checks;
+    for (int c = 0; c < consumers; c++) checks.emplace_back(new Check(producers));
+    vector<uint64_t> evicted(producers);
+
+    vector<thread> consumerThreads;
+    for (int c = 0; c < consumers; c++) {
+        consumerThreads.emplace_back([&q, &checks, c]() {
+            uint64_t item;
+            while (q.pop(item)) checks[c]->see(item);
+        });
+    }
+    vector<thread> producerThreads;
+    for (int p = 0; p < producers; p++) {
+        producerThreads.emplace_back([&q, &evicted, p, items]() {
+            uint64_t base = (uint64_t)p << kSeqBits;
+            uint64_t oldest;
+            for (uint64_t i = 0; i < items; i++) evicted[p] += q.pushEvict(base | i, oldest);
+        });
+    }
+    for (auto& t : producerThreads) t.join();
+    q.close();
+    for (auto& t : consumerThreads) t.join();
+
+    uint64_t dropped = 0, popped = 0;
+    bool     ok      = true;
+    for (int p = 0; p < producers; p++) dropped += evicted[p];
+    for (auto& check : checks) {
+        ok = ok && check->ordered;
+        for (int p = 0; p < producers; p++) popped += check->count[p];
+    }
+    return ok && popped + dropped == items * producers;
+}
+
+} // namespace
+
+bool stress(uint64_t items) {
+    bool ok = true;
+    char what[128];
+    auto expect = [&ok, &what](bool pass) {
+        if (!pass) LOGE("ERROR: queue stress failed: %s", what);
+        ok = ok && pass;
+    };
+
+    // 空的batch: head的slot正好可以读/写的时候也要直接返回0, 不能一直重试
+    {
+        MpmcQueue<uint64_t> q(4);
+        uint64_t            item = 1;
+        snprintf(what, sizeof(what), "mpmc batch with n == 0");
+        expect(q.tryPushBatch(&item, 0) == 0);
+        expect(q.tryPush(move(item)));
+        expect(q.tryPopBatch(&item, 0) == 0);
+        expect(q.tryPop(item) && item == 1);
+    }
+
+    const char* kinds[] = {"spsc", "mpmc", "mutex"};
+    for (const char* kind : kinds) {
+        bool spsc = string(kind) == "spsc";
+        for (size_t capacity : {1, 2, 4}) {
+            for (size_t batch : {1, 3, 8}) {
+                for (int threads : {1, 2, 4}) {
+                    if (spsc && threads > 1) continue;
+                    snprintf(what, sizeof(what), "%s %dp/%dc capacity %zu batch %zu", kind, threads, threads, capacity, batch);
+                    expect(benchmark(kind, threads, threads, items, capacity, batch).ok);
+                }
+            }
+        }
+    }
+
+    for (int producers : {1, 2, 4}) {
+        for (size_t capacity : {1, 2, 4}) {
+            snprintf(what, sizeof(what), "mpmc pushEvict %dp/2c capacity %zu", producers, capacity);
+            expect(stressEvict(producers, 2, items, capacity));
+        }
+    }
+    if (ok) LOG("queue stress passed");
+    return ok;
+}
+
+} // namespace queue
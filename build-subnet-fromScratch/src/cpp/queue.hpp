@@ -0,0 +1,428 @@
+#ifndef __QUEUE_HPP__
+#define __QUEUE_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "metrics.hpp"
+
+// pipeline的stage之间, 以及请求队列用的有界队列
+//     SpscQueue   一个producer一个consumer的ring buffer(Lamport). head和tail在各自的cache line上,
+//                 每一边缓存对方的index, 只有看起来满/空的时候才去读对方的cache line
+//     MpmcQueue   多个producer多个consumer(Vyukov). 每个slot有一个seq:
+//                     seq == pos      空的, producer用CAS占住tail = pos以后写
+//                     seq == pos + 1  写好了, consumer用CAS占住head = pos以后读
+//                 读完以后seq = pos + capacity, 下一圈可以再写. 抢到位置的线程独占这个slot, 元素可以move出来.
+//                 producer可以自己pop掉最旧的元素(drop-oldest)
+//     MutexQueue  std::mutex + condition_variable, 用来对比
+// 三种队列的接口一样:
+//     tryPush/tryPop            不等待, 满/空的时候返回false
+//     tryPushBatch/tryPopBatch  一次最多n个, 返回实际的个数, 只做一次同步
+//     push/pop/pushBatch/popBatch 等待(先spin再park), close以后push返回false, pop把剩下的取完以后返回false
+// 等待的一边先spin, spin的次数根据最近几次spin有没有等到来调整, 还没等到就park在condition_variable上.
+// 另一边只在有人park的时候才加锁notify, 没有人等的时候只多一次fence和一次load
+
+namespace queue {
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// 单核的时候spin没有意义, 对方要等到自己让出CPU才能运行
+int maxSpin();
+
+static const int kMinSpin = 16;
+
+class Waiter {
+public:
+    Waiter() : mSpin(std::min(kMinSpin, maxSpin())) {}
+    Waiter(const Waiter&) = delete;
+    Waiter& operator=(const Waiter&) = delete;
+
+    // 等到cond()为true, 超时返回false. timeoutMs < 0一直等
+    // cond可以有副作用(例如tryPop), 不在锁里调用, 否则两个方向的Waiter互相notify会死锁
+    template <typename Cond>
+    bool wait(Cond cond, int timeoutMs = -1) {
+        int limit = mSpin.load(std::memory_order_relaxed);
+        for (int i = 0; i < limit; i++) {
+            if (cond()) {
+                adapt(i, true);
+                return true;
+            }
+            cpuRelax();
+        }
+        if (cond()) {
+            adapt(limit, true);
+            return true;
+        }
+        adapt(limit, false);
+        if (timeoutMs == 0) return false;
+
+        // 先记下epoch并登记成waiter再检查条件; notify先修改条件再看waiter, 有waiter的时候增加epoch,
+        // 所以检查条件以后发生的notify一定会改变epoch, 不会丢wakeup
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeoutMs, 0));
+        while (true) {
+            uint32_t epoch = mEpoch.load();
+            mWaiters.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (cond()) {
+                mWaiters.fetch_sub(1);
+                return true;
+            }
+            {
+                std::unique_lock<std::mutex> lock(mLock);
+                while (mEpoch.load() == epoch) {
+                    if (timeoutMs < 0) {
+                        mCond.wait(lock);
+                    } else if (mCond.wait_until(lock, deadline) == std::cv_status::timeout) {
+                        break;
+                    }
+                }
+            }
+            mWaiters.fetch_sub(1);
+            if (cond()) return true;
+            if (timeoutMs >= 0 && std::chrono::steady_clock::now() >= deadline) return false;
+        }
+    }
+
+    // 条件已经修改以后调用
+    void notify() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mWaiters.load(std::memory_order_relaxed) == 0) return;
+        mEpoch.fetch_add(1);
+        { std::lock_guard<std::mutex> lock(mLock); }
+        mCond.notify_all();
+    }
+
+    int spin() const { return mSpin.load(std::memory_order_relaxed); }
+
+private:
+    // spin等到了: 下一次至少spin这么久的两倍; 没有等到: 慢慢减少
+    void adapt(int used, bool success) {
+        int current = mSpin.load(std::memory_order_relaxed);
+        int target  = success ? std::min(std::max(2 * used, kMinSpin), maxSpin()) : std::min(kMinSpin, maxSpin());
+        mSpin.store(current + (target - current) / 8, std::memory_order_relaxed);
+    }
+
+    std::atomic<int>        mSpin;
+    std::atomic<int>        mWaiters{0};
+    std::atomic<uint32_t>   mEpoch{0};
+    std::mutex              mLock;
+    std::condition_variable mCond;
+};
+
+// 阻塞的接口, 三种队列共用. Q需要提供tryPush/tryPop/tryPushBatch/tryPopBatch
+template <typename Q, typename T>
+class Blocking {
+public:
+    bool push(T&& value, int timeoutMs = -1) {
+        Q&   q  = self();
+        bool ok = false;
+        mNotFull.wait([&]() { return mClosed.load() || (ok = q.tryPush(std::move(value))); }, timeoutMs);
+        return ok;
+    }
+
+    bool pop(T& value, int timeoutMs = -1) {
+        Q&   q  = self();
+        bool ok = false;
+        mNotEmpty.wait([&]() { return (ok = q.tryPop(value)) || mClosed.load(); }, timeoutMs);
+        // close之前push的还要取完
+        return ok || q.tryPop(value);
+    }
+
+    // 全部push完才返回, close的时候返回已经push的个数
+    size_t pushBatch(T* items, size_t n, int timeoutMs = -1) {
+        Q&     q    = self();
+        size_t done = 0;
+        while (done < n) {
+            bool ok = mNotFull.wait([&]() {
+                if (mClosed.load()) return true;
+                done += q.tryPushBatch(items + done, n - done);
+                return done == n;
+            }, timeoutMs);
+            if (!ok || mClosed.load()) break;
+        }
+        return done;
+    }
+
+    // 至少有一个的时候返回最多n个, close并且空了返回0
+    size_t popBatch(T* items, size_t n, int timeoutMs = -1) {
+        Q&     q    = self();
+        size_t done = 0;
+        mNotEmpty.wait([&]() { return (done = q.tryPopBatch(items, n)) > 0 || mClosed.load(); }, timeoutMs);
+        return done > 0 ? done : q.tryPopBatch(items, n);
+    }
+
+    void close() {
+        mClosed.store(true);
+        mNotEmpty.notify();
+        mNotFull.notify();
+    }
+    bool closed() const { return mClosed.load(); }
+
+protected:
+    Q& self() { return *static_cast<Q*>(this); }
+
+    std::atomic<bool> mClosed{false};
+    Waiter            mNotEmpty;
+    Waiter            mNotFull;
+};
+
+static inline size_t roundCapacity(size_t capacity) {
+    size_t n = 1;
+    while (n < capacity) n <<= 1;
+    return n;
+}
+
+/* ------------------------------- SPSC ------------------------------- */
+
+template <typename T>
+class SpscQueue : public metrics::CacheAligned, public Blocking<SpscQueue<T>, T> {
+public:
+    // capacity会向上取整到2的幂次
+    explicit SpscQueue(size_t capacity) : mMask(roundCapacity(capacity) - 1), mItems(mMask + 1) {}
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    size_t capacity() const { return mMask + 1; }
+    // 近似值, 只用于统计
+    size_t size() const {
+        uint64_t tail = mTail.load(std::memory_order_relaxed);
+        uint64_t head = mHead.load(std::memory_order_relaxed);
+        return tail > head ? (size_t)(tail - head) : 0;
+    }
+    bool empty() const { return size() == 0; }
+
+    // producer. 满的时候返回false, value不变
+    bool tryPush(T&& value) { return tryPushBatch(&value, 1) == 1; }
+    // consumer
+    bool tryPop(T& value) { return tryPopBatch(&value, 1) == 1; }
+
+    size_t tryPushBatch(T* items, size_t n) {
+        uint64_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail + n - mCachedHead > capacity()) {
+            mCachedHead = mHead.load(std::memory_order_acquire);
+            n           = std::min<size_t>(n, capacity() - (tail - mCachedHead));
+            if (n == 0) return 0;
+        }
+        for (size_t i = 0; i < n; i++) mItems[(tail + i) & mMask] = std::move(items[i]);
+        mTail.store(tail + n, std::memory_order_release);
+        this->mNotEmpty.notify();
+        return n;
+    }
+
+    size_t tryPopBatch(T* items, size_t n) {
+        uint64_t head = mHead.load(std::memory_order_relaxed);
+        if (head + n > mCachedTail) {
+            mCachedTail = mTail.load(std::memory_order_acquire);
+            n           = std::min<size_t>(n, mCachedTail - head);
+            if (n == 0) return 0;
+        }
+        for (size_t i = 0; i < n; i++) items[i] = std::move(mItems[(head + i) & mMask]);
+        mHead.store(head + n, std::memory_order_release);
+        this->mNotFull.notify();
+        return n;
+    }
+
+private:
+    const size_t   mMask;
+    std::vector<T> mItems;
+
+    alignas(metrics::kCacheLine) std::atomic<uint64_t> mHead{0};
+    uint64_t                                           mCachedTail = 0;    // consumer
+    alignas(metrics::kCacheLine) std::atomic<uint64_t> mTail{0};
+    uint64_t                                           mCachedHead = 0;    // producer
+    char                                               mPad[metrics::kCacheLine - 2 * sizeof(uint64_t)];
+};
+
+/* ------------------------------- MPMC ------------------------------- */
+
+template <typename T>
+class MpmcQueue : public metrics::CacheAligned, public Blocking<MpmcQueue<T>, T> {
+public:
+    // 只有一个slot的时候写好的seq(pos + 1)和下一圈空的seq一样, 分不清满和空, 所以至少2个
+    explicit MpmcQueue(size_t capacity) : mMask(roundCapacity(std::max<size_t>(capacity, 2)) - 1), mSlots(mMask + 1) {
+        for (size_t i = 0; i <= mMask; i++) mSlots[i].seq.store(i, std::memory_order_relaxed);
+    }
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+    size_t capacity() const { return mMask + 1; }
+    size_t size() const {
+        uint64_t tail = mTail.load(std::memory_order_relaxed);
+        uint64_t head = mHead.load(std::memory_order_relaxed);
+        return tail > head ? (size_t)(tail - head) : 0;
+    }
+    bool empty() const { return size() == 0; }
+
+    bool tryPush(T&& value) { return tryPushBatch(&value, 1) == 1; }
+    bool tryPop(T& value) { return tryPopBatch(&value, 1) == 1; }
+
+    // 从tail开始数连续的空slot, 一次CAS占住. CAS成功说明这期间没有别的producer占过, 数到的slot都还是空的
+    size_t tryPushBatch(T* items, size_t n) {
+        if (n == 0) return 0;
+        uint64_t pos = mTail.load(std::memory_order_relaxed);
+        size_t   k;
+        while (true) {
+            k = claimable(pos, n, 0);
+            if (k == 0) {
+                if ((int64_t)(mSlots[pos & mMask].seq.load(std::memory_order_acquire) - pos) < 0) return 0;    // 满了
+                pos = mTail.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (mTail.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) break;
+        }
+        for (size_t i = 0; i < k; i++) {
+            Slot& slot = mSlots[(pos + i) & mMask];
+            slot.value = std::move(items[i]);
+            slot.seq.store(pos + i + 1, std::memory_order_release);
+        }
+        this->mNotEmpty.notify();
+        return k;
+    }
+
+    size_t tryPopBatch(T* items, size_t n) {
+        if (n == 0) return 0;
+        uint64_t pos = mHead.load(std::memory_order_relaxed);
+        size_t   k;
+        while (true) {
+            k = claimable(pos, n, 1);
+            if (k == 0) {
+                if ((int64_t)(mSlots[pos & mMask].seq.load(std::memory_order_acquire) - (pos + 1)) < 0) return 0;    // 空了
+                pos = mHead.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (mHead.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) break;
+        }
+        for (size_t i = 0; i < k; i++) {
+            Slot& slot = mSlots[(pos + i) & mMask];
+            items[i]   = std::move(slot.value);
+            slot.seq.store(pos + i + mMask + 1, std::memory_order_release);
+        }
+        this->mNotFull.notify();
+        return k;
+    }
+
+    // 满的时候pop掉最旧的元素再push, 直到push成功. 返回pop掉的个数, 最后一个放在evicted里, 之前的直接释放
+    // 别的producer可能抢走刚空出来的slot, 所以可能要pop不止一次
+    size_t pushEvict(T&& value, T& evicted) {
+        size_t dropped = 0;
+        while (!tryPush(std::move(value))) {
+            // 别的consumer可能刚占住最旧的slot还没有move完, 这时候pop不到, 等一下再试
+            T oldest;
+            if (tryPop(oldest)) {
+                evicted = std::move(oldest);
+                dropped++;
+            } else {
+                cpuRelax();
+            }
+        }
+        return dropped;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> seq{0};
+        T                     value;
+    };
+
+    // 从pos开始seq == pos + i + offset的连续slot的个数, 最多n个
+    size_t claimable(uint64_t pos, size_t n, uint64_t offset) const {
+        size_t k = 0;
+        while (k < n && k <= mMask && mSlots[(pos + k) & mMask].seq.load(std::memory_order_acquire) == pos + k + offset) k++;
+        return k;
+    }
+
+    const size_t      mMask;
+    std::vector<Slot> mSlots;
+
+    alignas(metrics::kCacheLine) std::atomic<uint64_t> mHead{0};
+    alignas(metrics::kCacheLine) std::atomic<uint64_t> mTail{0};
+    char                                               mPad[metrics::kCacheLine - sizeof(uint64_t)];
+};
+
+/* ------------------------------- mutex ------------------------------- */
+
+template <typename T>
+class MutexQueue : public Blocking<MutexQueue<T>, T> {
+public:
+    explicit MutexQueue(size_t capacity) : mCapacity(std::max<size_t>(capacity, 1)) {}
+
+    size_t capacity() const { return mCapacity; }
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mItems.size();
+    }
+    bool empty() const { return size() == 0; }
+
+    bool tryPush(T&& value) { return tryPushBatch(&value, 1) == 1; }
+    bool tryPop(T& value) { return tryPopBatch(&value, 1) == 1; }
+
+    size_t tryPushBatch(T* items, size_t n) {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            n = std::min(n, mCapacity - mItems.size());
+            for (size_t i = 0; i < n; i++) mItems.push_back(std::move(items[i]));
+        }
+        if (n > 0) this->mNotEmpty.notify();
+        return n;
+    }
+
+    size_t tryPopBatch(T* items, size_t n) {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            n = std::min(n, mItems.size());
+            for (size_t i = 0; i < n; i++) {
+                items[i] = std::move(mItems.front());
+                mItems.pop_front();
+            }
+        }
+        if (n > 0) this->mNotFull.notify();
+        return n;
+    }
+
+private:
+    const size_t       mCapacity;
+    mutable std::mutex mLock;
+    std::deque<T>      mItems;
+};
+
+/* ------------------------------- benchmark ------------------------------- */
+
+struct BenchResult {
+    std::string kind;
+    int         producers = 0;
+    int         consumers = 0;
+    size_t      batch     = 1;
+    uint64_t    items     = 0;     // 所有producer一共push的个数
+    double      seconds   = 0;
+    bool        ok        = false; // 没有丢失, 没有重复, 每个producer的元素按push的顺序被取出
+};
+
+// kind: spsc(只能1对1) | mpmc | mutex. 每个producer push items个, 用阻塞的接口, batch > 1的时候用batch接口
+BenchResult benchmark(const std::string& kind, int producers, int consumers, uint64_t items, size_t capacity = 1024,
+                      size_t batch = 1);
+void        report(const BenchResult& result);
+
+// 正确性的压力测试, 每种情况都检查没有丢失/重复/乱序, 出错的时候打印是哪一种并返回false
+//     - 三种队列在很小的capacity(1, 2, 4)下多个producer/consumer, batch比capacity还大
+//     - n == 0的batch接口直接返回0
+//     - 多个producer同时pushEvict: 被consumer取出的和被evict的加起来正好是push的全部
+bool        stress(uint64_t items = 100000);
+
+} // namespace queue
+
+#endif //__QUEUE_HPP__
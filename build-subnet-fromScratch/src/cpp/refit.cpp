@@ -0,0 +1,303 @@
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <set>
+
+#include "refit.hpp"
+#include "network.hpp"
+#include "half.hpp"
+#include "calibrator.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace refit {
+
+uint64_t hashTensor(const quant::WeightEntry& entry) {
+    uint64_t h     = 1469598103934665603ull;
+    auto     mix   = [&h](uint8_t byte) { h = (h ^ byte) * 1099511628211ull; };
+    int      width = entry.type == nvinfer1::DataType::kHALF ? 2 : 4;
+    mix((uint8_t)entry.type);
+    for (auto bits : entry.bits) {
+        for (int b = 0; b < width; b++) mix((uint8_t)(bits >> (8 * b)));
+    }
+    return h;
+}
+
+int64_t tensorBytes(const quant::WeightEntry& entry) {
+    return (int64_t)entry.bits.size() * (entry.type == nvinfer1::DataType::kHALF ? 2 : 4);
+}
+
+WeightsDiff diffWeights(const vector<quant::WeightEntry>& before, const vector<quant::WeightEntry>& after) {
+    map<string, const quant::WeightEntry*> old;
+    for (auto& e : before) old[e.name] = &e;
+
+    WeightsDiff diff;
+    set<string> seen;
+    for (auto& e : after) {
+        diff.totalBytes += tensorBytes(e);
+        seen.insert(e.name);
+        auto it = old.find(e.name);
+        if (it == old.end()) {
+            diff.added.push_back(e.name);
+        } else if (it->second->bits.size() != e.bits.size() || it->second->type != e.type) {
+            diff.reshaped.push_back(e.name);
+        } else if (hashTensor(*it->second) != hashTensor(e)) {
+            diff.changed.push_back(e.name);
+            diff.changedBytes += tensorBytes(e);
+        }
+    }
+    for (auto& e : before) {
+        if (!seen.count(e.name)) diff.removed.push_back(e.name);
+    }
+    return diff;
+}
+
+/* ------------------------------- plan ------------------------------- */
+
+static int64_t targetBytes(const Target& t) {
+    return (int64_t)t.values.size() * (t.type == nvinfer1::DataType::kHALF ? 2 : 4);
+}
+
+Plan planRefit(const WeightsDiff& diff, const vector<quant::WeightEntry>& after, Model::precision prec, float eps) {
+    map<string, const quant::WeightEntry*> weights;
+    for (auto& e : after) weights[e.name] = &e;
+    auto has = [&](const string& name) { return weights.count(name) > 0; };
+
+    Plan        plan;
+    set<string> folded;
+    for (auto& name : diff.changed) {
+        size_t dot = name.rfind('.');
+        if (dot == string::npos || !has(name)) {
+            plan.unsupported.push_back(name);
+            continue;
+        }
+        string layer  = name.substr(0, dot);
+        string suffix = name.substr(dot + 1);
+
+        // BN: 四个tensor一起重新折叠成IScaleLayer的scale和shift
+        bool bnParam = suffix == "weight" || suffix == "bias" || suffix == "running_mean" || suffix == "running_var";
+        if (bnParam && has(layer + ".running_var")) {
+            if (!folded.insert(layer).second) continue;
+            const char* parts[] = {".weight", ".bias", ".running_mean", ".running_var"};
+            vector<float> p[4];
+            bool complete = true;
+            for (int i = 0; i < 4; i++) {
+                complete = complete && has(layer + parts[i]);
+                if (complete) p[i] = quant::toFloat(*weights[layer + parts[i]]);
+                complete = complete && p[i].size() == p[0].size();
+            }
+            if (!complete) {
+                plan.unsupported.push_back(name);
+                continue;
+            }
+            int   count = (int)p[0].size();
+            Target scale, shift;
+            scale.layer = shift.layer = layer;
+            scale.role  = nvinfer1::WeightsRole::kSCALE;
+            shift.role  = nvinfer1::WeightsRole::kSHIFT;
+            scale.values.resize(count);
+            shift.values.resize(count);
+            network::parser::foldBatchNorm(p[0].data(), p[1].data(), p[2].data(), p[3].data(), count,
+                                           scale.values.data(), shift.values.data(), eps);
+            for (int i = 0; i < 4; i++) scale.sources.push_back(layer + parts[i]);
+            shift.sources = scale.sources;
+            plan.targets.push_back(scale);
+            plan.targets.push_back(shift);
+            continue;
+        }
+
+        if (suffix == "weight" || suffix == "bias") {
+            auto&  entry = *weights[name];
+            Target t;
+            t.layer   = layer;
+            t.role    = suffix == "weight" ? nvinfer1::WeightsRole::kKERNEL : nvinfer1::WeightsRole::kBIAS;
+            t.values  = quant::toFloat(entry);
+            t.sources = {name};
+            // 和Model::build_from_weights一样, FP16的时候conv的kernel以kHALF交给TensorRT
+            bool half = entry.type == nvinfer1::DataType::kHALF ||
+                        (prec == Model::precision::FP16 && globMatch("*conv*.weight", name));
+            t.type    = half ? nvinfer1::DataType::kHALF : nvinfer1::DataType::kFLOAT;
+            plan.targets.push_back(t);
+            continue;
+        }
+
+        // .weight_scale/.act_scale等
+        plan.unsupported.push_back(name);
+    }
+
+    for (auto& t : plan.targets) plan.refitBytes += targetBytes(t);
+    return plan;
+}
+
+/* ------------------------------- TensorRT ------------------------------- */
+
+namespace {
+
+typedef pair<string, nvinfer1::WeightsRole> Slot;
+
+vector<Slot> slots(nvinfer1::IRefitter& refitter, bool missing) {
+    int n = missing ? refitter.getMissing(0, nullptr, nullptr) : refitter.getAll(0, nullptr, nullptr);
+    vector<const char*>           names(n);
+    vector<nvinfer1::WeightsRole> roles(n);
+    if (missing) refitter.getMissing(n, names.data(), roles.data());
+    else         refitter.getAll(n, names.data(), roles.data());
+    vector<Slot> out;
+    for (int i = 0; i < n; i++) out.push_back(Slot(names[i], roles[i]));
+    return out;
+}
+
+const char* roleName(nvinfer1::WeightsRole role) {
+    switch (role) {
+        case nvinfer1::WeightsRole::kKERNEL:   return "kernel";
+        case nvinfer1::WeightsRole::kBIAS:     return "bias";
+        case nvinfer1::WeightsRole::kSHIFT:    return "shift";
+        case nvinfer1::WeightsRole::kSCALE:    return "scale";
+        case nvinfer1::WeightsRole::kCONSTANT: return "constant";
+        default:                               return "any";
+    }
+}
+
+// IRefitter只保存指针, refitCudaEngine之前buffer要一直有效
+class WeightsBuffer {
+public:
+    nvinfer1::Weights add(const Target& t) {
+        if (t.type == nvinfer1::DataType::kHALF) {
+            mHalf.push_back(vector<uint16_t>(t.values.size()));
+            fp16::convert(t.values.data(), mHalf.back().data(), t.values.size());
+            return nvinfer1::Weights{nvinfer1::DataType::kHALF, mHalf.back().data(), (int64_t)t.values.size()};
+        }
+        return nvinfer1::Weights{nvinfer1::DataType::kFLOAT, t.values.data(), (int64_t)t.values.size()};
+    }
+
+private:
+    // list的元素地址不会变
+    list<vector<uint16_t>> mHalf;
+};
+
+} // namespace
+
+bool refitEngine(const string& enginePath, const string& oldWts, const string& newWts, Model::precision prec,
+                 const string& outEngine) {
+    auto start = chrono::steady_clock::now();
+    string out = outEngine.empty() ? enginePath : outEngine;
+
+    vector<quant::WeightEntry> before, after;
+    if (!quant::readWeights(oldWts, before) || !quant::readWeights(newWts, after)) return false;
+
+    WeightsDiff diff = diffWeights(before, after);
+    if (!diff.sameTopology()) {
+        for (auto& n : diff.added)    LOGE("ERROR: %s is new in %s", n.c_str(), newWts.c_str());
+        for (auto& n : diff.removed)  LOGE("ERROR: %s is missing in %s", n.c_str(), newWts.c_str());
+        for (auto& n : diff.reshaped) LOGE("ERROR: %s changed its size or type", n.c_str());
+        LOGE("ERROR: the network changed, %s needs a full rebuild", enginePath.c_str());
+        return false;
+    }
+    LOG("%zu of %zu weights changed (%.1f KB of %.1f KB)", diff.changed.size(), after.size(),
+        diff.changedBytes / 1024.0, diff.totalBytes / 1024.0);
+    if (diff.changed.empty()) {
+        if (out == enginePath) return true;
+        vector<unsigned char> data = loadFile(enginePath);
+        return calib::writeCalibrationCache(out, data.data(), data.size());
+    }
+
+    Plan plan = planRefit(diff, after, prec);
+    if (!plan.ok()) {
+        for (auto& n : plan.unsupported) LOGE("ERROR: %s can not be refit", n.c_str());
+        LOGE("ERROR: %s needs a full rebuild", enginePath.c_str());
+        return false;
+    }
+
+    if (!fileExists(enginePath)) {
+        LOGE("ERROR: %s not found", enginePath.c_str());
+        return false;
+    }
+    vector<unsigned char> data = loadFile(enginePath);
+    Logger logger;
+    unique_ptr<nvinfer1::IRuntime>    runtime(nvinfer1::createInferRuntime(logger));
+    unique_ptr<nvinfer1::ICudaEngine> engine(runtime->deserializeCudaEngine(data.data(), data.size()));
+    if (engine == nullptr) {
+        LOGE("ERROR: failed to deserialize %s", enginePath.c_str());
+        return false;
+    }
+    if (!engine->isRefittable()) {
+        LOGE("ERROR: %s was built without kREFIT (set refittable = true in the build profile)", enginePath.c_str());
+        return false;
+    }
+    unique_ptr<nvinfer1::IRefitter> refitter(nvinfer1::createInferRefitter(*engine, logger));
+
+    // 显式量化的conv的kernel是单独的IConstantLayer(名字是X.weight)
+    set<Slot> refittable;
+    for (auto& s : slots(*refitter, false)) refittable.insert(s);
+    // 找不到的时候不打印, 补齐融合层的时候大部分target本来就不在engine里
+    auto lookup = [&](Target& t) {
+        if (refittable.count(Slot(t.layer, t.role))) return true;
+        if (t.role == nvinfer1::WeightsRole::kKERNEL && refittable.count(Slot(t.layer + ".weight", nvinfer1::WeightsRole::kCONSTANT))) {
+            t.layer += ".weight";
+            t.role   = nvinfer1::WeightsRole::kCONSTANT;
+            return true;
+        }
+        return false;
+    };
+
+    WeightsBuffer buffer;
+    set<Slot>     pushed;
+    for (auto& t : plan.targets) {
+        if (!lookup(t)) {
+            LOGE("ERROR: %s (%s) is not refittable in %s", t.layer.c_str(), roleName(t.role), enginePath.c_str());
+            return false;
+        }
+        if (!refitter->setWeights(t.layer.c_str(), t.role, buffer.add(t))) {
+            LOGE("ERROR: failed to refit %s (%s)", t.layer.c_str(), roleName(t.role));
+            return false;
+        }
+        pushed.insert(Slot(t.layer, t.role));
+    }
+
+    // 和变化的层融合在一起的层(例如conv + BN)也需要提供权重, 没有变化的值从新的权重里取
+    int64_t extraBytes = 0;
+    auto    missing    = slots(*refitter, true);
+    Plan    full;
+    if (!missing.empty()) {
+        WeightsDiff all;
+        for (auto& e : after) all.changed.push_back(e.name);
+        full = planRefit(all, after, prec);
+        map<Slot, const Target*> available;
+        for (auto& t : full.targets) {
+            if (lookup(t)) available[Slot(t.layer, t.role)] = &t;
+        }
+        for (auto& m : missing) {
+            auto it = available.find(m);
+            if (it == available.end() || pushed.count(m)) {
+                LOGE("ERROR: no weights for %s (%s), which is required by the refit", m.first.c_str(), roleName(m.second));
+                return false;
+            }
+            if (!refitter->setWeights(m.first.c_str(), m.second, buffer.add(*it->second))) {
+                LOGE("ERROR: failed to refit %s (%s), which is fused with a changed layer", m.first.c_str(), roleName(m.second));
+                return false;
+            }
+            extraBytes += targetBytes(*it->second);
+            LOGV("refit %s (%s) as well because it is fused with a changed layer", m.first.c_str(), roleName(m.second));
+        }
+    }
+    if (!refitter->refitCudaEngine()) {
+        LOGE("ERROR: failed to refit %s", enginePath.c_str());
+        return false;
+    }
+
+    unique_ptr<nvinfer1::IHostMemory> blob(engine->serialize());
+    if (blob == nullptr || !calib::writeCalibrationCache(out, blob->data(), blob->size())) {
+        LOGE("ERROR: failed to write %s", out.c_str());
+        return false;
+    }
+
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    int64_t refitBytes = plan.refitBytes + extraBytes;
+    LOG("refit %zu weights of %s in %.1f ms: %.1f KB pushed (%.1f KB for fused layers), a full rebuild uses %.1f KB (%.1f%%)",
+        plan.targets.size() + missing.size(), out.c_str(), ms, refitBytes / 1024.0, extraBytes / 1024.0,
+        diff.totalBytes / 1024.0, diff.totalBytes > 0 ? 100.0 * refitBytes / diff.totalBytes : 0.0);
+    return true;
+}
+
+} // namespace refit
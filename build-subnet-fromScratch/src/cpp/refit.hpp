@@ -0,0 +1,73 @@
+#ifndef __REFIT_HPP__
+#define __REFIT_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+#include "NvInfer.h"
+#include "quant.hpp"
+#include "model.hpp"
+
+// 只有权重的数值变化(同样的build_C2F结构, 重新训练的checkpoint)的时候, 不需要重新build engine:
+//     1. build的时候打开kREFIT(build profile里的refittable = true, 或者Model::setRefittable)
+//     2. refitEngine对比新旧两个.weights, 每个tensor算一个hash, 找出变化的tensor
+//     3. 变化的tensor映射到TensorRT的层和role(和network::parser里的命名一致):
+//            X.weight / X.bias                                  -> conv/fc X的kKERNEL / kBIAS
+//            X.{weight,bias,running_mean,running_var}, 有X.running_var -> BN折叠成的IScaleLayer X,
+//                                                                  重新折叠以后refit kSCALE和kSHIFT
+//            显式量化的conv的kernel是IConstantLayer X.weight      -> kCONSTANT
+//        Q/DQ的scale(.weight_scale, .act_scale)已经编译进INT8的kernel里, 不能refit
+//     4. 只把这些层交给IRefitter, engine不能refit或者tensor有增减/长度变化的时候需要重新build
+// diff和映射只依赖CPU
+
+namespace refit {
+
+// tensor的bit和类型的64位FNV-1a hash
+uint64_t hashTensor(const quant::WeightEntry& entry);
+int64_t  tensorBytes(const quant::WeightEntry& entry);
+
+struct WeightsDiff {
+    std::vector<std::string> changed;      // 数值变化, 长度和类型不变
+    std::vector<std::string> reshaped;     // 长度或者类型变化
+    std::vector<std::string> added;
+    std::vector<std::string> removed;
+    int64_t                  changedBytes = 0;
+    int64_t                  totalBytes   = 0;    // 新文件的所有tensor
+
+    bool sameTopology() const { return reshaped.empty() && added.empty() && removed.empty(); }
+};
+
+WeightsDiff diffWeights(const std::vector<quant::WeightEntry>& before, const std::vector<quant::WeightEntry>& after);
+
+// 一次IRefitter::setWeights
+struct Target {
+    std::string              layer;
+    nvinfer1::WeightsRole    role;
+    std::vector<float>       values;
+    nvinfer1::DataType       type = nvinfer1::DataType::kFLOAT;   // 和build时交给TensorRT的类型一样
+    std::vector<std::string> sources;                             // 用到的.weights里的tensor
+};
+
+struct Plan {
+    std::vector<Target>      targets;
+    std::vector<std::string> unsupported;   // 变化了但是不能refit的tensor
+    int64_t                  refitBytes = 0;
+
+    bool ok() const { return unsupported.empty(); }
+};
+
+// 根据diff和新的权重生成refit的列表, BN的四个tensor里任何一个变化都会重新折叠
+// prec是engine build时的精度: FP16的时候conv的kernel和Model::build_from_weights一样以kHALF交给TensorRT
+Plan planRefit(const WeightsDiff& diff, const std::vector<quant::WeightEntry>& after, Model::precision prec,
+               float eps = 1e-5f);
+
+// 用newWts里变化的权重refit engine, 结果写到outEngine(为空的时候覆盖enginePath)
+// 返回false的时候不会修改engine文件
+bool refitEngine(const std::string& enginePath, const std::string& oldWts, const std::string& newWts,
+                 Model::precision prec, const std::string& outEngine = "");
+
+} // namespace refit
+
+#endif //__REFIT_HPP__
@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <queue>
+#include <random>
+
+#include "sched.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace sched {
+
+static metrics::Counter& droppedTotal() {
+    static auto& c = metrics::Registry::instance().counter("trt_sched_dropped_total", "number of requests dropped because they could no longer meet their deadline");
+    return c;
+}
+
+static metrics::Counter& lateTotal() {
+    static auto& c = metrics::Registry::instance().counter("trt_sched_late_total", "number of requests that finished after their deadline");
+    return c;
+}
+
+static metrics::Gauge& queueDepth() {
+    static auto& g = metrics::Registry::instance().gauge("trt_sched_queue_depth", "number of requests waiting in the scheduler");
+    return g;
+}
+
+static metrics::Histogram& batchSizes() {
+    static auto& h = metrics::Registry::instance().histogram("trt_sched_batch_size", "number of requests in a scheduled batch");
+    return h;
+}
+
+Nanos now() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const char* statusName(Status status) {
+    switch (status) {
+        case Status::Met:     return "met";
+        case Status::Late:    return "late";
+        case Status::Dropped: return "dropped";
+        case Status::Failed:  return "failed";
+    }
+    return "unknown";
+}
+
+/* ------------------------------- latency model ------------------------------- */
+
+LatencyModel::LatencyModel(int maxBatch, double initialUs, double alpha)
+    : mInitialUs(initialUs), mAlpha(alpha), mMean(maxBatch + 1, 0), mDev(maxBatch + 1, 0), mCount(maxBatch + 1, 0) {}
+
+void LatencyModel::observe(int batch, double us) {
+    lock_guard<mutex> lock(mLock);
+    if (batch <= 0 || batch >= (int)mMean.size()) return;
+    if (mCount[batch] == 0) {
+        mMean[batch] = us;
+        mDev[batch]  = us * 0.1;
+    } else {
+        // 前几个样本用算术平均, 之后用EWMA跟踪变化(例如GPU降频)
+        double a     = std::max(mAlpha, 1.0 / (mCount[batch] + 1));
+        double error = us - mMean[batch];
+        mMean[batch] += a * error;
+        mDev[batch]  += a * (fabs(error) - mDev[batch]);
+    }
+    mCount[batch]++;
+}
+
+double LatencyModel::estimate(int batch) const {
+    if (mCount[batch] > 0) return mMean[batch] + 2 * mDev[batch];
+
+    // 没有见过的batch: 用见过的点做最小二乘 y = a + b * x, 只有一个点的时候按比例
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int    only = 0;
+    for (int b = 1; b < (int)mMean.size(); b++) {
+        if (mCount[b] == 0) continue;
+        double y = mMean[b] + 2 * mDev[b];
+        n   += 1;
+        sx  += b;
+        sy  += y;
+        sxx += (double)b * b;
+        sxy += b * y;
+        only = b;
+    }
+    if (n == 0) return mInitialUs * batch;
+    if (n == 1) {
+        double y = sy;
+        return batch < only ? y : y * batch / only;
+    }
+    double slope     = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+    double intercept = (sy - slope * sx) / n;
+    // batch变大不会变快
+    return std::max(intercept + std::max(slope, 0.0) * batch, 0.0);
+}
+
+double LatencyModel::predict(int batch) const {
+    lock_guard<mutex> lock(mLock);
+    batch = std::min(std::max(batch, 1), (int)mMean.size() - 1);
+    return estimate(batch);
+}
+
+int LatencyModel::samples(int batch) const {
+    lock_guard<mutex> lock(mLock);
+    return batch > 0 && batch < (int)mCount.size() ? mCount[batch] : 0;
+}
+
+void LatencyModel::report() const {
+    lock_guard<mutex> lock(mLock);
+    LOG("latency model (us):");
+    for (int b = 1; b < (int)mMean.size(); b++) {
+        if (mCount[b] == 0) {
+            LOG("    batch %2d: %8s, predict %8.1f (fitted)", b, "-", estimate(b));
+        } else {
+            LOG("    batch %2d: mean %8.1f, dev %6.1f, predict %8.1f, %d samples", b, mMean[b], mDev[b], estimate(b),
+                mCount[b]);
+        }
+    }
+}
+
+/* ------------------------------- scheduler ------------------------------- */
+
+// 同一个class里按deadline排序, 没有deadline的排在最后; deadline一样的时候先到先处理
+struct Scheduler::Queue {
+    struct Later {
+        bool operator()(const Request* a, const Request* b) const {
+            Nanos da = a->deadline == 0 ? INT64_MAX : a->deadline;
+            Nanos db = b->deadline == 0 ? INT64_MAX : b->deadline;
+            if (da != db) return da > db;
+            return a->id > b->id;
+        }
+    };
+    struct Arrival {
+        bool operator()(const Request* a, const Request* b) const { return a->id > b->id; }
+    };
+
+    // priority_queue不能move出元素, 存裸指针, 所有权在pop的时候转回RequestPtr
+    priority_queue<Request*, vector<Request*>, Later>   edf;
+    priority_queue<Request*, vector<Request*>, Arrival> fifo;
+    bool fifoMode = false;
+
+    ~Queue() {
+        while (!empty()) delete pop();
+    }
+    bool     empty() const { return fifoMode ? fifo.empty() : edf.empty(); }
+    size_t   size() const { return fifoMode ? fifo.size() : edf.size(); }
+    Request* top() const { return fifoMode ? fifo.top() : edf.top(); }
+    void     push(Request* r) { fifoMode ? fifo.push(r) : edf.push(r); }
+    Request* pop() {
+        Request* r = top();
+        fifoMode ? fifo.pop() : edf.pop();
+        return r;
+    }
+};
+
+struct Scheduler::Counters {
+    uint64_t           submitted = 0;
+    uint64_t           met       = 0;
+    uint64_t           late      = 0;
+    uint64_t           dropped   = 0;
+    uint64_t           failed    = 0;
+    metrics::Histogram latency{"sched_latency_us", ""};
+};
+
+Scheduler::Scheduler(BatchFn execute, const Options& options)
+    : mExecute(move(execute)), mOptions(options), mModel(std::max(options.maxBatch, 1), options.initialUs) {
+    mOptions.classes  = std::max(mOptions.classes, 1);
+    mOptions.maxBatch = std::max(mOptions.maxBatch, 1);
+    mOptions.workers  = std::max(mOptions.workers, 1);
+    for (int c = 0; c < mOptions.classes; c++) {
+        mQueues.emplace_back(new Queue());
+        mQueues.back()->fifoMode = mOptions.policy == Policy::Fifo;
+        mCounters.emplace_back(new Counters());
+    }
+}
+
+Scheduler::~Scheduler() {
+    stop();
+}
+
+void Scheduler::start() {
+    lock_guard<mutex> lock(mLock);
+    if (!mWorkers.empty()) return;
+    mStopping = false;
+    for (int i = 0; i < mOptions.workers; i++) mWorkers.emplace_back(&Scheduler::run, this);
+}
+
+void Scheduler::stop() {
+    {
+        lock_guard<mutex> lock(mLock);
+        mStopping = true;
+    }
+    mReady.notify_all();
+    for (auto& w : mWorkers) w.join();
+    mWorkers.clear();
+}
+
+bool Scheduler::submit(RequestPtr request) {
+    {
+        lock_guard<mutex> lock(mLock);
+        if (mStopping) return false;
+        request->priority = std::min(std::max(request->priority, 0), mOptions.classes - 1);
+        request->arrival  = now();
+        request->id       = mArrivals++;
+        mCounters[request->priority]->submitted++;
+        // Fifo不区分class, 都放在第0个队列
+        int queue = mOptions.policy == Policy::Fifo ? 0 : request->priority;
+        mQueues[queue]->push(request.release());
+    }
+    queueDepth().add(1);
+    mReady.notify_one();
+    return true;
+}
+
+size_t Scheduler::pending() const {
+    lock_guard<mutex> lock(mLock);
+    size_t n = 0;
+    for (auto& q : mQueues) n += q->size();
+    return n;
+}
+
+vector<RequestPtr> Scheduler::nextBatch(vector<RequestPtr>& expired) {
+    vector<RequestPtr> batch;
+    int                maxBatch = mOptions.maxBatch;
+
+    if (mOptions.policy == Policy::Fifo) {
+        Queue& q = *mQueues[0];
+        while (!q.empty() && (int)batch.size() < maxBatch) batch.emplace_back(q.pop());
+        return batch;
+    }
+
+    Nanos t = now();
+    // 1. 每个class的队头单独推理都已经赶不上的丢掉. 队头是这个class里deadline最早的, 后面的不用看
+    Nanos single = (Nanos)(mModel.predict(1) * 1000);
+    for (auto& q : mQueues) {
+        while (!q->empty() && q->top()->deadline != 0 && t + single > q->top()->deadline) {
+            expired.emplace_back(q->pop());
+        }
+    }
+
+    // 2. 优先级最高的非空class: 按deadline取出前2 * maxBatch个候选, 对每个batch大小b, deadline晚于预测完成时间的
+    //    候选是一个后缀, 取能按时完成最多请求的b(一样多的时候取小的, 延迟低). 过载的时候宁可放弃队头
+    //    一两个快到期的请求, 也要用大batch把吞吐提上去; 放回去的请求下一轮还来不及会在第1步丢掉
+    size_t top = 0;
+    while (top < mQueues.size() && mQueues[top]->empty()) top++;
+    if (top == mQueues.size()) return batch;
+
+    Queue&           q = *mQueues[top];
+    vector<Request*> candidates;
+    while (!q.empty() && (int)candidates.size() < 2 * maxBatch) candidates.push_back(q.pop());
+    auto deadlineOf = [](const Request* r) { return r->deadline == 0 ? INT64_MAX : r->deadline; };
+
+    size_t bestFirst = 0;
+    int    bestMet   = 0;
+    for (int b = 1; b <= maxBatch && b <= (int)candidates.size(); b++) {
+        Nanos  finish = t + (Nanos)(mModel.predict(b) * 1000);
+        size_t first  = 0;
+        while (first < candidates.size() && deadlineOf(candidates[first]) < finish) first++;
+        int met = std::min<int>(b, (int)(candidates.size() - first));
+        if (met > bestMet) {
+            bestMet   = met;
+            bestFirst = first;
+        }
+    }
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (i >= bestFirst && i < bestFirst + bestMet) {
+            batch.emplace_back(candidates[i]);
+        } else {
+            q.push(candidates[i]);
+        }
+    }
+
+    // 3. 这个class已经取完的时候, 用低优先级里还来得及的请求补满batch(不能让batch里的请求超时)
+    if (!q.empty() || batch.empty()) return batch;
+    Nanos earliest = deadlineOf(batch.front().get());
+    for (size_t c = top + 1; c < mQueues.size() && (int)batch.size() < maxBatch; c++) {
+        Queue& lower = *mQueues[c];
+        while (!lower.empty() && (int)batch.size() < maxBatch) {
+            Nanos deadline = deadlineOf(lower.top());
+            Nanos finish   = t + (Nanos)(mModel.predict((int)batch.size() + 1) * 1000);
+            if (finish > std::min(earliest, deadline)) break;
+            earliest = std::min(earliest, deadline);
+            batch.emplace_back(lower.pop());
+        }
+        if (!lower.empty()) break;
+    }
+    return batch;
+}
+
+void Scheduler::finish(RequestPtr& request, Status status, Nanos end) {
+    Counters& c = *mCounters[request->priority];
+    switch (status) {
+        case Status::Met:     c.met++; break;
+        case Status::Late:    c.late++; lateTotal().inc(); break;
+        case Status::Dropped: c.dropped++; droppedTotal().inc(); break;
+        case Status::Failed:  c.failed++; break;
+    }
+    if (status == Status::Met || status == Status::Late) {
+        c.latency.record((uint64_t)std::max<Nanos>(0, (end - request->arrival) / 1000));
+    }
+}
+
+void Scheduler::run() {
+    while (true) {
+        vector<RequestPtr> expired;
+        vector<RequestPtr> batch;
+        {
+            unique_lock<mutex> lock(mLock);
+            mReady.wait(lock, [&]() {
+                if (mStopping) return true;
+                for (auto& q : mQueues) if (!q->empty()) return true;
+                return false;
+            });
+            batch = nextBatch(expired);
+            if (batch.empty() && expired.empty() && mStopping) break;
+        }
+        queueDepth().sub((int64_t)(batch.size() + expired.size()));
+
+        Nanos end = now();
+        for (auto& r : expired) {
+            {
+                lock_guard<mutex> lock(mLock);
+                finish(r, Status::Dropped, end);
+            }
+            if (r->done) r->done(*r, Status::Dropped);
+        }
+        if (batch.empty()) continue;
+
+        vector<Request*> items;
+        for (auto& r : batch) items.push_back(r.get());
+        Nanos start = now();
+        bool  ok    = mExecute(items);
+        end         = now();
+        if (ok) mModel.observe((int)items.size(), (end - start) / 1000.0);
+        batchSizes().record(items.size());
+
+        for (auto& r : batch) {
+            Status status = !ok ? Status::Failed : (r->deadline != 0 && end > r->deadline ? Status::Late : Status::Met);
+            {
+                lock_guard<mutex> lock(mLock);
+                finish(r, status, end);
+            }
+            if (r->done) r->done(*r, status);
+        }
+    }
+}
+
+vector<ClassStats> Scheduler::stats() const {
+    lock_guard<mutex> lock(mLock);
+    vector<ClassStats> out;
+    for (size_t i = 0; i < mCounters.size(); i++) {
+        const Counters& c = *mCounters[i];
+        ClassStats      s;
+        s.priority  = (int)i;
+        s.submitted = c.submitted;
+        s.met       = c.met;
+        s.late      = c.late;
+        s.dropped   = c.dropped;
+        s.failed    = c.failed;
+        metrics::HistogramSnapshot h = c.latency.snapshot();
+        s.p50Ms     = h.count == 0 ? 0 : h.percentile(50) / 1000.0;
+        s.p99Ms     = h.count == 0 ? 0 : h.percentile(99) / 1000.0;
+        out.push_back(s);
+    }
+    return out;
+}
+
+void Scheduler::report() const {
+    LOG("scheduler (%s, max batch %d, %d worker(s)):", mOptions.policy == Policy::Edf ? "edf" : "fifo",
+        mOptions.maxBatch, mOptions.workers);
+    for (auto& s : stats()) {
+        LOG("    class %d: %7llu submitted, %7llu met, %6llu late, %6llu dropped, %4llu failed, miss rate %6.2f%%, "
+            "p50 %7.2f ms, p99 %7.2f ms",
+            s.priority, (unsigned long long)s.submitted, (unsigned long long)s.met, (unsigned long long)s.late,
+            (unsigned long long)s.dropped, (unsigned long long)s.failed, 100 * s.missRate(), s.p50Ms, s.p99Ms);
+    }
+}
+
+/* ------------------------------- simulation ------------------------------- */
+
+vector<ClassStats> simulate(const SimConfig& config) {
+    Options options = config.options;
+    options.classes = std::max<int>(1, (int)config.classes.size());
+
+    mt19937 rng(config.seed);
+    mutex   rngLock;
+    auto backend = [&](vector<Request*>& batch) {
+        double us;
+        {
+            lock_guard<mutex> lock(rngLock);
+            uniform_real_distribution<double> noise(1 - config.jitter, 1 + config.jitter);
+            us = (config.baseUs + config.perItemUs * batch.size()) * noise(rng);
+        }
+        this_thread::sleep_for(chrono::microseconds((int64_t)us));
+        for (auto r : batch) r->output.assign(1, (float)r->input.size());
+        return true;
+    };
+
+    Scheduler scheduler(backend, options);
+    scheduler.start();
+
+    // 每个class独立的泊松过程, 合并成一个按时间排序的到达序列
+    struct Arrival {
+        double at;
+        int    cls;
+        bool operator>(const Arrival& o) const { return at > o.at; }
+    };
+    priority_queue<Arrival, vector<Arrival>, greater<Arrival>> arrivals;
+    vector<exponential_distribution<double>> gaps;
+    for (size_t c = 0; c < config.classes.size(); c++) {
+        gaps.emplace_back(std::max(config.classes[c].rate, 1e-9));
+        Arrival a;
+        a.at  = gaps[c](rng);
+        a.cls = (int)c;
+        arrivals.push(a);
+    }
+
+    Nanos start = now();
+    while (!arrivals.empty()) {
+        Arrival a = arrivals.top();
+        arrivals.pop();
+        if (a.at >= config.seconds) continue;
+        Nanos due = start + (Nanos)(a.at * 1e9);
+        Nanos t   = now();
+        if (due > t) this_thread::sleep_for(chrono::nanoseconds(due - t));
+
+        RequestPtr r(new Request());
+        r->priority = a.cls;
+        r->deadline = now() + (Nanos)(config.classes[a.cls].deadlineMs * 1e6);
+        r->input.assign(16, 1.0f);
+        scheduler.submit(move(r));
+
+        double gap;
+        {
+            lock_guard<mutex> lock(rngLock);
+            gap = gaps[a.cls](rng);
+        }
+        a.at += gap;
+        arrivals.push(a);
+    }
+    scheduler.stop();
+    scheduler.report();
+    return scheduler.stats();
+}
+
+bool check(double seconds) {
+    bool ok = true;
+    auto accounted = [&ok](const vector<ClassStats>& stats, const char* what) {
+        for (auto& c : stats) {
+            if (c.met + c.late + c.dropped + c.failed != c.submitted) {
+                LOGE("ERROR: sched check %s: class %d lost requests (%llu submitted, %llu accounted)", what, c.priority,
+                     (unsigned long long)c.submitted, (unsigned long long)(c.met + c.late + c.dropped + c.failed));
+                ok = false;
+            }
+        }
+    };
+
+    SimConfig   sim;
+    ClassConfig interactive, bulk;
+    interactive.rate = 150;  interactive.deadlineMs = 15;
+    bulk.rate        = 600;  bulk.deadlineMs        = 200;
+    sim.classes = {interactive, bulk};
+    sim.seconds = seconds;
+
+    double miss[2][2];    // [正常负载/过载][EDF/FIFO]的交互请求的miss rate
+    for (int load = 0; load < 2; load++) {
+        sim.classes[1].rate = load == 0 ? 600 : 1500;
+        for (int p = 0; p < 2; p++) {
+            sim.options.policy = p == 0 ? Policy::Edf : Policy::Fifo;
+            LOG("%s, %s", load == 0 ? "moderate load" : "overload", p == 0 ? "edf" : "fifo");
+            auto stats = simulate(sim);
+            accounted(stats, load == 0 ? "moderate load" : "overload");
+            miss[load][p] = stats.empty() ? 1 : stats[0].missRate();
+        }
+    }
+    if (miss[1][0] >= 0.05 || miss[1][0] > miss[1][1]) {
+        LOGE("ERROR: sched check overload: interactive miss rate %.2f%% with edf, %.2f%% with fifo",
+             100 * miss[1][0], 100 * miss[1][1]);
+        ok = false;
+    }
+    if (ok) LOG("sched check passed");
+    return ok;
+}
+
+} // namespace sched
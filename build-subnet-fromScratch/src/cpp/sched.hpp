@@ -0,0 +1,165 @@
+#ifndef __SCHED_HPP__
+#define __SCHED_HPP__
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.hpp"
+
+// executor前面的调度: 请求有优先级(class, 0最高)和deadline
+//     - 不同的class按优先级, 同一个class里按deadline从早到晚(EDF)
+//     - 每次组batch之前, 按latency model预测的时间已经赶不上deadline的请求直接丢掉, 不占用GPU
+//     - batch的大小: 在优先级最高的class里选能按时完成最多请求的b(预测时间内能完成的是按deadline排序的一个后缀),
+//       这个class的请求取完了还放得下的时候, 用低优先级里还来得及的请求补满batch
+//     - latency model按batch大小记录实际的耗时(EWMA的均值和偏差), 预测的时候用均值 + 2倍偏差,
+//       没有见过的batch大小用见过的点线性拟合
+// Policy::Fifo是现在的做法(按到达顺序, 不丢, 每次取满batch), 用来对比
+
+namespace sched {
+
+typedef int64_t Nanos;
+
+Nanos now();
+
+enum class Status { Met, Late, Dropped, Failed };
+
+const char* statusName(Status status);
+
+struct Request {
+    uint64_t           id       = 0;
+    int                priority = 0;       // class, 0最高
+    Nanos              deadline = 0;       // 绝对时间(now()), 0表示没有deadline
+    Nanos              arrival  = 0;       // submit的时候填
+    std::vector<float> input;
+    std::vector<float> output;
+    // 完成, 超时或者丢弃的时候在executor的线程上调用
+    std::function<void(Request& request, Status status)> done;
+};
+
+typedef std::unique_ptr<Request> RequestPtr;
+
+// 一次推理一个batch, 返回false的时候整个batch都是Failed
+typedef std::function<bool(std::vector<Request*>& batch)> BatchFn;
+
+class LatencyModel {
+public:
+    explicit LatencyModel(int maxBatch, double initialUs = 1000, double alpha = 0.1);
+
+    void   observe(int batch, double us);
+    // 保守的预测(均值 + 2倍偏差), 单位us
+    double predict(int batch) const;
+    int    samples(int batch) const;
+    void   report() const;
+
+private:
+    double estimate(int batch) const;
+
+    mutable std::mutex  mLock;
+    double              mInitialUs;
+    double              mAlpha;
+    std::vector<double> mMean;
+    std::vector<double> mDev;
+    std::vector<int>    mCount;
+};
+
+enum class Policy { Edf, Fifo };
+
+struct Options {
+    Policy policy    = Policy::Edf;
+    int    classes   = 2;
+    int    maxBatch  = 8;
+    int    workers   = 1;
+    double initialUs = 1000;    // latency model还没有数据的时候的预测
+};
+
+struct ClassStats {
+    int      priority  = 0;
+    uint64_t submitted = 0;
+    uint64_t met       = 0;
+    uint64_t late      = 0;     // 完成了但是超过了deadline
+    uint64_t dropped   = 0;     // 预测赶不上, 没有推理
+    uint64_t failed    = 0;
+    double   p50Ms     = 0;     // 完成的请求从submit到完成的时间
+    double   p99Ms     = 0;
+
+    double missRate() const { return submitted == 0 ? 0 : (double)(late + dropped + failed) / submitted; }
+};
+
+class Scheduler {
+public:
+    Scheduler(BatchFn execute, const Options& options = Options());
+    ~Scheduler();
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    void start();
+    // 不再接收新的请求, 已经在队列里的请求处理(或者丢弃)完以后返回
+    void stop();
+
+    // priority超出范围的时候按最低优先级
+    bool submit(RequestPtr request);
+
+    size_t                  pending() const;
+    std::vector<ClassStats> stats() const;
+    const LatencyModel&     model() const { return mModel; }
+    void                    report() const;
+
+private:
+    struct Queue;
+
+    void                    run();
+    // 在锁里调用: 丢掉赶不上的请求, 选出下一个batch
+    std::vector<RequestPtr> nextBatch(std::vector<RequestPtr>& expired);
+    void                    finish(RequestPtr& request, Status status, Nanos end);
+
+private:
+    BatchFn      mExecute;
+    Options      mOptions;
+    LatencyModel mModel;
+
+    mutable std::mutex                  mLock;
+    std::condition_variable             mReady;
+    std::vector<std::unique_ptr<Queue>> mQueues;     // 每个class一个, Fifo的时候只用第0个
+    uint64_t                            mArrivals = 0;
+    bool                                mStopping = false;
+    std::vector<std::thread>            mWorkers;
+
+    struct Counters;
+    std::vector<std::unique_ptr<Counters>> mCounters;
+};
+
+/* ------------------------------- simulation ------------------------------- */
+
+struct ClassConfig {
+    double rate       = 100;     // 每秒的请求数(泊松到达)
+    double deadlineMs = 50;
+};
+
+struct SimConfig {
+    std::vector<ClassConfig> classes;
+    Options                  options;
+    double                   seconds   = 5;
+    double                   baseUs    = 2000;   // 假backend: baseUs + perItemUs * batch, 加上jitter比例的随机波动
+    double                   perItemUs = 500;
+    double                   jitter    = 0.1;
+    uint32_t                 seed      = 1;
+};
+
+// 按照配置产生请求交给Scheduler, 用sleep代替推理, 返回每个class的统计
+std::vector<ClassStats> simulate(const SimConfig& config);
+
+// 交互请求(15ms)和批量请求(200ms)在正常负载和过载下各跑一次EDF和FIFO, 检查:
+//     - 每个请求都有结果(met + late + dropped + failed == submitted)
+//     - 过载的时候EDF的交互请求几乎不miss(< 5%), 并且不比FIFO差
+// 出错的时候打印是哪一项并返回false
+bool check(double seconds = 3);
+
+} // namespace sched
+
+#endif //__SCHED_HPP__
@@ -0,0 +1,773 @@
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include "shapes.hpp"
+#include "buildconfig.hpp"
+#include "tensor.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace shapes {
+
+const char* opName(Op op) {
+    switch (op) {
+        case Op::Input:          return "input";
+        case Op::Convolution:    return "conv";
+        case Op::Deconvolution:  return "deconv";
+        case Op::Pooling:        return "pool";
+        case Op::Resize:         return "resize";
+        case Op::Slice:          return "slice";
+        case Op::Concatenation:  return "concat";
+        case Op::Shuffle:        return "shuffle";
+        case Op::Reduce:         return "reduce";
+        case Op::ElementWise:    return "elementwise";
+        case Op::FullyConnected: return "fc";
+        case Op::Constant:       return "constant";
+        case Op::Unary:          return "unary";
+    }
+    return "unknown";
+}
+
+Window window(vector<int> kernel, vector<int> stride, vector<int> padding) {
+    Window w;
+    w.kernel      = move(kernel);
+    w.stride      = move(stride);
+    w.prePadding  = padding;
+    w.postPadding = move(padding);
+    return w;
+}
+
+/* ------------------------------- Network ------------------------------- */
+
+int Network::add(Layer layer) {
+    TensorDesc tensor;
+    tensor.name     = layer.name;
+    tensor.dims.nbDims = -1;
+    tensor.producer = (int)layers.size();
+    if (!layer.inputs.empty() && layer.inputs[0] >= 0 && layer.inputs[0] < (int)tensors.size()) {
+        tensor.type = tensors[layer.inputs[0]].type;
+    }
+    layer.output = (int)tensors.size();
+    tensors.push_back(tensor);
+    layers.push_back(move(layer));
+    return layers.back().output;
+}
+
+int Network::addInput(const string& name, nvinfer1::Dims dims, nvinfer1::DataType type) {
+    TensorDesc tensor;
+    tensor.name = name;
+    tensor.dims = dims;
+    tensor.type = type;
+    tensors.push_back(tensor);
+    return (int)tensors.size() - 1;
+}
+
+int Network::addConvolution(const string& name, int input, int channels, Window window, int groups, int64_t weightsBytes) {
+    Layer layer;
+    layer.name         = name;
+    layer.op           = Op::Convolution;
+    layer.inputs       = {input};
+    layer.channels     = channels;
+    layer.groups       = groups;
+    layer.window       = move(window);
+    layer.weightsBytes = weightsBytes;
+    return add(move(layer));
+}
+
+int Network::addDeconvolution(const string& name, int input, int channels, Window window, int groups, int64_t weightsBytes) {
+    Layer layer;
+    layer.name         = name;
+    layer.op           = Op::Deconvolution;
+    layer.inputs       = {input};
+    layer.channels     = channels;
+    layer.groups       = groups;
+    layer.window       = move(window);
+    layer.weightsBytes = weightsBytes;
+    return add(move(layer));
+}
+
+int Network::addPooling(const string& name, int input, Window window) {
+    Layer layer;
+    layer.name   = name;
+    layer.op     = Op::Pooling;
+    layer.inputs = {input};
+    layer.window = move(window);
+    return add(move(layer));
+}
+
+int Network::addResize(const string& name, int input, vector<float> scales) {
+    Layer layer;
+    layer.name   = name;
+    layer.op     = Op::Resize;
+    layer.inputs = {input};
+    layer.scales = move(scales);
+    return add(move(layer));
+}
+
+int Network::addResize(const string& name, int input, nvinfer1::Dims dims) {
+    Layer layer;
+    layer.name   = name;
+    layer.op     = Op::Resize;
+    layer.inputs = {input};
+    layer.dims   = dims;
+    return add(move(layer));
+}
+
+int Network::addSlice(const string& name, int input, nvinfer1::Dims start, nvinfer1::Dims size, nvinfer1::Dims stride) {
+    Layer layer;
+    layer.name   = name;
+    layer.op     = Op::Slice;
+    layer.inputs = {input};
+    layer.start  = start;
+    layer.size   = size;
+    layer.stride = stride;
+    return add(move(layer));
+}
+
+int Network::addConcatenation(const string& name, vector<int> inputs, int axis) {
+    Layer layer;
+    layer.name   = name;
+    layer.op     = Op::Concatenation;
+    layer.inputs = move(inputs);
+    layer.axis   = axis;
+    return add(move(layer));
+}
+
+int Network::addShuffle(const string& name, int input, shuffle::Spec spec) {
+    Layer layer;
+    layer.name    = name;
+    layer.op      = Op::Shuffle;
+    layer.inputs  = {input};
+    layer.shuffle = move(spec);
+    return add(move(layer));
+}
+
+int Network::addReduce(const string& name, int input, uint32_t axes, bool keepDims) {
+    Layer layer;
+    layer.name       = name;
+    layer.op         = Op::Reduce;
+    layer.inputs     = {input};
+    layer.reduceAxes = axes;
+    layer.keepDims   = keepDims;
+    return add(move(layer));
+}
+
+int Network::addElementWise(const string& name, int a, int b) {
+    Layer layer;
+    layer.name   = name;
+    layer.op     = Op::ElementWise;
+    layer.inputs = {a, b};
+    return add(move(layer));
+}
+
+int Network::addFullyConnected(const string& name, int input, int channels, int64_t weightsBytes) {
+    Layer layer;
+    layer.name         = name;
+    layer.op           = Op::FullyConnected;
+    layer.inputs       = {input};
+    layer.channels     = channels;
+    layer.weightsBytes = weightsBytes;
+    return add(move(layer));
+}
+
+int Network::addConstant(const string& name, nvinfer1::Dims dims, nvinfer1::DataType type, int64_t weightsBytes) {
+    Layer layer;
+    layer.name         = name;
+    layer.op           = Op::Constant;
+    layer.dims         = dims;
+    layer.weightsBytes = weightsBytes;
+    int output = add(move(layer));
+    tensors[output].type = type;
+    return output;
+}
+
+int Network::addUnary(const string& name, int input, int64_t weightsBytes) {
+    Layer layer;
+    layer.name         = name;
+    layer.op           = Op::Unary;
+    layer.inputs       = {input};
+    layer.weightsBytes = weightsBytes;
+    return add(move(layer));
+}
+
+void Network::markOutput(int tensor) {
+    if (tensor >= 0 && tensor < (int)tensors.size()) {
+        tensors[tensor].output = true;
+    }
+}
+
+int Network::find(const string& name) const {
+    for (int i = 0; i < (int)tensors.size(); i++) {
+        if (tensors[i].name == name) return i;
+    }
+    return -1;
+}
+
+/* ------------------------------- shape推导 ------------------------------- */
+
+// 为空的时候用默认值
+static int at(const vector<int>& values, int i, int fallback) {
+    return i < (int)values.size() ? values[i] : fallback;
+}
+
+// 输入是-1的时候输出也是-1, 结果不是正数的时候返回0表示出错
+static int convDim(int in, int k, int s, int pre, int post, int d, bool same) {
+    if (in < 0) return -1;
+    if (same) return (in + s - 1) / s;
+    int span = in + pre + post - d * (k - 1) - 1;
+    return span < 0 ? 0 : span / s + 1;
+}
+
+static int deconvDim(int in, int k, int s, int pre, int post, int d, bool same) {
+    if (in < 0) return -1;
+    if (same) return in * s;
+    int out = (in - 1) * s + d * (k - 1) + 1 - pre - post;
+    return max(out, 0);
+}
+
+static int poolDim(int in, int k, int s, int pre, int post, bool roundUp, bool same) {
+    if (in < 0) return -1;
+    if (same) return (in + s - 1) / s;
+    int span = in + pre + post - k;
+    if (span < 0) return 0;
+    return (roundUp ? (span + s - 1) / s : span / s) + 1;
+}
+
+static bool checkWindow(const Window& w, int spatial) {
+    if ((int)w.kernel.size() != spatial) return false;
+    for (int i = 0; i < spatial; i++) {
+        if (w.kernel[i] <= 0 || at(w.stride, i, 1) <= 0 || at(w.dilation, i, 1) <= 0) return false;
+        if (at(w.prePadding, i, 0) < 0 || at(w.postPadding, i, 0) < 0) return false;
+    }
+    return true;
+}
+
+// conv/deconv/pool: [N, C, spatial...]
+static bool inferWindow(const Layer& layer, const nvinfer1::Dims& in, nvinfer1::Dims& out) {
+    const Window& w = layer.window;
+    int spatial = (int)w.kernel.size();
+    if (in.nbDims != spatial + 2 || !checkWindow(w, spatial)) {
+        LOGE("ERROR: %s: %d-d window on %s", layer.name.c_str(), spatial, printDims(in).c_str());
+        return false;
+    }
+
+    out = in;
+    if (layer.op != Op::Pooling) {
+        if (layer.channels <= 0 || layer.groups <= 0 || layer.channels % layer.groups != 0
+            || (in.d[1] >= 0 && in.d[1] % layer.groups != 0)) {
+            LOGE("ERROR: %s: %d channels in %d groups on %s", layer.name.c_str(), layer.channels, layer.groups, printDims(in).c_str());
+            return false;
+        }
+        out.d[1] = layer.channels;
+    }
+    for (int i = 0; i < spatial; i++) {
+        int k = w.kernel[i], s = at(w.stride, i, 1), d = at(w.dilation, i, 1);
+        int pre = at(w.prePadding, i, 0), post = at(w.postPadding, i, 0);
+        int dim;
+        switch (layer.op) {
+            case Op::Convolution:   dim = convDim(in.d[i + 2], k, s, pre, post, d, w.same); break;
+            case Op::Deconvolution: dim = deconvDim(in.d[i + 2], k, s, pre, post, d, w.same); break;
+            default:                dim = poolDim(in.d[i + 2], k, s, pre, post, w.roundUp, w.same); break;
+        }
+        if (dim == 0) {
+            LOGE("ERROR: %s: window %d is larger than %s", layer.name.c_str(), k, printDims(in).c_str());
+            return false;
+        }
+        out.d[i + 2] = dim;
+    }
+    return true;
+}
+
+static bool inferResize(const Layer& layer, const nvinfer1::Dims& in, nvinfer1::Dims& out) {
+    if (layer.scales.empty()) {
+        out = layer.dims;
+        return out.nbDims == in.nbDims;
+    }
+    if ((int)layer.scales.size() != in.nbDims) return false;
+    out = in;
+    for (int i = 0; i < in.nbDims; i++) {
+        if (layer.scales[i] <= 0) return false;
+        if (in.d[i] >= 0) out.d[i] = (int)(in.d[i] * layer.scales[i]);
+    }
+    return true;
+}
+
+static bool inferSlice(const Layer& layer, const nvinfer1::Dims& in, nvinfer1::Dims& out) {
+    if (layer.start.nbDims != in.nbDims || layer.size.nbDims != in.nbDims || layer.stride.nbDims != in.nbDims) return false;
+    for (int i = 0; i < in.nbDims; i++) {
+        int start = layer.start.d[i], size = layer.size.d[i], stride = layer.stride.d[i];
+        if (size < 0 || start < 0) return false;
+        // 最后一个元素要在输入里面
+        if (in.d[i] >= 0 && size > 0 && start + (int64_t)(size - 1) * stride >= in.d[i]) return false;
+        if (size > 1 && start + (int64_t)(size - 1) * stride < 0) return false;
+    }
+    out = layer.size;
+    return true;
+}
+
+static bool inferConcat(const Layer& layer, const vector<TensorDesc>& tensors, nvinfer1::Dims& out) {
+    out = tensors[layer.inputs[0]].dims;
+    int axis = layer.axis < 0 ? layer.axis + out.nbDims : layer.axis;
+    if (axis < 0 || axis >= out.nbDims) return false;
+    for (size_t j = 1; j < layer.inputs.size(); j++) {
+        auto& dims = tensors[layer.inputs[j]].dims;
+        if (dims.nbDims != out.nbDims) return false;
+        for (int i = 0; i < out.nbDims; i++) {
+            if (i == axis) {
+                out.d[i] = (out.d[i] < 0 || dims.d[i] < 0) ? -1 : out.d[i] + dims.d[i];
+            } else if (out.d[i] >= 0 && dims.d[i] >= 0 && out.d[i] != dims.d[i]) {
+                return false;
+            } else if (out.d[i] < 0) {
+                out.d[i] = dims.d[i];
+            }
+        }
+    }
+    return true;
+}
+
+static bool inferReduce(const Layer& layer, const nvinfer1::Dims& in, nvinfer1::Dims& out) {
+    if (in.nbDims < 32 && (layer.reduceAxes >> in.nbDims) != 0) return false;
+    out.nbDims = 0;
+    for (int i = 0; i < in.nbDims; i++) {
+        if (layer.reduceAxes & (1u << i)) {
+            if (layer.keepDims) out.d[out.nbDims++] = 1;
+        } else {
+            out.d[out.nbDims++] = in.d[i];
+        }
+    }
+    return true;
+}
+
+// 两个输入的rank一样, 每一维相等或者其中一个是1
+static bool inferBroadcast(const nvinfer1::Dims& a, const nvinfer1::Dims& b, nvinfer1::Dims& out) {
+    if (a.nbDims != b.nbDims) return false;
+    out = a;
+    for (int i = 0; i < a.nbDims; i++) {
+        int x = a.d[i], y = b.d[i];
+        if (x == y || y == 1) out.d[i] = x;
+        else if (x == 1)      out.d[i] = y;
+        else if (x < 0)       out.d[i] = y;
+        else if (y < 0)       out.d[i] = x;
+        else                  return false;
+    }
+    return true;
+}
+
+static bool inferLayer(const Layer& layer, const vector<TensorDesc>& tensors, nvinfer1::Dims& out) {
+    const nvinfer1::Dims& in = tensors[layer.inputs.empty() ? 0 : layer.inputs[0]].dims;
+    switch (layer.op) {
+        case Op::Convolution:
+        case Op::Deconvolution:
+        case Op::Pooling:        return inferWindow(layer, in, out);
+        case Op::Resize:         return inferResize(layer, in, out);
+        case Op::Slice:          return inferSlice(layer, in, out);
+        case Op::Concatenation:  return inferConcat(layer, tensors, out);
+        case Op::Shuffle:        out = shuffle::infer(layer.shuffle, in); return out.nbDims >= 0;
+        case Op::Reduce:         return inferReduce(layer, in, out);
+        case Op::ElementWise:    return inferBroadcast(in, tensors[layer.inputs[1]].dims, out);
+        case Op::FullyConnected:
+            // 和IFullyConnectedLayer一样, 最后三维(C, H, W)变成(K, 1, 1)
+            if (in.nbDims < 3 || layer.channels <= 0) return false;
+            out = in;
+            out.d[in.nbDims - 3] = layer.channels;
+            out.d[in.nbDims - 2] = 1;
+            out.d[in.nbDims - 1] = 1;
+            return true;
+        case Op::Constant:       out = layer.dims; return out.nbDims >= 0;
+        case Op::Unary:          out = in; return true;
+        case Op::Input:          break;
+    }
+    return false;
+}
+
+bool infer(Network& network) {
+    auto& tensors = network.tensors;
+    for (auto& layer : network.layers) {
+        bool inputsOk = layer.output >= 0 && layer.output < (int)tensors.size();
+        inputsOk = inputsOk && (!layer.inputs.empty() || layer.op == Op::Constant);
+        inputsOk = inputsOk && (layer.op != Op::ElementWise || layer.inputs.size() == 2);
+        for (int input : layer.inputs) {
+            inputsOk = inputsOk && input >= 0 && input < layer.output && tensors[input].dims.nbDims >= 0;
+        }
+        if (!inputsOk) {
+            LOGE("ERROR: %s (%s) has invalid inputs", layer.name.c_str(), opName(layer.op));
+            return false;
+        }
+
+        nvinfer1::Dims out;
+        out.nbDims = -1;
+        if (!inferLayer(layer, tensors, out) || out.nbDims < 0 || out.nbDims > nvinfer1::Dims::MAX_DIMS) {
+            string inputs;
+            for (int input : layer.inputs) {
+                inputs += (inputs.empty() ? "" : ", ") + printDims(tensors[input].dims);
+            }
+            LOGE("ERROR: %s (%s): cannot infer the output of [%s]", layer.name.c_str(), opName(layer.op), inputs.c_str());
+            return false;
+        }
+        tensors[layer.output].dims = out;
+        LOGV("%s, %s, %s", layer.name.c_str(), opName(layer.op), printDims(out).c_str());
+    }
+    return true;
+}
+
+/* ------------------------------- 内存估计 ------------------------------- */
+
+static const int64_t kArenaAlignment = 256;
+
+struct Interval {
+    int     tensor;
+    int     begin;          // 产生它的层
+    int     end;            // 最后一个用到它的层
+    int64_t bytes;
+    int64_t offset;
+};
+
+static int64_t tensorBytes(const TensorDesc& tensor, nvinfer1::DataType precision) {
+    int64_t count = 1;
+    for (int i = 0; i < tensor.dims.nbDims; i++) {
+        if (tensor.dims.d[i] < 0) return -1;
+        count *= tensor.dims.d[i];
+    }
+    bool isFloat = tensor.type == nvinfer1::DataType::kFLOAT || tensor.type == nvinfer1::DataType::kHALF;
+    return count * dataTypeSize(isFloat ? precision : tensor.type);
+}
+
+// 按大小从大到小, 放在和它的生命周期重叠的tensor之间第一个放得下的位置
+static int64_t placeFirstFit(vector<Interval>& intervals) {
+    vector<int> order(intervals.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = (int)i;
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return intervals[a].bytes > intervals[b].bytes; });
+
+    int64_t      arena = 0;
+    vector<int>  placed;
+    for (int index : order) {
+        auto& cur = intervals[index];
+        int64_t size = (cur.bytes + kArenaAlignment - 1) / kArenaAlignment * kArenaAlignment;
+
+        vector<pair<int64_t, int64_t>> used;
+        for (int other : placed) {
+            auto& o = intervals[other];
+            if (o.begin <= cur.end && cur.begin <= o.end) {
+                used.push_back({o.offset, (o.bytes + kArenaAlignment - 1) / kArenaAlignment * kArenaAlignment});
+            }
+        }
+        sort(used.begin(), used.end());
+
+        int64_t offset = 0;
+        for (auto& u : used) {
+            if (u.first >= offset + size) break;
+            offset = max(offset, u.first + u.second);
+        }
+        cur.offset = offset;
+        arena = max(arena, offset + size);
+        placed.push_back(index);
+    }
+    return arena;
+}
+
+bool estimate(Network& network, nvinfer1::DataType precision, Estimate& result) {
+    result = Estimate();
+    if (!infer(network)) return false;
+
+    auto& tensors = network.tensors;
+    auto& layers  = network.layers;
+    int   last    = (int)layers.size() - 1;
+
+    for (auto& layer : layers) {
+        result.weightsBytes += layer.weightsBytes;
+    }
+
+    // 每个tensor从产生它的层活到最后一个用到它的层, input和output一直活着
+    vector<Interval> intervals;
+    vector<int>      slot(tensors.size(), -1);
+    for (int i = 0; i < (int)tensors.size(); i++) {
+        auto& tensor   = tensors[i];
+        bool  constant = tensor.producer >= 0 && layers[tensor.producer].op == Op::Constant;
+        if (constant) continue;     // 已经算在权重里了
+
+        int64_t bytes = tensorBytes(tensor, precision);
+        if (bytes < 0) {
+            LOGE("ERROR: %s has dynamic shape %s, set the input shapes before estimating", tensor.name.c_str(), printDims(tensor.dims).c_str());
+            return false;
+        }
+        int begin = tensor.producer < 0 ? 0 : tensor.producer;
+        int end   = (tensor.producer < 0 || tensor.output) ? max(last, 0) : begin;
+        slot[i] = (int)intervals.size();
+        intervals.push_back({i, begin, end, bytes, 0});
+    }
+    for (int l = 0; l < (int)layers.size(); l++) {
+        for (int input : layers[l].inputs) {
+            if (slot[input] >= 0) {
+                auto& interval = intervals[slot[input]];
+                interval.end = max(interval.end, l);
+            }
+        }
+    }
+
+    // input/output由调用的人分配, 不在engine的activation内存里
+    vector<Interval> internal;
+    for (auto& interval : intervals) {
+        auto& tensor = tensors[interval.tensor];
+        if (tensor.producer < 0 || tensor.output) {
+            result.ioBytes += interval.bytes;
+        } else {
+            internal.push_back(interval);
+            result.totalBytes += interval.bytes;
+        }
+    }
+
+    // 每一层执行的时候活着的tensor
+    for (int l = 0; l <= last; l++) {
+        int64_t live = 0;
+        for (auto& interval : internal) {
+            if (interval.begin <= l && l <= interval.end) live += interval.bytes;
+        }
+        if (live > result.peakBytes) {
+            result.peakBytes = live;
+            result.peakLayer = layers[l].name;
+        }
+    }
+    result.arenaBytes = placeFirstFit(internal);
+    return true;
+}
+
+string summary(const Estimate& estimate) {
+    stringstream ss;
+    ss << "weights " << buildcfg::formatSize(estimate.weightsBytes)
+       << ", activations peak " << buildcfg::formatSize(estimate.peakBytes);
+    if (!estimate.peakLayer.empty()) ss << " at " << estimate.peakLayer;
+    ss << ", arena " << buildcfg::formatSize(estimate.arenaBytes)
+       << ", without reuse " << buildcfg::formatSize(estimate.totalBytes)
+       << ", io " << buildcfg::formatSize(estimate.ioBytes);
+    return ss.str();
+}
+
+/* ------------------------------- INetworkDefinition ------------------------------- */
+
+static vector<int> toVector(const nvinfer1::Dims& dims) {
+    vector<int> values;
+    for (int i = 0; i < dims.nbDims; i++) values.push_back(dims.d[i]);
+    return values;
+}
+
+static int64_t weightsBytes(const nvinfer1::Weights& weights) {
+    return weights.values == nullptr ? 0 : weights.count * dataTypeSize(weights.type);
+}
+
+static Window toWindow(nvinfer1::Dims kernel, nvinfer1::Dims stride, nvinfer1::Dims pre, nvinfer1::Dims post,
+                       nvinfer1::Dims dilation, nvinfer1::PaddingMode mode) {
+    Window window;
+    window.kernel      = toVector(kernel);
+    window.stride      = toVector(stride);
+    window.prePadding  = toVector(pre);
+    window.postPadding = toVector(post);
+    window.dilation    = toVector(dilation);
+    window.roundUp     = mode == nvinfer1::PaddingMode::kEXPLICIT_ROUND_UP || mode == nvinfer1::PaddingMode::kCAFFE_ROUND_UP;
+    window.same        = mode == nvinfer1::PaddingMode::kSAME_UPPER || mode == nvinfer1::PaddingMode::kSAME_LOWER;
+    return window;
+}
+
+static vector<int> toOrder(const nvinfer1::Permutation& perm, int rank) {
+    vector<int> order;
+    bool identity = true;
+    for (int i = 0; i < rank; i++) {
+        order.push_back(perm.order[i]);
+        identity = identity && perm.order[i] == i;
+    }
+    return identity ? vector<int>() : order;
+}
+
+static bool toSpec(nvinfer1::IShuffleLayer& layer, int rank, shuffle::Spec& spec) {
+    spec.first = toOrder(layer.getFirstTranspose(), rank);
+    auto reshape = layer.getReshapeDimensions();
+    if (reshape.nbDims >= 0) {
+        spec.reshape = toVector(reshape);
+        // 0是真正的长度为0的维度, shuffle::Spec里的0是placeholder
+        if (!layer.getZeroIsPlaceholder() && find(spec.reshape.begin(), spec.reshape.end(), 0) != spec.reshape.end()) return false;
+        rank = reshape.nbDims;
+    }
+    spec.second = toOrder(layer.getSecondTranspose(), rank);
+    return true;
+}
+
+bool fromNetwork(nvinfer1::INetworkDefinition& network, Network& result) {
+    result = Network();
+    map<nvinfer1::ITensor*, int> ids;
+    for (int i = 0; i < network.getNbInputs(); i++) {
+        auto input = network.getInput(i);
+        ids[input] = result.addInput(input->getName(), input->getDimensions(), input->getType());
+    }
+
+    for (int l = 0; l < network.getNbLayers(); l++) {
+        auto layer = network.getLayer(l);
+        string name = layer->getName();
+
+        vector<int> inputs;
+        for (int j = 0; j < layer->getNbInputs(); j++) {
+            auto tensor = layer->getInput(j);
+            auto it     = tensor == nullptr ? ids.end() : ids.find(tensor);
+            if (it == ids.end()) {
+                LOGW("%s: input %d is not produced by a supported layer", name.c_str(), j);
+                return false;
+            }
+            inputs.push_back(it->second);
+        }
+        int in = inputs.empty() ? -1 : inputs[0];
+        auto dynamic = [&](int count) {
+            if ((int)inputs.size() <= count) return false;
+            LOGW("%s: shape-tensor inputs are not supported", name.c_str());
+            return true;
+        };
+
+        int output = -1;
+        switch (layer->getType()) {
+            case nvinfer1::LayerType::kCONVOLUTION: {
+                auto conv = static_cast<nvinfer1::IConvolutionLayer*>(layer);
+                output = result.addConvolution(name, in, conv->getNbOutputMaps(),
+                    toWindow(conv->getKernelSizeNd(), conv->getStrideNd(), conv->getPrePadding(), conv->getPostPadding(),
+                             conv->getDilationNd(), conv->getPaddingMode()),
+                    conv->getNbGroups(), weightsBytes(conv->getKernelWeights()) + weightsBytes(conv->getBiasWeights()));
+                break;
+            }
+            case nvinfer1::LayerType::kDECONVOLUTION: {
+                auto deconv = static_cast<nvinfer1::IDeconvolutionLayer*>(layer);
+                output = result.addDeconvolution(name, in, deconv->getNbOutputMaps(),
+                    toWindow(deconv->getKernelSizeNd(), deconv->getStrideNd(), deconv->getPrePadding(), deconv->getPostPadding(),
+                             deconv->getDilationNd(), deconv->getPaddingMode()),
+                    deconv->getNbGroups(), weightsBytes(deconv->getKernelWeights()) + weightsBytes(deconv->getBiasWeights()));
+                break;
+            }
+            case nvinfer1::LayerType::kPOOLING: {
+                auto pool = static_cast<nvinfer1::IPoolingLayer*>(layer);
+                nvinfer1::Dims dilation;
+                dilation.nbDims = 0;
+                output = result.addPooling(name, in,
+                    toWindow(pool->getWindowSizeNd(), pool->getStrideNd(), pool->getPrePadding(), pool->getPostPadding(),
+                             dilation, pool->getPaddingMode()));
+                break;
+            }
+            case nvinfer1::LayerType::kRESIZE: {
+                if (dynamic(1)) return false;
+                auto resize = static_cast<nvinfer1::IResizeLayer*>(layer);
+                int  count  = resize->getScales(0, nullptr);
+                if (count > 0) {
+                    vector<float> scales(count);
+                    resize->getScales(count, scales.data());
+                    output = result.addResize(name, in, scales);
+                } else {
+                    output = result.addResize(name, in, resize->getOutputDimensions());
+                }
+                break;
+            }
+            case nvinfer1::LayerType::kSLICE: {
+                if (dynamic(1)) return false;
+                auto slice = static_cast<nvinfer1::ISliceLayer*>(layer);
+                output = result.addSlice(name, in, slice->getStart(), slice->getSize(), slice->getStride());
+                break;
+            }
+            case nvinfer1::LayerType::kCONCATENATION: {
+                auto concat = static_cast<nvinfer1::IConcatenationLayer*>(layer);
+                output = result.addConcatenation(name, inputs, concat->getAxis());
+                break;
+            }
+            case nvinfer1::LayerType::kSHUFFLE: {
+                if (dynamic(1)) return false;
+                shuffle::Spec spec;
+                if (!toSpec(*static_cast<nvinfer1::IShuffleLayer*>(layer), result.tensors[in].dims.nbDims, spec)) {
+                    LOGW("%s: reshape to a zero-length dimension is not supported", name.c_str());
+                    return false;
+                }
+                output = result.addShuffle(name, in, spec);
+                break;
+            }
+            case nvinfer1::LayerType::kREDUCE: {
+                auto reduce = static_cast<nvinfer1::IReduceLayer*>(layer);
+                output = result.addReduce(name, in, reduce->getReduceAxes(), reduce->getKeepDimensions());
+                break;
+            }
+            case nvinfer1::LayerType::kELEMENTWISE:
+            case nvinfer1::LayerType::kPARAMETRIC_RELU:
+                if (inputs.size() != 2) {
+                    LOGW("%s: expected 2 inputs, got %d", name.c_str(), (int)inputs.size());
+                    return false;
+                }
+                output = result.addElementWise(name, inputs[0], inputs[1]);
+                break;
+            case nvinfer1::LayerType::kFULLY_CONNECTED: {
+                auto fc = static_cast<nvinfer1::IFullyConnectedLayer*>(layer);
+                output = result.addFullyConnected(name, in, fc->getNbOutputChannels(),
+                    weightsBytes(fc->getKernelWeights()) + weightsBytes(fc->getBiasWeights()));
+                break;
+            }
+            case nvinfer1::LayerType::kCONSTANT: {
+                auto constant = static_cast<nvinfer1::IConstantLayer*>(layer);
+                output = result.addConstant(name, constant->getDimensions(), layer->getOutput(0)->getType(),
+                                            weightsBytes(constant->getWeights()));
+                break;
+            }
+            case nvinfer1::LayerType::kSCALE: {
+                auto scale = static_cast<nvinfer1::IScaleLayer*>(layer);
+                output = result.addUnary(name, in,
+                    weightsBytes(scale->getShift()) + weightsBytes(scale->getScale()) + weightsBytes(scale->getPower()));
+                break;
+            }
+            // 不改变shape的层, 多出来的输入(Q/DQ的scale)只影响liveness
+            case nvinfer1::LayerType::kACTIVATION:
+            case nvinfer1::LayerType::kSOFTMAX:
+            case nvinfer1::LayerType::kLRN:
+            case nvinfer1::LayerType::kUNARY:
+            case nvinfer1::LayerType::kIDENTITY:
+            case nvinfer1::LayerType::kQUANTIZE:
+            case nvinfer1::LayerType::kDEQUANTIZE:
+            case nvinfer1::LayerType::kCAST:
+                if (in < 0) return false;
+                output = result.addUnary(name, in);
+                break;
+            default:
+                LOGW("%s: layer type %d is not supported by shape inference", name.c_str(), (int)layer->getType());
+                return false;
+        }
+
+        if (layer->getNbOutputs() != 1) {
+            LOGW("%s has %d outputs", name.c_str(), layer->getNbOutputs());
+            return false;
+        }
+        // 多出来的输入也算用到了
+        result.layers.back().inputs = inputs;
+        result.tensors[output].type = layer->getOutput(0)->getType();
+        ids[layer->getOutput(0)] = output;
+    }
+
+    for (int i = 0; i < network.getNbOutputs(); i++) {
+        auto it = ids.find(network.getOutput(i));
+        if (it != ids.end()) result.markOutput(it->second);
+    }
+    return true;
+}
+
+bool check(nvinfer1::INetworkDefinition& network, Network& result) {
+    if (!fromNetwork(network, result) || !infer(result)) return false;
+    if ((int)result.layers.size() != network.getNbLayers()) {
+        LOGE("ERROR: %d layers were converted from a network with %d layers", (int)result.layers.size(), network.getNbLayers());
+        return false;
+    }
+
+    // fromNetwork按顺序每一层转换成一个Layer, 下标是对应的
+    int mismatches = 0;
+    for (int l = 0; l < network.getNbLayers(); l++) {
+        auto expected = network.getLayer(l)->getOutput(0)->getDimensions();
+        auto inferred = result.tensors[result.layers[l].output].dims;
+        bool same     = expected.nbDims == inferred.nbDims;
+        for (int i = 0; same && i < expected.nbDims; i++) same = expected.d[i] == inferred.d[i];
+        if (!same) {
+            LOGE("ERROR: %s: TensorRT gives %s, inferred %s", result.layers[l].name.c_str(), printDims(expected).c_str(),
+                 printDims(inferred).c_str());
+            mismatches++;
+        }
+    }
+    return mismatches == 0;
+}
+
+} // namespace shapes
@@ -0,0 +1,125 @@
+#ifndef __SHAPES_HPP__
+#define __SHAPES_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "NvInfer.h"
+#include "shuffle.hpp"
+
+// build之前在CPU上推导network里每个tensor的shape, 并估计权重和activation需要的内存
+//     - Network是和INetworkDefinition对应的一份描述, 可以直接搭, 也可以用fromNetwork从TensorRT的network转换过来
+//     - 支持conv/deconv/pool/resize/slice/concat/shuffle/reduce/fc/constant, 可以broadcast的elementwise,
+//       以及不改变shape的层(activation, scale, softmax, Q/DQ...)
+//     - activation按liveness复用: tensor在产生它的层分配, 最后一个用到它的层之后释放.
+//       peakBytes是同一时刻活着的tensor加起来的最大值, arenaBytes是按first-fit分配offset以后需要的大小.
+//       network的input/output由调用的人分配, 单独算在ioBytes里
+//     - 每一层的输出都算一个tensor, 没有考虑TensorRT的融合, 所以activation是偏大的估计
+// Model::build在调用builder之前检查, peak超过BuildProfile的memory_budget的时候直接失败, 不用等几分钟的build
+
+namespace shapes {
+
+enum class Op {
+    Input, Convolution, Deconvolution, Pooling, Resize, Slice, Concatenation,
+    Shuffle, Reduce, ElementWise, FullyConnected, Constant, Unary
+};
+
+const char* opName(Op op);
+
+// conv/deconv/pool的参数, 每个都是按空间维度(H, W)排列, stride和dilation为空的时候是1, padding为空的时候是0
+struct Window {
+    std::vector<int> kernel;
+    std::vector<int> stride;
+    std::vector<int> prePadding;
+    std::vector<int> postPadding;
+    std::vector<int> dilation;
+    bool             roundUp = false;     // pool的PaddingMode::kEXPLICIT_ROUND_UP
+    bool             same    = false;     // kSAME_UPPER/kSAME_LOWER, 输出是ceil(in / stride), deconv是in * stride
+};
+
+// 前后padding一样的window
+Window window(std::vector<int> kernel, std::vector<int> stride = {}, std::vector<int> padding = {});
+
+struct Layer {
+    std::string        name;
+    Op                 op = Op::Unary;
+    std::vector<int>   inputs;            // Network::tensors的下标
+    int                output = -1;
+    int64_t            weightsBytes = 0;
+
+    int                channels = 0;      // conv/deconv的输出channel, fc的输出个数
+    int                groups   = 1;
+    Window             window;
+    nvinfer1::Dims     start{}, size{}, stride{};   // slice
+    int                axis = 0;              // concat, 可以是负数
+    shuffle::Spec      shuffle;
+    uint32_t           reduceAxes = 0;
+    bool               keepDims   = true;
+    std::vector<float> scales;                // resize, 为空的时候用dims
+    nvinfer1::Dims     dims{};                // resize/constant的输出
+};
+
+struct TensorDesc {
+    std::string        name;
+    nvinfer1::Dims     dims{};            // infer之前只有input是有效的
+    nvinfer1::DataType type   = nvinfer1::DataType::kFLOAT;
+    int                producer = -1;     // 产生它的层, input是-1
+    bool               output = false;
+};
+
+// add*返回输出的tensor的下标
+struct Network {
+    std::vector<Layer>      layers;
+    std::vector<TensorDesc> tensors;
+
+    int  addInput(const std::string& name, nvinfer1::Dims dims, nvinfer1::DataType type = nvinfer1::DataType::kFLOAT);
+    int  addConvolution(const std::string& name, int input, int channels, Window window, int groups = 1, int64_t weightsBytes = 0);
+    int  addDeconvolution(const std::string& name, int input, int channels, Window window, int groups = 1, int64_t weightsBytes = 0);
+    int  addPooling(const std::string& name, int input, Window window);
+    int  addResize(const std::string& name, int input, std::vector<float> scales);
+    int  addResize(const std::string& name, int input, nvinfer1::Dims dims);
+    int  addSlice(const std::string& name, int input, nvinfer1::Dims start, nvinfer1::Dims size, nvinfer1::Dims stride);
+    int  addConcatenation(const std::string& name, std::vector<int> inputs, int axis);
+    int  addShuffle(const std::string& name, int input, shuffle::Spec spec);
+    int  addReduce(const std::string& name, int input, uint32_t axes, bool keepDims);
+    int  addElementWise(const std::string& name, int a, int b);
+    int  addFullyConnected(const std::string& name, int input, int channels, int64_t weightsBytes = 0);
+    int  addConstant(const std::string& name, nvinfer1::Dims dims, nvinfer1::DataType type, int64_t weightsBytes);
+    int  addUnary(const std::string& name, int input, int64_t weightsBytes = 0);
+    void markOutput(int tensor);
+
+    // 按名字找tensor, 没有的时候返回-1
+    int  find(const std::string& name) const;
+
+private:
+    int  add(Layer layer);
+};
+
+// 依次推导每一层的输出, 出错的时候打印是哪一层并返回false
+bool infer(Network& network);
+
+struct Estimate {
+    int64_t     weightsBytes = 0;
+    int64_t     peakBytes    = 0;      // 同一时刻活着的activation的最大值
+    int64_t     arenaBytes   = 0;      // first-fit分配offset以后需要的大小, >= peakBytes
+    int64_t     totalBytes   = 0;      // 不复用的时候所有activation加起来
+    int64_t     ioBytes      = 0;      // network的input和output
+    std::string peakLayer;             // 达到peak的时候正在执行的层
+
+    int64_t requiredBytes() const { return weightsBytes + peakBytes + ioBytes; }
+};
+
+// 先infer再估计. float的activation按precision的大小计算(kHALF的build里大部分activation是half)
+bool        estimate(Network& network, nvinfer1::DataType precision, Estimate& result);
+std::string summary(const Estimate& estimate);
+
+// TensorRT的network转换成Network, 有不支持的层(动态的reshape/slice, plugin...)的时候返回false
+bool fromNetwork(nvinfer1::INetworkDefinition& network, Network& result);
+
+// fromNetwork + infer, 再和TensorRT在network上推导的每一层的输出shape对比, 不一样的层打印出来并返回false
+bool check(nvinfer1::INetworkDefinition& network, Network& result);
+
+} // namespace shapes
+
+#endif //__SHAPES_HPP__
@@ -0,0 +1,580 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "shmring.hpp"
+#include "utils.hpp"
+#include "cuda_runtime.h"
+
+using namespace std;
+
+namespace shm {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "shared memory needs lock-free atomics");
+
+static const uint32_t kMagic    = 0x54524e47;   // "TRNG"
+static const uint32_t kVersion  = 2;          // 2: 超时的client把slot交给server释放(kAbandoned)
+static const size_t   kAlign    = 64;
+
+// client等response超时以后写到Slot::done, server处理完看到它就自己release这个slot
+static const uint64_t kAbandoned = ~0ULL;
+
+static size_t alignUp(size_t n) { return (n + kAlign - 1) / kAlign * kAlign; }
+
+static int64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+struct TensorRing::Header {
+    atomic<uint32_t> magic;          // 最后写, open看到magic才认为初始化完成
+    uint32_t         version;
+    uint32_t         slots;
+    uint32_t         reserved;
+    uint64_t         slotBytes;
+    uint64_t         slotStride;
+
+    alignas(kAlign) atomic<uint64_t> head;            // client占slot
+    alignas(kAlign) atomic<uint64_t> tail;            // server处理到的位置, 只用于观察
+    alignas(kAlign) atomic<uint32_t> requestWord;     // server等request的futex
+    atomic<uint32_t>                 serverWaiting;
+    alignas(kAlign) atomic<uint32_t> spaceWord;       // client等空slot的futex
+    atomic<uint32_t>                 spaceWaiters;
+};
+
+// 后面紧跟着input和output两块数据, 都按cache line对齐
+struct alignas(kAlign) TensorRing::Slot {
+    atomic<uint64_t> seq;
+    atomic<uint64_t> done;            // response写好以后是pos + 1
+    atomic<uint32_t> responseWord;    // client等response的futex
+    atomic<uint32_t> responseWaiters;
+    uint64_t         inputBytes;
+    uint64_t         outputBytes;
+    int64_t          submitNs;
+    uint32_t         ok;
+};
+
+/* ------------------------------- futex ------------------------------- */
+
+static void futexWait(atomic<uint32_t>& word, uint32_t expected, int timeoutMs) {
+    struct timespec ts;
+    struct timespec* pts = nullptr;
+    if (timeoutMs >= 0) {
+        ts.tv_sec  = timeoutMs / 1000;
+        ts.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+        pts        = &ts;
+    }
+    // 跨进程的futex, 不能用FUTEX_WAIT_PRIVATE
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, pts, nullptr, 0);
+}
+
+static void futexWake(atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// 先spin, 再登记成waiter后sleep. 登记以后再检查一次条件, 和notify里先改条件再看waiters配合, 不会丢wakeup
+// 单核的时候spin只会占住对方需要的CPU, 直接sleep
+static int spinCount() {
+    static const int count = thread::hardware_concurrency() > 1 ? 2000 : 0;
+    return count;
+}
+
+template <typename Cond>
+static bool waitFor(Cond cond, atomic<uint32_t>& word, atomic<uint32_t>& waiters, int timeoutMs) {
+    for (int i = 0, n = spinCount(); i < n; i++) {
+        if (cond()) return true;
+        cpuRelax();
+    }
+    int64_t deadline = timeoutMs < 0 ? 0 : monotonicNs() + (int64_t)timeoutMs * 1000000;
+    while (true) {
+        uint32_t observed = word.load();
+        waiters.fetch_add(1);
+        if (cond()) {
+            waiters.fetch_sub(1);
+            return true;
+        }
+        int remaining = -1;
+        if (timeoutMs >= 0) {
+            int64_t left = deadline - monotonicNs();
+            if (left <= 0) {
+                waiters.fetch_sub(1);
+                return false;
+            }
+            remaining = (int)std::max<int64_t>(1, left / 1000000);
+        }
+        futexWait(word, observed, remaining);
+        waiters.fetch_sub(1);
+        if (cond()) return true;
+    }
+}
+
+static void notify(atomic<uint32_t>& word, atomic<uint32_t>& waiters) {
+    if (waiters.load() == 0) return;
+    word.fetch_add(1);
+    futexWake(word);
+}
+
+/* ------------------------------- mapping ------------------------------- */
+
+static string shmName(const string& name) {
+    return name.empty() || name[0] == '/' ? name : "/" + name;
+}
+
+TensorRing::~TensorRing() {
+    close();
+}
+
+bool TensorRing::map(int fd, size_t bytes) {
+    void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        LOGE("ERROR: failed to map %s: %s", mName.c_str(), strerror(errno));
+        return false;
+    }
+    mBase   = base;
+    mBytes  = bytes;
+    mHeader = (Header*)base;
+    return true;
+}
+
+bool TensorRing::create(const string& name, uint32_t slots, size_t slotBytes) {
+    close();
+    if (slots == 0 || slotBytes == 0) {
+        LOGE("ERROR: a tensor ring needs at least one slot and one byte per slot");
+        return false;
+    }
+    mName = shmName(name);
+    shm_unlink(mName.c_str());
+    int fd = shm_open(mName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        LOGE("ERROR: failed to create %s: %s", mName.c_str(), strerror(errno));
+        return false;
+    }
+    size_t stride = kAlign + 2 * alignUp(slotBytes);
+    size_t bytes  = alignUp(sizeof(Header)) + stride * slots;
+    if (ftruncate(fd, bytes) != 0) {
+        LOGE("ERROR: failed to resize %s to %zu bytes: %s", mName.c_str(), bytes, strerror(errno));
+        ::close(fd);
+        shm_unlink(mName.c_str());
+        return false;
+    }
+    if (!map(fd, bytes)) {
+        shm_unlink(mName.c_str());
+        return false;
+    }
+    mOwner = true;
+    mTail  = 0;
+
+    // ftruncate出来的内存都是0, 只需要设置非0的字段
+    mHeader->version    = kVersion;
+    mHeader->slots      = slots;
+    mHeader->slotBytes  = slotBytes;
+    mHeader->slotStride = stride;
+    for (uint32_t i = 0; i < slots; i++) slotAt(i)->seq.store(i, memory_order_relaxed);
+    mHeader->magic.store(kMagic, memory_order_release);
+    LOG("created tensor ring %s: %u slots x %zu bytes (%.1f MB)", mName.c_str(), slots, slotBytes, bytes / 1048576.0);
+    return true;
+}
+
+bool TensorRing::open(const string& name, int timeoutMs) {
+    close();
+    mName = shmName(name);
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(std::max(0, timeoutMs));
+    while (true) {
+        int fd = shm_open(mName.c_str(), O_RDWR, 0600);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+            if (!map(fd, st.st_size)) return false;
+            bool ready = mHeader->magic.load(memory_order_acquire) == kMagic && mHeader->version == kVersion &&
+                         alignUp(sizeof(Header)) + mHeader->slotStride * mHeader->slots <= mBytes;
+            if (ready) return true;
+            munmap(mBase, mBytes);
+            mBase = nullptr;
+            mHeader = nullptr;
+        } else if (fd >= 0) {
+            ::close(fd);
+        }
+        if (chrono::steady_clock::now() >= deadline) {
+            LOGE("ERROR: tensor ring %s is not available", mName.c_str());
+            return false;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+}
+
+void TensorRing::close() {
+    if (mBase != nullptr) {
+        if (mPinned) cudaHostUnregister(mBase);
+        munmap(mBase, mBytes);
+    }
+    if (mOwner) shm_unlink(mName.c_str());
+    mBase   = nullptr;
+    mHeader = nullptr;
+    mBytes  = 0;
+    mOwner  = false;
+    mPinned = false;
+}
+
+uint32_t TensorRing::slots() const {
+    return mHeader ? mHeader->slots : 0;
+}
+
+size_t TensorRing::slotBytes() const {
+    return mHeader ? mHeader->slotBytes : 0;
+}
+
+TensorRing::Slot* TensorRing::slotAt(uint64_t pos) const {
+    static_assert(sizeof(Slot) <= kAlign, "slot header must fit in one cache line");
+    char* first = (char*)mBase + alignUp(sizeof(Header));
+    return (Slot*)(first + (pos % mHeader->slots) * mHeader->slotStride);
+}
+
+char* TensorRing::inputOf(Slot* slot) const {
+    return (char*)slot + kAlign;
+}
+
+char* TensorRing::outputOf(Slot* slot) const {
+    return (char*)slot + kAlign + alignUp(mHeader->slotBytes);
+}
+
+bool TensorRing::pin() {
+    if (mBase == nullptr) return false;
+    if (mPinned) return true;
+    if (cudaHostRegister(mBase, mBytes, cudaHostRegisterDefault) != cudaSuccess) {
+        LOGW("failed to pin %s, H2D copies from the ring will be staged", mName.c_str());
+        return false;
+    }
+    mPinned = true;
+    return true;
+}
+
+/* ------------------------------- client ------------------------------- */
+
+int64_t TensorRing::acquire(void** input, int timeoutMs) {
+    Header&  h   = *mHeader;
+    uint64_t pos = 0;
+    auto claim = [&]() {
+        pos = h.head.load(memory_order_relaxed);
+        while (true) {
+            uint64_t seq = slotAt(pos)->seq.load();
+            int64_t  dif = (int64_t)(seq - pos);
+            if (dif == 0) {
+                if (h.head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) return true;
+            } else if (dif < 0) {
+                return false;    // 所有的slot都在用
+            } else {
+                pos = h.head.load(memory_order_relaxed);
+            }
+        }
+    };
+    if (!waitFor(claim, h.spaceWord, h.spaceWaiters, timeoutMs)) return -1;
+    *input = inputOf(slotAt(pos));
+    return (int64_t)pos;
+}
+
+void TensorRing::submit(int64_t ticket, size_t inputBytes) {
+    Slot* slot       = slotAt(ticket);
+    slot->inputBytes = std::min<size_t>(inputBytes, mHeader->slotBytes);
+    slot->submitNs   = monotonicNs();
+    slot->seq.store(ticket + 1);
+    notify(mHeader->requestWord, mHeader->serverWaiting);
+}
+
+bool TensorRing::wait(int64_t ticket, const void** output, size_t* outputBytes, int timeoutMs) {
+    Slot* slot = slotAt(ticket);
+    auto  done = [&]() { return slot->done.load() == (uint64_t)ticket + 1; };
+    if (!waitFor(done, slot->responseWord, slot->responseWaiters, timeoutMs)) return false;
+    if (output != nullptr)      *output      = outputOf(slot);
+    if (outputBytes != nullptr) *outputBytes = slot->outputBytes;
+    return slot->ok != 0;
+}
+
+void TensorRing::release(int64_t ticket) {
+    slotAt(ticket)->seq.store(ticket + mHeader->slots);
+    notify(mHeader->spaceWord, mHeader->spaceWaiters);
+}
+
+bool TensorRing::call(const void* input, size_t inputBytes, void* output, size_t outputCapacity, size_t* outputBytes,
+                      int timeoutMs) {
+    if (inputBytes > slotBytes()) {
+        LOGE("ERROR: %zu bytes do not fit in a %zu byte slot", inputBytes, slotBytes());
+        return false;
+    }
+    // timeoutMs是整个call的时间, 等response的时候只剩acquire用剩下的
+    int64_t deadline = timeoutMs < 0 ? 0 : monotonicNs() + (int64_t)timeoutMs * 1000000;
+    void*   in;
+    int64_t ticket = acquire(&in, timeoutMs);
+    if (ticket < 0) return false;
+    memcpy(in, input, inputBytes);
+    submit(ticket, inputBytes);
+
+    int         left = timeoutMs < 0 ? -1 : (int)std::max<int64_t>(0, (deadline - monotonicNs()) / 1000000);
+    const void* out;
+    size_t      n  = 0;
+    bool        ok = wait(ticket, &out, &n, left);
+    Slot*       slot = slotAt(ticket);
+    uint64_t    done = slot->done.load();
+    if (done != (uint64_t)ticket + 1) {
+        // 超时以后slot还在server手里, 不能release. 把它标记成abandoned, server处理完自己release;
+        // CAS失败说明server刚好处理完, 按正常的流程release
+        if (slot->done.compare_exchange_strong(done, kAbandoned)) return false;
+    } else if (ok) {
+        memcpy(output, out, std::min(n, outputCapacity));
+        if (outputBytes != nullptr) *outputBytes = n;
+    }
+    release(ticket);
+    return ok;
+}
+
+/* ------------------------------- server ------------------------------- */
+
+bool TensorRing::next(Request& request, int timeoutMs) {
+    Slot* slot  = slotAt(mTail);
+    auto  ready = [&]() { return slot->seq.load() == mTail + 1; };
+    if (!waitFor(ready, mHeader->requestWord, mHeader->serverWaiting, timeoutMs)) return false;
+
+    request.id             = mTail;
+    request.input          = inputOf(slot);
+    request.inputBytes     = slot->inputBytes;
+    request.output         = outputOf(slot);
+    request.outputCapacity = mHeader->slotBytes;
+    request.submitNs       = slot->submitNs;
+    mTail++;
+    mHeader->tail.store(mTail, memory_order_relaxed);
+    return true;
+}
+
+void TensorRing::complete(const Request& request, size_t outputBytes, bool ok) {
+    Slot* slot        = slotAt(request.id);
+    slot->outputBytes = std::min<size_t>(outputBytes, mHeader->slotBytes);
+    slot->ok          = ok ? 1 : 0;
+    if (slot->done.exchange(request.id + 1) == kAbandoned) {
+        // client已经超时走了, 没有人等response, 直接把slot还回去
+        release(request.id);
+        return;
+    }
+    notify(slot->responseWord, slot->responseWaiters);
+}
+
+uint64_t serve(TensorRing& ring, Handler handler, const atomic<bool>& stop) {
+    uint64_t count = 0;
+    Request  request;
+    while (!stop) {
+        if (!ring.next(request, 100)) continue;
+        ring.complete(request, handler(request));
+        count++;
+    }
+    return count;
+}
+
+/* ------------------------------- benchmark ------------------------------- */
+
+namespace {
+
+bool writeAll(int fd, const void* data, size_t n) {
+    const char* p = (const char*)data;
+    while (n > 0) {
+        ssize_t k = ::write(fd, p, n);
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+bool readAll(int fd, void* data, size_t n) {
+    char* p = (char*)data;
+    while (n > 0) {
+        ssize_t k = ::read(fd, p, n);
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+// 子进程: 发requests次, 每次检查写回来的数据, 把每次的耗时(ns)写到pipe
+void runClient(const string& transport, const string& ringName, int port, int index, int requests, size_t bytes,
+               int pipeFd) {
+    vector<char>    input(bytes), output(bytes);
+    vector<int64_t> latencies;
+    latencies.reserve(requests);
+
+    TensorRing ring;
+    int        sock = -1;
+    if (transport == "shm") {
+        if (!ring.open(ringName, 5000)) _exit(1);
+    } else {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_port        = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0) _exit(1);
+    }
+
+    for (int i = 0; i < requests; i++) {
+        input[0] = (char)index;
+        input[bytes - 1] = (char)i;
+        int64_t start = monotonicNs();
+        bool    ok;
+        if (transport == "shm") {
+            size_t n = 0;
+            ok = ring.call(input.data(), bytes, output.data(), bytes, &n, -1) && n == bytes;
+        } else {
+            uint32_t len = (uint32_t)bytes;
+            ok = writeAll(sock, &len, 4) && writeAll(sock, input.data(), bytes) &&
+                 readAll(sock, &len, 4) && len == bytes && readAll(sock, output.data(), bytes);
+        }
+        latencies.push_back(monotonicNs() - start);
+        if (!ok || output[0] != (char)index || output[bytes - 1] != (char)i) _exit(2);
+    }
+    if (sock >= 0) ::close(sock);
+    writeAll(pipeFd, latencies.data(), latencies.size() * sizeof(int64_t));
+    _exit(0);
+}
+
+} // namespace
+
+BenchResult benchmark(const string& transport, int clients, int requests, size_t bytes, uint32_t slots) {
+    BenchResult result;
+    result.transport = transport;
+    result.clients   = clients;
+    result.bytes     = bytes = std::max<size_t>(bytes, 1);
+    if (transport != "shm" && transport != "tcp") {
+        LOGE("ERROR: unknown transport %s, should be shm or tcp", transport.c_str());
+        return result;
+    }
+
+    string     ringName = "/trt_bench_" + to_string(getpid());
+    TensorRing ring;
+    int        listener = -1;
+    int        port     = 0;
+    if (transport == "shm") {
+        if (!ring.create(ringName, slots, bytes)) return result;
+    } else {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family      = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len        = sizeof(addr);
+        if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, clients) != 0 ||
+            getsockname(listener, (sockaddr*)&addr, &len) != 0) {
+            LOGE("ERROR: failed to listen on 127.0.0.1: %s", strerror(errno));
+            ::close(listener);
+            return result;
+        }
+        port = ntohs(addr.sin_port);
+    }
+
+    auto          start = chrono::steady_clock::now();
+    vector<pid_t> pids;
+    vector<int>   pipes;
+    for (int c = 0; c < clients; c++) {
+        int fds[2];
+        if (pipe(fds) != 0) break;
+        pid_t pid = fork();
+        if (pid == 0) {
+            ::close(fds[0]);
+            runClient(transport, ringName, port, c, requests, bytes, fds[1]);
+        }
+        ::close(fds[1]);
+        if (pid < 0) {
+            ::close(fds[0]);
+            break;
+        }
+        pids.push_back(pid);
+        pipes.push_back(fds[0]);
+    }
+
+    // server: 原样写回
+    uint64_t total = (uint64_t)pids.size() * requests;
+    if (transport == "shm") {
+        Request request;
+        for (uint64_t done = 0; done < total; done++) {
+            if (!ring.next(request, 10000)) {
+                LOGE("ERROR: timed out after %llu requests", (unsigned long long)done);
+                break;
+            }
+            memcpy(request.output, request.input, request.inputBytes);
+            ring.complete(request, request.inputBytes);
+        }
+    } else {
+        vector<thread> workers;
+        for (size_t c = 0; c < pids.size(); c++) {
+            int sock = accept(listener, nullptr, nullptr);
+            if (sock < 0) break;
+            workers.emplace_back([sock, bytes, requests]() {
+                int one = 1;
+                setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                vector<char> buffer(bytes);
+                uint32_t     len;
+                for (int i = 0; i < requests; i++) {
+                    if (!readAll(sock, &len, 4) || len > bytes || !readAll(sock, buffer.data(), len)) break;
+                    if (!writeAll(sock, &len, 4) || !writeAll(sock, buffer.data(), len)) break;
+                }
+                ::close(sock);
+            });
+        }
+        for (auto& w : workers) w.join();
+        ::close(listener);
+    }
+
+    vector<int64_t> latencies;
+    for (size_t c = 0; c < pids.size(); c++) {
+        vector<int64_t> mine(requests);
+        if (readAll(pipes[c], mine.data(), mine.size() * sizeof(int64_t))) {
+            latencies.insert(latencies.end(), mine.begin(), mine.end());
+        }
+        ::close(pipes[c]);
+        int status = 0;
+        waitpid(pids[c], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            LOGE("ERROR: client %zu failed (status %d)", c, status);
+        }
+    }
+    result.seconds  = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.requests = latencies.size();
+    if (!latencies.empty()) {
+        sort(latencies.begin(), latencies.end());
+        result.p50Us = latencies[latencies.size() / 2] / 1000.0;
+        result.p99Us = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)] / 1000.0;
+        result.maxUs = latencies.back() / 1000.0;
+    }
+    return result;
+}
+
+void report(const BenchResult& r) {
+    double rate = r.seconds > 0 ? r.requests / r.seconds : 0;
+    LOG("%-4s %2d clients x %8zu bytes: %9.0f req/s %9.1f MB/s, p50 %7.1f us, p99 %7.1f us, max %8.1f us",
+        r.transport.c_str(), r.clients, r.bytes, rate, rate * r.bytes * 2 / 1048576.0, r.p50Us, r.p99Us, r.maxUs);
+}
+
+} // namespace shm
@@ -0,0 +1,115 @@
+#ifndef __SHMRING_HPP__
+#define __SHMRING_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+// 同一台机器上的进程(例如camera的采集进程)把tensor交给推理进程, 不需要序列化和拷贝:
+//     - POSIX shared memory(/dev/shm/<name>)里是固定数量, 固定大小的slot, 每个slot有一块input和一块output
+//     - client在slot里直接写input, server直接在slot里读input(pin以后可以直接cudaMemcpyAsync), 结果写回同一个slot
+//     - slot的分配是Vyukov的有界MPMC队列的head/tail协议: 每个slot有一个seq,
+//           seq == pos         空闲, client可以用CAS占住head = pos
+//           seq == pos + 1     request已经写好, server按顺序(tail)处理
+//           seq == pos + slots client读完response以后释放, 下一圈可以再用
+//       server只有一个, tail不需要CAS. client读完response之前slot不会被复用
+//     - 等待用futex(跨进程, 不能用FUTEX_PRIVATE), 先spin一小段时间, 只有有人在等的时候才做wake的系统调用
+// 共享内存里的atomic需要是lock-free的, 64位的平台(x86_64, aarch64)都满足
+
+namespace shm {
+
+struct Request {
+    uint64_t    id             = 0;         // 这个request在ring里的位置(pos)
+    const void* input          = nullptr;
+    size_t      inputBytes     = 0;
+    void*       output         = nullptr;   // server把结果写在这里
+    size_t      outputCapacity = 0;
+    int64_t     submitNs       = 0;         // client submit的时间(CLOCK_MONOTONIC, 进程之间可以比较)
+};
+
+class TensorRing {
+public:
+    TensorRing() {}
+    ~TensorRing();
+    TensorRing(const TensorRing&) = delete;
+    TensorRing& operator=(const TensorRing&) = delete;
+
+    // server创建ring, 同名的旧ring(例如上一次进程崩溃留下的)会被删掉. 析构的时候shm_unlink
+    bool create(const std::string& name, uint32_t slots, size_t slotBytes);
+    // client打开已经存在的ring, server还没创建的时候最多等timeoutMs
+    bool open(const std::string& name, int timeoutMs = 0);
+    void close();
+
+    uint32_t slots() const;
+    size_t   slotBytes() const;
+
+    /* ------------------------------- client ------------------------------- */
+
+    // 占一个slot, input指向slot里可以直接写的地址, 满的时候等到有空位. 超时返回-1
+    int64_t acquire(void** input, int timeoutMs = -1);
+    void    submit(int64_t ticket, size_t inputBytes);
+    // 等server处理完, output指向slot里的结果, 在release之前有效
+    bool    wait(int64_t ticket, const void** output, size_t* outputBytes, int timeoutMs = -1);
+    void    release(int64_t ticket);
+
+    // acquire + 拷贝input + submit + wait + 拷贝output + release. 超时的时候slot交给server处理完再释放, 不会一直等
+    bool call(const void* input, size_t inputBytes, void* output, size_t outputCapacity, size_t* outputBytes,
+              int timeoutMs = -1);
+
+    /* ------------------------------- server ------------------------------- */
+
+    // 按顺序取下一个request, 没有的时候等timeoutMs(-1一直等)
+    bool next(Request& request, int timeoutMs = -1);
+    // outputBytes为0也算完成, client的wait会返回ok
+    void complete(const Request& request, size_t outputBytes, bool ok = true);
+
+    // 把整个映射注册成CUDA的pinned memory, server可以直接从slot做H2D/D2H
+    bool pin();
+
+private:
+    struct Header;
+    struct Slot;
+
+    Slot* slotAt(uint64_t pos) const;
+    char* inputOf(Slot* slot) const;
+    char* outputOf(Slot* slot) const;
+    bool  map(int fd, size_t bytes);
+
+private:
+    std::string mName;
+    bool        mOwner  = false;
+    bool        mPinned = false;
+    void*       mBase   = nullptr;
+    size_t      mBytes  = 0;
+    Header*     mHeader = nullptr;
+    uint64_t    mTail   = 0;    // server
+};
+
+typedef std::function<size_t(const Request& request)> Handler;
+
+// 一直处理request直到stop为true, 返回处理的个数
+uint64_t serve(TensorRing& ring, Handler handler, const std::atomic<bool>& stop);
+
+/* ------------------------------- benchmark ------------------------------- */
+
+struct BenchResult {
+    std::string transport;
+    int         clients    = 0;
+    uint64_t    requests   = 0;
+    size_t      bytes      = 0;
+    double      seconds    = 0;
+    double      p50Us      = 0;
+    double      p99Us      = 0;
+    double      maxUs      = 0;
+};
+
+// fork出clients个进程, 每个进程发requests次bytes大小的tensor, server(当前进程)原样写回
+// shm: TensorRing; tcp: 127.0.0.1上的TCP(序列化成字节流, 现在的做法), 用来对比
+BenchResult benchmark(const std::string& transport, int clients, int requests, size_t bytes, uint32_t slots = 16);
+void        report(const BenchResult& result);
+
+} // namespace shm
+
+#endif //__SHMRING_HPP__
@@ -0,0 +1,404 @@
+#include <cstdint>
+#include <sstream>
+
+#include "shuffle.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace shuffle {
+
+Spec transpose(vector<int> order) {
+    Spec spec;
+    spec.first = move(order);
+    return spec;
+}
+
+Spec reshape(vector<int> dims) {
+    Spec spec;
+    spec.reshape = move(dims);
+    return spec;
+}
+
+/* ------------------------------- shape推导 ------------------------------- */
+
+static nvinfer1::Dims invalidDims() {
+    nvinfer1::Dims dims;
+    dims.nbDims = -1;
+    return dims;
+}
+
+static bool sameDims(const nvinfer1::Dims& a, const nvinfer1::Dims& b) {
+    if (a.nbDims != b.nbDims) return false;
+    for (int i = 0; i < a.nbDims; i++) {
+        if (a.d[i] != b.d[i]) return false;
+    }
+    return true;
+}
+
+static bool isPermutation(const vector<int>& order, int rank) {
+    if ((int)order.size() != rank) return false;
+    vector<bool> seen(rank, false);
+    for (int axis : order) {
+        if (axis < 0 || axis >= rank || seen[axis]) return false;
+        seen[axis] = true;
+    }
+    return true;
+}
+
+static bool isIdentityOrder(const vector<int>& order) {
+    for (int i = 0; i < (int)order.size(); i++) {
+        if (order[i] != i) return false;
+    }
+    return true;
+}
+
+// 长度不为1的维度的相对顺序不变, 这样的transpose不改变内存里元素的顺序
+static bool preservesOrder(const vector<int>& order, const nvinfer1::Dims& dims) {
+    int last = -1;
+    for (int axis : order) {
+        if (dims.d[axis] == 1) continue;
+        if (axis < last) return false;
+        last = axis;
+    }
+    return true;
+}
+
+// 先做a再做b, 空的表示identity
+static vector<int> compose(const vector<int>& a, const vector<int>& b) {
+    if (a.empty()) return b;
+    if (b.empty()) return a;
+    vector<int> order(b.size());
+    for (size_t i = 0; i < b.size(); i++) {
+        order[i] = a[b[i]];
+    }
+    return isIdentityOrder(order) ? vector<int>() : order;
+}
+
+static bool permute(const vector<int>& order, const nvinfer1::Dims& input, nvinfer1::Dims& output) {
+    output = input;
+    if (order.empty()) return true;
+    if (!isPermutation(order, input.nbDims)) return false;
+    for (int i = 0; i < input.nbDims; i++) {
+        output.d[i] = input.d[order[i]];
+    }
+    return true;
+}
+
+static bool reshapeDims(const vector<int>& dims, const nvinfer1::Dims& input, nvinfer1::Dims& output) {
+    output = input;
+    if (dims.empty()) return true;
+    if ((int)dims.size() > nvinfer1::Dims::MAX_DIMS) return false;
+
+    bool    unknown = false;
+    int64_t total   = 1;
+    for (int i = 0; i < input.nbDims; i++) {
+        if (input.d[i] < 0) unknown = true;
+        else                total *= input.d[i];
+    }
+
+    output.nbDims = (int)dims.size();
+    int     inferred = -1;
+    bool    partial  = false;      // 除了-1以外的维度里有动态的
+    int64_t product  = 1;
+    for (int i = 0; i < output.nbDims; i++) {
+        int d = dims[i];
+        if (d == 0) {
+            if (i >= input.nbDims) return false;
+            d = input.d[i];
+        } else if (d == -1) {
+            if (inferred >= 0) return false;
+            inferred = i;
+            continue;
+        } else if (d < 0) {
+            return false;
+        }
+        output.d[i] = d;
+        if (d < 0) partial = true;
+        else       product *= d;
+    }
+
+    if (inferred >= 0) {
+        if (unknown || partial) {
+            output.d[inferred] = -1;
+        } else {
+            if (product == 0 || total % product != 0) return false;
+            output.d[inferred] = (int32_t)(total / product);
+        }
+    } else if (!unknown && !partial && product != total) {
+        return false;
+    }
+    return true;
+}
+
+// 三个阶段以后的shape
+static bool stages(const Spec& spec, const nvinfer1::Dims& input,
+                   nvinfer1::Dims& afterFirst, nvinfer1::Dims& afterReshape, nvinfer1::Dims& output) {
+    if (input.nbDims < 0 || input.nbDims > nvinfer1::Dims::MAX_DIMS) return false;
+    return permute(spec.first, input, afterFirst)
+        && reshapeDims(spec.reshape, afterFirst, afterReshape)
+        && permute(spec.second, afterReshape, output);
+}
+
+nvinfer1::Dims infer(const Spec& spec, const nvinfer1::Dims& input) {
+    nvinfer1::Dims afterFirst, afterReshape, output;
+    if (!stages(spec, input, afterFirst, afterReshape, output)) return invalidDims();
+    return output;
+}
+
+bool isIdentity(const Spec& spec, const nvinfer1::Dims& input) {
+    nvinfer1::Dims afterFirst, afterReshape, output;
+    if (!stages(spec, input, afterFirst, afterReshape, output)) return false;
+    return sameDims(output, input)
+        && preservesOrder(spec.first, input)
+        && preservesOrder(spec.second, afterReshape);
+}
+
+/* ------------------------------- 合并 ------------------------------- */
+
+bool merge(const Spec& a, const Spec& b, const nvinfer1::Dims& input, Spec& merged) {
+    nvinfer1::Dims aFirst, aReshape, aOut, bFirst, bReshape, bOut;
+    if (!stages(a, input, aFirst, aReshape, aOut) || !stages(b, aOut, bFirst, bReshape, bOut)) return false;
+
+    Spec spec;
+    if (a.reshape.empty() && b.reshape.empty()) {
+        // 几个transpose合成一个
+        spec.first = compose(compose(a.first, a.second), compose(b.first, b.second));
+    } else if (a.reshape.empty()) {
+        // a的transpose都放到b的first transpose前面
+        spec.first   = compose(compose(a.first, a.second), b.first);
+        spec.reshape = b.reshape;
+        spec.second  = b.second;
+    } else if (b.reshape.empty()) {
+        // b的transpose都放到a的second transpose后面
+        spec.first   = a.first;
+        spec.reshape = a.reshape;
+        spec.second  = compose(a.second, compose(b.first, b.second));
+    } else {
+        // 两个reshape中间的transpose不改变元素顺序的时候, 两个reshape等价于直接reshape成b的结果
+        if (!preservesOrder(compose(a.second, b.first), aReshape)) return false;
+        spec.first   = a.first;
+        spec.reshape = b.reshape;
+        spec.second  = b.second;
+        // b的0是相对于b的输入的, 合并以后输入变了, 需要换成具体的值
+        for (int i = 0; i < (int)spec.reshape.size(); i++) {
+            if (spec.reshape[i] != 0) continue;
+            if (bFirst.d[i] < 0) return false;
+            spec.reshape[i] = bFirst.d[i];
+        }
+    }
+
+    if (!sameDims(infer(spec, input), bOut)) return false;
+    merged = spec;
+    return true;
+}
+
+bool simplify(const vector<Spec>& specs, const nvinfer1::Dims& input, vector<Spec>& result) {
+    result.clear();
+    vector<nvinfer1::Dims> inputs;      // result里每一个的输入
+    nvinfer1::Dims         current = input;
+    nvinfer1::Dims         expected = input;
+
+    for (auto& spec : specs) {
+        expected = infer(spec, expected);
+        if (expected.nbDims < 0) {
+            LOGE("ERROR: invalid shuffle %s on %s", describe(spec).c_str(), printDims(current).c_str());
+            return false;
+        }
+
+        Spec merged;
+        if (isIdentity(spec, current)) {
+            // 不需要任何操作
+        } else if (!result.empty() && merge(result.back(), spec, inputs.back(), merged)) {
+            if (isIdentity(merged, inputs.back())) {
+                result.pop_back();
+                inputs.pop_back();
+            } else {
+                result.back() = merged;
+            }
+        } else {
+            result.push_back(spec);
+            inputs.push_back(current);
+        }
+        current = result.empty() ? input : infer(result.back(), inputs.back());
+    }
+
+    // 化简前后的shape必须一样
+    if (!sameDims(current, expected)) {
+        LOGE("ERROR: simplified shuffle gives %s instead of %s", printDims(current).c_str(), printDims(expected).c_str());
+        return false;
+    }
+    return true;
+}
+
+static string joinInts(const vector<int>& values) {
+    stringstream ss;
+    for (size_t i = 0; i < values.size(); i++) {
+        ss << (i == 0 ? "" : ",") << values[i];
+    }
+    return ss.str();
+}
+
+string describe(const Spec& spec) {
+    stringstream ss;
+    if (!spec.first.empty())   ss << "first(" << joinInts(spec.first) << ") ";
+    if (!spec.reshape.empty()) ss << "reshape(" << joinInts(spec.reshape) << ") ";
+    if (!spec.second.empty())  ss << "second(" << joinInts(spec.second) << ") ";
+    string s = ss.str();
+    return s.empty() ? "identity" : s.substr(0, s.size() - 1);
+}
+
+/* ------------------------------- network ------------------------------- */
+
+static nvinfer1::Permutation toPermutation(const vector<int>& order) {
+    nvinfer1::Permutation perm;
+    for (int i = 0; i < nvinfer1::Dims::MAX_DIMS; i++) {
+        perm.order[i] = i < (int)order.size() ? order[i] : i;
+    }
+    return perm;
+}
+
+nvinfer1::IShuffleLayer* addLayer(
+    nvinfer1::INetworkDefinition& network, nvinfer1::ITensor& input, const Spec& spec, const string& name)
+{
+    auto dims = input.getDimensions();
+    if (infer(spec, dims).nbDims < 0) {
+        LOGE("ERROR: %s: invalid shuffle %s on %s", name.c_str(), describe(spec).c_str(), printDims(dims).c_str());
+        return nullptr;
+    }
+
+    auto layer = network.addShuffle(input);
+    if (!spec.first.empty()) {
+        layer->setFirstTranspose(toPermutation(spec.first));
+    }
+    if (!spec.reshape.empty()) {
+        nvinfer1::Dims reshape;
+        reshape.nbDims = (int)spec.reshape.size();
+        for (int i = 0; i < reshape.nbDims; i++) {
+            reshape.d[i] = spec.reshape[i];
+        }
+        layer->setReshapeDimensions(reshape);
+    }
+    if (!spec.second.empty()) {
+        layer->setSecondTranspose(toPermutation(spec.second));
+    }
+    layer->setName(name.c_str());
+
+    LOGV("%s, %s, %s", layer->getName(), describe(spec).c_str(), (printDims(layer->getOutput(0)->getDimensions())).c_str());
+    return layer;
+}
+
+nvinfer1::ITensor* apply(
+    nvinfer1::INetworkDefinition& network, nvinfer1::ITensor& input,
+    const vector<Spec>& specs, const string& name, int* layers)
+{
+    if (layers) *layers = 0;
+
+    vector<Spec> simplified;
+    if (!simplify(specs, input.getDimensions(), simplified)) {
+        LOGE("ERROR: %s: failed to simplify %d shuffles", name.c_str(), (int)specs.size());
+        return nullptr;
+    }
+    if (simplified.size() < specs.size()) {
+        LOGV("%s: %d shuffles -> %d layers", name.c_str(), (int)specs.size(), (int)simplified.size());
+    }
+
+    nvinfer1::ITensor* tensor = &input;
+    for (size_t i = 0; i < simplified.size(); i++) {
+        string layerName = simplified.size() == 1 ? name : name + "." + to_string(i);
+        auto   layer     = addLayer(network, *tensor, simplified[i], layerName);
+        if (layer == nullptr) return nullptr;
+        tensor = layer->getOutput(0);
+    }
+    if (layers) *layers = (int)simplified.size();
+    return tensor;
+}
+
+/* ------------------------------- 在CPU上检查 ------------------------------- */
+
+// 按order转置row-major的data, dims是转置之前的shape
+static vector<int64_t> transposeData(const vector<int>& order, const nvinfer1::Dims& dims, const vector<int64_t>& data) {
+    if (order.empty()) return data;
+    int     rank = dims.nbDims;
+    int64_t strides[nvinfer1::Dims::MAX_DIMS];
+    for (int i = rank - 1, s = 1; i >= 0; s *= dims.d[i], i--) strides[i] = s;
+
+    vector<int64_t> result(data.size());
+    int64_t         index[nvinfer1::Dims::MAX_DIMS] = {0};    // 结果里的下标
+    for (size_t n = 0; n < result.size(); n++) {
+        int64_t offset = 0;
+        for (int i = 0; i < rank; i++) offset += index[i] * strides[order[i]];
+        result[n] = data[offset];
+        for (int i = rank - 1; i >= 0 && ++index[i] == dims.d[order[i]]; i--) index[i] = 0;
+    }
+    return result;
+}
+
+// 依次执行specs, data是每个元素在输入里的下标
+static bool run(const vector<Spec>& specs, nvinfer1::Dims dims, vector<int64_t>& data, nvinfer1::Dims& output) {
+    for (auto& spec : specs) {
+        nvinfer1::Dims afterFirst, afterReshape, out;
+        if (!stages(spec, dims, afterFirst, afterReshape, out)) return false;
+        data = transposeData(spec.first, dims, data);
+        data = transposeData(spec.second, afterReshape, data);
+        dims = out;
+    }
+    output = dims;
+    return true;
+}
+
+bool equivalent(const vector<Spec>& a, const vector<Spec>& b, const nvinfer1::Dims& input) {
+    int64_t count = 1;
+    for (int i = 0; i < input.nbDims; i++) {
+        if (input.d[i] < 0) {
+            LOGE("ERROR: shuffle::equivalent needs a static input shape, got %s", printDims(input).c_str());
+            return false;
+        }
+        count *= input.d[i];
+    }
+    vector<int64_t> x(count), y;
+    for (int64_t i = 0; i < count; i++) x[i] = i;
+    y = x;
+
+    nvinfer1::Dims dx, dy;
+    return run(a, input, x, dx) && run(b, input, y, dy) && sameDims(dx, dy) && x == y;
+}
+
+bool check() {
+    struct Case {
+        const char*    name;
+        vector<Spec>   specs;
+        nvinfer1::Dims input;
+        int            layers;     // simplify以后的层数
+    };
+    vector<Case> cases = {
+        {"detection head", {reshape({1, 3, 85, -1}), transpose({0, 1, 3, 2})}, nvinfer1::Dims4{1, 255, 4, 4}, 1},
+        {"inverse transposes", {transpose({0, 2, 3, 1}), transpose({0, 3, 1, 2})}, nvinfer1::Dims4{1, 3, 4, 5}, 0},
+        {"reshape round trip", {reshape({1, 3, 20}), reshape({1, 3, 4, 5})}, nvinfer1::Dims4{1, 3, 4, 5}, 0},
+        {"transpose between reshapes", {reshape({1, 3, 20}), transpose({0, 2, 1}), reshape({1, 60})}, nvinfer1::Dims4{1, 3, 4, 5}, 2},
+        {"placeholders", {reshape({0, 0, -1}), transpose({0, 2, 1})}, nvinfer1::Dims4{2, 3, 4, 5}, 1},
+        {"size-1 axes", {transpose({1, 0, 2, 3}), reshape({3, 20})}, nvinfer1::Dims4{1, 3, 4, 5}, 1},
+        // 整体是identity, 但是按相邻的两个贪心地合并, 最后剩一个
+        {"nchw to nhwc and back", {transpose({0, 2, 3, 1}), reshape({0, -1, 3}), reshape({2, 4, 5, 3}), transpose({0, 3, 1, 2})},
+         nvinfer1::Dims4{2, 3, 4, 5}, 1},
+    };
+
+    bool ok = true;
+    for (auto& c : cases) {
+        vector<Spec> simplified;
+        if (!simplify(c.specs, c.input, simplified)) {
+            LOGE("ERROR: shuffle check %s: simplify failed", c.name);
+            ok = false;
+        } else if (!equivalent(c.specs, simplified, c.input)) {
+            LOGE("ERROR: shuffle check %s: the simplified shuffles move elements differently", c.name);
+            ok = false;
+        } else if ((int)simplified.size() != c.layers) {
+            LOGE("ERROR: shuffle check %s: %d layer(s) after simplify, expected %d", c.name, (int)simplified.size(), c.layers);
+            ok = false;
+        }
+    }
+    if (ok) LOG("shuffle check passed (%d cases)", (int)cases.size());
+    return ok;
+}
+
+} // namespace shuffle
@@ -0,0 +1,124 @@
+#ifndef __SHUFFLE_HPP__
+#define __SHUFFLE_HPP__
+
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "NvInfer.h"
+
+// reshape/transpose(IShuffleLayer)在CPU上的描述, 以及在添加到network之前的化简
+//     - 一个IShuffleLayer按顺序做first transpose -> reshape -> second transpose, Spec和它一一对应
+//     - 相邻的shuffle能用一个IShuffleLayer表示的时候合并成一个(比如detection head的reshape + permute)
+//     - 不改变shape也不改变内存里元素顺序的shuffle(identity)直接去掉, 不添加层
+//     - shape推导只用Dims, 不需要TensorRT, 可以在CPU上检查合并前后的结果是否一致
+//     - Chain<Rank>在编译期检查permutation是不是0..N-1的排列, 以及和前面reshape的rank是否一致
+// 例子:
+//     auto out = shuffle::from(network, *conv->getOutput(0), "head0")
+//                    .reshape(1, 3, 85, -1)
+//                    .permute<0, 1, 3, 2>()
+//                    .build();                 // 只有一个IShuffleLayer
+
+namespace shuffle {
+
+struct Spec {
+    std::vector<int> first;      // 为空表示没有first transpose, 结果的第i维是输入的第first[i]维
+    std::vector<int> reshape;    // 为空表示不reshape, 0表示和输入的这一维一样, 最多一个-1
+    std::vector<int> second;     // 为空表示没有second transpose
+};
+
+Spec transpose(std::vector<int> order);
+Spec reshape(std::vector<int> dims);
+
+// 输出的shape, 参数不合法的时候返回nbDims = -1. 输入里的-1(动态的维度)会传到输出
+nvinfer1::Dims infer(const Spec& spec, const nvinfer1::Dims& input);
+// 输出的shape和输入一样, 并且两个transpose都只移动了长度为1的维度
+bool           isIdentity(const Spec& spec, const nvinfer1::Dims& input);
+// a后面接b能用一个IShuffleLayer表示的时候把结果写到merged, input是a的输入
+bool           merge(const Spec& a, const Spec& b, const nvinfer1::Dims& input, Spec& merged);
+// 依次合并相邻的shuffle并去掉identity, 不合法的时候返回false
+bool           simplify(const std::vector<Spec>& specs, const nvinfer1::Dims& input, std::vector<Spec>& result);
+// "first(0,2,1) reshape(1,3,-1)"
+std::string    describe(const Spec& spec);
+// 在CPU上对下标数据分别执行a和b, 输出的shape和每个元素的位置都一样的时候返回true. input必须是静态的shape
+bool           equivalent(const std::vector<Spec>& a, const std::vector<Spec>& b, const nvinfer1::Dims& input);
+// 常见的几种组合(detection head, 互逆的transpose, reshape来回...): simplify以后和原来的equivalent, 并且层数符合预期
+bool           check();
+
+// 添加一个IShuffleLayer, 不做化简
+nvinfer1::IShuffleLayer* addLayer(
+    nvinfer1::INetworkDefinition& network, nvinfer1::ITensor& input, const Spec& spec, const std::string& name);
+
+// 化简以后添加IShuffleLayer, 只剩一个的时候层的名字是name, 否则是name.0, name.1, ...
+// 全部是identity的时候返回input本身. layers是实际添加的层数
+nvinfer1::ITensor* apply(
+    nvinfer1::INetworkDefinition& network, nvinfer1::ITensor& input,
+    const std::vector<Spec>& specs, const std::string& name, int* layers = nullptr);
+
+namespace detail {
+
+constexpr bool hasValue(int) { return false; }
+template <typename... Rest>
+constexpr bool hasValue(int value, int first, Rest... rest) { return value == first || hasValue(value, rest...); }
+
+// N个值里出现了0..N-1的每一个, 所以是一个排列
+template <int... Order>
+constexpr bool covers(int i) { return i >= (int)sizeof...(Order) || (hasValue(i, Order...) && covers<Order...>(i + 1)); }
+
+template <typename... T> struct AllIntegral : std::true_type {};
+template <typename T, typename... Rest>
+struct AllIntegral<T, Rest...> : std::integral_constant<bool, std::is_integral<T>::value && AllIntegral<Rest...>::value> {};
+
+} // namespace detail
+
+// Rank是编译期知道的rank, -1表示还不知道(network里的tensor), 这时候在build的时候检查
+template <int Rank = -1>
+class Chain {
+public:
+    Chain(nvinfer1::INetworkDefinition& network, nvinfer1::ITensor& input, std::string name, std::vector<Spec> specs = {})
+        : mNetwork(&network), mInput(&input), mName(std::move(name)), mSpecs(std::move(specs)) {}
+
+    template <typename... D>
+    Chain<sizeof...(D)> reshape(D... dims) const {
+        static_assert(sizeof...(D) >= 1 && sizeof...(D) <= nvinfer1::Dims::MAX_DIMS, "reshape rank must be in [1, Dims::MAX_DIMS]");
+        static_assert(detail::AllIntegral<D...>::value, "reshape dims must be integers");
+        return next<sizeof...(D)>(shuffle::reshape({static_cast<int>(dims)...}));
+    }
+
+    template <int... Order>
+    Chain<sizeof...(Order)> permute() const {
+        static_assert(sizeof...(Order) >= 1 && sizeof...(Order) <= nvinfer1::Dims::MAX_DIMS, "permutation rank must be in [1, Dims::MAX_DIMS]");
+        static_assert(Rank < 0 || Rank == (int)sizeof...(Order), "permutation rank does not match the tensor rank");
+        static_assert(detail::covers<Order...>(0), "permutation must contain each of 0..N-1 exactly once");
+        return next<sizeof...(Order)>(transpose({Order...}));
+    }
+
+    // 运行时才知道的参数, 在build的时候检查
+    Chain<Rank> permute(std::vector<int> order) const { return next<Rank>(transpose(std::move(order))); }
+    Chain<-1>   reshape(std::vector<int> dims) const { return next<-1>(shuffle::reshape(std::move(dims))); }
+
+    const std::vector<Spec>& specs() const { return mSpecs; }
+    // 出错的时候返回nullptr
+    nvinfer1::ITensor* build(int* layers = nullptr) const { return apply(*mNetwork, *mInput, mSpecs, mName, layers); }
+
+private:
+    template <int R>
+    Chain<R> next(Spec spec) const {
+        std::vector<Spec> specs = mSpecs;
+        specs.push_back(std::move(spec));
+        return Chain<R>(*mNetwork, *mInput, mName, std::move(specs));
+    }
+
+    nvinfer1::INetworkDefinition* mNetwork;
+    nvinfer1::ITensor*            mInput;
+    std::string                   mName;
+    std::vector<Spec>             mSpecs;
+};
+
+inline Chain<> from(nvinfer1::INetworkDefinition& network, nvinfer1::ITensor& input, std::string name) {
+    return Chain<>(network, input, std::move(name));
+}
+
+} // namespace shuffle
+
+#endif //__SHUFFLE_HPP__
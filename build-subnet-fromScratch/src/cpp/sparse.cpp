@@ -0,0 +1,114 @@
+#include <cmath>
+#include <utility>
+
+#include "sparse.hpp"
+#include "quant.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+namespace sparse {
+
+PruneStats prune24(float* w, int64_t count, int outputChannel, int kernelSize) {
+    PruneStats s;
+    s.count = count;
+
+    int64_t spatial = (int64_t)kernelSize * kernelSize;
+    int64_t channel = count / (outputChannel * spatial);
+    double  norm    = 0;
+    for (int64_t i = 0; i < count; i++) norm += (double)w[i] * w[i];
+
+    for (int64_t k = 0; k < outputChannel; k++) {
+        for (int64_t c = 0; c + 4 <= channel; c += 4) {
+            for (int64_t p = 0; p < spatial; p++) {
+                float* g = w + (k * channel + c) * spatial + p;
+
+                // 找到绝对值最大的两个, 一样大的时候保留前面的
+                int first = 0, second = -1;
+                for (int j = 1; j < 4; j++) {
+                    if (fabsf(g[j * spatial]) > fabsf(g[first * spatial])) {
+                        second = first;
+                        first  = j;
+                    } else if (second < 0 || fabsf(g[j * spatial]) > fabsf(g[second * spatial])) {
+                        second = j;
+                    }
+                }
+                for (int j = 0; j < 4; j++) {
+                    if (j == first || j == second) continue;
+                    s.l2 += (double)g[j * spatial] * g[j * spatial];
+                    g[j * spatial] = 0;
+                }
+                s.groups++;
+            }
+        }
+    }
+
+    for (int64_t i = 0; i < count; i++) s.zeros += w[i] == 0;
+    s.l2       = sqrt(s.l2);
+    s.relative = norm > 0 ? s.l2 / sqrt(norm) : 0;
+    return s;
+}
+
+static bool findKernelSize(const map<string, int>& kernelSizes, const string& layer, int& size) {
+    for (auto& k : kernelSizes) {
+        if (globMatch(k.first, layer)) {
+            size = k.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool pruneWeights(const string& inPath, const string& outPath, const map<string, int>& kernelSizes, const vector<string>& patterns) {
+    vector<quant::WeightEntry> entries;
+    if (!quant::readWeights(inPath, entries)) return false;
+
+    vector<PruneStats> stats;
+    for (size_t i = 0; i < entries.size(); i++) {
+        auto& entry = entries[i];
+        bool  match = false;
+        for (auto& p : patterns) match = match || globMatch(p, entry.name);
+        if (!match) continue;
+
+        int64_t outputChannel = quant::convOutputChannels(entries, i);
+        string  layer         = entry.name.substr(0, entry.name.rfind(".weight"));
+        int     kernelSize    = 0;
+        if (outputChannel == 0 || !findKernelSize(kernelSizes, layer, kernelSize)) {
+            LOGW("%s: unknown kernel shape, skipped", entry.name.c_str());
+            continue;
+        }
+        int64_t count = entry.bits.size();
+        if (count % (outputChannel * kernelSize * kernelSize) != 0) {
+            LOGW("%s: %ld values don't match %ld x C x %d x %d, skipped", entry.name.c_str(),
+                 (long)count, (long)outputChannel, kernelSize, kernelSize);
+            continue;
+        }
+
+        // 剪掉的值直接把bit清0, 保留下来的值(包括half)保持原来的bit
+        vector<float> w = quant::toFloat(entry);
+        PruneStats    s = prune24(w.data(), count, (int)outputChannel, kernelSize);
+        s.name = entry.name;
+        for (int64_t k = 0; k < count; k++) {
+            if (w[k] == 0) entry.bits[k] = 0;
+        }
+        stats.push_back(s);
+    }
+
+    LOG("%-32s %10s %10s %10s %12s %10s", "layer", "count", "groups", "sparsity", "l2 error", "relative");
+    int64_t count = 0, zeros = 0;
+    for (auto& s : stats) {
+        LOG("%-32s %10ld %10ld %9.2f%% %12.4e %10.4e", s.name.c_str(), (long)s.count, (long)s.groups,
+            s.count > 0 ? 100.0 * s.zeros / s.count : 0.0, s.l2, s.relative);
+        count += s.count;
+        zeros += s.zeros;
+    }
+    if (count > 0) {
+        LOG("total sparsity of pruned layers: %.2f%%", 100.0 * zeros / count);
+    }
+
+    if (!quant::writeWeights(outPath, entries)) return false;
+    LOG("pruned %zu layers, saved to %s", stats.size(), outPath.c_str());
+    return true;
+}
+
+} // namespace sparse
@@ -0,0 +1,34 @@
+#ifndef __SPARSE_HPP__
+#define __SPARSE_HPP__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+// 2:4 structured sparsity: 沿着input channel每连续4个值里只保留绝对值最大的2个
+// 剪枝以后的权重配合BuilderFlag::kSPARSE_WEIGHTS(Model::setSparseWeights)就可以使用Ampere以后的sparse tensor core
+// .weights里没有保存kernel的shape, 需要告诉工具每个conv的kernel size(支持*通配), 找不到的层不会被剪枝
+
+namespace sparse {
+
+struct PruneStats {
+    std::string name;
+    int64_t     count    = 0;
+    int64_t     zeros    = 0;    // 剪枝以后0的个数(包括原来就是0的)
+    int64_t     groups   = 0;    // 被剪枝的4个一组的个数, C不是4的倍数的时候剩下的channel保持dense
+    double      l2       = 0;    // ||W - W'||
+    double      relative = 0;    // ||W - W'|| / ||W||
+};
+
+// w的layout是[K, C, kh, kw], 4个一组的值在内存里的间隔是kh * kw
+PruneStats prune24(float* w, int64_t count, int outputChannel, int kernelSize);
+
+// 对inPath里名字匹配上patterns的conv kernel做2:4剪枝, 打印每一层的稀疏度和误差, 结果写到outPath
+bool pruneWeights(const std::string& inPath, const std::string& outPath,
+                  const std::map<std::string, int>& kernelSizes,
+                  const std::vector<std::string>& patterns = {"*conv*.weight"});
+
+} // namespace sparse
+
+#endif //__SPARSE_HPP__
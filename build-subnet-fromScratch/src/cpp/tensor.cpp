@@ -0,0 +1,534 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#include "tensor.hpp"
+#include "half.hpp"
+#include "metrics.hpp"
+#include "utils.hpp"
+
+using namespace std;
+
+static metrics::Counter& poolHits() {
+    static auto& c = metrics::Registry::instance().counter("trt_tensor_pool_hits_total", "tensor allocations served from the pool");
+    return c;
+}
+
+static metrics::Counter& poolMisses() {
+    static auto& c = metrics::Registry::instance().counter("trt_tensor_pool_misses_total", "tensor allocations that called malloc/cudaMalloc");
+    return c;
+}
+
+static metrics::Gauge& poolInUse() {
+    static auto& g = metrics::Registry::instance().gauge("trt_tensor_pool_in_use_bytes", "bytes held by live tensors");
+    return g;
+}
+
+const char* locationName(Location location) {
+    switch (location) {
+        case Location::Host:   return "host";
+        case Location::Pinned: return "pinned";
+        case Location::Device: return "device";
+    }
+    return "unknown";
+}
+
+size_t dataTypeSize(nvinfer1::DataType type) {
+    switch (type) {
+        case nvinfer1::DataType::kFLOAT: return 4;
+        case nvinfer1::DataType::kINT32: return 4;
+        case nvinfer1::DataType::kHALF:  return 2;
+        default:                         return 1;
+    }
+}
+
+static const char* typeName(nvinfer1::DataType type) {
+    switch (type) {
+        case nvinfer1::DataType::kFLOAT: return "float32";
+        case nvinfer1::DataType::kHALF:  return "float16";
+        case nvinfer1::DataType::kINT32: return "int32";
+        case nvinfer1::DataType::kINT8:  return "int8";
+        case nvinfer1::DataType::kUINT8: return "uint8";
+        case nvinfer1::DataType::kBOOL:  return "bool";
+        default:                         return "unknown";
+    }
+}
+
+/* ------------------------------- PooledAllocator ------------------------------- */
+
+PooledAllocator::PooledAllocator(Location location, size_t maxCachedBytes) :
+    mLocation(location), mMaxCached(maxCachedBytes) {}
+
+PooledAllocator::~PooledAllocator() {
+    trim();
+}
+
+size_t PooledAllocator::sizeClass(size_t bytes) {
+    const size_t kMinBlock  = 256;
+    const size_t kLarge     = (size_t)64 << 20;
+    const size_t kLargeStep = (size_t)2 << 20;
+    if (bytes <= kMinBlock) return kMinBlock;
+    if (bytes > kLarge) return (bytes + kLargeStep - 1) / kLargeStep * kLargeStep;
+    size_t size = kMinBlock;
+    while (size < bytes) size <<= 1;
+    return size;
+}
+
+void* PooledAllocator::rawAllocate(size_t bytes) {
+    void* ptr = nullptr;
+    switch (mLocation) {
+        case Location::Host:
+            ptr = malloc(bytes);
+            break;
+        case Location::Pinned:
+            if (cudaMallocHost(&ptr, bytes) != cudaSuccess) ptr = nullptr;
+            break;
+        case Location::Device:
+            if (cudaMalloc(&ptr, bytes) != cudaSuccess) ptr = nullptr;
+            break;
+    }
+    return ptr;
+}
+
+void PooledAllocator::rawFree(void* ptr) {
+    switch (mLocation) {
+        case Location::Host:   free(ptr); break;
+        case Location::Pinned: cudaFreeHost(ptr); break;
+        case Location::Device: cudaFree(ptr); break;
+    }
+}
+
+void* PooledAllocator::allocate(size_t bytes) {
+    size_t size = sizeClass(bytes);
+    {
+        lock_guard<mutex> lock(mLock);
+        auto it = mFree.find(size);
+        if (it != mFree.end() && !it->second.empty()) {
+            void* ptr = it->second.back();
+            it->second.pop_back();
+            mStats.hits++;
+            mStats.cachedBytes -= size;
+            mStats.inUseBytes  += size;
+            poolHits().inc();
+            poolInUse().add(size);
+            return ptr;
+        }
+    }
+
+    void* ptr = rawAllocate(size);
+    if (ptr == nullptr) {
+        // 可能是池子里空闲的块占着内存, 还回去以后再试一次
+        trim();
+        ptr = rawAllocate(size);
+    }
+    if (ptr == nullptr) {
+        LOGE("ERROR: failed to allocate %zu bytes of %s memory", size, locationName(mLocation));
+        return nullptr;
+    }
+    lock_guard<mutex> lock(mLock);
+    mStats.misses++;
+    mStats.inUseBytes += size;
+    poolMisses().inc();
+    poolInUse().add(size);
+    return ptr;
+}
+
+void PooledAllocator::release(void* ptr, size_t bytes) {
+    if (ptr == nullptr) return;
+    size_t size = sizeClass(bytes);
+    poolInUse().add(-(int64_t)size);
+    {
+        lock_guard<mutex> lock(mLock);
+        mStats.inUseBytes -= size;
+        if (mStats.cachedBytes + size <= mMaxCached) {
+            mFree[size].push_back(ptr);
+            mStats.cachedBytes += size;
+            return;
+        }
+    }
+    rawFree(ptr);
+}
+
+void PooledAllocator::trim() {
+    map<size_t, vector<void*>> blocks;
+    {
+        lock_guard<mutex> lock(mLock);
+        blocks.swap(mFree);
+        mStats.cachedBytes = 0;
+    }
+    for (auto& b : blocks) {
+        for (auto ptr : b.second) rawFree(ptr);
+    }
+}
+
+PoolStats PooledAllocator::stats() const {
+    lock_guard<mutex> lock(mLock);
+    return mStats;
+}
+
+PooledAllocator& allocatorFor(Location location) {
+    // 不析构: 静态对象析构的顺序里CUDA的context可能已经销毁了
+    static PooledAllocator* pools[] = {
+        new PooledAllocator(Location::Host),
+        new PooledAllocator(Location::Pinned),
+        new PooledAllocator(Location::Device),
+    };
+    return *pools[(int)location];
+}
+
+/* ------------------------------- Tensor ------------------------------- */
+
+struct Tensor::Storage {
+    void*      ptr       = nullptr;
+    size_t     bytes     = 0;
+    Allocator* allocator = nullptr;    // wrap的时候是nullptr, 不释放
+
+    ~Storage() {
+        if (allocator != nullptr) allocator->release(ptr, bytes);
+    }
+};
+
+static vector<int64_t> contiguousStrides(const vector<int64_t>& shape) {
+    vector<int64_t> strides(shape.size());
+    int64_t         stride = 1;
+    for (int i = (int)shape.size() - 1; i >= 0; i--) {
+        strides[i] = stride;
+        stride    *= shape[i];
+    }
+    return strides;
+}
+
+static bool validShape(const vector<int64_t>& shape) {
+    for (auto d : shape) {
+        if (d < 0) return false;
+    }
+    return true;
+}
+
+Tensor::Tensor(vector<int64_t> shape, nvinfer1::DataType type, Location location) {
+    if (!validShape(shape)) {
+        LOGE("ERROR: invalid tensor shape, dynamic dimensions must be resolved before allocating");
+        return;
+    }
+    mType     = type;
+    mLocation = location;
+    mShape    = move(shape);
+    mStrides  = contiguousStrides(mShape);
+
+    int64_t n = 1;
+    for (auto d : mShape) n *= d;
+
+    unique_ptr<Storage> storage(new Storage());
+    storage->bytes     = max<size_t>((size_t)n * elementSize(), 1);
+    storage->allocator = &allocatorFor(location);
+    storage->ptr       = storage->allocator->allocate(storage->bytes);
+    if (storage->ptr == nullptr) {
+        storage->allocator = nullptr;
+        return;
+    }
+    mStorage.reset(storage.release());
+}
+
+Tensor Tensor::fromDims(const nvinfer1::Dims& dims, nvinfer1::DataType type, Location location) {
+    return Tensor(vector<int64_t>(dims.d, dims.d + max(dims.nbDims, 0)), type, location);
+}
+
+Tensor Tensor::wrap(void* data, vector<int64_t> shape, nvinfer1::DataType type, Location location) {
+    Tensor t;
+    if (data == nullptr || !validShape(shape)) return t;
+    t.mType     = type;
+    t.mLocation = location;
+    t.mShape    = move(shape);
+    t.mStrides  = contiguousStrides(t.mShape);
+    t.mStorage  = make_shared<Storage>();
+    t.mStorage->ptr   = data;
+    t.mStorage->bytes = t.bytes();
+    return t;
+}
+
+int64_t Tensor::dim(int axis) const {
+    if (axis < 0) axis += rank();
+    return (axis >= 0 && axis < rank()) ? mShape[axis] : 0;
+}
+
+int64_t Tensor::count() const {
+    if (empty()) return 0;
+    int64_t n = 1;
+    for (auto d : mShape) n *= d;
+    return n;
+}
+
+bool Tensor::contiguous() const {
+    int64_t stride = 1;
+    for (int i = rank() - 1; i >= 0; i--) {
+        // 长度为1的维度的stride没有意义
+        if (mShape[i] != 1 && mStrides[i] != stride) return false;
+        stride *= mShape[i];
+    }
+    return true;
+}
+
+nvinfer1::Dims Tensor::dims() const {
+    nvinfer1::Dims d;
+    d.nbDims = rank();
+    if (rank() > nvinfer1::Dims::MAX_DIMS) {
+        d.nbDims = -1;
+        return d;
+    }
+    for (int i = 0; i < rank(); i++) {
+        if (mShape[i] > INT32_MAX) {
+            d.nbDims = -1;
+            return d;
+        }
+        d.d[i] = (int32_t)mShape[i];
+    }
+    return d;
+}
+
+void* Tensor::data() {
+    return empty() ? nullptr : static_cast<char*>(mStorage->ptr) + mOffset;
+}
+
+const void* Tensor::data() const {
+    return empty() ? nullptr : static_cast<const char*>(mStorage->ptr) + mOffset;
+}
+
+const void* Tensor::checkedData(nvinfer1::DataType type) const {
+    if (type != mType) {
+        LOGE("ERROR: tensor is %s, accessed as %s", typeName(mType), typeName(type));
+        return nullptr;
+    }
+    return data();
+}
+
+void* Tensor::checkedData(nvinfer1::DataType type) {
+    return const_cast<void*>(static_cast<const Tensor*>(this)->checkedData(type));
+}
+
+Tensor Tensor::alias() const {
+    Tensor t;
+    t.mStorage  = mStorage;
+    t.mOffset   = mOffset;
+    t.mType     = mType;
+    t.mLocation = mLocation;
+    t.mShape    = mShape;
+    t.mStrides  = mStrides;
+    return t;
+}
+
+Tensor Tensor::view() const {
+    return alias();
+}
+
+Tensor Tensor::slice(int axis, int64_t begin, int64_t end) const {
+    if (axis < 0) axis += rank();
+    if (empty() || axis < 0 || axis >= rank()) {
+        LOGE("ERROR: slice axis %d is out of range for %s", axis, str().c_str());
+        return Tensor();
+    }
+    int64_t n = mShape[axis];
+    if (begin < 0) begin += n;
+    if (end < 0)   end   += n;
+    begin = min(max<int64_t>(begin, 0), n);
+    end   = min(max<int64_t>(end, begin), n);
+
+    Tensor t = alias();
+    t.mShape[axis] = end - begin;
+    t.mOffset     += (size_t)(begin * mStrides[axis]) * elementSize();
+    return t;
+}
+
+Tensor Tensor::reshape(vector<int64_t> shape) const {
+    if (empty() || !contiguous()) {
+        LOGE("ERROR: reshape needs a contiguous tensor, got %s", str().c_str());
+        return Tensor();
+    }
+    int     inferred = -1;
+    int64_t known    = 1;
+    for (size_t i = 0; i < shape.size(); i++) {
+        if (shape[i] == -1 && inferred < 0) {
+            inferred = (int)i;
+        } else if (shape[i] < 0) {
+            LOGE("ERROR: reshape allows at most one -1");
+            return Tensor();
+        } else {
+            known *= shape[i];
+        }
+    }
+    if (inferred >= 0 && known > 0) shape[inferred] = count() / known;
+
+    int64_t total = 1;
+    for (auto d : shape) total *= d;
+    if (total != count()) {
+        LOGE("ERROR: cannot reshape %s to %ld elements", str().c_str(), total);
+        return Tensor();
+    }
+    Tensor t   = alias();
+    t.mShape   = move(shape);
+    t.mStrides = contiguousStrides(t.mShape);
+    return t;
+}
+
+Tensor Tensor::permute(const vector<int>& order) const {
+    vector<bool> seen(rank(), false);
+    bool         ok = !empty() && (int)order.size() == rank();
+    for (size_t i = 0; i < order.size() && ok; i++) {
+        ok = order[i] >= 0 && order[i] < rank() && !seen[order[i]];
+        if (ok) seen[order[i]] = true;
+    }
+    if (!ok) {
+        LOGE("ERROR: invalid permutation for %s", str().c_str());
+        return Tensor();
+    }
+    Tensor t = alias();
+    for (size_t i = 0; i < order.size(); i++) {
+        t.mShape[i]   = mShape[order[i]];
+        t.mStrides[i] = mStrides[order[i]];
+    }
+    return t;
+}
+
+// 两边都在host上, 任意的strides, 最内层连续的时候按行memcpy
+static void stridedCopy(char* dst, const int64_t* dstStrides, const char* src, const int64_t* srcStrides,
+                        const int64_t* shape, int rank, size_t elem) {
+    if (rank == 0) {
+        memcpy(dst, src, elem);
+        return;
+    }
+    if (rank == 1) {
+        if (dstStrides[0] == 1 && srcStrides[0] == 1) {
+            memcpy(dst, src, shape[0] * elem);
+            return;
+        }
+        for (int64_t i = 0; i < shape[0]; i++) {
+            memcpy(dst + i * dstStrides[0] * elem, src + i * srcStrides[0] * elem, elem);
+        }
+        return;
+    }
+    for (int64_t i = 0; i < shape[0]; i++) {
+        stridedCopy(dst + i * dstStrides[0] * elem, dstStrides + 1, src + i * srcStrides[0] * elem, srcStrides + 1,
+                    shape + 1, rank - 1, elem);
+    }
+}
+
+static cudaMemcpyKind copyKind(Location dst, Location src) {
+    bool dstDevice = dst == Location::Device;
+    bool srcDevice = src == Location::Device;
+    if (dstDevice && srcDevice) return cudaMemcpyDeviceToDevice;
+    if (dstDevice)              return cudaMemcpyHostToDevice;
+    if (srcDevice)              return cudaMemcpyDeviceToHost;
+    return cudaMemcpyHostToHost;
+}
+
+bool Tensor::copyFrom(const Tensor& src, cudaStream_t stream) {
+    if (empty() || src.empty() || src.mType != mType || src.mShape != mShape) {
+        LOGE("ERROR: cannot copy %s into %s", src.str().c_str(), str().c_str());
+        return false;
+    }
+    if (count() == 0) return true;
+
+    if (contiguous() && src.contiguous()) {
+        cudaMemcpyKind kind = copyKind(mLocation, src.mLocation);
+        if (kind == cudaMemcpyHostToHost) {
+            memcpy(data(), src.data(), bytes());
+            return true;
+        }
+        if (cudaMemcpyAsync(data(), src.data(), bytes(), kind, stream) != cudaSuccess) {
+            LOGE("ERROR: cudaMemcpyAsync %s -> %s failed", src.str().c_str(), str().c_str());
+            return false;
+        }
+        return stream != nullptr || cudaStreamSynchronize(stream) == cudaSuccess;
+    }
+
+    if (!hostAccessible() || !src.hostAccessible()) {
+        LOGE("ERROR: strided copy between %s and %s is only supported on host, make one side contiguous first",
+             src.str().c_str(), str().c_str());
+        return false;
+    }
+    stridedCopy(static_cast<char*>(data()), mStrides.data(), static_cast<const char*>(src.data()), src.mStrides.data(),
+                mShape.data(), rank(), elementSize());
+    return true;
+}
+
+Tensor Tensor::clone(Location location) const {
+    if (empty()) return Tensor();
+    Tensor t(mShape, mType, location);
+    if (t.empty() || !t.copyFrom(*this)) return Tensor();
+    return t;
+}
+
+Tensor Tensor::to(Location location, cudaStream_t stream) const {
+    if (empty()) return Tensor();
+    if (location == mLocation) return alias();
+    Tensor t(mShape, mType, location);
+    if (t.empty() || !t.copyFrom(*this, stream)) return Tensor();
+    return t;
+}
+
+static float loadAsFloat(const void* src, nvinfer1::DataType type, int64_t i) {
+    switch (type) {
+        case nvinfer1::DataType::kFLOAT: return static_cast<const float*>(src)[i];
+        case nvinfer1::DataType::kHALF:  return fp16::halfToFloat(static_cast<const uint16_t*>(src)[i]);
+        case nvinfer1::DataType::kINT32: return (float)static_cast<const int32_t*>(src)[i];
+        case nvinfer1::DataType::kINT8:  return (float)static_cast<const int8_t*>(src)[i];
+        case nvinfer1::DataType::kBOOL:  return static_cast<const bool*>(src)[i] ? 1.f : 0.f;
+        default:                         return (float)static_cast<const uint8_t*>(src)[i];
+    }
+}
+
+template <typename T>
+static T saturate(float v) {
+    // NaN转成0, 超出范围的截到最大/最小值
+    if (!(v == v)) return 0;
+    double d = min(max((double)v, (double)numeric_limits<T>::lowest()), (double)numeric_limits<T>::max());
+    return (T)llrint(d);
+}
+
+static void storeFromFloat(void* dst, nvinfer1::DataType type, int64_t i, float v) {
+    switch (type) {
+        case nvinfer1::DataType::kFLOAT: static_cast<float*>(dst)[i]    = v; break;
+        case nvinfer1::DataType::kHALF:  static_cast<uint16_t*>(dst)[i] = fp16::floatToHalf(v); break;
+        case nvinfer1::DataType::kINT32: static_cast<int32_t*>(dst)[i]  = saturate<int32_t>(v); break;
+        case nvinfer1::DataType::kINT8:  static_cast<int8_t*>(dst)[i]   = saturate<int8_t>(v); break;
+        case nvinfer1::DataType::kBOOL:  static_cast<bool*>(dst)[i]     = v != 0; break;
+        default:                         static_cast<uint8_t*>(dst)[i]  = saturate<uint8_t>(v); break;
+    }
+}
+
+Tensor Tensor::cast(nvinfer1::DataType type) const {
+    if (empty()) return Tensor();
+    if (type == mType) return alias();
+    if (!hostAccessible()) {
+        LOGE("ERROR: cast is only supported on host, got %s", str().c_str());
+        return Tensor();
+    }
+    if (!contiguous()) return clone(mLocation).cast(type);
+
+    Tensor  t(mShape, type, mLocation);
+    int64_t n = count();
+    if (t.empty()) return t;
+    if (mType == nvinfer1::DataType::kFLOAT && type == nvinfer1::DataType::kHALF) {
+        fp16::convert(static_cast<const float*>(data()), static_cast<uint16_t*>(t.data()), n);
+    } else if (mType == nvinfer1::DataType::kHALF && type == nvinfer1::DataType::kFLOAT) {
+        fp16::convert(static_cast<const uint16_t*>(data()), static_cast<float*>(t.data()), n);
+    } else {
+        for (int64_t i = 0; i < n; i++) storeFromFloat(t.data(), type, i, loadAsFloat(data(), mType, i));
+    }
+    return t;
+}
+
+string Tensor::str() const {
+    if (empty()) return "empty tensor";
+    string s = typeName(mType);
+    s += "[";
+    for (int i = 0; i < rank(); i++) {
+        s += to_string(mShape[i]);
+        if (i != rank() - 1) s += "x";
+    }
+    s += "] ";
+    s += locationName(mLocation);
+    if (!contiguous()) s += " (strided)";
+    return s;
+}
@@ -0,0 +1,158 @@
+#ifndef __TENSOR_HPP__
+#define __TENSOR_HPP__
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "NvInfer.h"
+#include "cuda_runtime.h"
+
+// 带类型的tensor, 替代到处传的float*加int size
+//     - dtype用TensorRT的DataType, shape和strides(单位是元素)都是int64, 超过2^31个元素也不会溢出
+//     - Location表示内存在哪里: Host(malloc), Pinned(cudaMallocHost), Device(cudaMalloc)
+//     - 内存从每个Location自己的池子里分配, 释放以后回到池子里, 同样大小的buffer反复分配不会再调用cudaMalloc
+//     - view/slice/reshape/permute不拷贝数据, 和原来的tensor共享同一块内存(引用计数), 原来的tensor析构以后view仍然有效
+//     - 可以move, 不能隐式拷贝, 需要拷贝数据的时候显式地用clone/copyFrom/to
+// Device上的内存释放以后马上可以被别的tensor重用, 析构之前调用的一方要保证用到它的stream已经同步
+
+enum class Location { Host, Pinned, Device };
+
+const char* locationName(Location location);
+size_t      dataTypeSize(nvinfer1::DataType type);
+
+class Allocator {
+public:
+    virtual ~Allocator() {}
+    // bytes是请求的大小, release的时候传回同样的值
+    virtual void* allocate(size_t bytes) = 0;
+    virtual void  release(void* ptr, size_t bytes) = 0;
+};
+
+struct PoolStats {
+    uint64_t hits        = 0;     // 从池子里拿到的
+    uint64_t misses      = 0;     // 调用了malloc/cudaMallocHost/cudaMalloc
+    size_t   inUseBytes  = 0;
+    size_t   cachedBytes = 0;     // 池子里空闲的
+};
+
+// 按大小分桶的池子: 64MB以下按2的幂次向上取整, 更大的按2MB对齐, 防止大的buffer浪费一倍的显存
+// 空闲的块超过maxCachedBytes的时候直接还给系统
+class PooledAllocator : public Allocator {
+public:
+    explicit PooledAllocator(Location location, size_t maxCachedBytes = (size_t)1 << 30);
+    ~PooledAllocator();
+    PooledAllocator(const PooledAllocator&) = delete;
+    PooledAllocator& operator=(const PooledAllocator&) = delete;
+
+    void* allocate(size_t bytes) override;
+    void  release(void* ptr, size_t bytes) override;
+    // 把池子里空闲的块都还给系统
+    void      trim();
+    PoolStats stats() const;
+    Location  location() const { return mLocation; }
+
+    static size_t sizeClass(size_t bytes);
+
+private:
+    void* rawAllocate(size_t bytes);
+    void  rawFree(void* ptr);
+
+    Location                              mLocation;
+    size_t                                mMaxCached;
+    mutable std::mutex                    mLock;
+    std::map<size_t, std::vector<void*>>  mFree;     // key是size class
+    PoolStats                             mStats;
+};
+
+// 每个Location一个全局的池子
+PooledAllocator& allocatorFor(Location location);
+
+// data<T>()检查的类型, half用uint16_t
+template <typename T> struct DataTypeOf;
+template <> struct DataTypeOf<float>    { static const nvinfer1::DataType value = nvinfer1::DataType::kFLOAT; };
+template <> struct DataTypeOf<uint16_t> { static const nvinfer1::DataType value = nvinfer1::DataType::kHALF; };
+template <> struct DataTypeOf<int32_t>  { static const nvinfer1::DataType value = nvinfer1::DataType::kINT32; };
+template <> struct DataTypeOf<int8_t>   { static const nvinfer1::DataType value = nvinfer1::DataType::kINT8; };
+template <> struct DataTypeOf<uint8_t>  { static const nvinfer1::DataType value = nvinfer1::DataType::kUINT8; };
+template <> struct DataTypeOf<bool>     { static const nvinfer1::DataType value = nvinfer1::DataType::kBOOL; };
+
+class Tensor {
+public:
+    Tensor() {}
+    // 分配contiguous的内存, 内容不初始化
+    Tensor(std::vector<int64_t> shape, nvinfer1::DataType type, Location location = Location::Host);
+    static Tensor fromDims(const nvinfer1::Dims& dims, nvinfer1::DataType type, Location location = Location::Host);
+    // 包装外部的内存, 不拥有, 调用的一方保证它比tensor和所有的view活得久
+    static Tensor wrap(void* data, std::vector<int64_t> shape, nvinfer1::DataType type, Location location = Location::Host);
+
+    Tensor(Tensor&&) = default;
+    Tensor& operator=(Tensor&&) = default;
+    Tensor(const Tensor&) = delete;
+    Tensor& operator=(const Tensor&) = delete;
+
+    // 默认构造的, 或者出错的时候返回的tensor是empty
+    bool                        empty() const { return mStorage == nullptr; }
+    nvinfer1::DataType          dtype() const { return mType; }
+    Location                    location() const { return mLocation; }
+    const std::vector<int64_t>& shape() const { return mShape; }
+    const std::vector<int64_t>& strides() const { return mStrides; }
+    int                         rank() const { return (int)mShape.size(); }
+    // axis可以是负数, 从后往前数
+    int64_t                     dim(int axis) const;
+    int64_t                     count() const;
+    size_t                      elementSize() const { return dataTypeSize(mType); }
+    size_t                      bytes() const { return (size_t)count() * elementSize(); }
+    bool                        contiguous() const;
+    // rank超过nvinfer1::Dims::MAX_DIMS或者某一维超过int32的时候返回nbDims = -1
+    nvinfer1::Dims              dims() const;
+    bool                        hostAccessible() const { return mLocation != Location::Device; }
+
+    void*       data();
+    const void* data() const;
+    // 类型对不上的时候打印错误并返回nullptr
+    template <typename T> T*       data()       { return static_cast<T*>(checkedData(DataTypeOf<T>::value)); }
+    template <typename T> const T* data() const { return static_cast<const T*>(checkedData(DataTypeOf<T>::value)); }
+
+    // 下面这些都不拷贝数据, 返回的tensor共享同一块内存
+    Tensor view() const;
+    // 沿axis取[begin, end), 支持负数的下标
+    Tensor slice(int axis, int64_t begin, int64_t end) const;
+    // 只支持contiguous的tensor, 最多一维是-1
+    Tensor reshape(std::vector<int64_t> shape) const;
+    // 结果的第i维是原来的第order[i]维
+    Tensor permute(const std::vector<int>& order) const;
+
+    // shape和dtype必须一样. contiguous的时候直接memcpy/cudaMemcpyAsync,
+    // 两边都在host上的时候支持任意的strides; stream为nullptr的时候拷贝完成以后才返回
+    bool   copyFrom(const Tensor& src, cudaStream_t stream = nullptr);
+    // 拷贝到location上一个新的contiguous的tensor
+    Tensor clone(Location location) const;
+    Tensor clone() const { return clone(mLocation); }
+    // location一样的时候返回view, 不拷贝
+    Tensor to(Location location, cudaStream_t stream = nullptr) const;
+    // 只支持host上的tensor, float/half/int32/int8/uint8/bool之间互相转换, dtype一样的时候返回view
+    Tensor cast(nvinfer1::DataType type) const;
+
+    // "float32[1x3x224x224] pinned"
+    std::string str() const;
+
+private:
+    struct Storage;
+
+    const void* checkedData(nvinfer1::DataType type) const;
+    void*       checkedData(nvinfer1::DataType type);
+    Tensor      alias() const;
+
+    std::shared_ptr<Storage> mStorage;
+    size_t                   mOffset   = 0;    // 单位是byte
+    nvinfer1::DataType       mType     = nvinfer1::DataType::kFLOAT;
+    Location                 mLocation = Location::Host;
+    std::vector<int64_t>     mShape;
+    std::vector<int64_t>     mStrides;
+};
+
+#endif //__TENSOR_HPP__
@@ -0,0 +1,186 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "timingcache.hpp"
+#include "utils.hpp"
+#include "NvInfer.h"
+#include "cuda_runtime.h"
+
+using namespace std;
+
+namespace timingcache {
+
+static const char     kMagic[8]    = {'T', 'R', 'T', 'T', 'C', 'A', 'C', 'H'};
+static const size_t   kDeviceBytes = 64;
+
+// magic + format + trtVersion + device + payload size + checksum
+static const size_t   kHeaderBytes = sizeof(kMagic) + 4 + 4 + kDeviceBytes + 8 + 8;
+
+static uint64_t fnv1a(const char* data, size_t size) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+CacheKey currentKey() {
+    CacheKey key;
+    key.trtVersion = getInferLibVersion();
+
+    int            device = 0;
+    cudaDeviceProp prop;
+    if (cudaGetDevice(&device) == 0 && cudaGetDeviceProperties(&prop, device) == 0) {
+        key.device = string(prop.name) + " sm_" + to_string(prop.major) + to_string(prop.minor);
+    }
+    return key;
+}
+
+FileLock::FileLock(const string& path, bool exclusive) {
+    string lockPath = path + ".lock";
+    mFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (mFd < 0) {
+        LOGE("ERROR: failed to open %s", lockPath.c_str());
+        return;
+    }
+    if (flock(mFd, exclusive ? LOCK_EX : LOCK_SH) != 0) {
+        LOGE("ERROR: failed to lock %s", lockPath.c_str());
+        close(mFd);
+        mFd = -1;
+    }
+}
+
+FileLock::~FileLock() {
+    if (mFd >= 0) {
+        flock(mFd, LOCK_UN);
+        close(mFd);
+    }
+}
+
+static void putBytes(vector<char>& out, const void* data, size_t size) {
+    out.insert(out.end(), (const char*)data, (const char*)data + size);
+}
+
+static vector<char> encode(const CacheKey& key, const vector<char>& payload) {
+    vector<char> out;
+    out.reserve(kHeaderBytes + payload.size());
+
+    char     device[kDeviceBytes] = {0};
+    uint32_t format               = kFormatVersion;
+    uint64_t size                 = payload.size();
+    uint64_t checksum             = fnv1a(payload.data(), payload.size());
+    strncpy(device, key.device.c_str(), kDeviceBytes - 1);
+
+    putBytes(out, kMagic, sizeof(kMagic));
+    putBytes(out, &format, 4);
+    putBytes(out, &key.trtVersion, 4);
+    putBytes(out, device, kDeviceBytes);
+    putBytes(out, &size, 8);
+    putBytes(out, &checksum, 8);
+    putBytes(out, payload.data(), payload.size());
+    return out;
+}
+
+static bool readFile(const string& path, vector<char>& data) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == nullptr) return false;
+    fseek(f, 0, SEEK_END);
+    data.resize(ftell(f));
+    fseek(f, 0, SEEK_SET);
+    bool ok = fread(data.data(), 1, data.size(), f) == data.size();
+    fclose(f);
+    return ok;
+}
+
+// 不加锁, 调用的地方负责
+static bool decode(const string& path, const CacheKey& key, vector<char>& blob) {
+    blob.clear();
+    vector<char> data;
+    if (!readFile(path, data)) return false;
+
+    if (data.size() < kHeaderBytes || memcmp(data.data(), kMagic, sizeof(kMagic)) != 0) {
+        LOGW("%s is not a timing cache, ignored", path.c_str());
+        return false;
+    }
+    const char* p = data.data() + sizeof(kMagic);
+    uint32_t format;
+    int32_t  trtVersion;
+    char     device[kDeviceBytes];
+    uint64_t size, checksum;
+    memcpy(&format, p, 4);                p += 4;
+    memcpy(&trtVersion, p, 4);            p += 4;
+    memcpy(device, p, kDeviceBytes);      p += kDeviceBytes;
+    memcpy(&size, p, 8);                  p += 8;
+    memcpy(&checksum, p, 8);              p += 8;
+    device[kDeviceBytes - 1] = 0;
+
+    if (format != kFormatVersion || trtVersion != key.trtVersion || key.device.compare(0, kDeviceBytes - 1, device) != 0) {
+        LOGW("%s was generated by TensorRT %d on %s, ignored (current: TensorRT %d on %s)", path.c_str(),
+             trtVersion, device, key.trtVersion, key.device.c_str());
+        return false;
+    }
+    if (size != data.size() - kHeaderBytes || fnv1a(p, size) != checksum) {
+        LOGW("%s is corrupted, ignored", path.c_str());
+        return false;
+    }
+    blob.assign(p, p + size);
+    return true;
+}
+
+bool load(const string& path, const CacheKey& key, vector<char>& blob) {
+    blob.clear();
+    if (!fileExists(path)) return false;
+
+    FileLock lock(path, false);
+    if (!lock.locked()) return false;
+    return decode(path, key, blob);
+}
+
+bool save(const string& path, const CacheKey& key, const vector<char>& mine, MergeFn merge, size_t maxBytes) {
+    FileLock lock(path, true);
+    if (!lock.locked()) return false;
+
+    // 加锁以后重新读一次, 其它的build可能在这期间已经保存过了
+    vector<char> existing, merged;
+    if (decode(path, key, existing) && !existing.empty()) {
+        if (!merge(existing, mine, merged)) {
+            LOGW("failed to merge %s, overwritten by the current cache", path.c_str());
+            merged = mine;
+        }
+    } else {
+        merged = mine;
+    }
+
+    if (maxBytes > 0 && merged.size() > maxBytes) {
+        if (mine.size() > maxBytes) {
+            LOGW("timing cache (%zu bytes) exceeds the limit of %zu bytes, not saved", mine.size(), maxBytes);
+            return false;
+        }
+        LOGW("merged timing cache (%zu bytes) exceeds the limit of %zu bytes, keeping only the current one",
+             merged.size(), maxBytes);
+        merged = mine;
+    }
+
+    vector<char> data = encode(key, merged);
+    string       tmp  = path + ".tmp";
+    FILE*        f    = fopen(tmp.c_str(), "wb");
+    if (f == nullptr) {
+        LOGE("ERROR: failed to open %s", tmp.c_str());
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGE("ERROR: failed to write %s", path.c_str());
+        remove(tmp.c_str());
+        return false;
+    }
+    LOGV("saved timing cache %s (%zu bytes)", path.c_str(), merged.size());
+    return true;
+}
+
+} // namespace timingcache
@@ -0,0 +1,55 @@
+#ifndef __TIMINGCACHE_HPP__
+#define __TIMINGCACHE_HPP__
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+// builder的timing cache(ITimingCache)保存到文件, 所有的模型和精度共用一个文件, 省掉重复的tactic timing
+// 文件的格式: header(magic, 格式版本, TensorRT版本, GPU型号, payload大小, checksum) + TensorRT序列化的cache
+//     - TensorRT版本或者GPU不一致, 或者文件损坏的时候直接忽略, 当作没有cache
+//     - 读的时候加共享锁, 保存的时候加排他锁, 重新读一次文件和自己的cache合并以后再写(临时文件 + rename)
+//       多个build同时保存也不会丢掉别人的结果
+//     - 合并以后超过大小上限的时候只保存这一次的cache
+// 文件的管理只依赖CPU, merge的方法由调用的地方提供(Model里用ITimingCache::combine)
+
+namespace timingcache {
+
+static const uint32_t kFormatVersion = 1;
+
+struct CacheKey {
+    int32_t     trtVersion = 0;
+    std::string device;
+};
+
+// 当前的TensorRT版本和GPU(名字 + compute capability)
+CacheKey currentKey();
+
+// existing是文件里已有的cache, mine是这一次build的cache, 合并的结果放到merged里
+typedef std::function<bool(const std::vector<char>& existing, const std::vector<char>& mine, std::vector<char>& merged)> MergeFn;
+
+// 文件锁(flock), 锁的是path + ".lock", 不影响cache文件本身的rename
+class FileLock {
+public:
+    FileLock(const std::string& path, bool exclusive);
+    ~FileLock();
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+    bool locked() const { return mFd >= 0; }
+
+private:
+    int mFd = -1;
+};
+
+// 找不到文件, 版本不一致或者损坏的时候返回false, blob为空
+bool load(const std::string& path, const CacheKey& key, std::vector<char>& blob);
+
+// maxBytes为0的时候不限制大小
+bool save(const std::string& path, const CacheKey& key, const std::vector<char>& mine,
+          MergeFn merge, size_t maxBytes = 0);
+
+} // namespace timingcache
+
+#endif //__TIMINGCACHE_HPP__
@@ -6,6 +6,15 @@
 #include "utils.hpp"
 #include "NvInfer.h"
 #include "model.hpp"
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <functional>
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 
 using namespace std;
@@ -76,79 +85,302 @@ string printDims(const nvinfer1::Dims dims){
     return result;
 }
 
-string printTensor(float* tensor, int size){
-    int n = 0;
-    char buff[10000];
-    string result;
-    n += snprintf(buff + n, sizeof(buff) - n, "[ ");
-    for (int i = 0; i < size; i++){
-        n += snprintf(buff + n, sizeof(buff) - n, "%.4lf", tensor[i]);
-        if (i != size - 1){
-            n += snprintf(buff + n, sizeof(buff) - n, ", ");
-        }
+// 把一个float按照"%.4f"的格式写到buf里, 返回写了多少个字节
+// |x| * 10000在double里是精确的, 再用nearbyint(默认是四舍六入五成双)取整, 结果和printf是一样的
+// 只有太大的数或者nan/inf才退回到snprintf
+static int formatFixed4(float x, char* buf) {
+    double v = fabs((double)x);
+    if (!(v < 1e14)) {
+        return snprintf(buf, 32, "%.4lf", (double)x);
     }
-    n += snprintf(buff + n, sizeof(buff) - n, " ]");
-    result = buff;
-    return result;
-}
 
-string printTensor(float* tensor, int size, int stride){
+    uint64_t scaled = (uint64_t)nearbyint(v * 10000.0);
+    uint64_t ipart  = scaled / 10000;
+    uint32_t fpart  = (uint32_t)(scaled % 10000);
+
+    char  digits[24];
+    int   nd = 0;
+    do {
+        digits[nd++] = (char)('0' + ipart % 10);
+        ipart /= 10;
+    } while (ipart > 0);
+
     int n = 0;
-    char buff[10000];
-    string result;
-    n += snprintf(buff + n, sizeof(buff) - n, "[ \n");
-
-    for (int i = 0; i < size / stride; i ++) {
-        for (int j = 0; j < stride; j ++){
-            n += snprintf(buff + n, sizeof(buff) - n, "%.4lf", tensor[j + i * stride]);
-            if (j != stride - 1){
-                n += snprintf(buff + n, sizeof(buff) - n, ", ");
-            } else {
-                n += snprintf(buff + n, sizeof(buff) - n, "\n");
-            }
+    if (signbit(x)) buf[n++] = '-';
+    while (nd > 0) buf[n++] = digits[--nd];
+    buf[n++] = '.';
+    buf[n++] = (char)('0' + fpart / 1000);
+    buf[n++] = (char)('0' + fpart / 100 % 10);
+    buf[n++] = (char)('0' + fpart / 10 % 10);
+    buf[n++] = (char)('0' + fpart % 10);
+    return n;
+}
+
+// 写到ostream之前先攒在一块固定大小的buffer里, 不会因为tensor太大而被截断
+class ChunkWriter {
+public:
+    explicit ChunkWriter(ostream& os) : mOs(os) {}
+    ~ChunkWriter() { flush(); }
+
+    void put(const char* str, int len) {
+        if (mUsed + len > (int)sizeof(mBuf)) flush();
+        memcpy(mBuf + mUsed, str, len);
+        mUsed += len;
+    }
+    void put(const char* str) { put(str, strlen(str)); }
+    void put(float value) {
+        if (mUsed + 32 > (int)sizeof(mBuf)) flush();
+        mUsed += formatFixed4(value, mBuf + mUsed);
+    }
+    void flush() {
+        mOs.write(mBuf, mUsed);
+        mUsed = 0;
+    }
+
+private:
+    ostream& mOs;
+    char     mBuf[4096];
+    int      mUsed = 0;
+};
+
+// 输出的格式和之前保持一致:
+//     1维:  [ a, b, c ]
+//     2维:  每一行是最后一维
+//     3/4维: 每一行是最后一维, 每H * W个元素之间空一行
+void printTensor(ostream& os, const float* tensor, int64_t size, nvinfer1::Dims dim) {
+    ChunkWriter w(os);
+
+    if (dim.nbDims < 2) {
+        w.put("[ ");
+        for (int64_t i = 0; i < size; i++) {
+            w.put(tensor[i]);
+            if (i != size - 1) w.put(", ", 2);
         }
+        w.put(" ]", 2);
+        return;
+    }
 
+    int64_t strideW = dim.d[dim.nbDims - 1];
+    int64_t area    = dim.nbDims >= 3 ? strideW * dim.d[dim.nbDims - 2] : 0;
+    if (strideW <= 0) strideW = size > 0 ? size : 1;
+
+    w.put("[ \n");
+    for (int64_t i = 0; i < size; i++) {
+        w.put(tensor[i]);
+        if ((i + 1) % strideW != 0 && i != size - 1) {
+            w.put(", ", 2);
+        } else {
+            w.put("\n", 1);
+            if (area > 0 && (i + 1) % area == 0) w.put("\n", 1);
+        }
     }
-    n += snprintf(buff + n, sizeof(buff) - n, " ]");
-    result = buff;
-    return result;
+    w.put(" ]", 2);
 }
 
-string printTensor(float* tensor, int size, int strideH, int strideW){
-    int n = 0;
-    char buff[10000];
-    string result;
-    n += snprintf(buff + n, sizeof(buff) - n, "[ \n");
-
-    int area = strideW * strideH;
-
-    for (int i = 0; i < size; i += area) {
-        for (int j = 0; j < area; j += strideW) {
-            for (int k = 0; k < strideW; k++) {
-                n += snprintf(buff + n, sizeof(buff) - n, "%.4lf", tensor[i + j + k]);
-                if (k != strideW - 1){
-                    n += snprintf(buff + n, sizeof(buff) - n, ", ");
-                } else {
-                    n += snprintf(buff + n, sizeof(buff) - n, "\n");
-                }
-            }
+string printTensor(float* tensor, int64_t size, nvinfer1::Dims dim) {
+    ostringstream ss;
+    printTensor(ss, tensor, size, dim);
+    return ss.str();
+}
+
+// 原来的实现: 每个元素一次snprintf. 原来的buffer固定10000字节, 这里按最坏情况分配, 只用来对比
+static string printTensorSnprintf(const float* tensor, int64_t size) {
+    vector<char> buff(size * 48 + 16);
+    size_t n = 0;
+    n += snprintf(buff.data() + n, buff.size() - n, "[ ");
+    for (int64_t i = 0; i < size; i++) {
+        n += snprintf(buff.data() + n, buff.size() - n, "%.4lf", tensor[i]);
+        if (i != size - 1) {
+            n += snprintf(buff.data() + n, buff.size() - n, ", ");
         }
-        n += snprintf(buff + n, sizeof(buff) - n, "\n");
     }
+    n += snprintf(buff.data() + n, buff.size() - n, " ]");
+    return string(buff.data(), n);
+}
 
-    n += snprintf(buff + n, sizeof(buff) - n, " ]");
-    result = buff;
-    return result;
+bool benchmarkPrintTensor(int64_t size, int iters) {
+    // 正负都有, 跨几个数量级, 还有刚好在舍入边界上的值
+    vector<float> data(size);
+    uint32_t      seed = 12345;
+    for (int64_t i = 0; i < size; i++) {
+        seed    = seed * 1664525u + 1013904223u;
+        float v = (float)((int32_t)seed) / 2147483648.0f;
+        data[i] = i % 7 == 0 ? v * 1e6f : i % 11 == 0 ? 0.00005f * (float)(i % 3) : v * 10.0f;
+    }
+    nvinfer1::Dims dim;
+    dim.nbDims = 1;
+    dim.d[0]   = (int32_t)size;
+
+    string expected = printTensorSnprintf(data.data(), size);
+    string actual   = printTensor(data.data(), size, dim);
+    if (actual != expected) {
+        LOGE("ERROR: printTensor does not match snprintf(\"%%.4lf\") for %ld floats", (long)size);
+        return false;
+    }
+
+    auto time = [iters](const function<void()>& fn) {
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iters; i++) fn();
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / iters;
+    };
+    size_t sink = 0;
+    double oldUs     = time([&]() { sink += printTensorSnprintf(data.data(), size).size(); });
+    double streamUs  = time([&]() { sink += printTensor(data.data(), size, dim).size(); });
+    double summaryUs = time([&]() { sink += (size_t)summarizeTensor(data.data(), size).count; });
+
+    LOG("printTensor %ld floats: snprintf %.1f us (%.1f ns/float), streaming %.1f us (%.1f ns/float), %.1fx, "
+        "summary %.1f us (%.1f GB/s)", (long)size, oldUs, oldUs * 1e3 / size, streamUs, streamUs * 1e3 / size,
+        streamUs > 0 ? oldUs / streamUs : 0.0, summaryUs, summaryUs > 0 ? size * sizeof(float) / summaryUs / 1e3 : 0.0);
+    return sink > 0;
 }
 
-string printTensor(float* tensor, int size, nvinfer1::Dims dim) {
-    if (dim.nbDims == 2) {
-        return printTensor(tensor, size, dim.d[1]);
-    } else if (dim.nbDims == 3) {
-        return printTensor(tensor, size, dim.d[1], dim.d[2]);
-    } else if (dim.nbDims == 4) {
-        return printTensor(tensor, size, dim.d[2], dim.d[3]);
+// 对于比较大的tensor, 只看统计信息: min/max忽略nan, mean只统计有限的值, nan和inf单独计数
+// 计数用的是int32的向量, 单个tensor超过2^31 * 宽度个nan的时候才会溢出
+TensorSummary summarizeTensor(const float* tensor, int64_t size) {
+    TensorSummary s;
+    float   mn   = INFINITY;
+    float   mx   = -INFINITY;
+    double  sum  = 0.0;
+    int64_t nan  = 0;
+    int64_t inf  = 0;
+    int64_t i    = 0;
+
+#if defined(__AVX__)
+    __m256  vmn   = _mm256_set1_ps(INFINITY);
+    __m256  vmx   = _mm256_set1_ps(-INFINITY);
+    __m256d vsum0 = _mm256_setzero_pd();
+    __m256d vsum1 = _mm256_setzero_pd();
+    __m256  vinf  = _mm256_set1_ps(INFINITY);
+    __m256  vabs  = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m128i vnan  = _mm_setzero_si128();
+    __m128i vninf = _mm_setzero_si128();
+    for (; i + 8 <= size; i += 8) {
+        __m256 x     = _mm256_loadu_ps(tensor + i);
+        __m256 isnan = _mm256_cmp_ps(x, x, _CMP_UNORD_Q);
+        __m256 isinf = _mm256_cmp_ps(_mm256_and_ps(x, vabs), vinf, _CMP_EQ_OQ);
+        // 比较的结果是全1(-1), 减掉就相当于计数
+        vnan  = _mm_sub_epi32(vnan,  _mm_castps_si128(_mm256_castps256_ps128(isnan)));
+        vnan  = _mm_sub_epi32(vnan,  _mm_castps_si128(_mm256_extractf128_ps(isnan, 1)));
+        vninf = _mm_sub_epi32(vninf, _mm_castps_si128(_mm256_castps256_ps128(isinf)));
+        vninf = _mm_sub_epi32(vninf, _mm_castps_si128(_mm256_extractf128_ps(isinf, 1)));
+        __m256 fin   = _mm256_andnot_ps(_mm256_or_ps(isnan, isinf), x);
+        // min/max的第二个参数是累加值, 遇到nan的时候返回第二个参数, 相当于跳过了nan
+        vmn   = _mm256_min_ps(x, vmn);
+        vmx   = _mm256_max_ps(x, vmx);
+        vsum0 = _mm256_add_pd(vsum0, _mm256_cvtps_pd(_mm256_castps256_ps128(fin)));
+        vsum1 = _mm256_add_pd(vsum1, _mm256_cvtps_pd(_mm256_extractf128_ps(fin, 1)));
+    }
+    float  fmn[8], fmx[8];
+    double dsum[4];
+    _mm256_storeu_ps(fmn, vmn);
+    _mm256_storeu_ps(fmx, vmx);
+    _mm256_storeu_pd(dsum, _mm256_add_pd(vsum0, vsum1));
+    for (int k = 0; k < 8; k++) { mn = std::min(mn, fmn[k]); mx = std::max(mx, fmx[k]); }
+    for (int k = 0; k < 4; k++) sum += dsum[k];
+    int32_t cnan[4], cinf[4];
+    _mm_storeu_si128((__m128i*)cnan, vnan);
+    _mm_storeu_si128((__m128i*)cinf, vninf);
+    for (int k = 0; k < 4; k++) { nan += cnan[k]; inf += cinf[k]; }
+#elif defined(__SSE2__)
+    __m128  vmn   = _mm_set1_ps(INFINITY);
+    __m128  vmx   = _mm_set1_ps(-INFINITY);
+    __m128d vsum0 = _mm_setzero_pd();
+    __m128d vsum1 = _mm_setzero_pd();
+    __m128  vinf  = _mm_set1_ps(INFINITY);
+    __m128  vabs  = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128i vnan  = _mm_setzero_si128();
+    __m128i vninf = _mm_setzero_si128();
+    for (; i + 4 <= size; i += 4) {
+        __m128 x     = _mm_loadu_ps(tensor + i);
+        __m128 isnan = _mm_cmpunord_ps(x, x);
+        __m128 isinf = _mm_cmpeq_ps(_mm_and_ps(x, vabs), vinf);
+        // 比较的结果是全1(-1), 减掉就相当于计数
+        vnan  = _mm_sub_epi32(vnan,  _mm_castps_si128(isnan));
+        vninf = _mm_sub_epi32(vninf, _mm_castps_si128(isinf));
+        __m128 fin   = _mm_andnot_ps(_mm_or_ps(isnan, isinf), x);
+        vmn   = _mm_min_ps(x, vmn);
+        vmx   = _mm_max_ps(x, vmx);
+        vsum0 = _mm_add_pd(vsum0, _mm_cvtps_pd(fin));
+        vsum1 = _mm_add_pd(vsum1, _mm_cvtps_pd(_mm_movehl_ps(fin, fin)));
+    }
+    float  fmn[4], fmx[4];
+    double dsum[2];
+    _mm_storeu_ps(fmn, vmn);
+    _mm_storeu_ps(fmx, vmx);
+    _mm_storeu_pd(dsum, _mm_add_pd(vsum0, vsum1));
+    for (int k = 0; k < 4; k++) { mn = std::min(mn, fmn[k]); mx = std::max(mx, fmx[k]); }
+    sum += dsum[0] + dsum[1];
+    int32_t cnan[4], cinf[4];
+    _mm_storeu_si128((__m128i*)cnan, vnan);
+    _mm_storeu_si128((__m128i*)cinf, vninf);
+    for (int k = 0; k < 4; k++) { nan += cnan[k]; inf += cinf[k]; }
+#elif defined(__aarch64__)
+    float32x4_t vmn   = vdupq_n_f32(INFINITY);
+    float32x4_t vmx   = vdupq_n_f32(-INFINITY);
+    float64x2_t vsum0 = vdupq_n_f64(0.0);
+    float64x2_t vsum1 = vdupq_n_f64(0.0);
+    float32x4_t vinf  = vdupq_n_f32(INFINITY);
+    for (; i + 4 <= size; i += 4) {
+        float32x4_t x     = vld1q_f32(tensor + i);
+        uint32x4_t  isnum = vceqq_f32(x, x);
+        uint32x4_t  isinf = vceqq_f32(vabsq_f32(x), vinf);
+        nan += 4 + (int32_t)vaddvq_s32(vreinterpretq_s32_u32(isnum));
+        inf -= (int32_t)vaddvq_s32(vreinterpretq_s32_u32(isinf));
+        float32x4_t fin   = vreinterpretq_f32_u32(vbicq_u32(vandq_u32(vreinterpretq_u32_f32(x), isnum), isinf));
+        // vminnm/vmaxnm会忽略nan
+        vmn   = vminnmq_f32(vmn, x);
+        vmx   = vmaxnmq_f32(vmx, x);
+        vsum0 = vaddq_f64(vsum0, vcvt_f64_f32(vget_low_f32(fin)));
+        vsum1 = vaddq_f64(vsum1, vcvt_high_f64_f32(fin));
+    }
+    mn   = vminnmvq_f32(vmn);
+    mx   = vmaxnmvq_f32(vmx);
+    sum += vaddvq_f64(vaddq_f64(vsum0, vsum1));
+#endif
+
+    for (; i < size; i++) {
+        float x = tensor[i];
+        if (std::isnan(x)) { nan++; continue; }
+        if (std::isinf(x)) { inf++; }
+        else               { sum += x; }
+        mn = std::min(mn, x);
+        mx = std::max(mx, x);
     }
+
+    s.count = size;
+    s.nan   = nan;
+    s.inf   = inf;
+    s.min   = mn;
+    s.max   = mx;
+    s.mean  = (size - nan - inf) > 0 ? sum / (size - nan - inf) : 0.0;
+    return s;
+}
+
+string printTensorSummary(const float* tensor, int64_t size, nvinfer1::Dims dim) {
+    auto s = summarizeTensor(tensor, size);
+    char buff[256];
+    snprintf(buff, sizeof(buff), "%s count: %ld, min: %.4f, max: %.4f, mean: %.4f, nan: %ld, inf: %ld",
+             printDims(dim).c_str(), (long)s.count, s.min, s.max, s.mean, (long)s.nan, (long)s.inf);
+    return buff;
+}
+
+// 转换成contiguous的float, device上的tensor返回empty
+static Tensor hostFloat(const Tensor& tensor) {
+    if (tensor.empty() || !tensor.hostAccessible()) return Tensor();
+    Tensor t = tensor.cast(nvinfer1::DataType::kFLOAT);
+    return t.contiguous() ? move(t) : t.clone();
+}
+
+string printTensor(const Tensor& tensor) {
+    Tensor t = hostFloat(tensor);
+    if (t.empty()) return tensor.str();
+    return printTensor(t.data<float>(), t.count(), t.dims());
+}
+
+string printTensorSummary(const Tensor& tensor) {
+    Tensor t = hostFloat(tensor);
+    if (t.empty()) return tensor.str();
+    return printTensorSummary(t.data<float>(), t.count(), t.dims());
 }
 
 string printTensorShape(nvinfer1::ITensor* tensor){
@@ -165,14 +397,29 @@ string printTensorShape(nvinfer1::ITensor* tensor){
     return str;
 }
 
-int getDimSize(nvinfer1::Dims dims) {
-    int size = 1;
+int64_t getDimSize(nvinfer1::Dims dims) {
+    int64_t size = 1;
     for (int j = 0; j < dims.nbDims; j++) {
         size *= dims.d[j];
     }
     return size;
 }
 
+bool parseDims(const string& str, nvinfer1::Dims& dims) {
+    dims.nbDims = 0;
+    const char* p = str.c_str();
+    while (*p != 0) {
+        char* end;
+        long  d = strtol(p, &end, 10);
+        if (end == p || dims.nbDims == nvinfer1::Dims::MAX_DIMS) return false;
+        dims.d[dims.nbDims++] = (int32_t)d;
+        p = end;
+        if (*p == 'x' && *(p + 1) != 0) p++;
+        else if (*p != 0) return false;
+    }
+    return dims.nbDims > 0;
+}
+
 string getEnginePath(string onnxPath, Model::precision prec){
     int name_l = onnxPath.rfind("/");
     int name_r = onnxPath.rfind(".");
@@ -198,6 +445,10 @@ string getEnginePath(string onnxPath, Model::precision prec){
     return enginePath;
 }
 
+string getCalibrationCachePath(string enginePath){
+    return enginePath.substr(0, enginePath.rfind(".engine")) + ".calib";
+}
+
 string getFileType(string filePath){
     int pos = filePath.rfind(".");
     string suffix;
@@ -205,6 +456,26 @@ string getFileType(string filePath){
     return suffix;
 }
 
+// 简单的通配匹配, 只支持'*'(匹配任意长度)和'?'(匹配一个字符)
+bool globMatch(const string& pattern, const string& str) {
+    size_t p = 0, s = 0, star = string::npos, mark = 0;
+    while (s < str.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == str[s])) {
+            p++; s++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            mark = s;
+        } else if (star != string::npos) {
+            p = star + 1;
+            s = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
 string getPrecision(nvinfer1::DataType type) {
     switch(type) {
         case nvinfer1::DataType::kFLOAT:  return "FP32";
@@ -214,3 +485,30 @@ string getPrecision(nvinfer1::DataType type) {
         default:                          return "unknown";
     }
 }
+
+void PhaseTimer::start(const string& phase) {
+    stop();
+    mPhases.push_back(make_pair(phase, 0.0));
+    mStart   = chrono::steady_clock::now();
+    mRunning = true;
+}
+
+void PhaseTimer::stop() {
+    if (!mRunning) return;
+    mPhases.back().second = chrono::duration<double, milli>(chrono::steady_clock::now() - mStart).count();
+    mRunning = false;
+}
+
+double PhaseTimer::total() const {
+    double t = 0;
+    for (auto& p : mPhases) t += p.second;
+    return t;
+}
+
+void PhaseTimer::report(const string& title) const {
+    double t = total();
+    LOG("%s: %.1f ms", title.c_str(), t);
+    for (auto& p : mPhases) {
+        LOG("    %-20s %10.1f ms %6.1f%%", p.first.c_str(), p.second, t > 0 ? 100.0 * p.second / t : 0.0);
+    }
+}
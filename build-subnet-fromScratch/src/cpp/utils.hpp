@@ -7,28 +7,14 @@
 #include <vector>
 #include <map>
 #include <iostream>
+#include <chrono>
 #include "model.hpp"
+#include "logger.hpp"
+#include "tensor.hpp"
 
 #define CUDA_CHECK(call)             __cudaCheck(call, __FILE__, __LINE__)
 #define LAST_KERNEL_CHECK(call)      __kernelCheck(__FILE__, __LINE__)
 
-#define LOG(...)                     __log_info(Level::INFO, __VA_ARGS__)
-#define LOGV(...)                    __log_info(Level::VERB, __VA_ARGS__)
-#define LOGE(...)                    __log_info(Level::ERROR, __VA_ARGS__)
-
-#define DGREEN    "\033[1;36m"
-#define BLUE      "\033[1;34m"
-#define PURPLE    "\033[1;35m"
-#define GREEN     "\033[1;32m"
-#define YELLOW    "\033[1;33m"
-#define RED       "\033[1;31m"
-#define CLEAR     "\033[0m"
-
-enum struct Level {
-    ERROR,
-    INFO,
-    VERB
-};
 
 static void __cudaCheck(cudaError_t err, const char* file, const int line) {
     if (err != cudaSuccess) {
@@ -47,42 +33,71 @@ static void __kernelCheck(const char* file, const int line) {
     }
 }
 
-static void __log_info(Level level, const char* format, ...) {
-    char msg[1000];
-    va_list args;
-    va_start(args, format);
-    int n = 0;
-
-    if (level == Level::INFO) {
-        n += snprintf(msg + n, sizeof(msg) - n, YELLOW "[info]" CLEAR);
-    } else if (level == Level::VERB) {
-        n += snprintf(msg + n, sizeof(msg) - n, PURPLE "[verb]" CLEAR);
-    } else {
-        n += snprintf(msg + n, sizeof(msg) - n, RED    "[verb]" CLEAR);
+// 给TensorRT的builder/runtime用的logger
+class Logger : public nvinfer1::ILogger{
+public:
+    // 先按等级过滤, 被过滤掉的消息不做任何处理; 剩下的直接交给异步的logger, 不再构造std::string
+    virtual void log (Severity severity, const char* msg) noexcept override{
+        if (severity > Severity::kINFO)
+            return;
+        switch (severity){
+            case Severity::kINTERNAL_ERROR: LOGE("[fatal]: %s", msg); break;
+            case Severity::kERROR:          LOGE("%s", msg); break;
+            case Severity::kWARNING:        LOGW("%s", msg); break;
+            default:                        LOG("%s", msg);  break;
+        }
     }
-    n += vsnprintf(msg + n, sizeof(msg) - n, format, args);
-
-    fprintf(stdout, "%s\n", msg);
-    va_end(args);
-
-    // if (level == Level::ERROR) {
-    //     free(msg);
-    //     exit(1);
-    // }
-}
+};
 
 bool fileExists(const std::string fileName);
 bool fileRead(const std::string &path, std::vector<unsigned char> &data, size_t &size);
 std::string getEnginePath(std::string onnxPath, Model::precision prec);
+// models/engine/sample_c2f_int8.engine -> models/engine/sample_c2f_int8.calib
+std::string getCalibrationCachePath(std::string enginePath);
 std::vector<unsigned char> loadFile(const std::string &path);
 std::string printDims(const nvinfer1::Dims dims);
-// std::string printTensor(float* tensor, int size);
-// std::string printTensor(float* tensor, int size, int stride);
-// std::string printTensor(float* tensor, int size, int strideH, int strideW);
-std::string printTensor(float* tensor, int size, nvinfer1::Dims dim);
+
+// 流式的打印, 任意大小的tensor都不会被截断
+void        printTensor(std::ostream& os, const float* tensor, int64_t size, nvinfer1::Dims dim);
+std::string printTensor(float* tensor, int64_t size, nvinfer1::Dims dim);
+// 和原来每个元素一次snprintf的实现对比: 输出必须一样, 打印两者的耗时以及summarizeTensor的吞吐
+bool        benchmarkPrintTensor(int64_t size = 100000, int iters = 20);
+
+// 大的tensor只打印统计信息, min/max忽略nan, mean只统计有限值
+struct TensorSummary {
+    int64_t count = 0;
+    int64_t nan   = 0;
+    int64_t inf   = 0;
+    float   min   = 0;
+    float   max   = 0;
+    double  mean  = 0;
+};
+TensorSummary summarizeTensor(const float* tensor, int64_t size);
+std::string   printTensorSummary(const float* tensor, int64_t size, nvinfer1::Dims dim);
+// 任意dtype的host tensor, 非float的先转换成float; device上的tensor只打印shape
+std::string   printTensor(const Tensor& tensor);
+std::string   printTensorSummary(const Tensor& tensor);
 std::string printTensorShape(nvinfer1::ITensor* tensor);
 std::string getPrecision(nvinfer1::DataType type);
 std::string getFileType(std::string filePath);
-int getDimSize(nvinfer1::Dims);
+bool globMatch(const std::string& pattern, const std::string& str);
+int64_t getDimSize(nvinfer1::Dims);
+// "1x3x224x224"这样的字符串转换成Dims, 格式不对的时候返回false
+bool parseDims(const std::string& str, nvinfer1::Dims& dims);
+
+// 记录每个阶段的耗时, start会结束上一个阶段, report一起打印出来
+class PhaseTimer {
+public:
+    void   start(const std::string& phase);
+    void   stop();
+    void   report(const std::string& title) const;
+    double total() const;
+    const std::vector<std::pair<std::string, double>>& phases() const { return mPhases; }
+
+private:
+    std::vector<std::pair<std::string, double>> mPhases;
+    std::chrono::steady_clock::time_point       mStart;
+    bool                                        mRunning = false;
+};
 
 #endif //__UTILS_HPP__
@@ -0,0 +1,55 @@
+import torch
+import torch.nn as nn
+import numpy as np
+import os
+
+from export_c2f import C2f, setup_seed
+
+# 把PyTorch里每一层的输出保存成.npy, 作为TensorRT逐层对比(Model::setReferenceDir)的参考值
+# 文件名和TensorRT里的层名保持一致:
+#     xxx.conv -> xxx.conv.npy
+#     xxx.norm -> xxx.norm.npy
+#     xxx.act  -> xxx.mul.npy  (TensorRT里SiLU是用sigmoid + mul搭出来的)
+# 最后的输出保存为output0.npy
+
+def trt_name(name):
+    if name.endswith(".act"):
+        return name[:-len(".act")] + ".mul"
+    return name
+
+def export_reference(model, input, dir):
+    os.makedirs(dir, exist_ok=True)
+    hooks = []
+
+    def save(name):
+        def hook(module, inputs, output):
+            np.save(os.path.join(dir, trt_name(name) + ".npy"), output.detach().cpu().numpy().astype(np.float32))
+        return hook
+
+    for name, module in model.named_modules():
+        if isinstance(module, (nn.Conv2d, nn.BatchNorm2d, nn.SiLU)):
+            hooks.append(module.register_forward_hook(save(name)))
+
+    output = model(input)
+    np.save(os.path.join(dir, "output0.npy"), output.detach().cpu().numpy().astype(np.float32))
+
+    for h in hooks:
+        h.remove()
+    print("Finished exporting reference tensors to {}".format(dir))
+
+
+if __name__ == "__main__":
+    # 和export_c2f.py里使用相同的seed和输入, 这样权重也是一样的
+    setup_seed(1)
+    input = torch.tensor([[[
+        [0.7576, 0.2793, 0.4031, 0.7347, 0.0293],
+        [0.7999, 0.3971, 0.7544, 0.5695, 0.4388],
+        [0.6387, 0.5247, 0.6826, 0.3051, 0.4635],
+        [0.4550, 0.5725, 0.4980, 0.9371, 0.6556],
+        [0.3138, 0.1980, 0.4162, 0.2843, 0.3398]]]])
+
+    model = C2f(c1=1, c2=4, shortcut=True)
+    model.eval()
+
+    current_path = os.path.dirname(__file__)
+    export_reference(model, input, current_path + "/../../models/reference/sample_c2f")